@@ -12184,6 +12184,21 @@ AC_DEFUN([LINUX_CONFIG_COMPAT],
 		AC_MSG_RESULT(no)
 	])
 
+	AC_MSG_CHECKING([if register_shrinker gets fmt])
+	MLNX_BG_LB_LINUX_TRY_COMPILE([
+		#include <linux/shrinker.h>
+	],[
+		static struct shrinker s;
+
+		return register_shrinker(&s, "%s", "test");
+	],[
+		AC_MSG_RESULT(yes)
+		MLNX_AC_DEFINE(HAVE_REGISTER_SHRINKER_FMT, 1,
+			[register_shrinker gets fmt])
+	],[
+		AC_MSG_RESULT(no)
+	])
+
 	AC_MSG_CHECKING([if fs.h has IOCB_NOWAIT])
 	MLNX_BG_LB_LINUX_TRY_COMPILE([
 		#include <linux/fs.h>
@@ -38,6 +38,9 @@
 #include <linux/slab.h>
 #include <linux/workqueue.h>
 #include <linux/netdevice.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
 #include <net/addrconf.h>
 
 #include <rdma/ib_cache.h>
@@ -94,6 +97,9 @@ struct ib_gid_table_entry {
 	 */
 	struct roce_gid_ndev_storage	*ndev_storage;
 	enum gid_table_entry_state	state;
+	/* linked in ib_gid_table->gid_hash while the entry is valid */
+	struct hlist_node		hash_node;
+	struct rcu_head			rcu_head;
 };
 
 struct ib_gid_table {
@@ -117,6 +123,11 @@ struct ib_gid_table {
 	 */
 	rwlock_t			rwlock;
 	struct ib_gid_table_entry	**data_vec;
+	/* Valid entries hashed by GID value. Updated together with data_vec
+	 * under both locks; lookups may walk it under RCU alone.
+	 */
+	struct hlist_head		*gid_hash;
+	unsigned int			gid_hash_bits;
 	/* bit field, each bit indicates the index of default GID */
 	u32				default_gid_indices;
 };
@@ -202,6 +213,13 @@ static struct ib_gid_table *rdma_gid_table(struct ib_device *device, u32 port)
 	return device->port_data[port].cache.gid;
 }
 
+static struct hlist_head *gid_hash_head(const struct ib_gid_table *table,
+				       const union ib_gid *gid)
+{
+	return &table->gid_hash[hash_32(jhash(gid, sizeof(*gid), 0),
+					table->gid_hash_bits)];
+}
+
 static bool is_gid_entry_free(const struct ib_gid_table_entry *entry)
 {
 	return !entry;
@@ -258,7 +276,8 @@ static void free_gid_entry_locked(struct ib_gid_table_entry *entry)
 
 	if (entry->ndev_storage)
 		call_rcu(&entry->ndev_storage->rcu_head, put_gid_ndev);
-	kfree(entry);
+	/* RCU lookups may still be looking at the unhashed entry */
+	kfree_rcu(entry, rcu_head);
 }
 
 static void free_gid_entry(struct kref *kref)
@@ -330,6 +349,8 @@ static void store_gid_entry(struct ib_gid_table *table,
 	lockdep_assert_held(&table->lock);
 	write_lock_irq(&table->rwlock);
 	table->data_vec[entry->attr.index] = entry;
+	hlist_add_head_rcu(&entry->hash_node,
+			   gid_hash_head(table, &entry->attr.gid));
 	write_unlock_irq(&table->rwlock);
 }
 
@@ -393,6 +414,7 @@ static void del_gid(struct ib_device *ib_dev, u32 port,
 	write_lock_irq(&table->rwlock);
 	entry = table->data_vec[ix];
 	entry->state = GID_TABLE_ENTRY_PENDING_DEL;
+	hlist_del_rcu(&entry->hash_node);
 	/*
 	 * For non RoCE protocol, GID entry slot is ready to use.
 	 */
@@ -462,18 +484,75 @@ done:
 	return ret;
 }
 
+static bool gid_entry_match(const struct ib_gid_table *table,
+			    const struct ib_gid_table_entry *data,
+			    const union ib_gid *gid,
+			    const struct ib_gid_attr *val, bool default_gid,
+			    unsigned long mask)
+{
+	const struct ib_gid_attr *attr = &data->attr;
+
+	if (mask & GID_ATTR_FIND_MASK_GID_TYPE &&
+	    attr->gid_type != val->gid_type)
+		return false;
+
+	if (mask & GID_ATTR_FIND_MASK_GID &&
+	    memcmp(gid, &attr->gid, sizeof(*gid)))
+		return false;
+
+	if (mask & GID_ATTR_FIND_MASK_NETDEV &&
+	    attr->ndev != val->ndev)
+		return false;
+
+	if (mask & GID_ATTR_FIND_MASK_DEFAULT &&
+	    is_gid_index_default(table, attr->index) != default_gid)
+		return false;
+
+	return true;
+}
+
+/* rwlock should be read locked, or lock should be held */
+static int find_gid_hashed(struct ib_gid_table *table,
+			   const union ib_gid *gid,
+			   const struct ib_gid_attr *val, bool default_gid,
+			   unsigned long mask)
+{
+	struct ib_gid_table_entry *data;
+	int found = -1;
+
+	/* keep returning the lowest matching index, as the linear scan did */
+	hlist_for_each_entry(data, gid_hash_head(table, gid), hash_node) {
+		if (found >= 0 && data->attr.index >= found)
+			continue;
+		if (gid_entry_match(table, data, gid, val, default_gid, mask))
+			found = data->attr.index;
+	}
+
+	return found;
+}
+
 /* rwlock should be read locked, or lock should be held */
 static int find_gid(struct ib_gid_table *table, const union ib_gid *gid,
 		    const struct ib_gid_attr *val, bool default_gid,
 		    unsigned long mask, int *pempty)
 {
+	bool hashed = mask & GID_ATTR_FIND_MASK_GID;
 	int i = 0;
 	int found = -1;
 	int empty = pempty ? -1 : 0;
 
-	while (i < table->sz && (found < 0 || empty < 0)) {
+	/*
+	 * Searches by GID value go through the hash; only the free slot
+	 * lookup (a pointer test per entry) still needs to scan data_vec.
+	 */
+	if (hashed) {
+		found = find_gid_hashed(table, gid, val, default_gid, mask);
+		if (!pempty)
+			return found;
+	}
+
+	while (i < table->sz && ((!hashed && found < 0) || empty < 0)) {
 		struct ib_gid_table_entry *data = table->data_vec[i];
-		struct ib_gid_attr *attr;
 		int curr_index = i;
 
 		i++;
@@ -505,27 +584,13 @@ static int find_gid(struct ib_gid_table *table, const union ib_gid *gid,
 		 * pending for removal and the entries which are marked as
 		 * invalid.
 		 */
-		if (!is_gid_entry_valid(data))
+		if (hashed || !is_gid_entry_valid(data))
 			continue;
 
 		if (found >= 0)
 			continue;
 
-		attr = &data->attr;
-		if (mask & GID_ATTR_FIND_MASK_GID_TYPE &&
-		    attr->gid_type != val->gid_type)
-			continue;
-
-		if (mask & GID_ATTR_FIND_MASK_GID &&
-		    memcmp(gid, &data->attr.gid, sizeof(*gid)))
-			continue;
-
-		if (mask & GID_ATTR_FIND_MASK_NETDEV &&
-		    attr->ndev != val->ndev)
-			continue;
-
-		if (mask & GID_ATTR_FIND_MASK_DEFAULT &&
-		    is_gid_index_default(table, curr_index) != default_gid)
+		if (!gid_entry_match(table, data, gid, val, default_gid, mask))
 			continue;
 
 		found = curr_index;
@@ -537,6 +602,38 @@ static int find_gid(struct ib_gid_table *table, const union ib_gid *gid,
 	return found;
 }
 
+/*
+ * Lockless lookup by GID value. Returns the matching valid entry with the
+ * lowest index with a reference held, or NULL.
+ */
+static struct ib_gid_table_entry *
+find_gid_entry_rcu(struct ib_gid_table *table, const union ib_gid *gid,
+		   const struct ib_gid_attr *val, unsigned long mask)
+{
+	struct ib_gid_table_entry *data, *found = NULL;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(data, gid_hash_head(table, gid), hash_node) {
+		if (found && data->attr.index >= found->attr.index)
+			continue;
+		if (READ_ONCE(data->state) != GID_TABLE_ENTRY_VALID)
+			continue;
+		if (gid_entry_match(table, data, gid, val, false, mask))
+			found = data;
+	}
+	if (found && !kref_get_unless_zero(&found->kref))
+		found = NULL;
+	rcu_read_unlock();
+
+	/* lost a race with del_gid() after taking the reference */
+	if (found && READ_ONCE(found->state) != GID_TABLE_ENTRY_VALID) {
+		put_gid_entry(found);
+		found = NULL;
+	}
+
+	return found;
+}
+
 static void make_default_gid(struct  net_device *dev, union ib_gid *gid)
 {
 	gid->global.subnet_prefix = cpu_to_be64(0xfe80000000000000LL);
@@ -686,13 +783,11 @@ rdma_find_gid_by_port(struct ib_device *ib_dev,
 		      enum ib_gid_type gid_type,
 		      u32 port, struct net_device *ndev)
 {
-	int local_index;
 	struct ib_gid_table *table;
 	unsigned long mask = GID_ATTR_FIND_MASK_GID |
 			     GID_ATTR_FIND_MASK_GID_TYPE;
 	struct ib_gid_attr val = {.ndev = ndev, .gid_type = gid_type};
-	const struct ib_gid_attr *attr;
-	unsigned long flags;
+	struct ib_gid_table_entry *entry;
 
 	if (!rdma_is_port_valid(ib_dev, port))
 		return ERR_PTR(-ENOENT);
@@ -702,16 +797,10 @@ rdma_find_gid_by_port(struct ib_device *ib_dev,
 	if (ndev)
 		mask |= GID_ATTR_FIND_MASK_NETDEV;
 
-	read_lock_irqsave(&table->rwlock, flags);
-	local_index = find_gid(table, gid, &val, false, mask, NULL);
-	if (local_index >= 0) {
-		get_gid_entry(table->data_vec[local_index]);
-		attr = &table->data_vec[local_index]->attr;
-		read_unlock_irqrestore(&table->rwlock, flags);
-		return attr;
-	}
+	entry = find_gid_entry_rcu(table, gid, &val, mask);
+	if (entry)
+		return &entry->attr;
 
-	read_unlock_irqrestore(&table->rwlock, flags);
 	return ERR_PTR(-ENOENT);
 }
 EXPORT_SYMBOL(rdma_find_gid_by_port);
@@ -739,19 +828,20 @@ const struct ib_gid_attr *rdma_find_gid_by_filter(
 		       void *),
 	void *context)
 {
-	const struct ib_gid_attr *res = ERR_PTR(-ENOENT);
+	struct ib_gid_table_entry *entry, *found = NULL;
 	struct ib_gid_table *table;
 	unsigned long flags;
-	unsigned int i;
 
 	if (!rdma_is_port_valid(ib_dev, port))
 		return ERR_PTR(-EINVAL);
 
 	table = rdma_gid_table(ib_dev, port);
 
+	/* the rwlock keeps ndev stable while filter() runs */
 	read_lock_irqsave(&table->rwlock, flags);
-	for (i = 0; i < table->sz; i++) {
-		struct ib_gid_table_entry *entry = table->data_vec[i];
+	hlist_for_each_entry(entry, gid_hash_head(table, gid), hash_node) {
+		if (found && entry->attr.index >= found->attr.index)
+			continue;
 
 		if (!is_gid_entry_valid(entry))
 			continue;
@@ -759,14 +849,13 @@ const struct ib_gid_attr *rdma_find_gid_by_filter(
 		if (memcmp(gid, &entry->attr.gid, sizeof(*gid)))
 			continue;
 
-		if (filter(gid, &entry->attr, context)) {
-			get_gid_entry(entry);
-			res = &entry->attr;
-			break;
-		}
+		if (filter(gid, &entry->attr, context))
+			found = entry;
 	}
+	if (found)
+		get_gid_entry(found);
 	read_unlock_irqrestore(&table->rwlock, flags);
-	return res;
+	return found ? &found->attr : ERR_PTR(-ENOENT);
 }
 
 static struct ib_gid_table *alloc_gid_table(int sz)
@@ -780,12 +869,20 @@ static struct ib_gid_table *alloc_gid_table(int sz)
 	if (!table->data_vec)
 		goto err_free_table;
 
+	table->gid_hash_bits = ilog2(roundup_pow_of_two(max(sz, 2)));
+	table->gid_hash = kcalloc(1U << table->gid_hash_bits,
+				  sizeof(*table->gid_hash), GFP_KERNEL);
+	if (!table->gid_hash)
+		goto err_free_data_vec;
+
 	mutex_init(&table->lock);
 
 	table->sz = sz;
 	rwlock_init(&table->rwlock);
 	return table;
 
+err_free_data_vec:
+	kfree(table->data_vec);
 err_free_table:
 	kfree(table);
 	return NULL;
@@ -814,6 +911,7 @@ static void release_gid_table(struct ib_device *device,
 		return;
 
 	mutex_destroy(&table->lock);
+	kfree(table->gid_hash);
 	kfree(table->data_vec);
 	kfree(table);
 }
@@ -1020,22 +1118,12 @@ const struct ib_gid_attr *rdma_find_gid(struct ib_device *device,
 		mask |= GID_ATTR_FIND_MASK_NETDEV;
 
 	rdma_for_each_port(device, p) {
-		struct ib_gid_table *table;
-		unsigned long flags;
-		int index;
+		struct ib_gid_table_entry *entry;
 
-		table = device->port_data[p].cache.gid;
-		read_lock_irqsave(&table->rwlock, flags);
-		index = find_gid(table, gid, &gid_attr_val, false, mask, NULL);
-		if (index >= 0) {
-			const struct ib_gid_attr *attr;
-
-			get_gid_entry(table->data_vec[index]);
-			attr = &table->data_vec[index]->attr;
-			read_unlock_irqrestore(&table->rwlock, flags);
-			return attr;
-		}
-		read_unlock_irqrestore(&table->rwlock, flags);
+		entry = find_gid_entry_rcu(device->port_data[p].cache.gid, gid,
+					   &gid_attr_val, mask);
+		if (entry)
+			return &entry->attr;
 	}
 
 	return ERR_PTR(-ENOENT);
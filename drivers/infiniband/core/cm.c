@@ -12,6 +12,7 @@
 #include <linux/device.h>
 #include <linux/module.h>
 #include <linux/err.h>
+#include <linux/hash.h>
 #include <linux/idr.h>
 #include <linux/interrupt.h>
 #include <linux/random.h>
@@ -108,16 +109,37 @@ static struct ib_client cm_client = {
 	.remove = cm_remove_one
 };
 
+/*
+ * The listen, remote id, remote QP and remote SIDR lookup tables are split
+ * into shards, each an rbtree under its own spinlock, so that MADs for
+ * unrelated connections don't serialise on one lock.  Listeners are sharded
+ * by device since their service IDs are matched under a mask; the remote
+ * tables are sharded by the remote communication ID (and QPN).
+ */
+#define CM_TABLE_SHARD_BITS	5
+#define CM_TABLE_SHARDS		(1 << CM_TABLE_SHARD_BITS)
+
+enum {
+	CM_LISTEN_TABLE,
+	CM_REMOTE_ID_TABLE,
+	CM_REMOTE_QP_TABLE,
+	CM_REMOTE_SIDR_TABLE,
+	CM_TABLE_COUNT
+};
+
+struct cm_table_shard {
+	spinlock_t lock;
+	struct rb_root root;
+	/* Times the lock was found held by someone else */
+	atomic_long_t contended;
+} ____cacheline_aligned_in_smp;
+
 static struct ib_cm {
 	spinlock_t lock;
 	struct list_head device_list;
 	rwlock_t device_lock;
-	struct rb_root listen_service_table;
 	u64 listen_service_id;
-	/* struct rb_root peer_service_table; todo: fix peer to peer */
-	struct rb_root remote_qp_table;
-	struct rb_root remote_id_table;
-	struct rb_root remote_sidr_table;
+	struct cm_table_shard tables[CM_TABLE_COUNT][CM_TABLE_SHARDS];
 	struct xarray local_id_table;
 	u32 local_id_next;
 	__be32 random_id_operand;
@@ -254,11 +276,11 @@ struct cm_id_private {
 
 	struct rb_node service_node;
 	struct rb_node sidr_id_node;
-	spinlock_t lock;	/* Do not acquire inside cm.lock */
+	spinlock_t lock;	/* Do not acquire inside cm.lock or a table lock */
 	struct completion comp;
 	refcount_t refcount;
 	/* Number of clients sharing this ib_cm_id. Only valid for listeners.
-	 * Protected by the cm.lock spinlock. */
+	 * Protected by the lock of its listen table shard. */
 	int listen_sharecount;
 	struct rcu_head rcu;
 
@@ -626,22 +648,66 @@ static int be64_gt(__be64 a, __be64 b)
 	return (__force u64) a > (__force u64) b;
 }
 
+static struct cm_table_shard *cm_listen_shard(struct ib_device *device)
+{
+	return &cm.tables[CM_LISTEN_TABLE][hash_ptr(device,
+						     CM_TABLE_SHARD_BITS)];
+}
+
+static struct cm_table_shard *cm_remote_id_shard(__be32 remote_id)
+{
+	return &cm.tables[CM_REMOTE_ID_TABLE]
+			 [hash_32((__force u32)remote_id, CM_TABLE_SHARD_BITS)];
+}
+
+static struct cm_table_shard *cm_remote_qp_shard(__be32 remote_id,
+						 __be32 remote_qpn)
+{
+	return &cm.tables[CM_REMOTE_QP_TABLE]
+			 [hash_32((__force u32)remote_id ^ (__force u32)remote_qpn,
+				  CM_TABLE_SHARD_BITS)];
+}
+
+static struct cm_table_shard *cm_remote_sidr_shard(__be32 remote_id)
+{
+	return &cm.tables[CM_REMOTE_SIDR_TABLE]
+			 [hash_32((__force u32)remote_id, CM_TABLE_SHARD_BITS)];
+}
+
+static unsigned long cm_shard_lock(struct cm_table_shard *shard)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	if (!spin_trylock(&shard->lock)) {
+		atomic_long_inc(&shard->contended);
+		spin_lock(&shard->lock);
+	}
+	return flags;
+}
+
+static void cm_shard_unlock(struct cm_table_shard *shard, unsigned long flags)
+{
+	spin_unlock_irqrestore(&shard->lock, flags);
+}
+
 /*
- * Inserts a new cm_id_priv into the listen_service_table. Returns cm_id_priv
+ * Inserts a new cm_id_priv into the listen table. Returns cm_id_priv
  * if the new ID was inserted, NULL if it could not be inserted due to a
  * collision, or the existing cm_id_priv ready for shared usage.
  */
 static struct cm_id_private *cm_insert_listen(struct cm_id_private *cm_id_priv,
 					      ib_cm_handler shared_handler)
 {
-	struct rb_node **link = &cm.listen_service_table.rb_node;
+	struct cm_table_shard *shard = cm_listen_shard(cm_id_priv->id.device);
+	struct rb_node **link = &shard->root.rb_node;
 	struct rb_node *parent = NULL;
 	struct cm_id_private *cur_cm_id_priv;
 	__be64 service_id = cm_id_priv->id.service_id;
 	__be64 service_mask = cm_id_priv->id.service_mask;
 	unsigned long flags;
 
-	spin_lock_irqsave(&cm.lock, flags);
+	flags = cm_shard_lock(shard);
 	while (*link) {
 		parent = *link;
 		cur_cm_id_priv = rb_entry(parent, struct cm_id_private,
@@ -656,12 +722,12 @@ static struct cm_id_private *cm_insert_listen(struct cm_id_private *cm_id_priv,
 			if (cur_cm_id_priv->id.cm_handler != shared_handler ||
 			    cur_cm_id_priv->id.context ||
 			    WARN_ON(!cur_cm_id_priv->id.cm_handler)) {
-				spin_unlock_irqrestore(&cm.lock, flags);
+				cm_shard_unlock(shard, flags);
 				return NULL;
 			}
 			refcount_inc(&cur_cm_id_priv->refcount);
 			cur_cm_id_priv->listen_sharecount++;
-			spin_unlock_irqrestore(&cm.lock, flags);
+			cm_shard_unlock(shard, flags);
 			return cur_cm_id_priv;
 		}
 
@@ -678,24 +744,29 @@ static struct cm_id_private *cm_insert_listen(struct cm_id_private *cm_id_priv,
 	}
 	cm_id_priv->listen_sharecount++;
 	rb_link_node(&cm_id_priv->service_node, parent, link);
-	rb_insert_color(&cm_id_priv->service_node, &cm.listen_service_table);
-	spin_unlock_irqrestore(&cm.lock, flags);
+	rb_insert_color(&cm_id_priv->service_node, &shard->root);
+	cm_shard_unlock(shard, flags);
 	return cm_id_priv;
 }
 
 static struct cm_id_private * cm_find_listen(struct ib_device *device,
 					     __be64 service_id)
 {
-	struct rb_node *node = cm.listen_service_table.rb_node;
-	struct cm_id_private *cm_id_priv;
+	struct cm_table_shard *shard = cm_listen_shard(device);
+	struct cm_id_private *cm_id_priv, *res = NULL;
+	struct rb_node *node;
+	unsigned long flags;
 
+	flags = cm_shard_lock(shard);
+	node = shard->root.rb_node;
 	while (node) {
 		cm_id_priv = rb_entry(node, struct cm_id_private, service_node);
 		if ((cm_id_priv->id.service_mask & service_id) ==
 		     cm_id_priv->id.service_id &&
 		    (cm_id_priv->id.device == device)) {
 			refcount_inc(&cm_id_priv->refcount);
-			return cm_id_priv;
+			res = cm_id_priv;
+			break;
 		}
 		if (device < cm_id_priv->id.device)
 			node = node->rb_left;
@@ -708,13 +779,20 @@ static struct cm_id_private * cm_find_listen(struct ib_device *device,
 		else
 			node = node->rb_right;
 	}
-	return NULL;
+	cm_shard_unlock(shard, flags);
+	return res;
 }
 
+/*
+ * The remote table insert helpers expect the lock of the shard for the
+ * timewait_info (or cm_id_priv) key to be held by the caller.
+ */
 static struct cm_timewait_info * cm_insert_remote_id(struct cm_timewait_info
 						     *timewait_info)
 {
-	struct rb_node **link = &cm.remote_id_table.rb_node;
+	struct cm_table_shard *shard =
+		cm_remote_id_shard(timewait_info->work.remote_id);
+	struct rb_node **link = &shard->root.rb_node;
 	struct rb_node *parent = NULL;
 	struct cm_timewait_info *cur_timewait_info;
 	__be64 remote_ca_guid = timewait_info->remote_ca_guid;
@@ -737,18 +815,21 @@ static struct cm_timewait_info * cm_insert_remote_id(struct cm_timewait_info
 	}
 	timewait_info->inserted_remote_id = 1;
 	rb_link_node(&timewait_info->remote_id_node, parent, link);
-	rb_insert_color(&timewait_info->remote_id_node, &cm.remote_id_table);
+	rb_insert_color(&timewait_info->remote_id_node, &shard->root);
 	return NULL;
 }
 
 static struct cm_id_private *cm_find_remote_id(__be64 remote_ca_guid,
 					       __be32 remote_id)
 {
-	struct rb_node *node = cm.remote_id_table.rb_node;
+	struct cm_table_shard *shard = cm_remote_id_shard(remote_id);
 	struct cm_timewait_info *timewait_info;
 	struct cm_id_private *res = NULL;
+	struct rb_node *node;
+	unsigned long flags;
 
-	spin_lock_irq(&cm.lock);
+	flags = cm_shard_lock(shard);
+	node = shard->root.rb_node;
 	while (node) {
 		timewait_info = rb_entry(node, struct cm_timewait_info,
 					 remote_id_node);
@@ -766,14 +847,17 @@ static struct cm_id_private *cm_find_remote_id(__be64 remote_ca_guid,
 			break;
 		}
 	}
-	spin_unlock_irq(&cm.lock);
+	cm_shard_unlock(shard, flags);
 	return res;
 }
 
 static struct cm_timewait_info * cm_insert_remote_qpn(struct cm_timewait_info
 						      *timewait_info)
 {
-	struct rb_node **link = &cm.remote_qp_table.rb_node;
+	struct cm_table_shard *shard =
+		cm_remote_qp_shard(timewait_info->work.remote_id,
+				   timewait_info->remote_qpn);
+	struct rb_node **link = &shard->root.rb_node;
 	struct rb_node *parent = NULL;
 	struct cm_timewait_info *cur_timewait_info;
 	__be64 remote_ca_guid = timewait_info->remote_ca_guid;
@@ -801,14 +885,16 @@ static struct cm_timewait_info * cm_insert_remote_qpn(struct cm_timewait_info
 	}
 	timewait_info->inserted_remote_qp = 1;
 	rb_link_node(&timewait_info->remote_qp_node, parent, link);
-	rb_insert_color(&timewait_info->remote_qp_node, &cm.remote_qp_table);
+	rb_insert_color(&timewait_info->remote_qp_node, &shard->root);
 	return NULL;
 }
 
 static struct cm_id_private * cm_insert_remote_sidr(struct cm_id_private
 						    *cm_id_priv)
 {
-	struct rb_node **link = &cm.remote_sidr_table.rb_node;
+	struct cm_table_shard *shard =
+		cm_remote_sidr_shard(cm_id_priv->id.remote_id);
+	struct rb_node **link = &shard->root.rb_node;
 	struct rb_node *parent = NULL;
 	struct cm_id_private *cur_cm_id_priv;
 	union ib_gid *port_gid = &cm_id_priv->av.dgid;
@@ -835,10 +921,24 @@ static struct cm_id_private * cm_insert_remote_sidr(struct cm_id_private
 		}
 	}
 	rb_link_node(&cm_id_priv->sidr_id_node, parent, link);
-	rb_insert_color(&cm_id_priv->sidr_id_node, &cm.remote_sidr_table);
+	rb_insert_color(&cm_id_priv->sidr_id_node, &shard->root);
 	return NULL;
 }
 
+static void cm_remove_remote_sidr(struct cm_id_private *cm_id_priv)
+{
+	struct cm_table_shard *shard =
+		cm_remote_sidr_shard(cm_id_priv->id.remote_id);
+	unsigned long flags;
+
+	flags = cm_shard_lock(shard);
+	if (!RB_EMPTY_NODE(&cm_id_priv->sidr_id_node)) {
+		rb_erase(&cm_id_priv->sidr_id_node, &shard->root);
+		RB_CLEAR_NODE(&cm_id_priv->sidr_id_node);
+	}
+	cm_shard_unlock(shard, flags);
+}
+
 static struct cm_id_private *cm_alloc_id_priv(struct ib_device *device,
 					      ib_cm_handler cm_handler,
 					      void *context)
@@ -982,14 +1082,23 @@ static u8 cm_ack_timeout(u8 ca_ack_delay, u8 packet_life_time)
 static void cm_remove_remote(struct cm_id_private *cm_id_priv)
 {
 	struct cm_timewait_info *timewait_info = cm_id_priv->timewait_info;
+	struct cm_table_shard *shard;
+	unsigned long flags;
 
 	if (timewait_info->inserted_remote_id) {
-		rb_erase(&timewait_info->remote_id_node, &cm.remote_id_table);
+		shard = cm_remote_id_shard(timewait_info->work.remote_id);
+		flags = cm_shard_lock(shard);
+		rb_erase(&timewait_info->remote_id_node, &shard->root);
+		cm_shard_unlock(shard, flags);
 		timewait_info->inserted_remote_id = 0;
 	}
 
 	if (timewait_info->inserted_remote_qp) {
-		rb_erase(&timewait_info->remote_qp_node, &cm.remote_qp_table);
+		shard = cm_remote_qp_shard(timewait_info->work.remote_id,
+					   timewait_info->remote_qpn);
+		flags = cm_shard_lock(shard);
+		rb_erase(&timewait_info->remote_qp_node, &shard->root);
+		cm_shard_unlock(shard, flags);
 		timewait_info->inserted_remote_qp = 0;
 	}
 }
@@ -1020,8 +1129,8 @@ static void cm_enter_timewait(struct cm_id_private *cm_id_priv)
 	if (!cm_dev)
 		return;
 
-	spin_lock_irqsave(&cm.lock, flags);
 	cm_remove_remote(cm_id_priv);
+	spin_lock_irqsave(&cm.lock, flags);
 	list_add_tail(&cm_id_priv->timewait_info->list, &cm.timewait_list);
 	spin_unlock_irqrestore(&cm.lock, flags);
 
@@ -1050,15 +1159,11 @@ static void cm_enter_timewait(struct cm_id_private *cm_id_priv)
 
 static void cm_reset_to_idle(struct cm_id_private *cm_id_priv)
 {
-	unsigned long flags;
-
 	lockdep_assert_held(&cm_id_priv->lock);
 
 	cm_id_priv->id.state = IB_CM_IDLE;
 	if (cm_id_priv->timewait_info) {
-		spin_lock_irqsave(&cm.lock, flags);
 		cm_remove_remote(cm_id_priv);
-		spin_unlock_irqrestore(&cm.lock, flags);
 		kfree(cm_id_priv->timewait_info);
 		cm_id_priv->timewait_info = NULL;
 	}
@@ -1067,26 +1172,29 @@ static void cm_reset_to_idle(struct cm_id_private *cm_id_priv)
 static void cm_destroy_id(struct ib_cm_id *cm_id, int err)
 {
 	struct cm_id_private *cm_id_priv;
+	struct cm_table_shard *shard;
 	struct cm_work *work;
+	unsigned long flags;
 
 	cm_id_priv = container_of(cm_id, struct cm_id_private, id);
 	spin_lock_irq(&cm_id_priv->lock);
 retest:
 	switch (cm_id->state) {
 	case IB_CM_LISTEN:
-		spin_lock(&cm.lock);
+		shard = cm_listen_shard(cm_id->device);
+		flags = cm_shard_lock(shard);
 		if (--cm_id_priv->listen_sharecount > 0) {
 			/* The id is still shared. */
 			WARN_ON(refcount_read(&cm_id_priv->refcount) == 1);
-			spin_unlock(&cm.lock);
+			cm_shard_unlock(shard, flags);
 			spin_unlock_irq(&cm_id_priv->lock);
 			cm_deref_id(cm_id_priv);
 			return;
 		}
 		cm_id->state = IB_CM_IDLE;
-		rb_erase(&cm_id_priv->service_node, &cm.listen_service_table);
+		rb_erase(&cm_id_priv->service_node, &shard->root);
 		RB_CLEAR_NODE(&cm_id_priv->service_node);
-		spin_unlock(&cm.lock);
+		cm_shard_unlock(shard, flags);
 		break;
 	case IB_CM_SIDR_REQ_SENT:
 		cm_id->state = IB_CM_IDLE;
@@ -1157,13 +1265,15 @@ retest:
 	}
 	WARN_ON(cm_id->state != IB_CM_IDLE);
 
-	spin_lock(&cm.lock);
 	/* Required for cleanup paths related cm_req_handler() */
 	if (cm_id_priv->timewait_info) {
 		cm_remove_remote(cm_id_priv);
 		kfree(cm_id_priv->timewait_info);
 		cm_id_priv->timewait_info = NULL;
 	}
+	cm_remove_remote_sidr(cm_id_priv);
+
+	spin_lock(&cm.lock);
 	if (!list_empty(&cm_id_priv->altr_list) &&
 	    (!cm_id_priv->altr_send_port_not_ready))
 		list_del(&cm_id_priv->altr_list);
@@ -1172,8 +1282,6 @@ retest:
 		list_del(&cm_id_priv->prim_list);
 	WARN_ON(cm_id_priv->listen_sharecount);
 	WARN_ON(!RB_EMPTY_NODE(&cm_id_priv->service_node));
-	if (!RB_EMPTY_NODE(&cm_id_priv->sidr_id_node))
-		rb_erase(&cm_id_priv->sidr_id_node, &cm.remote_sidr_table);
 	spin_unlock(&cm.lock);
 	spin_unlock_irq(&cm_id_priv->lock);
 
@@ -1982,34 +2090,41 @@ free:	cm_free_msg(msg);
 static struct cm_id_private * cm_match_req(struct cm_work *work,
 					   struct cm_id_private *cm_id_priv)
 {
+	struct cm_timewait_info *new_info = cm_id_priv->timewait_info;
 	struct cm_id_private *listen_cm_id_priv, *cur_cm_id_priv;
 	struct cm_timewait_info *timewait_info;
+	struct cm_table_shard *shard;
 	struct cm_req_msg *req_msg;
+	unsigned long flags;
 
 	req_msg = (struct cm_req_msg *)work->mad_recv_wc->recv_buf.mad;
 
 	/* Check for possible duplicate REQ. */
-	spin_lock_irq(&cm.lock);
-	timewait_info = cm_insert_remote_id(cm_id_priv->timewait_info);
+	shard = cm_remote_id_shard(new_info->work.remote_id);
+	flags = cm_shard_lock(shard);
+	timewait_info = cm_insert_remote_id(new_info);
 	if (timewait_info) {
 		cur_cm_id_priv = cm_acquire_id(timewait_info->work.local_id,
 					   timewait_info->work.remote_id);
-		spin_unlock_irq(&cm.lock);
+		cm_shard_unlock(shard, flags);
 		if (cur_cm_id_priv) {
 			cm_dup_req_handler(work, cur_cm_id_priv);
 			cm_deref_id(cur_cm_id_priv);
 		}
 		return NULL;
 	}
+	cm_shard_unlock(shard, flags);
 
 	/* Check for stale connections. */
-	timewait_info = cm_insert_remote_qpn(cm_id_priv->timewait_info);
+	shard = cm_remote_qp_shard(new_info->work.remote_id,
+				   new_info->remote_qpn);
+	flags = cm_shard_lock(shard);
+	timewait_info = cm_insert_remote_qpn(new_info);
 	if (timewait_info) {
-		cm_remove_remote(cm_id_priv);
 		cur_cm_id_priv = cm_acquire_id(timewait_info->work.local_id,
 					   timewait_info->work.remote_id);
-
-		spin_unlock_irq(&cm.lock);
+		cm_shard_unlock(shard, flags);
+		cm_remove_remote(cm_id_priv);
 		cm_issue_rej(work->port, work->mad_recv_wc,
 			     IB_CM_REJ_STALE_CONN, CM_MSG_RESPONSE_REQ,
 			     NULL, 0);
@@ -2019,6 +2134,7 @@ static struct cm_id_private * cm_match_req(struct cm_work *work,
 		}
 		return NULL;
 	}
+	cm_shard_unlock(shard, flags);
 
 	/* Find matching listen request. */
 	listen_cm_id_priv = cm_find_listen(
@@ -2026,13 +2142,11 @@ static struct cm_id_private * cm_match_req(struct cm_work *work,
 		cpu_to_be64(IBA_GET(CM_REQ_SERVICE_ID, req_msg)));
 	if (!listen_cm_id_priv) {
 		cm_remove_remote(cm_id_priv);
-		spin_unlock_irq(&cm.lock);
 		cm_issue_rej(work->port, work->mad_recv_wc,
 			     IB_CM_REJ_INVALID_SERVICE_ID, CM_MSG_RESPONSE_REQ,
 			     NULL, 0);
 		return NULL;
 	}
-	spin_unlock_irq(&cm.lock);
 	return listen_cm_id_priv;
 }
 
@@ -2469,6 +2583,8 @@ static int cm_rep_handler(struct cm_work *work)
 	int ret;
 	struct cm_id_private *cur_cm_id_priv;
 	struct cm_timewait_info *timewait_info;
+	struct cm_table_shard *shard;
+	unsigned long flags;
 
 	rep_msg = (struct cm_rep_msg *)work->mad_recv_wc->recv_buf.mad;
 	cm_id_priv = cm_acquire_id(
@@ -2504,10 +2620,12 @@ static int cm_rep_handler(struct cm_work *work)
 		cpu_to_be64(IBA_GET(CM_REP_LOCAL_CA_GUID, rep_msg));
 	cm_id_priv->timewait_info->remote_qpn = cm_rep_get_qpn(rep_msg, cm_id_priv->qp_type);
 
-	spin_lock(&cm.lock);
 	/* Check for duplicate REP. */
-	if (cm_insert_remote_id(cm_id_priv->timewait_info)) {
-		spin_unlock(&cm.lock);
+	shard = cm_remote_id_shard(cm_id_priv->timewait_info->work.remote_id);
+	flags = cm_shard_lock(shard);
+	timewait_info = cm_insert_remote_id(cm_id_priv->timewait_info);
+	cm_shard_unlock(shard, flags);
+	if (timewait_info) {
 		spin_unlock_irq(&cm_id_priv->lock);
 		ret = -EINVAL;
 		pr_debug("%s: Failed to insert remote id %d\n", __func__,
@@ -2515,13 +2633,15 @@ static int cm_rep_handler(struct cm_work *work)
 		goto error;
 	}
 	/* Check for a stale connection. */
+	shard = cm_remote_qp_shard(cm_id_priv->timewait_info->work.remote_id,
+				   cm_id_priv->timewait_info->remote_qpn);
+	flags = cm_shard_lock(shard);
 	timewait_info = cm_insert_remote_qpn(cm_id_priv->timewait_info);
 	if (timewait_info) {
-		cm_remove_remote(cm_id_priv);
 		cur_cm_id_priv = cm_acquire_id(timewait_info->work.local_id,
 					   timewait_info->work.remote_id);
-
-		spin_unlock(&cm.lock);
+		cm_shard_unlock(shard, flags);
+		cm_remove_remote(cm_id_priv);
 		spin_unlock_irq(&cm_id_priv->lock);
 		cm_issue_rej(work->port, work->mad_recv_wc,
 			     IB_CM_REJ_STALE_CONN, CM_MSG_RESPONSE_REP,
@@ -2539,7 +2659,7 @@ static int cm_rep_handler(struct cm_work *work)
 
 		goto error;
 	}
-	spin_unlock(&cm.lock);
+	cm_shard_unlock(shard, flags);
 
 	cm_id_priv->id.state = IB_CM_REP_RCVD;
 	cm_id_priv->id.remote_id =
@@ -3558,6 +3678,8 @@ static int cm_sidr_req_handler(struct cm_work *work)
 {
 	struct cm_id_private *cm_id_priv, *listen_cm_id_priv;
 	struct cm_sidr_req_msg *sidr_req_msg;
+	struct cm_table_shard *shard;
+	unsigned long flags;
 	struct ib_wc *wc;
 	int ret;
 
@@ -3586,10 +3708,11 @@ static int cm_sidr_req_handler(struct cm_work *work)
 	if (ret)
 		goto out;
 
-	spin_lock_irq(&cm.lock);
+	shard = cm_remote_sidr_shard(cm_id_priv->id.remote_id);
+	flags = cm_shard_lock(shard);
 	listen_cm_id_priv = cm_insert_remote_sidr(cm_id_priv);
+	cm_shard_unlock(shard, flags);
 	if (listen_cm_id_priv) {
-		spin_unlock_irq(&cm.lock);
 		atomic_long_inc(&work->port->counter_group[CM_RECV_DUPLICATES].
 				counter[CM_SIDR_REQ_COUNTER]);
 		goto out; /* Duplicate message. */
@@ -3598,13 +3721,11 @@ static int cm_sidr_req_handler(struct cm_work *work)
 	listen_cm_id_priv = cm_find_listen(cm_id_priv->id.device,
 					   cm_id_priv->id.service_id);
 	if (!listen_cm_id_priv) {
-		spin_unlock_irq(&cm.lock);
 		ib_send_cm_sidr_rep(&cm_id_priv->id,
 				    &(struct ib_cm_sidr_rep_param){
 					    .status = IB_SIDR_UNSUPPORTED });
 		goto out; /* No match. */
 	}
-	spin_unlock_irq(&cm.lock);
 
 	cm_id_priv->id.cm_handler = listen_cm_id_priv->id.cm_handler;
 	cm_id_priv->id.context = listen_cm_id_priv->id.context;
@@ -3662,7 +3783,6 @@ static int cm_send_sidr_rep_locked(struct cm_id_private *cm_id_priv,
 				   struct ib_cm_sidr_rep_param *param)
 {
 	struct ib_mad_send_buf *msg;
-	unsigned long flags;
 	int ret;
 
 	lockdep_assert_held(&cm_id_priv->lock);
@@ -3687,12 +3807,7 @@ static int cm_send_sidr_rep_locked(struct cm_id_private *cm_id_priv,
 		return ret;
 	}
 	cm_id_priv->id.state = IB_CM_IDLE;
-	spin_lock_irqsave(&cm.lock, flags);
-	if (!RB_EMPTY_NODE(&cm_id_priv->sidr_id_node)) {
-		rb_erase(&cm_id_priv->sidr_id_node, &cm.remote_sidr_table);
-		RB_CLEAR_NODE(&cm_id_priv->sidr_id_node);
-	}
-	spin_unlock_irqrestore(&cm.lock, flags);
+	cm_remove_remote_sidr(cm_id_priv);
 	return 0;
 }
 
@@ -4310,6 +4425,47 @@ static struct kobj_type cm_counter_obj_type = {
 	.default_attrs = cm_counter_default_attrs
 };
 
+/*
+ * The lookup tables are shared by all devices, so their lock contention
+ * is reported once under /sys/class/infiniband_cm rather than per port.
+ */
+static ssize_t cm_show_contention(int table, char *buf)
+{
+	long count = 0;
+	int i;
+
+	for (i = 0; i < CM_TABLE_SHARDS; i++)
+		count += atomic_long_read(&cm.tables[table][i].contended);
+
+	return sprintf(buf, "%ld\n", count);
+}
+
+#define CM_CONTENTION_ATTR(_name, _table)				\
+static ssize_t _name##_contention_show(struct class *class,		\
+				       struct class_attribute *attr,	\
+				       char *buf)			\
+{									\
+	return cm_show_contention(_table, buf);				\
+}									\
+static struct class_attribute class_attr_##_name##_contention =	\
+	__ATTR(_name##_contention, 0444, _name##_contention_show, NULL)
+
+CM_CONTENTION_ATTR(listen, CM_LISTEN_TABLE);
+CM_CONTENTION_ATTR(remote_id, CM_REMOTE_ID_TABLE);
+CM_CONTENTION_ATTR(remote_qp, CM_REMOTE_QP_TABLE);
+CM_CONTENTION_ATTR(remote_sidr, CM_REMOTE_SIDR_TABLE);
+
+static struct attribute *cm_class_attrs[] = {
+	&class_attr_listen_contention.attr,
+	&class_attr_remote_id_contention.attr,
+	&class_attr_remote_qp_contention.attr,
+	&class_attr_remote_sidr_contention.attr,
+	NULL,
+};
+#ifdef HAVE_CLASS_GROUPS
+ATTRIBUTE_GROUPS(cm_class);
+#endif
+
 static char *cm_devnode(struct device *dev, umode_t *mode)
 {
 	if (mode)
@@ -4321,9 +4477,30 @@ struct class cm_class = {
 	.owner   = THIS_MODULE,
 	.name    = "infiniband_cm",
 	.devnode = cm_devnode,
+#ifdef HAVE_CLASS_GROUPS
+	.class_groups = cm_class_groups,
+#endif
 };
 EXPORT_SYMBOL(cm_class);
 
+#ifndef HAVE_CLASS_GROUPS
+/* Files are removed along with the class by class_unregister() */
+static int cm_create_class_files(void)
+{
+	int i, ret;
+
+	for (i = 0; cm_class_attrs[i]; i++) {
+		ret = class_create_file(&cm_class,
+					container_of(cm_class_attrs[i],
+						     struct class_attribute,
+						     attr));
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+#endif
+
 static int cm_create_port_fs(struct cm_port *port)
 {
 	int i, ret;
@@ -4511,17 +4688,19 @@ static void cm_remove_one(struct ib_device *ib_device, void *client_data)
 
 static int __init ib_cm_init(void)
 {
-	int ret;
+	int ret, i, j;
 
 	INIT_LIST_HEAD(&cm.device_list);
 	rwlock_init(&cm.device_lock);
 	spin_lock_init(&cm.lock);
 	spin_lock_init(&cm.state_lock);
-	cm.listen_service_table = RB_ROOT;
+	for (i = 0; i < CM_TABLE_COUNT; i++) {
+		for (j = 0; j < CM_TABLE_SHARDS; j++) {
+			spin_lock_init(&cm.tables[i][j].lock);
+			cm.tables[i][j].root = RB_ROOT;
+		}
+	}
 	cm.listen_service_id = be64_to_cpu(IB_CM_ASSIGN_SERVICE_ID);
-	cm.remote_id_table = RB_ROOT;
-	cm.remote_qp_table = RB_ROOT;
-	cm.remote_sidr_table = RB_ROOT;
 	xa_init_flags(&cm.local_id_table, XA_FLAGS_ALLOC);
 	get_random_bytes(&cm.random_id_operand, sizeof cm.random_id_operand);
 	INIT_LIST_HEAD(&cm.timewait_list);
@@ -4532,6 +4711,12 @@ static int __init ib_cm_init(void)
 		goto error1;
 	}
 
+#ifndef HAVE_CLASS_GROUPS
+	ret = cm_create_class_files();
+	if (ret)
+		goto error2;
+#endif
+
 	cm.wq = alloc_workqueue("ib_cm", 0, 1);
 	if (!cm.wq) {
 		ret = -ENOMEM;
@@ -10,6 +10,8 @@
 #include <linux/in.h>
 #include <linux/in6.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/hash.h>
 #include <linux/random.h>
 #include <linux/igmp.h>
 #include <linux/xarray.h>
@@ -174,9 +176,32 @@ static struct ib_client cma_client = {
 static struct ib_sa_client sa_client;
 static LIST_HEAD(dev_list);
 static LIST_HEAD(listen_any_list);
+/*
+ * lock serialises device add/remove with wildcard listeners: it protects
+ * listen_any_list and is held around every change of dev_list and of the
+ * per-device listen_list children.  The connection setup paths only need
+ * the narrower locks below, so that independent connections and listeners
+ * don't queue up behind each other:
+ *  - devices_rwsem: dev_list, written with lock held, read by device lookups
+ *  - cma_device->id_list_lock: the ids attached to that device
+ *  - cma_port_locks[]: bind lists of the port spaces, sharded by port, and
+ *    the listen_list of the listeners bound there
+ * Lock order is lock -> devices_rwsem -> id_list_lock, and lock -> port lock.
+ */
 static DEFINE_MUTEX(lock);
+static DECLARE_RWSEM(devices_rwsem);
 static struct workqueue_struct *cma_wq;
 
+#define CMA_PORT_LOCK_BITS	6
+static struct mutex cma_port_locks[1 << CMA_PORT_LOCK_BITS];
+
+static struct mutex *cma_port_lock(enum rdma_ucm_port_space ps,
+				   unsigned short port)
+{
+	return &cma_port_locks[hash_32((u32)ps << 16 | port,
+				       CMA_PORT_LOCK_BITS)];
+}
+
 static unsigned int cma_pernet_id;
 
 struct cma_pernet {
@@ -215,6 +240,7 @@ struct cma_device {
 	struct ib_device	*device;
 	struct completion	comp;
 	refcount_t refcount;
+	struct mutex		id_list_lock;
 	struct list_head	id_list;
 	enum ib_gid_type	*default_gid_type;
 	u8			*default_roce_tos;
@@ -280,7 +306,7 @@ struct cma_device *cma_enum_devices_by_ibdev(cma_device_filter	filter,
 	struct cma_device *cma_dev;
 	struct cma_device *found_cma_dev = NULL;
 
-	mutex_lock(&lock);
+	down_read(&devices_rwsem);
 
 	list_for_each_entry(cma_dev, &dev_list, list)
 		if (filter(cma_dev->device, cookie)) {
@@ -290,7 +316,7 @@ struct cma_device *cma_enum_devices_by_ibdev(cma_device_filter	filter,
 
 	if (found_cma_dev)
 		cma_dev_get(found_cma_dev);
-	mutex_unlock(&lock);
+	up_read(&devices_rwsem);
 	return found_cma_dev;
 }
 
@@ -470,7 +496,9 @@ static void _cma_attach_to_dev(struct rdma_id_private *id_priv,
 	id_priv->id.device = cma_dev->device;
 	id_priv->id.route.addr.dev_addr.transport =
 		rdma_node_get_transport(cma_dev->device->node_type);
+	mutex_lock(&cma_dev->id_list_lock);
 	list_add_tail(&id_priv->list, &cma_dev->id_list);
+	mutex_unlock(&cma_dev->id_list_lock);
 #if defined(HAVE_TRACE_EVENTS_H) && !defined(MLX_DISABLE_TRACEPOINTS)
 	trace_cm_id_attach(id_priv, cma_dev->device);
 #endif
@@ -487,15 +515,17 @@ static void cma_attach_to_dev(struct rdma_id_private *id_priv,
 
 static void cma_release_dev(struct rdma_id_private *id_priv)
 {
-	mutex_lock(&lock);
+	struct cma_device *cma_dev = id_priv->cma_dev;
+
+	mutex_lock(&cma_dev->id_list_lock);
 	list_del(&id_priv->list);
-	cma_dev_put(id_priv->cma_dev);
+	mutex_unlock(&cma_dev->id_list_lock);
 	id_priv->cma_dev = NULL;
 	if (id_priv->id.route.addr.dev_addr.sgid_attr) {
 		rdma_put_gid_attr(id_priv->id.route.addr.dev_addr.sgid_attr);
 		id_priv->id.route.addr.dev_addr.sgid_attr = NULL;
 	}
-	mutex_unlock(&lock);
+	cma_dev_put(cma_dev);
 }
 
 static inline struct sockaddr *cma_src_addr(struct rdma_id_private *id_priv)
@@ -640,7 +670,7 @@ static int cma_acquire_dev_by_src_ip(struct rdma_id_private *id_priv)
 	memcpy(&gid, dev_addr->src_dev_addr +
 	       rdma_addr_gid_offset(dev_addr), sizeof(gid));
 
-	mutex_lock(&lock);
+	down_read(&devices_rwsem);
 	list_for_each_entry(cma_dev, &dev_list, list) {
 		rdma_for_each_port (cma_dev->device, port) {
 			gidp = rdma_protocol_roce(cma_dev->device, port) ?
@@ -658,7 +688,7 @@ static int cma_acquire_dev_by_src_ip(struct rdma_id_private *id_priv)
 		}
 	}
 out:
-	mutex_unlock(&lock);
+	up_read(&devices_rwsem);
 	return ret;
 }
 
@@ -701,13 +731,11 @@ static int cma_ib_acquire_dev(struct rdma_id_private *id_priv,
 
 	id_priv->id.port_num = req->port;
 	cma_bind_sgid_attr(id_priv, sgid_attr);
-	/* Need to acquire lock to protect against reader
+	/* id_list_lock, taken by the attach, protects against readers
 	 * of cma_dev->id_list such as cma_netdev_callback() and
 	 * cma_process_remove().
 	 */
-	mutex_lock(&lock);
 	cma_attach_to_dev(id_priv, listen_id_priv->cma_dev);
-	mutex_unlock(&lock);
 	if (id_priv->res.kern_name)
 		rdma_restrack_kadd(&id_priv->res);
 	else
@@ -734,7 +762,7 @@ static int cma_iw_acquire_dev(struct rdma_id_private *id_priv,
 	memcpy(&gid, dev_addr->src_dev_addr +
 	       rdma_addr_gid_offset(dev_addr), sizeof(gid));
 
-	mutex_lock(&lock);
+	down_read(&devices_rwsem);
 
 	cma_dev = listen_id_priv->cma_dev;
 	port = listen_id_priv->id.port_num;
@@ -775,7 +803,7 @@ out:
 			rdma_restrack_uadd(&id_priv->res);
 	}
 
-	mutex_unlock(&lock);
+	up_read(&devices_rwsem);
 	return ret;
 }
 
@@ -797,7 +825,7 @@ static int cma_resolve_ib_dev(struct rdma_id_private *id_priv)
 	dgid = (union ib_gid *) &addr->sib_addr;
 	pkey = ntohs(addr->sib_pkey);
 
-	mutex_lock(&lock);
+	down_read(&devices_rwsem);
 	list_for_each_entry(cur_dev, &dev_list, list) {
 		rdma_for_each_port (cur_dev->device, p) {
 			if (!rdma_cap_af_ib(cur_dev->device, p))
@@ -829,7 +857,7 @@ static int cma_resolve_ib_dev(struct rdma_id_private *id_priv)
 			}
 		}
 	}
-	mutex_unlock(&lock);
+	up_read(&devices_rwsem);
 	return -ENODEV;
 
 found:
@@ -838,7 +866,7 @@ found:
 		rdma_restrack_kadd(&id_priv->res);
 	else
 		rdma_restrack_uadd(&id_priv->res);
-	mutex_unlock(&lock);
+	up_read(&devices_rwsem);
 	addr = (struct sockaddr_ib *)cma_src_addr(id_priv);
 	memcpy(&addr->sib_addr, &sgid, sizeof(sgid));
 	cma_translate_ib(addr, &id_priv->id.route.addr.dev_addr);
@@ -1641,11 +1669,11 @@ static struct rdma_id_private *cma_find_listener(
 	struct rdma_id_private *id_priv, *id_priv_dev;
 	COMPAT_HL_NODE
 
-	lockdep_assert_held(&lock);
-
 	if (!bind_list)
 		return ERR_PTR(-EINVAL);
 
+	lockdep_assert_held(cma_port_lock(bind_list->ps, bind_list->port));
+
 	compat_hlist_for_each_entry(id_priv, &bind_list->owners, node) {
 		if (cma_match_private_data(id_priv, ib_event->private_data)) {
 			if (id_priv->id.device == cm_id->device &&
@@ -1671,8 +1699,11 @@ cma_ib_id_from_event(struct ib_cm_id *cm_id,
 		     struct cma_req_info *req,
 		     struct net_device **net_dev)
 {
+	enum rdma_ucm_port_space ps;
 	struct rdma_bind_list *bind_list;
 	struct rdma_id_private *id_priv;
+	struct mutex *port_lock;
+	unsigned short port;
 	int err;
 
 	err = cma_save_req_info(ib_event, req);
@@ -1689,7 +1720,11 @@ cma_ib_id_from_event(struct ib_cm_id *cm_id,
 		}
 	}
 
-	mutex_lock(&lock);
+	ps = rdma_ps_from_service_id(req->service_id);
+	port = cma_port_from_service_id(req->service_id);
+	port_lock = cma_port_lock(ps, port);
+
+	mutex_lock(port_lock);
 	/*
 	 * Net namespace might be getting deleted while route lookup,
 	 * cm_id lookup is in progress. Therefore, perform netdevice
@@ -1726,12 +1761,11 @@ cma_ib_id_from_event(struct ib_cm_id *cm_id,
 	}
 
 	bind_list = cma_ps_find(*net_dev ? dev_net(*net_dev) : &init_net,
-				rdma_ps_from_service_id(req->service_id),
-				cma_port_from_service_id(req->service_id));
+				ps, port);
 	id_priv = cma_find_listener(bind_list, cm_id, ib_event, req, *net_dev);
 err:
 	rcu_read_unlock();
-	mutex_unlock(&lock);
+	mutex_unlock(port_lock);
 	if (IS_ERR(id_priv) && *net_dev) {
 		dev_put(*net_dev);
 		*net_dev = NULL;
@@ -1754,7 +1788,10 @@ static void cma_cancel_route(struct rdma_id_private *id_priv)
 
 static void cma_cancel_listens(struct rdma_id_private *id_priv)
 {
+	struct mutex *port_lock = cma_port_lock(id_priv->bind_list->ps,
+						id_priv->bind_list->port);
 	struct rdma_id_private *dev_id_priv;
+	struct cma_device *cma_dev;
 
 	/*
 	 * Remove from listen_any_list to prevent added devices from spawning
@@ -1767,8 +1804,13 @@ static void cma_cancel_listens(struct rdma_id_private *id_priv)
 		dev_id_priv = list_entry(id_priv->listen_list.next,
 					 struct rdma_id_private, listen_list);
 		/* sync with device removal to avoid duplicate destruction */
+		cma_dev = dev_id_priv->cma_dev;
+		mutex_lock(&cma_dev->id_list_lock);
 		list_del_init(&dev_id_priv->list);
+		mutex_unlock(&cma_dev->id_list_lock);
+		mutex_lock(port_lock);
 		list_del(&dev_id_priv->listen_list);
+		mutex_unlock(port_lock);
 		mutex_unlock(&lock);
 
 		rdma_destroy_id(&dev_id_priv->id);
@@ -1801,16 +1843,19 @@ static void cma_release_port(struct rdma_id_private *id_priv)
 	struct rdma_bind_list *bind_list = id_priv->bind_list;
 	struct net *net = id_priv->id.route.addr.dev_addr.net;
 
+	struct mutex *port_lock;
+
 	if (!bind_list)
 		return;
 
-	mutex_lock(&lock);
+	port_lock = cma_port_lock(bind_list->ps, bind_list->port);
+	mutex_lock(port_lock);
 	hlist_del(&id_priv->node);
 	if (hlist_empty(&bind_list->owners)) {
 		cma_ps_remove(net, bind_list->ps, bind_list->port);
 		kfree(bind_list);
 	}
-	mutex_unlock(&lock);
+	mutex_unlock(port_lock);
 }
 
 static void destroy_mc(struct rdma_id_private *id_priv,
@@ -2537,6 +2582,7 @@ static int cma_listen_on_dev(struct rdma_id_private *id_priv,
 	struct rdma_id_private *dev_id_priv;
 	struct rdma_cm_id *id;
 	struct net *net = id_priv->id.route.addr.dev_addr.net;
+	struct mutex *port_lock;
 	int ret;
 
 	lockdep_assert_held(&lock);
@@ -2570,7 +2616,11 @@ static int cma_listen_on_dev(struct rdma_id_private *id_priv,
 	ret = rdma_listen(id, id_priv->backlog);
 	if (ret)
 		goto err_listen;
+	port_lock = cma_port_lock(id_priv->bind_list->ps,
+				  id_priv->bind_list->port);
+	mutex_lock(port_lock);
 	list_add_tail(&dev_id_priv->listen_list, &id_priv->listen_list);
+	mutex_unlock(port_lock);
 	return 0;
 err_listen:
 	/* Caller must destroy this after releasing lock */
@@ -2591,8 +2641,11 @@ static int cma_listen_on_all(struct rdma_id_private *id_priv)
 		ret = cma_listen_on_dev(id_priv, cma_dev, &to_destroy);
 		if (ret) {
 			/* Prevent racing with cma_process_remove() */
-			if (to_destroy)
+			if (to_destroy) {
+				mutex_lock(&cma_dev->id_list_lock);
 				list_del_init(&to_destroy->list);
+				mutex_unlock(&cma_dev->id_list_lock);
+			}
 			goto err_listen;
 		}
 	}
@@ -3180,7 +3233,7 @@ static int cma_bind_loopback(struct rdma_id_private *id_priv)
 	int ret;
 
 	cma_dev = NULL;
-	mutex_lock(&lock);
+	down_read(&devices_rwsem);
 	list_for_each_entry(cur_dev, &dev_list, list) {
 		if (cma_family(id_priv) == AF_IB &&
 		    !rdma_cap_ib_cm(cur_dev->device, 1))
@@ -3228,7 +3281,7 @@ port_found:
 		rdma_restrack_uadd(&id_priv->res);
 	cma_set_loopback(cma_src_addr(id_priv));
 out:
-	mutex_unlock(&lock);
+	up_read(&devices_rwsem);
 	return ret;
 }
 
@@ -3476,7 +3529,7 @@ static void cma_bind_port(struct rdma_bind_list *bind_list,
 	u64 sid, mask;
 	__be16 port;
 
-	lockdep_assert_held(&lock);
+	lockdep_assert_held(cma_port_lock(bind_list->ps, bind_list->port));
 
 	addr = cma_src_addr(id_priv);
 	port = htons(bind_list->port);
@@ -3506,7 +3559,7 @@ static int cma_alloc_port(enum rdma_ucm_port_space ps,
 	struct rdma_bind_list *bind_list;
 	int ret;
 
-	lockdep_assert_held(&lock);
+	lockdep_assert_held(cma_port_lock(ps, snum));
 
 	bind_list = kzalloc(sizeof *bind_list, GFP_KERNEL);
 	if (!bind_list)
@@ -3535,7 +3588,7 @@ static int cma_port_is_unique(struct rdma_bind_list *bind_list,
 	__be16 dport = cma_port(daddr);
 	COMPAT_HL_NODE
 
-	lockdep_assert_held(&lock);
+	lockdep_assert_held(cma_port_lock(bind_list->ps, bind_list->port));
 
 	compat_hlist_for_each_entry(cur_id, &bind_list->owners, node) {
 		struct sockaddr  *cur_daddr = cma_dst_addr(cur_id);
@@ -3576,16 +3629,16 @@ static int cma_alloc_any_port(enum rdma_ucm_port_space ps,
 	unsigned int rover;
 	struct net *net = id_priv->id.route.addr.dev_addr.net;
 
-	lockdep_assert_held(&lock);
-
 	inet_get_local_port_range(net, &low, &high);
 	remaining = (high - low) + 1;
 	rover = prandom_u32() % remaining + low;
 retry:
-	if (last_used_port != rover) {
+	if (READ_ONCE(last_used_port) != rover) {
+		struct mutex *port_lock = cma_port_lock(ps, rover);
 		struct rdma_bind_list *bind_list;
 		int ret;
 
+		mutex_lock(port_lock);
 		bind_list = cma_ps_find(net, ps, (unsigned short)rover);
 
 		if (!bind_list) {
@@ -3595,12 +3648,13 @@ retry:
 			if (!ret)
 				cma_bind_port(bind_list, id_priv);
 		}
+		mutex_unlock(port_lock);
 		/*
 		 * Remember previously used port number in order to avoid
 		 * re-using same port immediately after it is closed.
 		 */
 		if (!ret)
-			last_used_port = rover;
+			WRITE_ONCE(last_used_port, rover);
 		if (ret != -EADDRNOTAVAIL)
 			return ret;
 	}
@@ -3626,7 +3680,7 @@ static int cma_check_port(struct rdma_bind_list *bind_list,
 	struct sockaddr *addr, *cur_addr;
 	COMPAT_HL_NODE
 
-	lockdep_assert_held(&lock);
+	lockdep_assert_held(cma_port_lock(bind_list->ps, bind_list->port));
 
 	addr = cma_src_addr(id_priv);
 	compat_hlist_for_each_entry(cur_id, &bind_list->owners, node) {
@@ -3654,15 +3708,16 @@ static int cma_use_port(enum rdma_ucm_port_space ps,
 			struct rdma_id_private *id_priv)
 {
 	struct rdma_bind_list *bind_list;
+	struct mutex *port_lock;
 	unsigned short snum;
 	int ret;
 
-	lockdep_assert_held(&lock);
-
 	snum = ntohs(cma_port(cma_src_addr(id_priv)));
 	if (snum < PROT_SOCK && !capable(CAP_NET_BIND_SERVICE))
 		return -EACCES;
 
+	port_lock = cma_port_lock(ps, snum);
+	mutex_lock(port_lock);
 	bind_list = cma_ps_find(id_priv->id.route.addr.dev_addr.net, ps, snum);
 	if (!bind_list) {
 		ret = cma_alloc_port(ps, id_priv, snum);
@@ -3671,6 +3726,7 @@ static int cma_use_port(enum rdma_ucm_port_space ps,
 		if (!ret)
 			cma_bind_port(bind_list, id_priv);
 	}
+	mutex_unlock(port_lock);
 	return ret;
 }
 
@@ -3733,12 +3789,10 @@ static int cma_get_port(struct rdma_id_private *id_priv)
 	if (!ps)
 		return -EPROTONOSUPPORT;
 
-	mutex_lock(&lock);
 	if (cma_any_port(cma_src_addr(id_priv)))
 		ret = cma_alloc_any_port(ps, id_priv);
 	else
 		ret = cma_use_port(ps, id_priv);
-	mutex_unlock(&lock);
 
 	return ret;
 }
@@ -3787,11 +3841,14 @@ int rdma_listen(struct rdma_cm_id *id, int backlog)
 	 * any more, and has to be unique in the bind list.
 	 */
 	if (id_priv->reuseaddr) {
-		mutex_lock(&lock);
+		struct mutex *port_lock = cma_port_lock(id_priv->bind_list->ps,
+							id_priv->bind_list->port);
+
+		mutex_lock(port_lock);
 		ret = cma_check_port(id_priv->bind_list, id_priv, 0);
 		if (!ret)
 			id_priv->reuseaddr = 0;
-		mutex_unlock(&lock);
+		mutex_unlock(port_lock);
 		if (ret)
 			goto err;
 	}
@@ -4873,16 +4930,19 @@ static int cma_netdev_callback(struct notifier_block *self, unsigned long event,
 	if (!netif_is_bond_master(ndev))
 		return NOTIFY_DONE;
 
-	mutex_lock(&lock);
-	list_for_each_entry(cma_dev, &dev_list, list)
+	down_read(&devices_rwsem);
+	list_for_each_entry(cma_dev, &dev_list, list) {
+		mutex_lock(&cma_dev->id_list_lock);
 		list_for_each_entry(id_priv, &cma_dev->id_list, list) {
 			ret = cma_netdev_change(ndev, id_priv);
 			if (ret)
-				goto out;
+				break;
 		}
-
-out:
-	mutex_unlock(&lock);
+		mutex_unlock(&cma_dev->id_list_lock);
+		if (ret)
+			break;
+	}
+	up_read(&devices_rwsem);
 	return ret;
 }
 
@@ -4934,20 +4994,45 @@ static void cma_send_device_removal_put(struct rdma_id_private *id_priv)
 
 static void cma_process_remove(struct cma_device *cma_dev)
 {
+	struct rdma_id_private *id_priv, *parent;
+	struct mutex *port_lock;
+
 	mutex_lock(&lock);
+	mutex_lock(&cma_dev->id_list_lock);
 	while (!list_empty(&cma_dev->id_list)) {
-		struct rdma_id_private *id_priv = list_first_entry(
-			&cma_dev->id_list, struct rdma_id_private, list);
+		id_priv = list_first_entry(&cma_dev->id_list,
+					   struct rdma_id_private, list);
 
-		list_del(&id_priv->listen_list);
 		list_del_init(&id_priv->list);
+		/*
+		 * cma_release_dev() does not take the global lock, so pin the
+		 * ID before a concurrent destroy can see it unlinked.
+		 */
 		cma_id_get(id_priv);
+		mutex_unlock(&cma_dev->id_list_lock);
+		/*
+		 * Per-device listeners sit on the listen_list of their
+		 * wildcard parent, which find_listener() walks under the
+		 * parent's port lock.
+		 */
+		if (id_priv->internal_id) {
+			parent = id_priv->id.context;
+			port_lock = cma_port_lock(parent->bind_list->ps,
+						  parent->bind_list->port);
+			mutex_lock(port_lock);
+			list_del(&id_priv->listen_list);
+			mutex_unlock(port_lock);
+		} else {
+			list_del(&id_priv->listen_list);
+		}
 		mutex_unlock(&lock);
 
 		cma_send_device_removal_put(id_priv);
 
 		mutex_lock(&lock);
+		mutex_lock(&cma_dev->id_list_lock);
 	}
+	mutex_unlock(&cma_dev->id_list_lock);
 	mutex_unlock(&lock);
 
 	cma_dev_put(cma_dev);
@@ -5012,11 +5097,14 @@ static int cma_add_one(struct ib_device *device)
 
 	init_completion(&cma_dev->comp);
 	refcount_set(&cma_dev->refcount, 1);
+	mutex_init(&cma_dev->id_list_lock);
 	INIT_LIST_HEAD(&cma_dev->id_list);
 	ib_set_client_data(device, &cma_client, cma_dev);
 
 	mutex_lock(&lock);
+	down_write(&devices_rwsem);
 	list_add_tail(&cma_dev->list, &dev_list);
+	up_write(&devices_rwsem);
 	list_for_each_entry(id_priv, &listen_any_list, list) {
 		ret = cma_listen_on_dev(id_priv, cma_dev, &to_destroy);
 		if (ret)
@@ -5030,7 +5118,9 @@ static int cma_add_one(struct ib_device *device)
 	return 0;
 
 free_listen:
+	down_write(&devices_rwsem);
 	list_del(&cma_dev->list);
+	up_write(&devices_rwsem);
 	mutex_unlock(&lock);
 
 	/* cma_process_remove() will delete to_destroy */
@@ -5056,7 +5146,9 @@ static void cma_remove_one(struct ib_device *device, void *client_data)
 #endif
 
 	mutex_lock(&lock);
+	down_write(&devices_rwsem);
 	list_del(&cma_dev->list);
+	up_write(&devices_rwsem);
 	mutex_unlock(&lock);
 
 	cma_process_remove(cma_dev);
@@ -5096,18 +5188,21 @@ static struct pernet_operations cma_pernet_operations = {
 
 static int __init cma_init(void)
 {
-	int ret;
+	int ret, i;
+
+	for (i = 0; i < ARRAY_SIZE(cma_port_locks); i++)
+		mutex_init(&cma_port_locks[i]);
 
 	/*
 	 * There is a rare lock ordering dependency in cma_netdev_callback()
 	 * that only happens when bonding is enabled. Teach lockdep that rtnl
-	 * must never be nested under lock so it can find these without having
-	 * to test with bonding.
+	 * must never be nested under devices_rwsem so it can find these
+	 * without having to test with bonding.
 	 */
 	if (IS_ENABLED(CONFIG_LOCKDEP)) {
 		rtnl_lock();
-		mutex_lock(&lock);
-		mutex_unlock(&lock);
+		down_read(&devices_rwsem);
+		up_read(&devices_rwsem);
 		rtnl_unlock();
 	}
 
@@ -236,6 +236,29 @@ void ib_mad_cleanup(void);
 int ib_sa_init(void);
 void ib_sa_cleanup(void);
 
+struct ib_sa_path_cache_stats {
+	u64 hits;
+	u64 neg_hits;
+	u64 misses;
+	u64 coalesced;
+	u64 invalidations;
+	u64 entries;
+};
+
+int ib_sa_path_cache_get_stats(struct ib_device *device, u32 port_num,
+			       struct ib_sa_path_cache_stats *stats);
+
+int ib_mr_pool_used(struct ib_qp *qp);
+void rdma_rw_mr_pool_work(struct work_struct *work);
+
+#if defined(CONFIG_INFINIBAND_USER_MEM) && defined(HAVE_MMU_INTERVAL_NOTIFIER)
+void ib_umem_cache_flush_device(struct ib_device *device);
+#else
+static inline void ib_umem_cache_flush_device(struct ib_device *device)
+{
+}
+#endif
+
 void rdma_nl_init(void);
 void rdma_nl_exit(void);
 
@@ -399,6 +422,7 @@ static inline struct ib_qp *_ib_create_qp(struct ib_device *dev,
 	spin_lock_init(&qp->mr_lock);
 	INIT_LIST_HEAD(&qp->rdma_mrs);
 	INIT_LIST_HEAD(&qp->sig_mrs);
+	INIT_DELAYED_WORK(&qp->mr_grow_work, rdma_rw_mr_pool_work);
 
 	/*
 	 * We don't track XRC QPs for now, because they don't have PD
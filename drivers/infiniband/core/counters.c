@@ -2,6 +2,7 @@
 /*
  * Copyright (c) 2019 Mellanox Technologies. All rights reserved.
  */
+#include <linux/module.h>
 #include <rdma/ib_verbs.h>
 #include <rdma/rdma_counter.h>
 
@@ -9,6 +10,34 @@
 #include "restrack.h"
 
 #define ALL_AUTO_MODE_MASKS (RDMA_COUNTER_MASK_QP_TYPE | RDMA_COUNTER_MASK_PID)
+#define RDMA_COUNTER_HISTORY_MAX 3600
+
+static unsigned int counter_sample_ms;
+module_param(counter_sample_ms, uint, 0444);
+MODULE_PARM_DESC(counter_sample_ms,
+		 "Interval in msecs at which bound counters are sampled into their history, 0 disables sampling (default: 0)");
+
+static unsigned int counter_history_len = 60;
+module_param(counter_history_len, uint, 0444);
+MODULE_PARM_DESC(counter_history_len,
+		 "Number of samples kept per counter, 2 to 3600 (default: 60)");
+
+/*
+ * Each sample is the ktime_get_ns() stamp followed by the values of all
+ * hw counters of the counter, in a ring of @len samples.
+ */
+struct rdma_counter_history {
+	unsigned int	len;
+	unsigned int	head;		/* next sample to write */
+	unsigned int	count;		/* valid samples */
+	u64		data[];
+};
+
+static u64 *history_sample(struct rdma_counter_history *h,
+			   unsigned int num_counters, unsigned int i)
+{
+	return &h->data[i * (num_counters + 1)];
+}
 
 static int __counter_set_mode(struct rdma_counter_mode *curr,
 			      enum rdma_nl_counter_mode new_mode,
@@ -94,7 +123,9 @@ static struct rdma_counter *rdma_counter_alloc(struct ib_device *dev, u32 port,
 			goto err_mode;
 	}
 
-	port_counter->num_counters++;
+	if (!port_counter->num_counters++ && counter_sample_ms)
+		queue_delayed_work(ib_wq, &port_counter->sample_work,
+				   msecs_to_jiffies(counter_sample_ms));
 	mutex_unlock(&port_counter->lock);
 
 	counter->mode.mode = mode;
@@ -114,18 +145,34 @@ err_stats:
 static void rdma_counter_free(struct rdma_counter *counter)
 {
 	struct rdma_port_counter *port_counter;
+	bool last;
 
 	port_counter = &counter->device->port_data[counter->port].port_counter;
 	mutex_lock(&port_counter->lock);
 	port_counter->num_counters--;
-	if (!port_counter->num_counters &&
-	    (port_counter->mode.mode == RDMA_COUNTER_MODE_MANUAL))
+	last = !port_counter->num_counters;
+	if (last && (port_counter->mode.mode == RDMA_COUNTER_MODE_MANUAL))
 		__counter_set_mode(&port_counter->mode, RDMA_COUNTER_MODE_NONE,
 				   0);
 
 	mutex_unlock(&port_counter->lock);
 
 	rdma_restrack_del(&counter->res);
+
+	/*
+	 * The sampler stops re-arming once the port has no counters, but it
+	 * must not outlive the last one; re-arm it if a new counter raced in.
+	 */
+	if (last && counter_sample_ms) {
+		cancel_delayed_work_sync(&port_counter->sample_work);
+		mutex_lock(&port_counter->lock);
+		if (port_counter->num_counters)
+			queue_delayed_work(ib_wq, &port_counter->sample_work,
+					   msecs_to_jiffies(counter_sample_ms));
+		mutex_unlock(&port_counter->lock);
+	}
+
+	kfree(counter->history);
 	kfree(counter->stats);
 	kfree(counter);
 }
@@ -350,6 +397,115 @@ int rdma_counter_query_stats(struct rdma_counter *counter)
 	return ret;
 }
 
+/* Append the current counter->stats to the history, counter->lock held */
+static void rdma_counter_record(struct rdma_counter *counter)
+{
+	unsigned int num_counters = counter->stats->num_counters;
+	struct rdma_counter_history *h = counter->history;
+	u64 *sample;
+
+	if (!h) {
+		unsigned int len = clamp(counter_history_len, 2U,
+					 RDMA_COUNTER_HISTORY_MAX);
+
+		h = kzalloc(struct_size(h, data,
+					(size_t)len * (num_counters + 1)),
+			    GFP_KERNEL);
+		if (!h)
+			return;
+		h->len = len;
+		counter->history = h;
+	}
+
+	sample = history_sample(h, num_counters, h->head);
+	sample[0] = ktime_get_ns();
+	memcpy(&sample[1], counter->stats->value,
+	       num_counters * sizeof(*sample));
+	h->head = (h->head + 1) % h->len;
+	if (h->count < h->len)
+		h->count++;
+}
+
+static void rdma_counter_sample_work(struct work_struct *work)
+{
+	struct rdma_port_counter *port_counter =
+		container_of(to_delayed_work(work), struct rdma_port_counter,
+			     sample_work);
+	struct ib_port_data *pdata =
+		container_of(port_counter, struct ib_port_data, port_counter);
+	struct ib_device *dev = pdata->ib_dev;
+	u32 port = pdata - dev->port_data;
+	struct rdma_restrack_entry *res;
+	struct rdma_restrack_root *rt;
+	struct rdma_counter *counter;
+	unsigned long id = 0;
+
+	if (!dev->ops.counter_update_stats)
+		return;
+
+	rt = &dev->res[RDMA_RESTRACK_COUNTER];
+	xa_lock(&rt->xa);
+	xa_for_each(&rt->xa, id, res) {
+		if (!rdma_restrack_get(res))
+			continue;
+
+		xa_unlock(&rt->xa);
+
+		counter = container_of(res, struct rdma_counter, res);
+		if (counter->port == port) {
+			mutex_lock(&counter->lock);
+			if (!dev->ops.counter_update_stats(counter))
+				rdma_counter_record(counter);
+			mutex_unlock(&counter->lock);
+		}
+
+		xa_lock(&rt->xa);
+		rdma_restrack_put(res);
+	}
+	xa_unlock(&rt->xa);
+
+	mutex_lock(&port_counter->lock);
+	if (port_counter->num_counters)
+		queue_delayed_work(ib_wq, &port_counter->sample_work,
+				   msecs_to_jiffies(counter_sample_ms));
+	mutex_unlock(&port_counter->lock);
+}
+
+/**
+ * rdma_counter_history_delta() - Increase of each hw counter over the
+ *   sampled history of @counter
+ * @delta: filled with counter->stats->num_counters values
+ * @samples: number of samples the window spans
+ *
+ * Return: The length of the window in nsecs, 0 if there is no history yet
+ */
+u64 rdma_counter_history_delta(struct rdma_counter *counter, u64 *delta,
+			       u32 *samples)
+{
+	unsigned int num_counters = counter->stats->num_counters;
+	struct rdma_counter_history *h;
+	u64 *first, *last, window = 0;
+	int i;
+
+	mutex_lock(&counter->lock);
+	h = counter->history;
+	if (!h || h->count < 2)
+		goto out;
+
+	first = history_sample(h, num_counters,
+			       (h->head + h->len - h->count) % h->len);
+	last = history_sample(h, num_counters, (h->head + h->len - 1) % h->len);
+	/* a counter that went backwards was reset, report no progress */
+	for (i = 0; i < num_counters; i++)
+		delta[i] = last[i + 1] >= first[i + 1] ?
+			   last[i + 1] - first[i + 1] : 0;
+	window = last[0] - first[0];
+	*samples = h->count;
+out:
+	mutex_unlock(&counter->lock);
+	return window;
+}
+
 static u64 get_running_counters_hwstat_sum(struct ib_device *dev,
 					   u32 port, u32 index)
 {
@@ -609,6 +765,8 @@ void rdma_counter_init(struct ib_device *dev)
 		port_counter = &dev->port_data[port].port_counter;
 		port_counter->mode.mode = RDMA_COUNTER_MODE_NONE;
 		mutex_init(&port_counter->lock);
+		INIT_DELAYED_WORK(&port_counter->sample_work,
+				  rdma_counter_sample_work);
 
 		if (!dev->ops.alloc_hw_stats)
 			continue;
@@ -636,6 +794,8 @@ void rdma_counter_release(struct ib_device *dev)
 
 	rdma_for_each_port(dev, port) {
 		port_counter = &dev->port_data[port].port_counter;
+		/* Normally stopped when the last counter was unbound */
+		cancel_delayed_work_sync(&port_counter->sample_work);
 		kfree(port_counter->hstats);
 		mutex_destroy(&port_counter->lock);
 	}
@@ -5,6 +5,7 @@
 #include <linux/module.h>
 #include <linux/err.h>
 #include <linux/slab.h>
+#include <linux/sched/clock.h>
 #include <rdma/ib_verbs.h>
 
 #include "core_priv.h"
@@ -27,6 +28,11 @@
 #define IB_POLL_FLAGS \
 	(IB_CQ_NEXT_COMP | IB_CQ_REPORT_MISSED_EVENTS)
 
+static unsigned int hybrid_poll_usecs = 20;
+module_param(hybrid_poll_usecs, uint, 0644);
+MODULE_PARM_DESC(hybrid_poll_usecs,
+		 "Default idle busy-poll window of IB_POLL_HYBRID CQs in usecs (default: 20)");
+
 static const struct dim_cq_moder
 rdma_dim_prof[RDMA_DIM_PARAMS_NUM_PROFILES] = {
 	{1,   0, 1,  0},
@@ -97,6 +103,16 @@ static int __poll_cq(struct ib_cq *cq, int num_entries, struct ib_wc *wc)
 }
 #endif
 
+static void ib_cq_flush_batches(struct ib_cq *cq)
+{
+	struct ib_cq_batch *batch, *tmp;
+
+	list_for_each_entry_safe(batch, tmp, &cq->batch_list, entry) {
+		list_del_init(&batch->entry);
+		batch->flush(cq, batch);
+	}
+}
+
 static int __ib_process_cq(struct ib_cq *cq, int budget, struct ib_wc *wcs,
 			   int batch)
 {
@@ -128,7 +144,11 @@ static int __ib_process_cq(struct ib_cq *cq, int budget, struct ib_wc *wcs,
 				WARN_ON_ONCE(wc->status == IB_WC_SUCCESS);
 		}
 
+		if (!list_empty(&cq->batch_list))
+			ib_cq_flush_batches(cq);
+
 		completed += n;
+		WRITE_ONCE(cq->comp_count, cq->comp_count + n);
 
 		if (n != batch || (budget != -1 && completed >= budget))
 			break;
@@ -244,6 +264,95 @@ static void ib_cq_completion_workqueue(struct ib_cq *cq, void *private)
 	queue_work(cq->comp_wq, &cq->work);
 }
 
+/*
+ * IB_POLL_HYBRID: process the CQ from the workqueue like IB_POLL_WORKQUEUE,
+ * but keep polling it until no completion showed up for poll_usecs before
+ * re-arming, so that back-to-back bursts don't each pay for an interrupt.
+ * The window restarts whenever new completions are found, and the whole
+ * run shares one IB_POLL_BUDGET_WORKQUEUE budget.
+ */
+static void ib_cq_hybrid_poll_work(struct work_struct *work)
+{
+	struct ib_cq *cq = container_of(work, struct ib_cq, work);
+	u64 window = (u64)READ_ONCE(cq->poll_usecs) * NSEC_PER_USEC;
+	int completed, total, budget = IB_POLL_BUDGET_WORKQUEUE;
+	u64 spin_start, deadline, now;
+
+	total = __ib_process_cq(cq, budget, cq->wc, IB_POLL_BATCH);
+
+	spin_start = local_clock();
+	now = spin_start;
+	deadline = spin_start + window;
+	while (window && total < budget && !need_resched()) {
+		completed = __ib_process_cq(cq, budget - total, cq->wc,
+					    IB_POLL_BATCH);
+		now = local_clock();
+		if (completed) {
+			cq->poll_stats.spin_comps += completed;
+			total += completed;
+			deadline = now + window;
+		} else if (now >= deadline) {
+			break;
+		}
+		cpu_relax();
+	}
+	cq->poll_stats.spin_ns += now - spin_start;
+
+	if (total >= budget) {
+		queue_work(cq->comp_wq, &cq->work);
+		return;
+	}
+
+	WRITE_ONCE(cq->armed_at, local_clock());
+	cq->poll_stats.arms++;
+	if (ib_req_notify_cq(cq, IB_POLL_FLAGS) > 0)
+		queue_work(cq->comp_wq, &cq->work);
+	else if (cq->dim)
+		rdma_dim(cq->dim, total);
+}
+
+static void ib_cq_completion_hybrid(struct ib_cq *cq, void *private)
+{
+	u64 armed_at = READ_ONCE(cq->armed_at);
+
+	if (armed_at) {
+		cq->poll_stats.sleep_ns += local_clock() - armed_at;
+		WRITE_ONCE(cq->armed_at, 0);
+	}
+#ifdef HAVE_TRACE_EVENTS_RDMA_CORE_HEADER
+	trace_cq_schedule(cq);
+#endif
+	queue_work(cq->comp_wq, &cq->work);
+}
+
+/**
+ * ib_cq_set_poll_usecs - set the busy-poll window of an IB_POLL_HYBRID CQ
+ * @cq:		CQ to configure
+ * @usecs:	time without completions after which the CQ is re-armed,
+ *		0 re-arms right after draining it
+ */
+void ib_cq_set_poll_usecs(struct ib_cq *cq, unsigned int usecs)
+{
+	WRITE_ONCE(cq->poll_usecs, usecs);
+}
+EXPORT_SYMBOL(ib_cq_set_poll_usecs);
+
+/**
+ * ib_cq_get_poll_stats - report busy-poll accounting of an IB_POLL_HYBRID CQ
+ * @cq:		CQ to query
+ * @stats:	filled with the time spent spinning and waiting for interrupts
+ *
+ * The counters are updated without locking and may be slightly stale.
+ */
+void ib_cq_get_poll_stats(struct ib_cq *cq, struct ib_cq_poll_stats *stats)
+{
+	stats->spin_ns = READ_ONCE(cq->poll_stats.spin_ns);
+	stats->sleep_ns = READ_ONCE(cq->poll_stats.sleep_ns);
+	stats->spin_comps = READ_ONCE(cq->poll_stats.spin_comps);
+	stats->arms = READ_ONCE(cq->poll_stats.arms);
+}
+EXPORT_SYMBOL(ib_cq_get_poll_stats);
+
 /**
  * __ib_alloc_cq_user - allocate a completion queue
  * @dev:		device to allocate the CQ for
@@ -281,6 +390,7 @@ struct ib_cq *__ib_alloc_cq_user(struct ib_device *dev, void *private,
 	cq->poll_ctx = poll_ctx;
 	atomic_set(&cq->usecnt, 0);
 	cq->comp_vector = comp_vector;
+	INIT_LIST_HEAD(&cq->batch_list);
 
 	cq->wc = kmalloc_array(IB_POLL_BATCH, sizeof(*cq->wc), GFP_KERNEL);
 	if (!cq->wc)
@@ -327,6 +437,14 @@ struct ib_cq *__ib_alloc_cq_user(struct ib_device *dev, void *private,
 		cq->comp_wq = (cq->poll_ctx == IB_POLL_WORKQUEUE) ?
 				ib_comp_wq : ib_comp_unbound_wq;
 		break;
+	case IB_POLL_HYBRID:
+		cq->comp_handler = ib_cq_completion_hybrid;
+		cq->poll_usecs = READ_ONCE(hybrid_poll_usecs);
+		INIT_WORK(&cq->work, ib_cq_hybrid_poll_work);
+		cq->comp_wq = ib_comp_wq;
+		WRITE_ONCE(cq->armed_at, local_clock());
+		ib_req_notify_cq(cq, IB_CQ_NEXT_COMP);
+		break;
 	default:
 		ret = -EINVAL;
 		goto out_destroy_cq;
@@ -408,6 +526,7 @@ void ib_free_cq_user(struct ib_cq *cq, struct ib_udata *udata)
 #endif
 	case IB_POLL_WORKQUEUE:
 	case IB_POLL_UNBOUND_WORKQUEUE:
+	case IB_POLL_HYBRID:
 		cancel_work_sync(&cq->work);
 		break;
 	default:
@@ -425,35 +544,124 @@ void ib_free_cq_user(struct ib_cq *cq, struct ib_udata *udata)
 }
 EXPORT_SYMBOL(ib_free_cq_user);
 
+/*
+ * Shared CQs are kept on per completion vector lists so that a lookup for a
+ * given vector does not walk the CQs of the other vectors.  Each CQ carries a
+ * completion rate that is sampled lazily whenever the pool considers it.  The
+ * load of a CQ is the share of its CQEs already claimed plus its rate as a
+ * share of the busiest rate of the pool, both scaled to
+ * IB_CQ_POOL_LOAD_SCALE, so freshly claimed but still idle CQs are not handed
+ * out over and over.
+ *
+ * Unhinted lookups take the CQ cached for their node as long as its load
+ * stays below that of the runner-up of the last scan; claims and releases
+ * keep the cached loads current, and the pool is scanned again once that
+ * lead is used up or the rates are due for a new sample.
+ */
+#define IB_CQ_POOL_RATE_INTERVAL	(HZ / 10)
+#define IB_CQ_POOL_LOAD_SCALE		1024
+
 void ib_cq_pool_cleanup(struct ib_device *dev)
 {
+	struct ib_cq_pool *pool;
 	struct ib_cq *cq, *n;
-	unsigned int i;
+	unsigned int i, v;
 
 	for (i = 0; i < ARRAY_SIZE(dev->cq_pools); i++) {
-		list_for_each_entry_safe(cq, n, &dev->cq_pools[i],
-					 pool_entry) {
-			WARN_ON(cq->cqe_used);
-			list_del(&cq->pool_entry);
-			cq->shared = false;
-			ib_free_cq(cq);
+		pool = &dev->cq_pools[i];
+		for (v = 0; v < pool->nr_vectors; v++) {
+			list_for_each_entry_safe(cq, n, &pool->vectors[v].cqs,
+						 pool_entry) {
+				WARN_ON(cq->cqe_used);
+				list_del(&cq->pool_entry);
+				cq->shared = false;
+				ib_free_cq(cq);
+			}
 		}
+		kfree(pool->vectors);
+		pool->vectors = NULL;
+		pool->nr_vectors = 0;
+		kfree(pool->hints);
+		pool->hints = NULL;
 	}
 }
 
+static bool ib_poll_ctx_shareable(enum ib_poll_context poll_ctx)
+{
+	return poll_ctx <= IB_POLL_LAST_POOL_TYPE || poll_ctx == IB_POLL_HYBRID;
+}
+
+static int ib_cq_vector_node(struct ib_device *dev, unsigned int vector)
+{
+	const struct cpumask *mask = ib_get_vector_affinity(dev, vector);
+	unsigned int cpu;
+
+	if (!mask)
+		return NUMA_NO_NODE;
+	cpu = cpumask_first(mask);
+	if (cpu >= nr_cpu_ids)
+		return NUMA_NO_NODE;
+	return cpu_to_node(cpu);
+}
+
+static int ib_cq_pool_init_vectors(struct ib_device *dev,
+				   struct ib_cq_pool *pool)
+{
+	struct ib_cq_pool_vector *vectors;
+	struct ib_cq_pool_hint *hints;
+	unsigned int nr_vectors, v;
+
+	if (pool->vectors)
+		return 0;
+
+	nr_vectors = min_t(unsigned int, dev->num_comp_vectors,
+			   num_online_cpus());
+	vectors = kcalloc(nr_vectors, sizeof(*vectors), GFP_KERNEL);
+	if (!vectors)
+		return -ENOMEM;
+	hints = kcalloc(nr_node_ids, sizeof(*hints), GFP_KERNEL);
+	if (!hints) {
+		kfree(vectors);
+		return -ENOMEM;
+	}
+	for (v = 0; v < nr_vectors; v++) {
+		INIT_LIST_HEAD(&vectors[v].cqs);
+		vectors[v].node = ib_cq_vector_node(dev, v);
+	}
+
+	spin_lock_irq(&dev->cq_pools_lock);
+	if (!pool->vectors) {
+		pool->vectors = vectors;
+		pool->hints = hints;
+		pool->nr_vectors = nr_vectors;
+		vectors = NULL;
+		hints = NULL;
+	}
+	spin_unlock_irq(&dev->cq_pools_lock);
+
+	kfree(vectors);
+	kfree(hints);
+	return 0;
+}
+
 static int ib_alloc_cqs(struct ib_device *dev, unsigned int nr_cqes,
 			enum ib_poll_context poll_ctx)
 {
+	struct ib_cq_pool *pool = &dev->cq_pools[poll_ctx];
 	LIST_HEAD(tmp_list);
 	unsigned int nr_cqs, i;
 	struct ib_cq *cq, *n;
 	int ret;
 
-	if (poll_ctx > IB_POLL_LAST_POOL_TYPE) {
-		WARN_ON_ONCE(poll_ctx > IB_POLL_LAST_POOL_TYPE);
+	if (!ib_poll_ctx_shareable(poll_ctx)) {
+		WARN_ON_ONCE(1);
 		return -EINVAL;
 	}
 
+	ret = ib_cq_pool_init_vectors(dev, pool);
+	if (ret)
+		return ret;
+
 	/*
 	 * Allocate at least as many CQEs as requested, and otherwise
 	 * a reasonable batch size so that we can share CQs between
@@ -461,7 +669,7 @@ static int ib_alloc_cqs(struct ib_device *dev, unsigned int nr_cqes,
 	 */
 	nr_cqes = min_t(unsigned int, dev->attrs.max_cqe,
 			max(nr_cqes, IB_MAX_SHARED_CQ_SZ));
-	nr_cqs = min_t(unsigned int, dev->num_comp_vectors, num_online_cpus());
+	nr_cqs = pool->nr_vectors;
 	for (i = 0; i < nr_cqs; i++) {
 		cq = ib_alloc_cq(dev, NULL, nr_cqes, i, poll_ctx);
 		if (IS_ERR(cq)) {
@@ -469,11 +677,14 @@ static int ib_alloc_cqs(struct ib_device *dev, unsigned int nr_cqes,
 			goto out_free_cqs;
 		}
 		cq->shared = true;
+		cq->pool_stamp = jiffies;
 		list_add_tail(&cq->pool_entry, &tmp_list);
 	}
 
 	spin_lock_irq(&dev->cq_pools_lock);
-	list_splice(&tmp_list, &dev->cq_pools[poll_ctx]);
+	list_for_each_entry_safe(cq, n, &tmp_list, pool_entry)
+		list_move_tail(&cq->pool_entry,
+			       &pool->vectors[cq->comp_vector].cqs);
 	spin_unlock_irq(&dev->cq_pools_lock);
 
 	return 0;
@@ -486,68 +697,183 @@ out_free_cqs:
 	return ret;
 }
 
+/* Called with cq_pools_lock held. */
+static unsigned long ib_cq_pool_load(struct ib_cq_pool *pool,
+				     struct ib_cq *cq, unsigned long now)
+{
+	unsigned long elapsed = now - cq->pool_stamp;
+	unsigned long comps, rate, load;
+
+	if (elapsed >= IB_CQ_POOL_RATE_INTERVAL) {
+		comps = READ_ONCE(cq->comp_count);
+		rate = mult_frac(comps - cq->pool_comp_last, HZ, elapsed);
+		cq->pool_rate = (cq->pool_rate * 3 + rate) / 4;
+		cq->pool_comp_last = comps;
+		cq->pool_stamp = now;
+	}
+	if (cq->pool_rate > pool->peak_rate)
+		pool->peak_rate = cq->pool_rate;
+
+	load = mult_frac(cq->cqe_used, IB_CQ_POOL_LOAD_SCALE, cq->cqe);
+	if (pool->peak_rate)
+		load += mult_frac(cq->pool_rate, IB_CQ_POOL_LOAD_SCALE,
+				  pool->peak_rate);
+	return load;
+}
+
+/* Least loaded CQ of @vec with room for @nr_cqe, cq_pools_lock held. */
+static struct ib_cq *ib_cq_pool_find(struct ib_cq_pool *pool,
+				     struct ib_cq_pool_vector *vec,
+				     unsigned int nr_cqe, unsigned long now)
+{
+	struct ib_cq *cq, *found = NULL;
+	unsigned long l, load = 0;
+
+	list_for_each_entry(cq, &vec->cqs, pool_entry) {
+		if (cq->cqe_used + nr_cqe > cq->cqe)
+			continue;
+		l = ib_cq_pool_load(pool, cq, now);
+		if (!found || l < load) {
+			found = cq;
+			load = l;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Least loaded CQ over all vectors, preferring vectors whose interrupts are
+ * served on @node.  The result is cached for @node together with the load
+ * of the runner-up.  cq_pools_lock held.
+ */
+static struct ib_cq *ib_cq_pool_find_any(struct ib_cq_pool *pool,
+					 unsigned int nr_cqe, int node,
+					 unsigned long now)
+{
+	struct ib_cq_pool_hint *hint = &pool->hints[node];
+	unsigned long load, best = 0, next = ULONG_MAX;
+	struct ib_cq *cq, *found = NULL;
+	unsigned int v;
+	bool local;
+
+	cq = hint->cq;
+	if (cq && time_before(now, hint->stamp + IB_CQ_POOL_RATE_INTERVAL) &&
+	    cq->cqe_used + nr_cqe <= cq->cqe && hint->load <= hint->next_load)
+		return cq;
+
+	/* let the reference rate follow the pool when it calms down */
+	if (time_after_eq(now, pool->peak_stamp + IB_CQ_POOL_RATE_INTERVAL)) {
+		pool->peak_rate -= pool->peak_rate / 4;
+		pool->peak_stamp = now;
+	}
+
+	for (local = true; ; local = false) {
+		for (v = 0; v < pool->nr_vectors; v++) {
+			struct ib_cq_pool_vector *vec = &pool->vectors[v];
+
+			if (local && vec->node != NUMA_NO_NODE &&
+			    vec->node != node)
+				continue;
+			list_for_each_entry(cq, &vec->cqs, pool_entry) {
+				if (cq->cqe_used + nr_cqe > cq->cqe)
+					continue;
+				load = ib_cq_pool_load(pool, cq, now);
+				if (!found || load < best) {
+					if (found)
+						next = best;
+					found = cq;
+					best = load;
+				} else if (load < next) {
+					next = load;
+				}
+			}
+		}
+		if (found || !local)
+			break;
+	}
+
+	hint->cq = found;
+	hint->load = best;
+	hint->next_load = next;
+	hint->stamp = now;
+	return found;
+}
+
+/*
+ * @cq was claimed or released: refresh the cached loads and make it the
+ * choice of the nodes it is local to if it now beats their cached CQ.
+ * cq_pools_lock held.
+ */
+static void ib_cq_pool_update_hints(struct ib_cq_pool *pool, struct ib_cq *cq)
+{
+	int vnode = pool->vectors[cq->comp_vector].node;
+	struct ib_cq_pool_hint *hint;
+	unsigned long load;
+	int node;
+
+	load = ib_cq_pool_load(pool, cq, jiffies);
+	for_each_node(node) {
+		hint = &pool->hints[node];
+		if (hint->cq == cq) {
+			hint->load = load;
+		} else if (hint->cq && load < hint->load &&
+			   (vnode == NUMA_NO_NODE || vnode == node)) {
+			hint->next_load = hint->load;
+			hint->cq = cq;
+			hint->load = load;
+		}
+	}
+}
+
 /**
  * ib_cq_pool_get() - Find the least used completion queue that matches
  *   a given cpu hint (or least used for wild card affinity) and fits
  *   nr_cqe.
  * @dev: rdma device
  * @nr_cqe: number of needed cqe entries
- * @comp_vector_hint: completion vector hint (-1) for the driver to assign
- *   a comp vector based on internal counter
+ * @comp_vector_hint: completion vector hint (-1) for the pool to pick the
+ *   least loaded vector local to the caller's NUMA node
  * @poll_ctx: cq polling context
  *
  * Finds a cq that satisfies @comp_vector_hint and @nr_cqe requirements and
- * claim entries in it for us.  In case there is no available cq, allocate
+ * claim entries in it for us.  Among the candidates the CQ with the lowest
+ * load, claimed CQEs and recent completion rate, wins.  In case there is no available cq, allocate
  * a new cq with the requirements and add it to the device pool.
  * IB_POLL_DIRECT cannot be used for shared cqs so it is not a valid value
- * for @poll_ctx.
+ * for @poll_ctx; IB_POLL_HYBRID CQs are pooled separately.
  */
 struct ib_cq *ib_cq_pool_get(struct ib_device *dev, unsigned int nr_cqe,
 			     int comp_vector_hint,
 			     enum ib_poll_context poll_ctx)
 {
-	static unsigned int default_comp_vector;
-	unsigned int vector, num_comp_vectors;
-	struct ib_cq *cq, *found = NULL;
+	int node = numa_node_id();
+	struct ib_cq_pool *pool;
+	struct ib_cq *found;
 	int ret;
 
-	if (poll_ctx > IB_POLL_LAST_POOL_TYPE) {
-		WARN_ON_ONCE(poll_ctx > IB_POLL_LAST_POOL_TYPE);
+	if (!ib_poll_ctx_shareable(poll_ctx)) {
+		WARN_ON_ONCE(1);
 		return ERR_PTR(-EINVAL);
 	}
+	pool = &dev->cq_pools[poll_ctx];
 
-	num_comp_vectors =
-		min_t(unsigned int, dev->num_comp_vectors, num_online_cpus());
-	/* Project the affinty to the device completion vector range */
-	if (comp_vector_hint < 0) {
-		comp_vector_hint =
-			(READ_ONCE(default_comp_vector) + 1) % num_comp_vectors;
-		WRITE_ONCE(default_comp_vector, comp_vector_hint);
-	}
-	vector = comp_vector_hint % num_comp_vectors;
-
-	/*
-	 * Find the least used CQ with correct affinity and
-	 * enough free CQ entries
-	 */
-	while (!found) {
+	for (;;) {
 		spin_lock_irq(&dev->cq_pools_lock);
-		list_for_each_entry(cq, &dev->cq_pools[poll_ctx],
-				    pool_entry) {
-			/*
-			 * Check to see if we have found a CQ with the
-			 * correct completion vector
-			 */
-			if (vector != cq->comp_vector)
-				continue;
-			if (cq->cqe_used + nr_cqe > cq->cqe)
-				continue;
-			found = cq;
-			break;
-		}
-
+		if (!pool->nr_vectors)
+			found = NULL;
+		else if (comp_vector_hint < 0)
+			found = ib_cq_pool_find_any(pool, nr_cqe, node,
+						    jiffies);
+		else
+			/* Project the affinty to the pool vector range */
+			found = ib_cq_pool_find(pool,
+						&pool->vectors[comp_vector_hint %
+							       pool->nr_vectors],
+						nr_cqe, jiffies);
 		if (found) {
 			found->cqe_used += nr_cqe;
+			ib_cq_pool_update_hints(pool, found);
 			spin_unlock_irq(&dev->cq_pools_lock);
 
 			return found;
@@ -562,8 +888,6 @@ struct ib_cq *ib_cq_pool_get(struct ib_device *dev, unsigned int nr_cqe,
 		if (ret)
 			return ERR_PTR(ret);
 	}
-
-	return found;
 }
 EXPORT_SYMBOL(ib_cq_pool_get);
 
@@ -579,6 +903,7 @@ void ib_cq_pool_put(struct ib_cq *cq, unsigned int nr_cqe)
 
 	spin_lock_irq(&cq->device->cq_pools_lock);
 	cq->cqe_used -= nr_cqe;
+	ib_cq_pool_update_hints(&cq->device->cq_pools[cq->poll_ctx], cq);
 	spin_unlock_irq(&cq->device->cq_pools_lock);
 }
 EXPORT_SYMBOL(ib_cq_pool_put);
@@ -602,7 +602,6 @@ static void rdma_init_coredev(struct ib_core_device *coredev,
 struct ib_device *_ib_alloc_device(size_t size)
 {
 	struct ib_device *device;
-	unsigned int i;
 
 	if (WARN_ON(size < sizeof(struct ib_device)))
 		return NULL;
@@ -635,8 +634,6 @@ struct ib_device *_ib_alloc_device(size_t size)
 	INIT_WORK(&device->unregistration_work, ib_unregister_work);
 
 	spin_lock_init(&device->cq_pools_lock);
-	for (i = 0; i < ARRAY_SIZE(device->cq_pools); i++)
-		INIT_LIST_HEAD(&device->cq_pools[i]);
 
 	return device;
 }
@@ -1512,6 +1509,9 @@ static void __ib_unregister_device(struct ib_device *ib_dev)
 
 	disable_device(ib_dev);
 
+	/* All MRs are gone, drop the registrations still cached for reuse */
+	ib_umem_cache_flush_device(ib_dev);
+
 	/* Expedite removing unregistered pointers from the hash table */
 	free_netdevs(ib_dev);
 
@@ -41,9 +41,11 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <linux/dma-mapping.h>
+#include <linux/hash.h>
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/security.h>
+#include <linux/sched/clock.h>
 #include <linux/sysfs.h>
 #include <linux/xarray.h>
 #include <rdma/ib_cache.h>
@@ -98,6 +100,12 @@ MODULE_PARM_DESC(recv_queue_size, "Size of receive queue in number of work reque
 module_param_named(mad_smp_window, mad_smp_window, int, 0444);
 MODULE_PARM_DESC(mad_smp_window, "Maximun number of outgoing SMP requests");
 
+#define IB_MAD_MAX_RECV_WORKERS	64
+static unsigned int mad_recv_workers;
+module_param_named(recv_workers, mad_recv_workers, uint, 0444);
+MODULE_PARM_DESC(recv_workers,
+		 "Number of workers per port handing received MADs to their agents, 0 hands them over from the completion handler (default: 0)");
+
 static DEFINE_XARRAY_ALLOC1(ib_mad_clients);
 static u32 ib_mad_client_next;
 static struct list_head ib_mad_port_list;
@@ -185,6 +193,84 @@ static unsigned long adjusted_time(unsigned long last, unsigned long next)
 	return next;
 }
 
+static unsigned int tf_slot(struct to_fifo *tf, unsigned long exp_time)
+{
+	return (exp_time / tf->tick) & (TF_WHEEL_SLOTS - 1);
+}
+
+/* Add @item to the timeout wheel and arm the timer for it, lists_lock held */
+static void tf_link_timeout(struct to_fifo *tf, struct tf_entry *item)
+{
+	unsigned int slot = tf_slot(tf, item->exp_time);
+
+	list_add_tail(&item->to_list, &tf->wheel[slot]);
+	__set_bit(slot, tf->wheel_map);
+	if (!timer_pending(&tf->timer) ||
+	    time_before(item->exp_time, tf->timer.expires))
+		mod_timer(&tf->timer, item->exp_time);
+}
+
+/* Remove @item from the timeout wheel, lists_lock held */
+static void tf_unlink_timeout(struct to_fifo *tf, struct tf_entry *item)
+{
+	unsigned int slot = tf_slot(tf, item->exp_time);
+
+	list_del(&item->to_list);
+	if (list_empty(&tf->wheel[slot]))
+		__clear_bit(slot, tf->wheel_map);
+}
+
+/*
+ * Move the entries expired by @now to @exp_lst, oldest tick first.  Only
+ * the slots of the ticks passed since the last run are looked at, entries
+ * there that belong to a later round of the wheel stay.  lists_lock held.
+ */
+static void tf_expire(struct to_fifo *tf, unsigned long now,
+		      struct list_head *exp_lst)
+{
+	unsigned long clk = now / tf->tick;
+	unsigned long n = min_t(unsigned long, clk - tf->wheel_clk + 1,
+				TF_WHEEL_SLOTS);
+	struct tf_entry *item, *tmp;
+	unsigned int slot;
+
+	for (; n; n--) {
+		slot = (clk - n + 1) & (TF_WHEEL_SLOTS - 1);
+		list_for_each_entry_safe(item, tmp, &tf->wheel[slot], to_list) {
+			if (time_before(now, item->exp_time))
+				continue;
+			list_del(&item->fifo_list);
+			list_move_tail(&item->to_list, exp_lst);
+			tf->num_items--;
+		}
+		if (list_empty(&tf->wheel[slot]))
+			__clear_bit(slot, tf->wheel_map);
+	}
+	tf->wheel_clk = clk;
+}
+
+/*
+ * Find when the wheel has to run next: the end of the tick of the next
+ * occupied slot.  Returns false if the wheel is empty.  lists_lock held.
+ */
+static bool tf_next_expiry(struct to_fifo *tf, unsigned long now,
+			   unsigned long *next)
+{
+	unsigned long clk = now / tf->tick;
+	unsigned int slot = clk & (TF_WHEEL_SLOTS - 1);
+	unsigned int bit;
+
+	bit = find_next_bit(tf->wheel_map, TF_WHEEL_SLOTS, slot);
+	if (bit >= TF_WHEEL_SLOTS) {
+		bit = find_first_bit(tf->wheel_map, TF_WHEEL_SLOTS);
+		if (bit >= TF_WHEEL_SLOTS)
+			return false;
+	}
+
+	*next = (clk + ((bit - slot) & (TF_WHEEL_SLOTS - 1)) + 1) * tf->tick;
+	return true;
+}
+
 static void notify_failure(struct ib_mad_send_wr_private *mad_send_wr,
 			   enum ib_wc_status status)
 {
@@ -213,48 +299,33 @@ static inline struct ib_mad_send_wr_private *tfe_to_mad(struct tf_entry *tfe)
 static void timeout_handler_task(struct work_struct *work)
 {
 	struct tf_entry *tmp1, *tmp2;
-	struct list_head *list_item, exp_lst;
-	unsigned long flags, curr_time;
-	int lst_empty;
+	struct list_head exp_lst;
+	unsigned long flags, curr_time, next;
 	struct to_fifo *tf;
 
 	tf = container_of(work, struct to_fifo, work);
-	do {
-		INIT_LIST_HEAD(&exp_lst);
-
-		spin_lock_irqsave(&tf->lists_lock, flags);
-		curr_time = jiffies;
-		list_for_each(list_item, &tf->to_head) {
-			tmp1 = list_entry(list_item, struct tf_entry, to_list);
-			if (time_before(curr_time, tmp1->exp_time))
-				break;
-			list_del(&tmp1->fifo_list);
-			tf->num_items--;
-		}
+	INIT_LIST_HEAD(&exp_lst);
 
-		/* cut list up to and including list_item->prev */
-		list_cut_position(&exp_lst, &tf->to_head, list_item->prev);
-		spin_unlock_irqrestore(&tf->lists_lock, flags);
+	spin_lock_irqsave(&tf->lists_lock, flags);
+	curr_time = jiffies;
+	tf_expire(tf, curr_time, &exp_lst);
+	spin_unlock_irqrestore(&tf->lists_lock, flags);
 
-		lst_empty = list_empty(&exp_lst);
-		list_for_each_entry_safe(tmp1, tmp2, &exp_lst, to_list) {
-			list_del(&tmp1->to_list);
-			if (tmp1->canceled) {
-				tmp1->canceled = 0;
-				notify_failure(tfe_to_mad(tmp1),
-					       IB_WC_WR_FLUSH_ERR);
-			} else {
-				notify_failure(tfe_to_mad(tmp1),
-					       IB_WC_RESP_TIMEOUT_ERR);
-			}
+	list_for_each_entry_safe(tmp1, tmp2, &exp_lst, to_list) {
+		list_del(&tmp1->to_list);
+		if (tmp1->canceled) {
+			tmp1->canceled = 0;
+			notify_failure(tfe_to_mad(tmp1),
+				       IB_WC_WR_FLUSH_ERR);
+		} else {
+			notify_failure(tfe_to_mad(tmp1),
+				       IB_WC_RESP_TIMEOUT_ERR);
 		}
-	} while (!lst_empty);
+	}
 
 	spin_lock_irqsave(&tf->lists_lock, flags);
-	if (!list_empty(&tf->to_head)) {
-		tmp1 = list_entry(tf->to_head.next, struct tf_entry, to_list);
-		mod_timer(&tf->timer, adjusted_time(curr_time, tmp1->exp_time));
-	}
+	if (tf_next_expiry(tf, jiffies, &next))
+		mod_timer(&tf->timer, adjusted_time(curr_time, next));
 	spin_unlock_irqrestore(&tf->lists_lock, flags);
 }
 
@@ -266,6 +337,7 @@ static void timeout_handler_task(struct work_struct *work)
 static struct to_fifo *tf_create(void)
 {
 	struct to_fifo *tf;
+	int i;
 
 	tf = kzalloc(sizeof(*tf), GFP_KERNEL);
 	if (tf) {
@@ -275,7 +347,11 @@ static struct to_fifo *tf_create(void)
 			return NULL;
 		}
 		spin_lock_init(&tf->lists_lock);
-		INIT_LIST_HEAD(&tf->to_head);
+		for (i = 0; i < TF_WHEEL_SLOTS; i++)
+			INIT_LIST_HEAD(&tf->wheel[i]);
+		tf->tick = max_t(unsigned long, 1,
+				 msecs_to_jiffies(MIN_BETWEEN_ACTIVATIONS_MS));
+		tf->wheel_clk = jiffies / tf->tick;
 		INIT_LIST_HEAD(&tf->fifo_head);
 #ifdef HAVE_TIMER_SETUP
 		timer_setup(&tf->timer, activate_timeout_handler_task, 0);
@@ -309,8 +385,6 @@ static int tf_enqueue(struct sa_cc_data *cc_obj, struct tf_entry *item,
 		      u32 timeout_ms)
 {
 	struct to_fifo *tf = cc_obj->tf;
-	struct tf_entry *tmp;
-	struct list_head *list_item;
 	unsigned long flags;
 
 	item->exp_time = jiffies + msecs_to_jiffies(timeout_ms);
@@ -322,24 +396,10 @@ static int tf_enqueue(struct sa_cc_data *cc_obj, struct tf_entry *item,
 		return -EBUSY;
 	}
 
-	/* Insert item to timeout list */
-	list_for_each_prev(list_item, &tf->to_head) {
-		tmp = list_entry(list_item, struct tf_entry, to_list);
-		if (time_after(item->exp_time, tmp->exp_time))
-			break;
-	}
-
-	list_add(&item->to_list, list_item);
-
-	/* Insert item to fifo list */
+	tf_link_timeout(tf, item);
 	list_add_tail(&item->fifo_list, &tf->fifo_head);
-
 	tf->num_items++;
 
-	/* modify expiration timer if required */
-	if (list_item == &tf->to_head)
-		mod_timer(&tf->timer, item->exp_time);
-
 	spin_unlock_irqrestore(&tf->lists_lock, flags);
 
 	return 0;
@@ -358,7 +418,7 @@ static struct tf_entry *tf_dequeue(struct to_fifo *tf, u32 *time_left_ms)
 {
 	unsigned long flags;
 	unsigned long time_left;
-	struct tf_entry *tmp, *tmp1;
+	struct tf_entry *tmp;
 
 	spin_lock_irqsave(&tf->lists_lock, flags);
 	if (list_empty(&tf->fifo_head)) {
@@ -376,18 +436,9 @@ static struct tf_entry *tf_dequeue(struct to_fifo *tf, u32 *time_left_ms)
 		return NULL;
 	}
 
-	/* modify timer in case enqueued item is the next to expire */
-	if (tf->to_head.next == &tmp->to_list) {
-		if (list_is_last(&tmp->to_list, &tf->to_head)) {
-			del_timer(&tf->timer);
-		} else {
-			tmp1 = list_entry(tmp->to_list.next,
-					  struct tf_entry, to_list);
-			mod_timer(&tf->timer, tmp1->exp_time);
-		}
-	}
+	/* the timer may now fire for nothing, the wheel copes with that */
+	tf_unlink_timeout(tf, tmp);
 	list_del(&tmp->fifo_list);
-	list_del(&tmp->to_list);
 	tf->num_items--;
 	spin_unlock_irqrestore(&tf->lists_lock, flags);
 
@@ -439,7 +490,7 @@ static void tf_free_agent(struct to_fifo *tf,
 	spin_lock_irqsave(&tf->lists_lock, flags);
 	list_for_each_entry_safe(tmp, tmp1, &tf->fifo_head, fifo_list) {
 		if (tfe_to_mad(tmp)->mad_agent_priv == mad_agent_priv) {
-			list_del(&tmp->to_list);
+			tf_unlink_timeout(tf, tmp);
 			list_move(&tmp->fifo_list, &tmp_head);
 			tf->num_items--;
 		}
@@ -468,8 +519,7 @@ static int tf_modify_item(struct to_fifo *tf,
 			  struct ib_mad_agent_private *mad_agent_priv,
 			  struct ib_mad_send_buf *send_buf, u32 timeout_ms)
 {
-	struct tf_entry *tmp, *item;
-	struct list_head *list_item;
+	struct tf_entry *item;
 	unsigned long flags;
 	int found = 0;
 
@@ -487,30 +537,18 @@ static int tf_modify_item(struct to_fifo *tf,
 		return -ENXIO;
 	}
 
+	tf_unlink_timeout(tf, item);
 	item->exp_time = jiffies + msecs_to_jiffies(timeout_ms);
 
-	if (timeout_ms) {
-		list_del(&item->to_list);
-		list_for_each_prev(list_item, &tf->to_head) {
-			tmp = list_entry(list_item, struct tf_entry, to_list);
-			if (time_after(item->exp_time, tmp->exp_time))
-				break;
-		}
-		list_add(&item->to_list, list_item);
-
-		/* modify expiration timer if required */
-		if (list_item == &tf->to_head)
-			mod_timer(&tf->timer, item->exp_time);
-	} else {
+	if (!timeout_ms) {
 		/*
-		 * when item canceled (timeout_ms == 0) move item to
-		 * head of timeout list and to the tail of fifo list
+		 * when item canceled (timeout_ms == 0) it expires right
+		 * away, move it to the tail of fifo list
 		 */
 		item->canceled = 1;
-		list_move(&item->to_list, &tf->to_head);
 		list_move_tail(&item->fifo_list, &tf->fifo_head);
-		mod_timer(&tf->timer, item->exp_time);
 	}
+	tf_link_timeout(tf, item);
 	spin_unlock_irqrestore(&tf->lists_lock, flags);
 
 	return 0;
@@ -2825,6 +2863,82 @@ handle_smi(struct ib_mad_port_private *port_priv,
 	return handle_ib_smi(port_priv, qp_info, wc, port_num, recv, response);
 }
 
+static void ib_mad_recv_work(struct work_struct *work)
+{
+	struct ib_mad_recv_worker *worker =
+		container_of(work, struct ib_mad_recv_worker, work);
+	struct ib_mad_private_header *hdr, *tmp;
+	struct ib_mad_recv_class_stats *stats;
+	struct ib_mad_hdr *mad;
+	LIST_HEAD(list);
+	u64 delay;
+	u8 mgmt_class;
+
+	spin_lock_irq(&worker->lock);
+	list_splice_init(&worker->list, &list);
+	spin_unlock_irq(&worker->lock);
+
+	list_for_each_entry_safe(hdr, tmp, &list, dispatch_list) {
+		list_del(&hdr->dispatch_list);
+
+		mad = (struct ib_mad_hdr *)hdr->recv_wc.recv_buf.mad;
+		mgmt_class = convert_mgmt_class(mad->mgmt_class);
+		if (mgmt_class < MAX_MGMT_CLASS) {
+			delay = local_clock() - hdr->dispatch_time;
+			stats = &worker->stats[mgmt_class];
+			stats->count++;
+			stats->delay_ns += delay;
+			if (delay > stats->max_delay_ns)
+				stats->max_delay_ns = delay;
+		}
+
+		ib_mad_complete_recv(hdr->dispatch_agent, &hdr->recv_wc);
+		cond_resched();
+	}
+}
+
+/*
+ * All MADs of an agent go to the same worker, keyed by the agent's hi_tid.
+ * An agent therefore sees its MADs in the order they were received and
+ * its receive handler never runs concurrently with itself, as with inline
+ * dispatch.  Only different agents run in parallel.
+ */
+static struct ib_mad_recv_worker *
+ib_mad_pick_recv_worker(struct ib_mad_port_private *port_priv,
+			struct ib_mad_agent_private *mad_agent)
+{
+	return &port_priv->recv_workers[hash_32(mad_agent->agent.hi_tid, 32) %
+					port_priv->recv_workers_nr];
+}
+
+/*
+ * Hand a received MAD to its agent.  The agent reference taken by
+ * find_mad_agent() is dropped by ib_mad_complete_recv(), so agents are
+ * not unregistered while they have MADs queued.
+ */
+static void ib_mad_dispatch_recv(struct ib_mad_port_private *port_priv,
+				 struct ib_mad_agent_private *mad_agent,
+				 struct ib_mad_private *recv)
+{
+	struct ib_mad_recv_worker *worker;
+	unsigned long flags;
+
+	if (!port_priv->recv_workers_nr) {
+		ib_mad_complete_recv(mad_agent, &recv->header.recv_wc);
+		return;
+	}
+
+	worker = ib_mad_pick_recv_worker(port_priv, mad_agent);
+	recv->header.dispatch_agent = mad_agent;
+	recv->header.dispatch_time = local_clock();
+
+	spin_lock_irqsave(&worker->lock, flags);
+	list_add_tail(&recv->header.dispatch_list, &worker->list);
+	spin_unlock_irqrestore(&worker->lock, flags);
+
+	queue_work(port_priv->recv_wq, &worker->work);
+}
+
 static void ib_mad_recv_done(struct ib_cq *cq, struct ib_wc *wc)
 {
 	struct ib_mad_port_private *port_priv = cq->cq_context;
@@ -2936,7 +3050,7 @@ static void ib_mad_recv_done(struct ib_cq *cq, struct ib_wc *wc)
 #ifndef MLX_DISABLE_TRACEPOINTS
 		trace_ib_mad_recv_done_agent(mad_agent);
 #endif
-		ib_mad_complete_recv(mad_agent, &recv->header.recv_wc);
+		ib_mad_dispatch_recv(port_priv, mad_agent, recv);
 		/*
 		 * recv is freed up in error cases in ib_mad_complete_recv
 		 * or via recv_handler in ib_mad_complete_recv()
@@ -3791,6 +3905,53 @@ static void destroy_mad_qp(struct ib_mad_qp_info *qp_info)
  * Open the port
  * Create the QP, PD, MR, and CQ if needed
  */
+static int ib_mad_recv_workers_init(struct ib_mad_port_private *port_priv)
+{
+	unsigned int i, nr;
+
+	nr = min_t(unsigned int, READ_ONCE(mad_recv_workers),
+		   IB_MAD_MAX_RECV_WORKERS);
+	if (!nr)
+		return 0;
+
+	port_priv->recv_workers = kcalloc(nr, sizeof(*port_priv->recv_workers),
+					  GFP_KERNEL);
+	if (!port_priv->recv_workers)
+		return -ENOMEM;
+
+	port_priv->recv_wq = alloc_workqueue("ib_mad_rx%u",
+					     WQ_UNBOUND | WQ_MEM_RECLAIM, nr,
+					     port_priv->port_num);
+	if (!port_priv->recv_wq) {
+		kfree(port_priv->recv_workers);
+		port_priv->recv_workers = NULL;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr; i++) {
+		spin_lock_init(&port_priv->recv_workers[i].lock);
+		INIT_LIST_HEAD(&port_priv->recv_workers[i].list);
+		INIT_WORK(&port_priv->recv_workers[i].work, ib_mad_recv_work);
+	}
+	port_priv->recv_workers_nr = nr;
+	return 0;
+}
+
+/*
+ * Every queued MAD holds a reference on its agent and all agents are gone
+ * by the time the port is closed, so the workers are idle here.
+ */
+static void ib_mad_recv_workers_cleanup(struct ib_mad_port_private *port_priv)
+{
+	if (!port_priv->recv_workers_nr)
+		return;
+
+	destroy_workqueue(port_priv->recv_wq);
+	kfree(port_priv->recv_workers);
+	port_priv->recv_workers = NULL;
+	port_priv->recv_workers_nr = 0;
+}
+
 static int ib_mad_port_open(struct ib_device *device,
 			    u32 port_num)
 {
@@ -3854,9 +4015,14 @@ static int ib_mad_port_open(struct ib_device *device,
 		goto error8;
 	}
 
-	if (sa_cc_init(&port_priv->sa_cc))
+	ret = ib_mad_recv_workers_init(port_priv);
+	if (ret)
 		goto error9;
 
+	ret = sa_cc_init(&port_priv->sa_cc);
+	if (ret)
+		goto error9a;
+
 	spin_lock_irqsave(&ib_mad_port_list_lock, flags);
 	list_add_tail(&port_priv->port_list, &ib_mad_port_list);
 	spin_unlock_irqrestore(&ib_mad_port_list_lock, flags);
@@ -3877,6 +4043,8 @@ error10:
 	spin_unlock_irqrestore(&ib_mad_port_list_lock, flags);
 
 	sa_cc_destroy(&port_priv->sa_cc);
+error9a:
+	ib_mad_recv_workers_cleanup(port_priv);
 error9:
 	destroy_workqueue(port_priv->wq);
 error8:
@@ -3917,6 +4085,7 @@ static int ib_mad_port_close(struct ib_device *device, u32 port_num)
 
 	destroy_workqueue(port_priv->wq);
 	sa_cc_destroy(&port_priv->sa_cc);
+	ib_mad_recv_workers_cleanup(port_priv);
 	destroy_mad_qp(&port_priv->qp_info[1]);
 	destroy_mad_qp(&port_priv->qp_info[0]);
 	ib_free_cq(port_priv->cq);
@@ -4098,6 +4267,58 @@ static ssize_t queue_size_show(struct sa_cc_data *cc_obj,
 	return sprintf(buf, "%lu\n", cc_obj->queue_size);
 }
 
+/*
+ * Receive queueing delay per management class, one line per class seen:
+ * class, MADs, average and maximum delay in nsecs.  Writing 0 resets it.
+ */
+static ssize_t recv_delay_show(struct sa_cc_data *cc_obj, char *buf)
+{
+	struct ib_mad_port_private *port_priv =
+		container_of(cc_obj, struct ib_mad_port_private, sa_cc);
+	struct ib_mad_recv_class_stats *stats;
+	u64 count, delay, max_delay;
+	unsigned int i, c;
+	ssize_t len = 0;
+
+	for (c = 0; c < MAX_MGMT_CLASS; c++) {
+		count = delay = max_delay = 0;
+		for (i = 0; i < port_priv->recv_workers_nr; i++) {
+			stats = &port_priv->recv_workers[i].stats[c];
+			count += READ_ONCE(stats->count);
+			delay += READ_ONCE(stats->delay_ns);
+			max_delay = max_t(u64, max_delay,
+					  READ_ONCE(stats->max_delay_ns));
+		}
+		if (!count)
+			continue;
+
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "0x%02x %llu %llu %llu\n",
+				 c ? c : IB_MGMT_CLASS_SUBN_DIRECTED_ROUTE,
+				 count, div64_u64(delay, count), max_delay);
+	}
+
+	return len;
+}
+
+static ssize_t recv_delay_store(struct sa_cc_data *cc_obj, const char *buf,
+				size_t count)
+{
+	struct ib_mad_port_private *port_priv =
+		container_of(cc_obj, struct ib_mad_port_private, sa_cc);
+	unsigned long var;
+	unsigned int i;
+
+	if (kstrtoul(buf, 0, &var) || var)
+		return -EINVAL;
+
+	for (i = 0; i < port_priv->recv_workers_nr; i++)
+		memset(port_priv->recv_workers[i].stats, 0,
+		       sizeof(port_priv->recv_workers[i].stats));
+
+	return count;
+}
+
 static ssize_t sa_cc_attr_store(struct kobject *kobj, struct attribute *attr,
 				const char *buf, size_t size)
 {
@@ -4144,12 +4365,14 @@ static SA_CC_ATTR(queue_size);
 static SA_CC_ATTR(time_sa_mad);
 static SA_CC_ATTR(max_outstanding);
 static SA_CC_ATTR(drops);
+static SA_CC_ATTR(recv_delay);
 
 static struct attribute *sa_cc_default_attrs[] = {
 	&sa_cc_attr_queue_size.attr,
 	&sa_cc_attr_time_sa_mad.attr,
 	&sa_cc_attr_max_outstanding.attr,
 	&sa_cc_attr_drops.attr,
+	&sa_cc_attr_recv_delay.attr,
 	NULL
 };
 
@@ -4211,6 +4434,10 @@ static struct ib_client mad_client = {
 
 int ib_mad_init(void)
 {
+	/* the packed receive header must keep its list_head aligned */
+	BUILD_BUG_ON(offsetof(struct ib_mad_private_header, dispatch_list) %
+		     __alignof__(struct list_head));
+
 	mad_recvq_size = min(mad_recvq_size, IB_MAD_QP_MAX_SIZE);
 	mad_recvq_size = max(mad_recvq_size, IB_MAD_QP_MIN_SIZE);
 
@@ -74,6 +74,15 @@ struct ib_mad_private_header {
 	struct ib_mad_recv_wc recv_wc;
 	struct ib_wc wc;
 	u64 mapping;
+	/*
+	 * Receive worker hand-off.  The header is only touched by the CPU,
+	 * the HCA DMAs into grh and mad behind it, so adding fields only
+	 * moves those.  All members above are 8-byte multiples, so the
+	 * list_head stays naturally aligned despite __packed.
+	 */
+	struct list_head dispatch_list;
+	struct ib_mad_agent_private *dispatch_agent;
+	u64 dispatch_time;
 } __packed;
 
 struct ib_mad_private {
@@ -219,8 +228,15 @@ struct smp_window {
 	struct list_head overflow_list;
 };
 
+/* Timeout wheel of the timeout-fifo, one slot per tick */
+#define TF_WHEEL_BITS		8
+#define TF_WHEEL_SLOTS		(1 << TF_WHEEL_BITS)
+
 struct to_fifo {
-	struct list_head to_head;
+	struct list_head wheel[TF_WHEEL_SLOTS];
+	DECLARE_BITMAP(wheel_map, TF_WHEEL_SLOTS);
+	unsigned long wheel_clk;    /* last tick the wheel was run for */
+	unsigned long tick;	    /* slot width in jiffies */
 	struct list_head fifo_head;
 	spinlock_t lists_lock;
 	struct timer_list timer;
@@ -242,6 +258,26 @@ struct sa_cc_data {
 	struct to_fifo  *tf;
 };
 
+/* Receive queueing delay of a management class */
+struct ib_mad_recv_class_stats {
+	u64 count;
+	u64 delay_ns;
+	u64 max_delay_ns;
+};
+
+/*
+ * Received MADs are handed to their agent by one of a few workers per
+ * port.  A response goes to the worker its TID hashes to, a request to
+ * the one its sender hashes to, so neither a transaction nor the
+ * requests of one peer are reordered.
+ */
+struct ib_mad_recv_worker {
+	spinlock_t lock;
+	struct list_head list;
+	struct work_struct work;
+	struct ib_mad_recv_class_stats stats[MAX_MGMT_CLASS];
+} ____cacheline_aligned_in_smp;
+
 struct ib_mad_port_private {
 	struct list_head port_list;
 	struct ib_device *device;
@@ -256,6 +292,10 @@ struct ib_mad_port_private {
 
 	struct smp_window smp_window;
 	struct sa_cc_data sa_cc;
+
+	struct workqueue_struct *recv_wq;
+	unsigned int recv_workers_nr;
+	struct ib_mad_recv_worker *recv_workers;
 };
 
 int ib_send_mad(struct ib_mad_send_wr_private *mad_send_wr);
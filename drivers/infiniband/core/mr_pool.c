@@ -2,21 +2,153 @@
 /*
  * Copyright (c) 2016 HGST, a Western Digital Company.
  */
+#include <linux/percpu.h>
 #include <rdma/ib_verbs.h>
 #include <rdma/mr_pool.h>
 
-struct ib_mr *ib_mr_pool_get(struct ib_qp *qp, struct list_head *list)
+#include "core_priv.h"
+
+/*
+ * The rdma_mrs and sig_mrs pools of a QP are fronted by small per-CPU
+ * magazines so that the common get/put pair only takes an uncontended
+ * CPU-local lock.  qp->mr_lock is taken only to move a batch of MRs between
+ * a magazine and the QP list when the magazine runs empty or full.  When
+ * both the local magazine and the QP list are empty, MRs parked in the
+ * magazines of other CPUs are taken back, so a pool never reports
+ * exhaustion while it still has free MRs.  Pools on any other list, or QPs
+ * whose per-CPU state could not be allocated, use the QP list directly.
+ *
+ * Lock order: ib_mr_pool_cpu->lock, then qp->mr_lock.
+ */
+#define IB_MR_MAG_SIZE		16
+#define IB_MR_MAG_BATCH		(IB_MR_MAG_SIZE / 2)
+
+enum {
+	IB_MR_POOL_RDMA,
+	IB_MR_POOL_SIG,
+	IB_MR_POOL_NR,
+};
+
+struct ib_mr_magazine {
+	unsigned int		nr;
+	struct ib_mr		*mrs[IB_MR_MAG_SIZE];
+};
+
+struct ib_mr_pool_cpu {
+	spinlock_t		lock;
+	struct ib_mr_magazine	mag[IB_MR_POOL_NR];
+	/* MRs handed out minus MRs returned on this CPU, may be negative */
+	int			used;
+	u64			misses;
+	u64			exhausted;
+};
+
+static int ib_mr_pool_idx(struct ib_qp *qp, struct list_head *list)
+{
+	if (list == &qp->rdma_mrs)
+		return IB_MR_POOL_RDMA;
+	if (list == &qp->sig_mrs)
+		return IB_MR_POOL_SIG;
+	return -1;
+}
+
+/* Move up to IB_MR_MAG_BATCH MRs from @list into @mag, magazine locked. */
+static void ib_mr_pool_refill(struct ib_qp *qp, struct list_head *list,
+		struct ib_mr_magazine *mag)
 {
 	struct ib_mr *mr;
-	unsigned long flags;
 
-	spin_lock_irqsave(&qp->mr_lock, flags);
-	mr = list_first_entry_or_null(list, struct ib_mr, qp_entry);
-	if (mr) {
+	spin_lock(&qp->mr_lock);
+	while (mag->nr < IB_MR_MAG_BATCH) {
+		mr = list_first_entry_or_null(list, struct ib_mr, qp_entry);
+		if (!mr)
+			break;
 		list_del(&mr->qp_entry);
-		qp->mrs_used++;
+		mag->mrs[mag->nr++] = mr;
+	}
+	spin_unlock(&qp->mr_lock);
+}
+
+/* Return the top @nr MRs of @mag to @list, magazine locked. */
+static void ib_mr_pool_flush(struct ib_qp *qp, struct list_head *list,
+		struct ib_mr_magazine *mag, unsigned int nr)
+{
+	spin_lock(&qp->mr_lock);
+	while (nr--)
+		list_add(&mag->mrs[--mag->nr]->qp_entry, list);
+	spin_unlock(&qp->mr_lock);
+}
+
+/* Take one MR parked in the magazine of any CPU. */
+static struct ib_mr *ib_mr_pool_steal(struct ib_qp *qp, int idx)
+{
+	struct ib_mr_pool_cpu *pc;
+	struct ib_mr *mr = NULL;
+	unsigned long flags;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(qp->mr_pcpu, cpu);
+		spin_lock_irqsave(&pc->lock, flags);
+		if (pc->mag[idx].nr) {
+			mr = pc->mag[idx].mrs[--pc->mag[idx].nr];
+			pc->used++;
+		}
+		spin_unlock_irqrestore(&pc->lock, flags);
+		if (mr)
+			break;
+	}
+
+	return mr;
+}
+
+struct ib_mr *ib_mr_pool_get(struct ib_qp *qp, struct list_head *list)
+{
+	int idx = ib_mr_pool_idx(qp, list);
+	struct ib_mr_magazine *mag;
+	struct ib_mr_pool_cpu *pc;
+	struct ib_mr *mr = NULL;
+	unsigned long flags;
+
+	if (idx < 0 || !qp->mr_pcpu) {
+		spin_lock_irqsave(&qp->mr_lock, flags);
+		mr = list_first_entry_or_null(list, struct ib_mr, qp_entry);
+		if (mr) {
+			list_del(&mr->qp_entry);
+			qp->mrs_used++;
+		}
+		spin_unlock_irqrestore(&qp->mr_lock, flags);
+
+		return mr;
+	}
+
+	local_irq_save(flags);
+	pc = this_cpu_ptr(qp->mr_pcpu);
+	spin_lock(&pc->lock);
+	mag = &pc->mag[idx];
+	if (!mag->nr) {
+		pc->misses++;
+		ib_mr_pool_refill(qp, list, mag);
+	}
+	if (mag->nr) {
+		mr = mag->mrs[--mag->nr];
+		pc->used++;
+	}
+	spin_unlock(&pc->lock);
+	local_irq_restore(flags);
+
+	if (mr)
+		return mr;
+
+	mr = ib_mr_pool_steal(qp, idx);
+	if (!mr) {
+		local_irq_save(flags);
+		pc = this_cpu_ptr(qp->mr_pcpu);
+		spin_lock(&pc->lock);
+		pc->exhausted++;
+		spin_unlock(&pc->lock);
+		local_irq_restore(flags);
 	}
-	spin_unlock_irqrestore(&qp->mr_lock, flags);
 
 	return mr;
 }
@@ -24,21 +156,111 @@ EXPORT_SYMBOL(ib_mr_pool_get);
 
 void ib_mr_pool_put(struct ib_qp *qp, struct list_head *list, struct ib_mr *mr)
 {
+	int idx = ib_mr_pool_idx(qp, list);
+	struct ib_mr_magazine *mag;
+	struct ib_mr_pool_cpu *pc;
 	unsigned long flags;
 
-	spin_lock_irqsave(&qp->mr_lock, flags);
-	list_add(&mr->qp_entry, list);
-	qp->mrs_used--;
-	spin_unlock_irqrestore(&qp->mr_lock, flags);
+	if (idx < 0 || !qp->mr_pcpu) {
+		spin_lock_irqsave(&qp->mr_lock, flags);
+		list_add(&mr->qp_entry, list);
+		qp->mrs_used--;
+		spin_unlock_irqrestore(&qp->mr_lock, flags);
+		return;
+	}
+
+	local_irq_save(flags);
+	pc = this_cpu_ptr(qp->mr_pcpu);
+	spin_lock(&pc->lock);
+	mag = &pc->mag[idx];
+	if (mag->nr == IB_MR_MAG_SIZE)
+		ib_mr_pool_flush(qp, list, mag, IB_MR_MAG_BATCH);
+	mag->mrs[mag->nr++] = mr;
+	pc->used--;
+	spin_unlock(&pc->lock);
+	local_irq_restore(flags);
 }
 EXPORT_SYMBOL(ib_mr_pool_put);
 
-int ib_mr_pool_init(struct ib_qp *qp, struct list_head *list, int nr,
+static int ib_mr_pool_add(struct ib_qp *qp, struct list_head *list, int nr,
 		enum ib_mr_type type, u32 max_num_sg, u32 max_num_meta_sg)
 {
 	struct ib_mr *mr;
 	unsigned long flags;
-	int ret, i;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (type == IB_MR_TYPE_INTEGRITY)
+			mr = ib_alloc_mr_integrity(qp->pd, max_num_sg,
+						   max_num_meta_sg);
+		else
+			mr = ib_alloc_mr(qp->pd, type, max_num_sg);
+		if (IS_ERR(mr))
+			return PTR_ERR(mr);
+
+		spin_lock_irqsave(&qp->mr_lock, flags);
+		list_add_tail(&mr->qp_entry, list);
+		spin_unlock_irqrestore(&qp->mr_lock, flags);
+	}
+
+	return 0;
+}
+
+int ib_mr_pool_init(struct ib_qp *qp, struct list_head *list, int nr,
+		enum ib_mr_type type, u32 max_num_sg, u32 max_num_meta_sg)
+{
+	int cpu, ret;
+
+	/* without per-CPU state the pool simply falls back to qp->mr_lock */
+	if (!qp->mr_pcpu && ib_mr_pool_idx(qp, list) >= 0) {
+		qp->mr_pcpu = alloc_percpu(struct ib_mr_pool_cpu);
+		if (qp->mr_pcpu)
+			for_each_possible_cpu(cpu)
+				spin_lock_init(&per_cpu_ptr(qp->mr_pcpu,
+							    cpu)->lock);
+	}
+
+	ret = ib_mr_pool_add(qp, list, nr, type, max_num_sg, max_num_meta_sg);
+	if (ret)
+		ib_mr_pool_destroy(qp, list);
+	return ret;
+}
+EXPORT_SYMBOL(ib_mr_pool_init);
+
+/**
+ * ib_mr_pool_grow - add MRs to an initialized pool
+ * @qp: QP owning the pool
+ * @list: qp->rdma_mrs or qp->sig_mrs
+ * @nr: number of MRs to add
+ * @max_grown: limit on the MRs grown over both pools of @qp
+ * @type: MR type of the pool
+ * @max_num_sg: max SG entries per MR, as passed to ib_mr_pool_init()
+ * @max_num_meta_sg: max metadata SG entries per MR
+ *
+ * May sleep.  The @nr MRs are reserved against @max_grown before any is
+ * allocated, so concurrent callers cannot exceed it.  MRs allocated before
+ * a failure stay in the pool.
+ */
+int ib_mr_pool_grow(struct ib_qp *qp, struct list_head *list, int nr,
+		u32 max_grown, enum ib_mr_type type, u32 max_num_sg,
+		u32 max_num_meta_sg)
+{
+	int idx = ib_mr_pool_idx(qp, list);
+	unsigned long flags;
+	struct ib_mr *mr;
+	int i, ret = 0;
+
+	if (idx < 0)
+		return -EINVAL;
+
+	spin_lock_irqsave(&qp->mr_lock, flags);
+	if (qp->mrs_grown[IB_MR_POOL_RDMA] + qp->mrs_grown[IB_MR_POOL_SIG] +
+	    nr > max_grown) {
+		spin_unlock_irqrestore(&qp->mr_lock, flags);
+		return -ENOSPC;
+	}
+	qp->mrs_grown[idx] += nr;
+	spin_unlock_irqrestore(&qp->mr_lock, flags);
 
 	for (i = 0; i < nr; i++) {
 		if (type == IB_MR_TYPE_INTEGRITY)
@@ -48,7 +270,7 @@ int ib_mr_pool_init(struct ib_qp *qp, struct list_head *list, int nr,
 			mr = ib_alloc_mr(qp->pd, type, max_num_sg);
 		if (IS_ERR(mr)) {
 			ret = PTR_ERR(mr);
-			goto out;
+			break;
 		}
 
 		spin_lock_irqsave(&qp->mr_lock, flags);
@@ -56,18 +278,96 @@ int ib_mr_pool_init(struct ib_qp *qp, struct list_head *list, int nr,
 		spin_unlock_irqrestore(&qp->mr_lock, flags);
 	}
 
-	return 0;
-out:
-	ib_mr_pool_destroy(qp, list);
+	if (i < nr) {
+		spin_lock_irqsave(&qp->mr_lock, flags);
+		qp->mrs_grown[idx] -= nr - i;
+		spin_unlock_irqrestore(&qp->mr_lock, flags);
+	}
 	return ret;
 }
-EXPORT_SYMBOL(ib_mr_pool_init);
+EXPORT_SYMBOL(ib_mr_pool_grow);
+
+/*
+ * Move the MRs parked in the magazines of pool @idx beyond @keep per CPU
+ * back to @list.  Returns the number of MRs left parked.
+ */
+static unsigned int ib_mr_pool_drain(struct ib_qp *qp, struct list_head *list,
+		int idx, unsigned int keep)
+{
+	struct ib_mr_magazine *mag;
+	struct ib_mr_pool_cpu *pc;
+	unsigned int parked = 0;
+	unsigned long flags;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(qp->mr_pcpu, cpu);
+		mag = &pc->mag[idx];
+		spin_lock_irqsave(&pc->lock, flags);
+		spin_lock(&qp->mr_lock);
+		while (mag->nr > keep)
+			list_add(&mag->mrs[--mag->nr]->qp_entry, list);
+		spin_unlock(&qp->mr_lock);
+		parked += mag->nr;
+		spin_unlock_irqrestore(&pc->lock, flags);
+	}
+
+	return parked;
+}
+
+/**
+ * ib_mr_pool_shrink - release the free MRs added by ib_mr_pool_grow()
+ * @qp: QP owning the pool
+ * @list: qp->rdma_mrs or qp->sig_mrs
+ *
+ * May sleep.  Magazines are only trimmed down to IB_MR_MAG_BATCH MRs, so
+ * each CPU keeps a warm cache across idle periods.  MRs in use stay grown
+ * until a later call.
+ *
+ * Return: the number of grown MRs still held by the pool beyond those
+ * parked in the magazines, i.e. those a later call may release.
+ */
+u32 ib_mr_pool_shrink(struct ib_qp *qp, struct list_head *list)
+{
+	int idx = ib_mr_pool_idx(qp, list);
+	unsigned int parked = 0;
+	unsigned long flags;
+	struct ib_mr *mr;
+	u32 left;
+
+	if (idx < 0)
+		return 0;
+
+	if (qp->mr_pcpu && READ_ONCE(qp->mrs_grown[idx]))
+		parked = ib_mr_pool_drain(qp, list, idx, IB_MR_MAG_BATCH);
+
+	for (;;) {
+		spin_lock_irqsave(&qp->mr_lock, flags);
+		left = qp->mrs_grown[idx];
+		mr = left ? list_first_entry_or_null(list, struct ib_mr,
+						     qp_entry) : NULL;
+		if (!mr) {
+			spin_unlock_irqrestore(&qp->mr_lock, flags);
+			return left > parked ? left - parked : 0;
+		}
+		list_del(&mr->qp_entry);
+		qp->mrs_grown[idx]--;
+		spin_unlock_irqrestore(&qp->mr_lock, flags);
+
+		ib_dereg_mr(mr);
+	}
+}
+EXPORT_SYMBOL(ib_mr_pool_shrink);
 
 void ib_mr_pool_destroy(struct ib_qp *qp, struct list_head *list)
 {
+	int idx = ib_mr_pool_idx(qp, list);
 	struct ib_mr *mr;
 	unsigned long flags;
 
+	if (idx >= 0 && qp->mr_pcpu)
+		ib_mr_pool_drain(qp, list, idx, 0);
+
 	spin_lock_irqsave(&qp->mr_lock, flags);
 	while (!list_empty(list)) {
 		mr = list_first_entry(list, struct ib_mr, qp_entry);
@@ -77,6 +377,42 @@ void ib_mr_pool_destroy(struct ib_qp *qp, struct list_head *list)
 		ib_dereg_mr(mr);
 		spin_lock_irqsave(&qp->mr_lock, flags);
 	}
+	if (idx >= 0)
+		qp->mrs_grown[idx] = 0;
 	spin_unlock_irqrestore(&qp->mr_lock, flags);
 }
 EXPORT_SYMBOL(ib_mr_pool_destroy);
+
+/**
+ * ib_mr_pool_get_stats - report MR pool counters of a QP
+ * @qp: QP owning the pools
+ * @stats: filled with the counters summed over rdma_mrs and sig_mrs
+ */
+void ib_mr_pool_get_stats(struct ib_qp *qp, struct ib_mr_pool_stats *stats)
+{
+	struct ib_mr_pool_cpu *pc;
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->grown = READ_ONCE(qp->mrs_grown[IB_MR_POOL_RDMA]) +
+		       READ_ONCE(qp->mrs_grown[IB_MR_POOL_SIG]);
+	if (!qp->mr_pcpu)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(qp->mr_pcpu, cpu);
+		stats->misses += READ_ONCE(pc->misses);
+		stats->exhausted += READ_ONCE(pc->exhausted);
+	}
+}
+EXPORT_SYMBOL(ib_mr_pool_get_stats);
+
+int ib_mr_pool_used(struct ib_qp *qp)
+{
+	int cpu, used = READ_ONCE(qp->mrs_used);
+
+	if (qp->mr_pcpu)
+		for_each_possible_cpu(cpu)
+			used += READ_ONCE(per_cpu_ptr(qp->mr_pcpu, cpu)->used);
+	return used;
+}
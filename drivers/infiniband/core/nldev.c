@@ -37,6 +37,7 @@
 #include <net/netlink.h>
 #include <rdma/rdma_cm.h>
 #include <rdma/rdma_netlink.h>
+#include <rdma/mr_pool.h>
 
 #include "core_priv.h"
 #include "cma_priv.h"
@@ -111,10 +112,18 @@ static const struct nla_policy nldev_policy[RDMA_NLDEV_ATTR_MAX] = {
 	[RDMA_NLDEV_ATTR_RES_PD_ENTRY]		= { .type = NLA_NESTED },
 	[RDMA_NLDEV_ATTR_RES_PID]		= { .type = NLA_U32 },
 	[RDMA_NLDEV_ATTR_RES_POLL_CTX]		= { .type = NLA_U8 },
+	[RDMA_NLDEV_ATTR_RES_CQ_POLL_STATS]	= { .type = NLA_NESTED },
 	[RDMA_NLDEV_ATTR_RES_PS]		= { .type = NLA_U32 },
 	[RDMA_NLDEV_ATTR_RES_QP]		= { .type = NLA_NESTED },
 	[RDMA_NLDEV_ATTR_RES_QP_ENTRY]		= { .type = NLA_NESTED },
+	[RDMA_NLDEV_ATTR_RES_QP_MR_POOL]	= { .type = NLA_NESTED },
 	[RDMA_NLDEV_ATTR_RES_RAW]		= { .type = NLA_BINARY },
+	[RDMA_NLDEV_ATTR_SA_PATH_CACHE]		= { .type = NLA_NESTED },
+	[RDMA_NLDEV_ATTR_STAT_HISTORY]		= { .type = NLA_NESTED },
+	[RDMA_NLDEV_ATTR_STAT_HISTORY_SAMPLES]	= { .type = NLA_U32 },
+	[RDMA_NLDEV_ATTR_STAT_HISTORY_WINDOW_MS] = { .type = NLA_U64 },
+	[RDMA_NLDEV_ATTR_STAT_HISTORY_DELTAS]	= { .type = NLA_NESTED },
+	[RDMA_NLDEV_ATTR_STAT_HISTORY_RATES]	= { .type = NLA_NESTED },
 	[RDMA_NLDEV_ATTR_RES_RKEY]		= { .type = NLA_U32 },
 	[RDMA_NLDEV_ATTR_RES_RQPN]		= { .type = NLA_U32 },
 	[RDMA_NLDEV_ATTR_RES_RQ_PSN]		= { .type = NLA_U32 },
@@ -294,6 +303,36 @@ static int fill_dev_info(struct sk_buff *msg, struct ib_device *device)
 	return ret;
 }
 
+static int fill_sa_path_cache_info(struct sk_buff *msg,
+				   struct ib_device *device, u32 port)
+{
+	struct ib_sa_path_cache_stats stats;
+	struct nlattr *table_attr;
+
+	if (ib_sa_path_cache_get_stats(device, port, &stats))
+		return 0;
+
+	table_attr = nla_nest_start(msg, RDMA_NLDEV_ATTR_SA_PATH_CACHE);
+	if (!table_attr)
+		return -EMSGSIZE;
+
+	if (rdma_nl_stat_hwcounter_entry(msg, "hits", stats.hits) ||
+	    rdma_nl_stat_hwcounter_entry(msg, "neg_hits", stats.neg_hits) ||
+	    rdma_nl_stat_hwcounter_entry(msg, "misses", stats.misses) ||
+	    rdma_nl_stat_hwcounter_entry(msg, "coalesced", stats.coalesced) ||
+	    rdma_nl_stat_hwcounter_entry(msg, "invalidations",
+					 stats.invalidations) ||
+	    rdma_nl_stat_hwcounter_entry(msg, "entries", stats.entries))
+		goto err;
+
+	nla_nest_end(msg, table_attr);
+	return 0;
+
+err:
+	nla_nest_cancel(msg, table_attr);
+	return -EMSGSIZE;
+}
+
 static int fill_port_info(struct sk_buff *msg,
 			  struct ib_device *device, u32 port,
 			  const struct net *net)
@@ -330,6 +369,8 @@ static int fill_port_info(struct sk_buff *msg,
 			return -EMSGSIZE;
 		if (nla_put_u8(msg, RDMA_NLDEV_ATTR_LMC, attr.lmc))
 			return -EMSGSIZE;
+		if (fill_sa_path_cache_info(msg, device, port))
+			return -EMSGSIZE;
 	}
 	if (nla_put_u8(msg, RDMA_NLDEV_ATTR_PORT_STATE, attr.state))
 		return -EMSGSIZE;
@@ -497,6 +538,30 @@ static int fill_res_qp_entry_query(struct sk_buff *msg,
 err:	return -EMSGSIZE;
 }
 
+static int fill_res_qp_mr_pool(struct sk_buff *msg, struct ib_qp *qp)
+{
+	struct ib_mr_pool_stats stats;
+	struct nlattr *table_attr;
+
+	ib_mr_pool_get_stats(qp, &stats);
+
+	table_attr = nla_nest_start(msg, RDMA_NLDEV_ATTR_RES_QP_MR_POOL);
+	if (!table_attr)
+		return -EMSGSIZE;
+
+	if (rdma_nl_stat_hwcounter_entry(msg, "mag_misses", stats.misses) ||
+	    rdma_nl_stat_hwcounter_entry(msg, "exhausted", stats.exhausted) ||
+	    rdma_nl_stat_hwcounter_entry(msg, "grown", stats.grown))
+		goto err;
+
+	nla_nest_end(msg, table_attr);
+	return 0;
+
+err:
+	nla_nest_cancel(msg, table_attr);
+	return -EMSGSIZE;
+}
+
 static int fill_res_qp_entry(struct sk_buff *msg, bool has_cap_net_admin,
 			     struct rdma_restrack_entry *res, uint32_t port)
 {
@@ -523,6 +588,11 @@ static int fill_res_qp_entry(struct sk_buff *msg, bool has_cap_net_admin,
 	if (ret)
 		return -EMSGSIZE;
 
+	/* only kernel QPs with rdma_rw MR pools have magazines */
+	if (rdma_is_kernel_res(res) && qp->mr_pcpu &&
+	    fill_res_qp_mr_pool(msg, qp))
+		return -EMSGSIZE;
+
 	return fill_res_qp_entry_query(msg, res, dev, qp);
 }
 
@@ -591,6 +661,32 @@ static int fill_res_cm_id_entry(struct sk_buff *msg, bool has_cap_net_admin,
 err: return -EMSGSIZE;
 }
 
+static int fill_res_cq_poll_stats(struct sk_buff *msg, struct ib_cq *cq)
+{
+	struct ib_cq_poll_stats stats;
+	struct nlattr *table_attr;
+
+	ib_cq_get_poll_stats(cq, &stats);
+
+	table_attr = nla_nest_start(msg, RDMA_NLDEV_ATTR_RES_CQ_POLL_STATS);
+	if (!table_attr)
+		return -EMSGSIZE;
+
+	if (rdma_nl_stat_hwcounter_entry(msg, "spin_ns", stats.spin_ns) ||
+	    rdma_nl_stat_hwcounter_entry(msg, "sleep_ns", stats.sleep_ns) ||
+	    rdma_nl_stat_hwcounter_entry(msg, "spin_comps",
+					 stats.spin_comps) ||
+	    rdma_nl_stat_hwcounter_entry(msg, "arms", stats.arms))
+		goto err;
+
+	nla_nest_end(msg, table_attr);
+	return 0;
+
+err:
+	nla_nest_cancel(msg, table_attr);
+	return -EMSGSIZE;
+}
+
 static int fill_res_cq_entry(struct sk_buff *msg, bool has_cap_net_admin,
 			     struct rdma_restrack_entry *res, uint32_t port)
 {
@@ -611,6 +707,10 @@ static int fill_res_cq_entry(struct sk_buff *msg, bool has_cap_net_admin,
 	if (nla_put_u8(msg, RDMA_NLDEV_ATTR_DEV_DIM, (cq->dim != NULL)))
 		return -EMSGSIZE;
 
+	if (rdma_is_kernel_res(res) && cq->poll_ctx == IB_POLL_HYBRID &&
+	    fill_res_cq_poll_stats(msg, cq))
+		return -EMSGSIZE;
+
 	if (nla_put_u32(msg, RDMA_NLDEV_ATTR_RES_CQN, res->id))
 		return -EMSGSIZE;
 	if (!rdma_is_kernel_res(res) &&
@@ -849,6 +949,79 @@ err:
 	return -EMSGSIZE;
 }
 
+static int fill_stat_counter_history_table(struct sk_buff *msg, int attr,
+					   struct rdma_hw_stats *st,
+					   const u64 *values)
+{
+	struct nlattr *table_attr;
+	int i;
+
+	table_attr = nla_nest_start(msg, attr);
+	if (!table_attr)
+		return -EMSGSIZE;
+
+	for (i = 0; i < st->num_counters; i++)
+		if (rdma_nl_stat_hwcounter_entry(msg, st->names[i], values[i]))
+			goto err;
+
+	nla_nest_end(msg, table_attr);
+	return 0;
+
+err:
+	nla_nest_cancel(msg, table_attr);
+	return -EMSGSIZE;
+}
+
+static int fill_stat_counter_history(struct sk_buff *msg,
+				     struct rdma_counter *counter)
+{
+	struct rdma_hw_stats *st = counter->stats;
+	struct nlattr *table_attr;
+	u64 *delta, window_ms;
+	u32 samples;
+	int i, ret = 0;
+
+	delta = kcalloc(2 * st->num_counters, sizeof(*delta), GFP_KERNEL);
+	if (!delta)
+		return -ENOMEM;
+
+	/* nothing to report until at least two samples were taken */
+	window_ms = div_u64(rdma_counter_history_delta(counter, delta,
+						       &samples),
+			    NSEC_PER_MSEC);
+	if (!window_ms)
+		goto out;
+
+	/* rates go in the second half of the array */
+	for (i = 0; i < st->num_counters; i++)
+		delta[st->num_counters + i] =
+			div64_u64(delta[i] * MSEC_PER_SEC, window_ms);
+
+	ret = -EMSGSIZE;
+	table_attr = nla_nest_start(msg, RDMA_NLDEV_ATTR_STAT_HISTORY);
+	if (!table_attr)
+		goto out;
+
+	if (nla_put_u32(msg, RDMA_NLDEV_ATTR_STAT_HISTORY_SAMPLES, samples) ||
+	    nla_put_u64_64bit(msg, RDMA_NLDEV_ATTR_STAT_HISTORY_WINDOW_MS,
+			      window_ms, RDMA_NLDEV_ATTR_PAD) ||
+	    fill_stat_counter_history_table(msg,
+					    RDMA_NLDEV_ATTR_STAT_HISTORY_DELTAS,
+					    st, delta) ||
+	    fill_stat_counter_history_table(msg,
+					    RDMA_NLDEV_ATTR_STAT_HISTORY_RATES,
+					    st, &delta[st->num_counters])) {
+		nla_nest_cancel(msg, table_attr);
+		goto out;
+	}
+
+	nla_nest_end(msg, table_attr);
+	ret = 0;
+out:
+	kfree(delta);
+	return ret;
+}
+
 static int fill_res_counter_entry(struct sk_buff *msg, bool has_cap_net_admin,
 				  struct rdma_restrack_entry *res,
 				  uint32_t port)
@@ -866,7 +1039,8 @@ static int fill_res_counter_entry(struct sk_buff *msg, bool has_cap_net_admin,
 	    nla_put_u32(msg, RDMA_NLDEV_ATTR_STAT_COUNTER_ID, counter->id) ||
 	    fill_stat_counter_mode(msg, counter) ||
 	    fill_stat_counter_qps(msg, counter) ||
-	    fill_stat_counter_hwcounters(msg, counter))
+	    fill_stat_counter_hwcounters(msg, counter) ||
+	    fill_stat_counter_history(msg, counter))
 		return -EMSGSIZE;
 
 	return 0;
@@ -1395,25 +1569,127 @@ err:
 	return ret;
 }
 
+/* Entries referenced per xa_lock hold while dumping */
+#define NLDEV_RES_DUMP_BATCH	32
+
+/*
+ * Optional dump filters: RES_PID applies to every type, RES_TYPE and
+ * RES_STATE to QPs and CM IDs.  Negative values mean "no filter".
+ */
+struct nldev_res_filter {
+	pid_t pid;
+	int type;
+	int state;
+};
+
+static int nldev_res_parse_filter(struct nlattr **tb,
+				  enum rdma_restrack_type res_type,
+				  struct nldev_res_filter *filter)
+{
+	filter->pid = tb[RDMA_NLDEV_ATTR_RES_PID] ?
+		      nla_get_u32(tb[RDMA_NLDEV_ATTR_RES_PID]) : 0;
+	filter->type = tb[RDMA_NLDEV_ATTR_RES_TYPE] ?
+		       nla_get_u8(tb[RDMA_NLDEV_ATTR_RES_TYPE]) : -1;
+	filter->state = tb[RDMA_NLDEV_ATTR_RES_STATE] ?
+			nla_get_u8(tb[RDMA_NLDEV_ATTR_RES_STATE]) : -1;
+
+	if ((filter->type >= 0 || filter->state >= 0) &&
+	    res_type != RDMA_RESTRACK_QP && res_type != RDMA_RESTRACK_CM_ID)
+		return -EINVAL;
+	return 0;
+}
+
+static bool nldev_res_match(struct rdma_restrack_entry *res,
+			    const struct nldev_res_filter *filter)
+{
+	struct ib_qp_init_attr qp_init_attr;
+	struct rdma_id_private *id_priv;
+	struct ib_qp_attr qp_attr;
+	struct ib_qp *qp;
+
+	if (filter->pid && (rdma_is_kernel_res(res) ||
+			    task_pid_vnr(res->task) != filter->pid))
+		return false;
+
+	if (filter->type < 0 && filter->state < 0)
+		return true;
+
+	if (res->type == RDMA_RESTRACK_CM_ID) {
+		id_priv = container_of(res, struct rdma_id_private, res);
+		return (filter->type < 0 ||
+			id_priv->id.qp_type == filter->type) &&
+		       (filter->state < 0 || id_priv->state == filter->state);
+	}
+
+	qp = container_of(res, struct ib_qp, res);
+	if (filter->type >= 0 && qp->qp_type != filter->type)
+		return false;
+	if (filter->state >= 0 &&
+	    (ib_query_qp(qp, &qp_attr, 0, &qp_init_attr) ||
+	     qp_attr.qp_state != filter->state))
+		return false;
+	return true;
+}
+
+/*
+ * Take references on up to NLDEV_RES_DUMP_BATCH entries starting at @id.
+ * On return @id is the index to continue from, and @end tells whether the
+ * walk reached the end of the xarray.
+ */
+static int nldev_res_get_batch(struct rdma_restrack_root *rt,
+			       unsigned long *id, bool *end,
+			       struct rdma_restrack_entry **batch)
+{
+	struct rdma_restrack_entry *res;
+	int nr = 0;
+
+	*end = false;
+	xa_lock(&rt->xa);
+	for (res = xa_find(&rt->xa, id, U32_MAX, XA_PRESENT); res;
+	     res = xa_find_after(&rt->xa, id, U32_MAX, XA_PRESENT)) {
+		if (rdma_restrack_get(res))
+			batch[nr++] = res;
+		if (nr == NLDEV_RES_DUMP_BATCH)
+			break;
+	}
+	xa_unlock(&rt->xa);
+
+	if (!res || *id == U32_MAX)
+		*end = true;
+	else
+		(*id)++;
+	return nr;
+}
+
+/*
+ * The dump resumes from the xarray index saved in cb->args[0] rather than
+ * skipping over the entries already sent, so every part of a large dump
+ * costs the same.  cb->args[1] is set once the whole index space was walked.
+ */
 static int res_get_common_dumpit(struct sk_buff *skb,
 				 struct netlink_callback *cb,
 				 enum rdma_restrack_type res_type,
 				 res_fill_func_t fill_func)
 {
 	const struct nldev_fill_res_entry *fe = &fill_entries[res_type];
+	struct rdma_restrack_entry *batch[NLDEV_RES_DUMP_BATCH];
 	struct nlattr *tb[RDMA_NLDEV_ATTR_MAX];
+	struct nldev_res_filter filter;
 	struct rdma_restrack_entry *res;
 	struct rdma_restrack_root *rt;
-	int err, ret = 0, idx = 0;
+	unsigned long id = cb->args[0];
 	struct nlattr *table_attr;
 	struct nlattr *entry_attr;
 	struct ib_device *device;
-	int start = cb->args[0];
 	bool has_cap_net_admin;
+	int err, ret = 0, i, nr;
 	struct nlmsghdr *nlh;
-	unsigned long id;
 	u32 index, port = 0;
 	bool filled = false;
+	bool end;
+
+	if (cb->args[1])
+		return 0;
 
 #ifdef HAVE_NLMSG_PARSE_DEPRECATED
 	err = nlmsg_parse_deprecated(cb->nlh, 0, tb, RDMA_NLDEV_ATTR_MAX - 1,
@@ -1432,6 +1708,9 @@ static int res_get_common_dumpit(struct sk_buff *skb,
 	if (err || !tb[RDMA_NLDEV_ATTR_DEV_INDEX])
 		return -EINVAL;
 
+	if (nldev_res_parse_filter(tb, res_type, &filter))
+		return -EINVAL;
+
 	index = nla_get_u32(tb[RDMA_NLDEV_ATTR_DEV_INDEX]);
 	device = ib_device_get_by_index(sock_net(skb->sk), index);
 	if (!device)
@@ -1475,53 +1754,51 @@ static int res_get_common_dumpit(struct sk_buff *skb,
 #endif
 
 	rt = &device->res[res_type];
-	xa_lock(&rt->xa);
-	/*
-	 * FIXME: if the skip ahead is something common this loop should
-	 * use xas_for_each & xas_pause to optimize, we can have a lot of
-	 * objects.
-	 */
-	xa_for_each(&rt->xa, id, res) {
-		if (idx < start || !rdma_restrack_get(res))
-			goto next;
-
-		xa_unlock(&rt->xa);
-
-		filled = true;
+	do {
+		nr = nldev_res_get_batch(rt, &id, &end, batch);
+		for (i = 0; i < nr; i++) {
+			res = batch[i];
+			if (!nldev_res_match(res, &filter))
+				continue;
 
 #ifdef HAVE_NLA_NEST_START_NOFLAG
-		entry_attr = nla_nest_start_noflag(skb, fe->entry);
+			entry_attr = nla_nest_start_noflag(skb, fe->entry);
 #else
-		entry_attr = nla_nest_start(skb, fe->entry);
+			entry_attr = nla_nest_start(skb, fe->entry);
 #endif
-		if (!entry_attr) {
-			ret = -EMSGSIZE;
-			rdma_restrack_put(res);
-			goto msg_full;
-		}
-
-		ret = fill_func(skb, has_cap_net_admin, res, port);
-
-		rdma_restrack_put(res);
-
-		if (ret) {
-			nla_nest_cancel(skb, entry_attr);
-			if (ret == -EMSGSIZE)
+			if (!entry_attr) {
+				ret = -EMSGSIZE;
 				goto msg_full;
-			if (ret == -EAGAIN)
-				goto again;
-			goto res_err;
+			}
+
+			ret = fill_func(skb, has_cap_net_admin, res, port);
+			if (ret) {
+				nla_nest_cancel(skb, entry_attr);
+				if (ret == -EMSGSIZE)
+					goto msg_full;
+				if (ret == -EAGAIN)
+					continue;
+				goto res_err;
+			}
+			nla_nest_end(skb, entry_attr);
+			filled = true;
 		}
-		nla_nest_end(skb, entry_attr);
-again:		xa_lock(&rt->xa);
-next:		idx++;
-	}
-	xa_unlock(&rt->xa);
+		while (nr)
+			rdma_restrack_put(batch[--nr]);
+		cond_resched();
+	} while (!end);
+	cb->args[1] = 1;
+	ret = 0;
+	goto out;
 
 msg_full:
+	/* resend this entry in the next message */
+	cb->args[0] = res->id;
+	while (nr)
+		rdma_restrack_put(batch[--nr]);
+out:
 	nla_nest_end(skb, table_attr);
 	nlmsg_end(skb, nlh);
-	cb->args[0] = idx;
 
 	/*
 	 * No more entries to fill, cancel the message and
@@ -1534,6 +1811,8 @@ msg_full:
 	return skb->len;
 
 res_err:
+	while (nr)
+		rdma_restrack_put(batch[--nr]);
 	nla_nest_cancel(skb, table_attr);
 err:
 	nlmsg_cancel(skb, nlh);
@@ -110,16 +110,7 @@ void rdma_restrack_clean(struct ib_device *dev)
  */
 int rdma_restrack_count(struct ib_device *dev, enum rdma_restrack_type type)
 {
-	struct rdma_restrack_root *rt = &dev->res[type];
-	struct rdma_restrack_entry *e;
-	XA_STATE(xas, &rt->xa, 0);
-	u32 cnt = 0;
-
-	xa_lock(&rt->xa);
-	xas_for_each(&xas, e, U32_MAX)
-		cnt++;
-	xa_unlock(&rt->xa);
-	return cnt;
+	return atomic_read(&dev->res[type].count);
 }
 EXPORT_SYMBOL(rdma_restrack_count);
 
@@ -234,8 +225,10 @@ static void rdma_restrack_add(struct rdma_restrack_entry *res)
 		ret = (ret < 0) ? ret : 0;
 	}
 
-	if (!ret)
+	if (!ret) {
+		atomic_inc(&rt->count);
 		res->valid = true;
+	}
 }
 
 /**
@@ -332,6 +325,7 @@ void rdma_restrack_del(struct rdma_restrack_entry *res)
 
 	old = xa_erase(&rt->xa, res->id);
 	WARN_ON(old != res);
+	atomic_dec(&rt->count);
 	res->valid = false;
 
 	rdma_restrack_put(res);
@@ -21,6 +21,11 @@ struct rdma_restrack_root {
 	 * @next_id: Next ID to support cyclic allocation
 	 */
 	u32 next_id;
+	/**
+	 * @count: Number of valid entries, kept so that the summary does
+	 * not have to walk the XArray under its lock
+	 */
+	atomic_t count;
 };
 
 int rdma_restrack_init(struct ib_device *dev);
@@ -9,6 +9,8 @@
 #include <rdma/rw.h>
 #include <linux/sizes.h>
 
+#include "core_priv.h"
+
 enum {
 	RDMA_RW_SINGLE_WR,
 	RDMA_RW_MULTI_WR,
@@ -20,6 +22,27 @@ static bool rdma_rw_force_mr;
 module_param_named(force_mr, rdma_rw_force_mr, bool, 0);
 MODULE_PARM_DESC(force_mr, "Force usage of MRs for RDMA READ/WRITE operations");
 
+/*
+ * When a QP's MR pool runs dry the context still fails with -EAGAIN, but a
+ * work item adds RDMA_RW_MR_GROW_BATCH MRs to the pool, up to mr_grow_max
+ * extra MRs per QP, so that the caller's retry finds one.  The work runs in
+ * process context because ib_alloc_mr() may sleep and rdma_rw_ctx_init() is
+ * called from completion handlers.  Once the QP went RDMA_RW_MR_IDLE_MS
+ * without running dry, the grown MRs are released again.
+ */
+#define RDMA_RW_MR_GROW_BATCH	16
+#define RDMA_RW_MR_IDLE_MS	10000
+
+enum {
+	RDMA_RW_GROW_RDMA_MRS,
+	RDMA_RW_GROW_SIG_MRS,
+};
+
+static unsigned int rdma_rw_mr_grow_max = 256;
+module_param_named(mr_grow_max, rdma_rw_mr_grow_max, uint, 0644);
+MODULE_PARM_DESC(mr_grow_max,
+		 "Max MRs added on demand to a QP's RDMA READ/WRITE MR pool (default: 256)");
+
 /*
  * Report whether memory registration should be used. Memory registration must
  * be used for iWarp devices because of iWARP-specific limitations. Memory
@@ -71,6 +94,52 @@ static inline u32 rdma_rw_fr_page_list_len(struct ib_device *dev,
 	return min_t(u32, max_pages, 256);
 }
 
+static struct ib_mr *rdma_rw_get_mr(struct ib_qp *qp, struct list_head *list)
+{
+	struct ib_mr *mr;
+
+	mr = ib_mr_pool_get(qp, list);
+	if (mr || !READ_ONCE(rdma_rw_mr_grow_max))
+		return mr;
+
+	WRITE_ONCE(qp->mr_grow_stamp, jiffies);
+	set_bit(list == &qp->sig_mrs ? RDMA_RW_GROW_SIG_MRS :
+				       RDMA_RW_GROW_RDMA_MRS,
+		&qp->mr_grow_flags);
+	mod_delayed_work(ib_wq, &qp->mr_grow_work, 0);
+	return NULL;
+}
+
+void rdma_rw_mr_pool_work(struct work_struct *work)
+{
+	struct ib_qp *qp = container_of(to_delayed_work(work), struct ib_qp,
+					mr_grow_work);
+	u32 max_num_sg = rdma_rw_fr_page_list_len(qp->pd->device,
+						  qp->integrity_en);
+	u32 max_grown = READ_ONCE(rdma_rw_mr_grow_max);
+	u32 left;
+
+	if (test_and_clear_bit(RDMA_RW_GROW_RDMA_MRS, &qp->mr_grow_flags))
+		ib_mr_pool_grow(qp, &qp->rdma_mrs, RDMA_RW_MR_GROW_BATCH,
+				max_grown, IB_MR_TYPE_MEM_REG, max_num_sg, 0);
+	if (test_and_clear_bit(RDMA_RW_GROW_SIG_MRS, &qp->mr_grow_flags))
+		ib_mr_pool_grow(qp, &qp->sig_mrs, RDMA_RW_MR_GROW_BATCH,
+				max_grown, IB_MR_TYPE_INTEGRITY, max_num_sg,
+				max_num_sg);
+
+	if (time_before(jiffies, READ_ONCE(qp->mr_grow_stamp) +
+				 msecs_to_jiffies(RDMA_RW_MR_IDLE_MS))) {
+		left = 1;
+	} else {
+		left = ib_mr_pool_shrink(qp, &qp->rdma_mrs);
+		left += ib_mr_pool_shrink(qp, &qp->sig_mrs);
+	}
+
+	if (left)
+		queue_delayed_work(ib_wq, &qp->mr_grow_work,
+				   msecs_to_jiffies(RDMA_RW_MR_IDLE_MS));
+}
+
 static inline int rdma_rw_inv_key(struct rdma_rw_reg_ctx *reg)
 {
 	int count = 0;
@@ -97,7 +166,7 @@ static int rdma_rw_init_one_mr(struct ib_qp *qp, u32 port_num,
 	u32 nents = min(sg_cnt, pages_per_mr);
 	int count = 0, ret;
 
-	reg->mr = ib_mr_pool_get(qp, &qp->rdma_mrs);
+	reg->mr = rdma_rw_get_mr(qp, &qp->rdma_mrs);
 	if (!reg->mr)
 		return -EAGAIN;
 
@@ -414,7 +483,7 @@ int rdma_rw_ctx_signature_init(struct rdma_rw_ctx *ctx, struct ib_qp *qp,
 		goto out_unmap_prot_sg;
 	}
 
-	ctx->reg->mr = ib_mr_pool_get(qp, &qp->sig_mrs);
+	ctx->reg->mr = rdma_rw_get_mr(qp, &qp->sig_mrs);
 	if (!ctx->reg->mr) {
 		ret = -EAGAIN;
 		goto out_free_ctx;
@@ -737,6 +806,7 @@ out_free_rdma_mrs:
 
 void rdma_rw_cleanup_mrs(struct ib_qp *qp)
 {
+	cancel_delayed_work_sync(&qp->mr_grow_work);
 	ib_mr_pool_destroy(qp, &qp->sig_mrs);
 	ib_mr_pool_destroy(qp, &qp->rdma_mrs);
 }
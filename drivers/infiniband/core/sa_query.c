@@ -42,6 +42,8 @@
 #include <linux/kref.h>
 #include <linux/xarray.h>
 #include <linux/workqueue.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
 #include <uapi/linux/if_ether.h>
 #include <rdma/ib_pack.h>
 #include <rdma/ib_cache.h>
@@ -61,6 +63,36 @@
 #define IB_SA_CPI_RETRY_WAIT			1000 /*msecs */
 static int sa_local_svc_timeout_ms = IB_SA_LOCAL_SVC_TIMEOUT_DEFAULT;
 
+/*
+ * Path record cache.  Resolved path records are kept per port, keyed by
+ * the fields of the query, for path_cache_ttl_ms.  A query for a key that
+ * is already being resolved waits for the outstanding query instead of
+ * sending another one.  Queries the SA answered with an error are cached
+ * for path_cache_neg_ttl_ms.  The cache of a port is dropped on any SM,
+ * LID, P_Key or port state event.
+ */
+#define IB_SA_PATH_CACHE_BITS		6
+#define IB_SA_PATH_CACHE_COMP_MASK \
+	(IB_SA_PATH_REC_SERVICE_ID | IB_SA_PATH_REC_DGID | \
+	 IB_SA_PATH_REC_SGID | IB_SA_PATH_REC_REVERSIBLE | \
+	 IB_SA_PATH_REC_NUMB_PATH | IB_SA_PATH_REC_PKEY | IB_SA_PATH_REC_SL | \
+	 IB_SA_PATH_REC_QOS_CLASS | IB_SA_PATH_REC_TRAFFIC_CLASS)
+
+static unsigned int path_cache_ttl_ms;
+module_param(path_cache_ttl_ms, uint, 0644);
+MODULE_PARM_DESC(path_cache_ttl_ms,
+		 "Lifetime of cached path records in msecs, 0 disables the cache (default: 0)");
+
+static unsigned int path_cache_neg_ttl_ms = 1000;
+module_param(path_cache_neg_ttl_ms, uint, 0644);
+MODULE_PARM_DESC(path_cache_neg_ttl_ms,
+		 "Lifetime of cached failed path lookups in msecs (default: 1000)");
+
+static unsigned int path_cache_size = 1024;
+module_param(path_cache_size, uint, 0644);
+MODULE_PARM_DESC(path_cache_size,
+		 "Maximum number of cached path records per port (default: 1024)");
+
 struct ib_sa_sm_ah {
 	struct ib_ah        *ah;
 	struct kref          ref;
@@ -96,6 +128,11 @@ struct ib_sa_port {
 	spinlock_t                   classport_lock; /* protects class port info set */
 	spinlock_t           ah_lock;
 	u32		     port_num;
+	spinlock_t	     path_cache_lock; /* protects path_cache* */
+	bool		     path_cache_closed;
+	unsigned int	     path_cache_count;
+	struct ib_sa_path_cache_stats path_cache_stats;
+	DECLARE_HASHTABLE(path_cache, IB_SA_PATH_CACHE_BITS);
 };
 
 struct ib_sa_device {
@@ -122,6 +159,7 @@ struct ib_sa_query {
 #define IB_SA_ENABLE_LOCAL_SERVICE	0x00000001
 #define IB_SA_CANCEL			0x00000002
 #define IB_SA_QUERY_OPA			0x00000004
+#define IB_SA_QUERY_CACHED		0x00000008
 
 struct ib_sa_service_query {
 	void (*callback)(int, struct ib_sa_service_rec *, void *);
@@ -129,11 +167,49 @@ struct ib_sa_service_query {
 	struct ib_sa_query sa_query;
 };
 
+struct ib_sa_path_cache_key {
+	union ib_gid		dgid;
+	union ib_gid		sgid;
+	__be64			service_id;
+	ib_sa_comp_mask		comp_mask;
+	__be16			pkey;
+	__be16			qos_class;
+	u8			sl;
+	u8			traffic_class;
+	u8			reversible;
+	u8			numb_path;
+};
+
+struct ib_sa_path_cache_entry {
+	struct hlist_node	node;
+	struct ib_sa_path_cache_key key;
+	unsigned long		expires;
+	int			status;
+	bool			pending;
+	bool			stale;
+	bool			resent;
+	/* queries waiting for the outstanding lookup of this key */
+	struct list_head	waiters;
+	struct sa_path_rec	rec;
+	/* to send the lookup again if the query resolving it is canceled */
+	struct ib_sa_port	*port;
+	unsigned long		timeout_ms;
+	int			retries;
+	struct work_struct	resend_work;
+};
+
 struct ib_sa_path_query {
 	void (*callback)(int, struct sa_path_rec *, void *);
 	void *context;
 	struct ib_sa_query sa_query;
 	struct sa_path_rec *conv_pr;
+	/* entry this query resolves for other waiters, if any */
+	struct ib_sa_path_cache_entry *cache_entry;
+	/* answered from the cache or from another query */
+	struct list_head cache_list;
+	struct work_struct cache_work;
+	int cache_status;
+	struct sa_path_rec cache_rec;
 };
 
 struct ib_sa_guidinfo_query {
@@ -1186,6 +1262,345 @@ void ib_sa_unregister_client(struct ib_sa_client *client)
 }
 EXPORT_SYMBOL(ib_sa_unregister_client);
 
+static void ib_sa_path_cache_make_key(struct ib_sa_path_cache_key *key,
+				      struct sa_path_rec *rec,
+				      ib_sa_comp_mask comp_mask)
+{
+	memset(key, 0, sizeof(*key));
+	key->comp_mask = comp_mask;
+	if (comp_mask & IB_SA_PATH_REC_DGID)
+		key->dgid = rec->dgid;
+	if (comp_mask & IB_SA_PATH_REC_SGID)
+		key->sgid = rec->sgid;
+	if (comp_mask & IB_SA_PATH_REC_SERVICE_ID)
+		key->service_id = rec->service_id;
+	if (comp_mask & IB_SA_PATH_REC_PKEY)
+		key->pkey = rec->pkey;
+	if (comp_mask & IB_SA_PATH_REC_SL)
+		key->sl = rec->sl;
+	if (comp_mask & IB_SA_PATH_REC_QOS_CLASS)
+		key->qos_class = rec->qos_class;
+	if (comp_mask & IB_SA_PATH_REC_TRAFFIC_CLASS)
+		key->traffic_class = rec->traffic_class;
+	if (comp_mask & IB_SA_PATH_REC_REVERSIBLE)
+		key->reversible = rec->reversible;
+	if (comp_mask & IB_SA_PATH_REC_NUMB_PATH)
+		key->numb_path = rec->numb_path;
+}
+
+static void ib_sa_path_cache_key_rec(struct sa_path_rec *rec,
+				     const struct ib_sa_path_cache_key *key)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->rec_type = SA_PATH_REC_TYPE_IB;
+	rec->dgid = key->dgid;
+	rec->sgid = key->sgid;
+	rec->service_id = key->service_id;
+	rec->pkey = key->pkey;
+	rec->qos_class = key->qos_class;
+	rec->sl = key->sl;
+	rec->traffic_class = key->traffic_class;
+	rec->reversible = key->reversible;
+	rec->numb_path = key->numb_path;
+}
+
+static bool ib_sa_path_cacheable(struct sa_path_rec *rec,
+				 ib_sa_comp_mask comp_mask,
+				 void *callback)
+{
+	return READ_ONCE(path_cache_ttl_ms) && callback &&
+	       rec->rec_type == SA_PATH_REC_TYPE_IB &&
+	       (comp_mask & IB_SA_PATH_REC_DGID) &&
+	       !(comp_mask & ~IB_SA_PATH_CACHE_COMP_MASK);
+}
+
+static struct ib_sa_path_cache_entry *
+ib_sa_path_cache_find(struct ib_sa_port *port,
+		      const struct ib_sa_path_cache_key *key, u32 hash)
+{
+	struct ib_sa_path_cache_entry *entry;
+
+	hash_for_each_possible(port->path_cache, entry, node, hash)
+		if (!memcmp(&entry->key, key, sizeof(*key)))
+			return entry;
+	return NULL;
+}
+
+static void ib_sa_path_cache_unhash(struct ib_sa_port *port,
+				    struct ib_sa_path_cache_entry *entry)
+{
+	hash_del(&entry->node);
+	port->path_cache_count--;
+}
+
+/* Drop expired entries to make room, path_cache_lock held. */
+static void ib_sa_path_cache_expire(struct ib_sa_port *port)
+{
+	struct ib_sa_path_cache_entry *entry;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(port->path_cache, bkt, tmp, entry, node) {
+		if (entry->pending || time_before(jiffies, entry->expires))
+			continue;
+		ib_sa_path_cache_unhash(port, entry);
+		kfree(entry);
+	}
+}
+
+static void ib_sa_path_cache_flush(struct ib_sa_port *port)
+{
+	struct ib_sa_path_cache_entry *entry;
+	struct hlist_node *tmp;
+	unsigned long flags;
+	int bkt;
+
+	spin_lock_irqsave(&port->path_cache_lock, flags);
+	hash_for_each_safe(port->path_cache, bkt, tmp, entry, node) {
+		ib_sa_path_cache_unhash(port, entry);
+		/* the outstanding query still completes its waiters */
+		if (entry->pending)
+			entry->stale = true;
+		else
+			kfree(entry);
+	}
+	port->path_cache_stats.invalidations++;
+	spin_unlock_irqrestore(&port->path_cache_lock, flags);
+}
+
+static void ib_sa_path_cache_work(struct work_struct *work)
+{
+	struct ib_sa_path_query *query =
+		container_of(work, struct ib_sa_path_query, cache_work);
+	unsigned long flags;
+
+	query->callback(query->cache_status,
+			query->cache_status ? NULL : &query->cache_rec,
+			query->context);
+
+	xa_lock_irqsave(&queries, flags);
+	__xa_erase(&queries, query->sa_query.id);
+	xa_unlock_irqrestore(&queries, flags);
+
+	ib_sa_client_put(query->sa_query.client);
+	kfree(query);
+}
+
+/*
+ * Complete a query that never went to the SA.  The callback runs from
+ * ib_wq, as callers may issue the query with locks held that their
+ * callback takes.
+ */
+static void ib_sa_path_cache_done(struct ib_sa_path_query *query, int status,
+				  struct sa_path_rec *rec)
+{
+	query->cache_status = status;
+	if (!status)
+		query->cache_rec = *rec;
+	queue_work(ib_wq, &query->cache_work);
+}
+
+/* Called with the queries xarray locked, so @sa_query is still alive. */
+static void ib_sa_path_cache_cancel(struct ib_sa_query *sa_query)
+{
+	struct ib_sa_path_query *query =
+		container_of(sa_query, struct ib_sa_path_query, sa_query);
+	struct ib_sa_port *port = sa_query->port;
+
+	spin_lock(&port->path_cache_lock);
+	if (!list_empty(&query->cache_list)) {
+		list_del_init(&query->cache_list);
+		ib_sa_path_cache_done(query, -EINTR, NULL);
+	}
+	spin_unlock(&port->path_cache_lock);
+}
+
+/*
+ * Record the result of a lookup sent on behalf of a cache entry and hand
+ * it to the queries waiting on that entry.  Answers of the SA are kept,
+ * failures to reach it are not.  A canceled query says nothing about the
+ * path: if others wait for it the lookup is sent once more for them, else
+ * they are told to retry.
+ */
+static void __ib_sa_path_cache_complete(struct ib_sa_port *port,
+					struct ib_sa_path_cache_entry *entry,
+					int status, struct sa_path_rec *rec)
+{
+	struct ib_sa_path_query *waiter, *tmp;
+	unsigned long flags;
+	unsigned int ttl;
+
+	if (!status)
+		ttl = READ_ONCE(path_cache_ttl_ms);
+	else if (status == -EINVAL)
+		ttl = READ_ONCE(path_cache_neg_ttl_ms);
+	else
+		ttl = 0;
+
+	spin_lock_irqsave(&port->path_cache_lock, flags);
+	if (status == -EINTR && !entry->resent && !port->path_cache_closed &&
+	    !list_empty(&entry->waiters)) {
+		entry->resent = true;
+		queue_work(ib_wq, &entry->resend_work);
+		spin_unlock_irqrestore(&port->path_cache_lock, flags);
+		return;
+	}
+
+	list_for_each_entry_safe(waiter, tmp, &entry->waiters, cache_list) {
+		list_del_init(&waiter->cache_list);
+		ib_sa_path_cache_done(waiter, status == -EINTR ? -EAGAIN : status,
+				      rec);
+	}
+
+	entry->pending = false;
+	if (entry->stale || !ttl) {
+		if (!entry->stale)
+			ib_sa_path_cache_unhash(port, entry);
+		kfree(entry);
+	} else {
+		entry->status = status;
+		if (!status)
+			entry->rec = *rec;
+		entry->expires = jiffies + msecs_to_jiffies(ttl);
+	}
+	spin_unlock_irqrestore(&port->path_cache_lock, flags);
+}
+
+static void ib_sa_path_cache_complete(struct ib_sa_path_query *query,
+				      int status, struct sa_path_rec *rec)
+{
+	struct ib_sa_path_cache_entry *entry = query->cache_entry;
+
+	if (!entry)
+		return;
+	query->cache_entry = NULL;
+	__ib_sa_path_cache_complete(query->sa_query.port, entry, status, rec);
+}
+
+static void ib_sa_path_cache_resend(struct work_struct *work);
+
+/*
+ * Try to answer @query from the cache of its port.  Returns the query ID
+ * if the query was answered or joined an outstanding lookup, or a
+ * negative value if it has to be sent.  In the latter case the query may
+ * have been made the one resolving a new cache entry.
+ */
+static int ib_sa_path_cache_lookup(struct ib_sa_path_query *query,
+				   struct sa_path_rec *rec,
+				   ib_sa_comp_mask comp_mask,
+				   unsigned long timeout_ms, int retries,
+				   gfp_t gfp_mask, struct ib_sa_query **sa_query)
+{
+	struct ib_sa_port *port = query->sa_query.port;
+	struct ib_sa_path_cache_entry *entry, *new;
+	struct ib_sa_path_cache_key key;
+	unsigned long flags;
+	unsigned int max;
+	u32 hash;
+	int ret, id;
+
+	ib_sa_path_cache_make_key(&key, rec, comp_mask);
+	hash = jhash(&key, sizeof(key), 0);
+
+	new = kzalloc(sizeof(*new), gfp_mask);
+	if (!new)
+		return -ENOMEM;
+
+	/* the ID must be valid before another context completes the query */
+	xa_lock_irqsave(&queries, flags);
+	ret = __xa_alloc(&queries, &id, &query->sa_query, xa_limit_32b,
+			 gfp_mask);
+	xa_unlock_irqrestore(&queries, flags);
+	if (ret < 0) {
+		kfree(new);
+		return ret;
+	}
+
+	query->sa_query.id = id;
+	query->sa_query.flags |= IB_SA_QUERY_CACHED;
+	INIT_LIST_HEAD(&query->cache_list);
+	INIT_WORK(&query->cache_work, ib_sa_path_cache_work);
+	ib_sa_client_get(query->sa_query.client);
+	*sa_query = &query->sa_query;
+
+	spin_lock_irqsave(&port->path_cache_lock, flags);
+	entry = ib_sa_path_cache_find(port, &key, hash);
+	if (entry && !entry->pending && time_after_eq(jiffies, entry->expires)) {
+		ib_sa_path_cache_unhash(port, entry);
+		kfree(entry);
+		entry = NULL;
+	}
+
+	if (entry) {
+		if (entry->pending) {
+			port->path_cache_stats.coalesced++;
+			list_add_tail(&query->cache_list, &entry->waiters);
+		} else {
+			if (entry->status)
+				port->path_cache_stats.neg_hits++;
+			else
+				port->path_cache_stats.hits++;
+			ib_sa_path_cache_done(query, entry->status,
+					      &entry->rec);
+		}
+		spin_unlock_irqrestore(&port->path_cache_lock, flags);
+		kfree(new);
+		return id;
+	}
+
+	port->path_cache_stats.misses++;
+	max = READ_ONCE(path_cache_size);
+	if (port->path_cache_count >= max)
+		ib_sa_path_cache_expire(port);
+	if (port->path_cache_count < max) {
+		new->key = key;
+		new->pending = true;
+		INIT_LIST_HEAD(&new->waiters);
+		new->port = port;
+		new->timeout_ms = timeout_ms;
+		new->retries = retries;
+		INIT_WORK(&new->resend_work, ib_sa_path_cache_resend);
+		hash_add(port->path_cache, &new->node, hash);
+		port->path_cache_count++;
+		query->cache_entry = new;
+		new = NULL;
+	}
+	spin_unlock_irqrestore(&port->path_cache_lock, flags);
+	kfree(new);
+
+	*sa_query = NULL;
+	ib_sa_client_put(query->sa_query.client);
+	query->sa_query.flags &= ~IB_SA_QUERY_CACHED;
+	xa_lock_irqsave(&queries, flags);
+	__xa_erase(&queries, id);
+	xa_unlock_irqrestore(&queries, flags);
+	return -ENOENT;
+}
+
+/**
+ * ib_sa_path_cache_get_stats - report path record cache counters of a port
+ * @device: device the port belongs to
+ * @port_num: port number
+ * @stats: filled with the counters of the port
+ */
+int ib_sa_path_cache_get_stats(struct ib_device *device, u32 port_num,
+			       struct ib_sa_path_cache_stats *stats)
+{
+	struct ib_sa_device *sa_dev = ib_get_client_data(device, &sa_client);
+	struct ib_sa_port *port;
+	unsigned long flags;
+
+	if (!sa_dev || !rdma_cap_ib_sa(device, port_num))
+		return -EOPNOTSUPP;
+
+	port = &sa_dev->port[port_num - sa_dev->start_port];
+	spin_lock_irqsave(&port->path_cache_lock, flags);
+	*stats = port->path_cache_stats;
+	stats->entries = port->path_cache_count;
+	spin_unlock_irqrestore(&port->path_cache_lock, flags);
+	return 0;
+}
+
 /**
  * ib_sa_cancel_query - try to cancel an SA query
  * @id:ID of query to cancel
@@ -1206,6 +1621,11 @@ void ib_sa_cancel_query(int id, struct ib_sa_query *query)
 		xa_unlock_irqrestore(&queries, flags);
 		return;
 	}
+	if (query->flags & IB_SA_QUERY_CACHED) {
+		ib_sa_path_cache_cancel(query);
+		xa_unlock_irqrestore(&queries, flags);
+		return;
+	}
 	agent = query->port->agent;
 	mad_buf = query->mad_buf;
 	xa_unlock_irqrestore(&queries, flags);
@@ -1507,6 +1927,7 @@ static void ib_sa_path_rec_callback(struct ib_sa_query *sa_query,
 				  mad->data, &rec);
 			rec.rec_type = SA_PATH_REC_TYPE_IB;
 			sa_path_set_dmac_zero(&rec);
+			ib_sa_path_cache_complete(query, status, &rec);
 
 			if (query->conv_pr) {
 				struct sa_path_rec opa;
@@ -1518,8 +1939,10 @@ static void ib_sa_path_rec_callback(struct ib_sa_query *sa_query,
 				query->callback(status, &rec, query->context);
 			}
 		}
-	} else
+	} else {
+		ib_sa_path_cache_complete(query, status, NULL);
 		query->callback(status, NULL, query->context);
+	}
 }
 
 static void ib_sa_path_rec_release(struct ib_sa_query *sa_query)
@@ -1531,6 +1954,78 @@ static void ib_sa_path_rec_release(struct ib_sa_query *sa_query)
 	kfree(query);
 }
 
+/* The answer is handed out by ib_sa_path_cache_complete(). */
+static void ib_sa_path_cache_resend_done(int status, struct sa_path_rec *rec,
+					 void *context)
+{
+}
+
+/*
+ * Send the lookup of a cache entry whose resolving query was canceled
+ * while others waited for it.  The query belongs to no client, so it
+ * cannot be canceled again; it only ends when the SA answers, the
+ * request times out or the port goes away.
+ */
+static void ib_sa_path_cache_resend(struct work_struct *work)
+{
+	struct ib_sa_path_cache_entry *entry =
+		container_of(work, struct ib_sa_path_cache_entry, resend_work);
+	struct ib_sa_port *port = entry->port;
+	struct ib_sa_path_query *query;
+	struct ib_sa_mad *mad;
+	bool closed;
+	int ret;
+
+	spin_lock_irq(&port->path_cache_lock);
+	closed = port->path_cache_closed;
+	spin_unlock_irq(&port->path_cache_lock);
+	if (closed) {
+		ret = -ENODEV;
+		goto err;
+	}
+
+	query = kzalloc(sizeof(*query), GFP_KERNEL);
+	if (!query) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	query->sa_query.port = port;
+	query->callback = ib_sa_path_cache_resend_done;
+	ib_sa_path_cache_key_rec(&query->cache_rec, &entry->key);
+
+	ret = alloc_mad(&query->sa_query, GFP_KERNEL);
+	if (ret)
+		goto err_free;
+
+	mad = query->sa_query.mad_buf->mad;
+	init_mad(&query->sa_query, port->agent);
+
+	query->sa_query.callback = ib_sa_path_rec_callback;
+	query->sa_query.release  = ib_sa_path_rec_release;
+	mad->mad_hdr.method	 = IB_MGMT_METHOD_GET;
+	mad->mad_hdr.attr_id	 = cpu_to_be16(IB_SA_ATTR_PATH_REC);
+	mad->sa_hdr.comp_mask	 = entry->key.comp_mask;
+	ib_pack(path_rec_table, ARRAY_SIZE(path_rec_table),
+		&query->cache_rec, mad->data);
+
+	query->sa_query.flags |= IB_SA_ENABLE_LOCAL_SERVICE;
+	query->sa_query.mad_buf->context[1] = &query->cache_rec;
+
+	/* the entry may be gone as soon as the query is sent */
+	query->cache_entry = entry;
+	ret = send_mad(&query->sa_query, entry->timeout_ms, entry->retries,
+		       GFP_KERNEL);
+	if (ret >= 0)
+		return;
+
+	query->cache_entry = NULL;
+	free_mad(&query->sa_query);
+err_free:
+	kfree(query);
+err:
+	__ib_sa_path_cache_complete(port, entry, ret, NULL);
+}
+
 /**
  * ib_sa_path_rec_get - Start a Path get query
  * @client:SA client
@@ -1591,6 +2086,17 @@ int ib_sa_path_rec_get(struct ib_sa_client *client,
 		return -ENOMEM;
 
 	query->sa_query.port     = port;
+	query->sa_query.client   = client;
+	query->callback          = callback;
+	query->context           = context;
+
+	if (ib_sa_path_cacheable(rec, comp_mask, callback)) {
+		ret = ib_sa_path_cache_lookup(query, rec, comp_mask, timeout_ms,
+					      retries, gfp_mask, sa_query);
+		if (ret >= 0)
+			return ret;
+	}
+
 	if (rec->rec_type == SA_PATH_REC_TYPE_OPA) {
 		status = opa_pr_query_possible(client, sa_dev, device, port_num,
 					       rec);
@@ -1614,9 +2120,6 @@ int ib_sa_path_rec_get(struct ib_sa_client *client,
 		goto err2;
 
 	ib_sa_client_get(client);
-	query->sa_query.client = client;
-	query->callback        = callback;
-	query->context         = context;
 
 	mad = query->sa_query.mad_buf->mad;
 	init_mad(&query->sa_query, agent);
@@ -1656,6 +2159,7 @@ err3:
 	ib_sa_client_put(query->sa_query.client);
 	free_mad(&query->sa_query);
 err2:
+	ib_sa_path_cache_complete(query, ret, NULL);
 	kfree(query->conv_pr);
 err1:
 	kfree(query);
@@ -2322,6 +2826,8 @@ static void ib_sa_event(struct ib_event_handler *handler,
 		if (!rdma_cap_ib_sa(handler->device, port->port_num))
 			return;
 
+		ib_sa_path_cache_flush(port);
+
 		spin_lock_irqsave(&port->ah_lock, flags);
 		if (port->sm_ah)
 			kref_put(&port->sm_ah->ref, free_sm_ah);
@@ -2374,6 +2880,9 @@ static int ib_sa_add_one(struct ib_device *device)
 		spin_lock_init(&sa_dev->port[i].classport_lock);
 		sa_dev->port[i].classport_info.valid = false;
 
+		spin_lock_init(&sa_dev->port[i].path_cache_lock);
+		hash_init(sa_dev->port[i].path_cache);
+
 		sa_dev->port[i].agent =
 			ib_register_mad_agent(device, i + s, IB_QPT_GSI,
 					      NULL, 0, send_handler,
@@ -2430,6 +2939,15 @@ static void ib_sa_remove_one(struct ib_device *device, void *client_data)
 	int i;
 
 	ib_unregister_event_handler(&sa_dev->event_handler);
+
+	/* no more lookups are sent again once the MAD agents are gone */
+	for (i = 0; i <= sa_dev->end_port - sa_dev->start_port; ++i) {
+		if (!rdma_cap_ib_sa(device, i + 1))
+			continue;
+		spin_lock_irq(&sa_dev->port[i].path_cache_lock);
+		sa_dev->port[i].path_cache_closed = true;
+		spin_unlock_irq(&sa_dev->port[i].path_cache_lock);
+	}
 	flush_workqueue(ib_wq);
 
 	for (i = 0; i <= sa_dev->end_port - sa_dev->start_port; ++i) {
@@ -2438,10 +2956,14 @@ static void ib_sa_remove_one(struct ib_device *device, void *client_data)
 			ib_unregister_mad_agent(sa_dev->port[i].agent);
 			if (sa_dev->port[i].sm_ah)
 				kref_put(&sa_dev->port[i].sm_ah->ref, free_sm_ah);
+			ib_sa_path_cache_flush(&sa_dev->port[i]);
 		}
 
 	}
 
+	/* waiters completed by the flushed MAD agents */
+	flush_workqueue(ib_wq);
+
 	kfree(sa_dev);
 }
 
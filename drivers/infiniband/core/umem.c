@@ -43,12 +43,31 @@
 #endif
 #include <linux/slab.h>
 #include <linux/pagemap.h>
+#ifdef HAVE_MMU_INTERVAL_NOTIFIER
+#include <linux/hashtable.h>
+#include <linux/moduleparam.h>
+#include <linux/wait_bit.h>
+#endif
 #ifdef CONFIG_INFINIBAND_ON_DEMAND_PAGING
 #include <rdma/ib_umem_odp.h>
 #endif
 
 #include "uverbs.h"
 #include "ib_peer_mem.h"
+#include "core_priv.h"
+
+/*
+ * Pages are pinned in batches of up to 2^IB_UMEM_PAGE_LIST_ORDER pages worth
+ * of page pointers, so that large and huge page backed regions need fewer
+ * GUP calls and contiguous runs are folded into long SG entries before
+ * ib_umem_find_best_pgsz() looks at them.
+ */
+#if !defined(HAVE_FOLL_LONGTERM) && !defined(HAVE_GET_USER_PAGES_LONGTERM)
+/* vma_list is indexed in step with page_list and is a single page */
+#define IB_UMEM_PAGE_LIST_ORDER	0
+#else
+#define IB_UMEM_PAGE_LIST_ORDER	3
+#endif
 
 static void __ib_umem_release(struct ib_device *dev, struct ib_umem *umem, int dirty)
 {
@@ -202,6 +221,280 @@ unsigned long ib_umem_find_best_pgsz(struct ib_umem *umem,
 }
 EXPORT_SYMBOL(ib_umem_find_best_pgsz);
 
+#ifdef HAVE_MMU_INTERVAL_NOTIFIER
+/*
+ * Registration cache
+ *
+ * Applications such as MPI libraries register and deregister the same
+ * buffers over and over.  When enabled, a released umem stays pinned and
+ * DMA mapped on an LRU, and a later ib_umem_get() of the same device, mm,
+ * range and access flags gets it back without pinning or mapping again.
+ * Every cacheable umem carries an interval notifier on its range; any
+ * invalidation of the range makes it stale, so the cache never hands out
+ * pages that no longer back the user mapping.
+ */
+static const struct kernel_param_ops umem_cache_pages_ops;
+
+static unsigned int umem_cache_pages;
+module_param_cb(umem_cache_pages, &umem_cache_pages_ops, &umem_cache_pages,
+		0644);
+MODULE_PARM_DESC(umem_cache_pages,
+		 "Max pages of released user memory kept pinned for re-registration, 0 disables the cache (default 0)");
+
+enum {
+	IB_UMEM_CACHE_NONE,	/* not cacheable */
+	IB_UMEM_CACHE_PINNING,	/* notifier armed, pages being pinned */
+	IB_UMEM_CACHE_ACTIVE,	/* owned by a user */
+	IB_UMEM_CACHE_PARKED,	/* released, on the cache LRU */
+	IB_UMEM_CACHE_STALE,	/* range invalidated, never reused */
+};
+
+#define IB_UMEM_CACHE_HASH_BITS	8
+
+static DEFINE_SPINLOCK(ib_umem_cache_lock);
+static DEFINE_HASHTABLE(ib_umem_cache_hash, IB_UMEM_CACHE_HASH_BITS);
+static LIST_HEAD(ib_umem_cache_lru);
+static unsigned long ib_umem_cache_npages;
+/* releases queued on ib_wq by invalidations and not yet done */
+static atomic_t ib_umem_cache_releasing = ATOMIC_INIT(0);
+
+static void ib_umem_do_release(struct ib_umem *umem);
+
+static unsigned long ib_umem_cache_key(struct mm_struct *mm,
+				       unsigned long addr, size_t size)
+{
+	return (unsigned long)mm ^ addr ^ size;
+}
+
+/* Take a parked umem off the cache, with ib_umem_cache_lock held */
+static void ib_umem_cache_unlink(struct ib_umem *umem)
+{
+	hash_del(&umem->cache_node);
+	list_del(&umem->cache_lru);
+	ib_umem_cache_npages -= ib_umem_num_pages(umem);
+}
+
+static void ib_umem_cache_dispose(struct list_head *list)
+{
+	struct ib_umem *umem, *tmp;
+
+	list_for_each_entry_safe(umem, tmp, list, cache_lru) {
+		list_del(&umem->cache_lru);
+		ib_umem_do_release(umem);
+	}
+}
+
+static void ib_umem_cache_release_work(struct work_struct *work)
+{
+	ib_umem_do_release(container_of(work, struct ib_umem, work));
+	if (atomic_dec_and_test(&ib_umem_cache_releasing))
+		wake_up_var(&ib_umem_cache_releasing);
+}
+
+static bool ib_umem_cache_invalidate(struct mmu_interval_notifier *mni,
+				     const struct mmu_notifier_range *range,
+				     unsigned long cur_seq)
+{
+	struct ib_umem *umem =
+		container_of(mni, struct ib_umem, cache_notifier);
+	bool parked;
+
+	spin_lock(&ib_umem_cache_lock);
+	mmu_interval_set_seq(mni, cur_seq);
+	parked = umem->cache_state == IB_UMEM_CACHE_PARKED;
+	if (parked)
+		ib_umem_cache_unlink(umem);
+	umem->cache_state = IB_UMEM_CACHE_STALE;
+	spin_unlock(&ib_umem_cache_lock);
+
+	/* Unpinning may sleep and the notifier can't be removed from here */
+	if (parked) {
+		atomic_inc(&ib_umem_cache_releasing);
+		queue_work(ib_wq, &umem->work);
+	}
+	return true;
+}
+
+static const struct mmu_interval_notifier_ops ib_umem_cache_ops = {
+	.invalidate = ib_umem_cache_invalidate,
+};
+
+static struct ib_umem *ib_umem_cache_get(struct ib_device *device,
+					 struct mm_struct *mm,
+					 unsigned long addr, size_t size,
+					 int access)
+{
+	struct ib_umem *umem;
+
+	spin_lock(&ib_umem_cache_lock);
+	hash_for_each_possible(ib_umem_cache_hash, umem, cache_node,
+			       ib_umem_cache_key(mm, addr, size)) {
+		if (umem->ibdev != device || umem->owning_mm != mm ||
+		    umem->address != addr || umem->length != size ||
+		    umem->cache_access != access)
+			continue;
+		ib_umem_cache_unlink(umem);
+		umem->cache_state = IB_UMEM_CACHE_ACTIVE;
+		spin_unlock(&ib_umem_cache_lock);
+		return umem;
+	}
+	spin_unlock(&ib_umem_cache_lock);
+	return NULL;
+}
+
+/*
+ * Arm the notifier of a umem about to be pinned and return the sequence
+ * ib_umem_cache_track() checks once the pages are pinned, so changes of
+ * the mapping while pinning are caught.  Failures only disable caching.
+ */
+static unsigned long ib_umem_cache_begin(struct ib_umem *umem, int access)
+{
+	INIT_WORK(&umem->work, ib_umem_cache_release_work);
+	umem->cache_access = access;
+	if (mmu_interval_notifier_insert(&umem->cache_notifier,
+					 umem->owning_mm,
+					 ALIGN_DOWN(umem->address, PAGE_SIZE),
+					 ib_umem_num_pages(umem) << PAGE_SHIFT,
+					 &ib_umem_cache_ops))
+		return 0;
+	umem->cache_state = IB_UMEM_CACHE_PINNING;
+	return mmu_interval_read_begin(&umem->cache_notifier);
+}
+
+/* Make a pinned umem cacheable unless its range changed meanwhile */
+static void ib_umem_cache_track(struct ib_umem *umem, unsigned long seq)
+{
+	if (umem->cache_state == IB_UMEM_CACHE_NONE)
+		return;
+
+	spin_lock(&ib_umem_cache_lock);
+	if (umem->cache_state == IB_UMEM_CACHE_PINNING)
+		umem->cache_state =
+			mmu_interval_read_retry(&umem->cache_notifier, seq) ?
+			IB_UMEM_CACHE_STALE : IB_UMEM_CACHE_ACTIVE;
+	spin_unlock(&ib_umem_cache_lock);
+}
+
+/* Disarm the notifier of a umem whose pinning failed */
+static void ib_umem_cache_untrack(struct ib_umem *umem)
+{
+	if (umem->cache_state == IB_UMEM_CACHE_NONE)
+		return;
+	mmu_interval_notifier_remove(&umem->cache_notifier);
+	umem->cache_state = IB_UMEM_CACHE_NONE;
+}
+
+/* Park a released umem, returns false if it must be released now */
+static bool ib_umem_cache_put(struct ib_umem *umem)
+{
+	unsigned long limit = READ_ONCE(umem_cache_pages);
+	unsigned long npages = ib_umem_num_pages(umem);
+	struct ib_umem *victim, *tmp;
+	LIST_HEAD(dispose);
+
+	if (npages > limit)
+		return false;
+
+	spin_lock(&ib_umem_cache_lock);
+	if (umem->cache_state != IB_UMEM_CACHE_ACTIVE) {
+		spin_unlock(&ib_umem_cache_lock);
+		return false;
+	}
+	list_for_each_entry_safe(victim, tmp, &ib_umem_cache_lru, cache_lru) {
+		if (ib_umem_cache_npages + npages <= limit)
+			break;
+		ib_umem_cache_unlink(victim);
+		victim->cache_state = IB_UMEM_CACHE_STALE;
+		list_add_tail(&victim->cache_lru, &dispose);
+	}
+	hash_add(ib_umem_cache_hash, &umem->cache_node,
+		 ib_umem_cache_key(umem->owning_mm, umem->address,
+				   umem->length));
+	list_add_tail(&umem->cache_lru, &ib_umem_cache_lru);
+	ib_umem_cache_npages += npages;
+	umem->cache_state = IB_UMEM_CACHE_PARKED;
+	spin_unlock(&ib_umem_cache_lock);
+
+	ib_umem_cache_dispose(&dispose);
+	return true;
+}
+
+/* Release the parked umems matching @device or @mm, returns the count */
+static unsigned int ib_umem_cache_flush(struct ib_device *device,
+					struct mm_struct *mm)
+{
+	struct ib_umem *umem, *tmp;
+	unsigned int count = 0;
+	LIST_HEAD(dispose);
+
+	spin_lock(&ib_umem_cache_lock);
+	list_for_each_entry_safe(umem, tmp, &ib_umem_cache_lru, cache_lru) {
+		if ((device && umem->ibdev != device) ||
+		    (mm && umem->owning_mm != mm))
+			continue;
+		ib_umem_cache_unlink(umem);
+		umem->cache_state = IB_UMEM_CACHE_STALE;
+		list_add_tail(&umem->cache_lru, &dispose);
+		count++;
+	}
+	spin_unlock(&ib_umem_cache_lock);
+
+	ib_umem_cache_dispose(&dispose);
+	return count;
+}
+
+/* Release the least recently parked umems until at most @limit pages stay */
+static void ib_umem_cache_trim(unsigned long limit)
+{
+	struct ib_umem *umem, *tmp;
+	LIST_HEAD(dispose);
+
+	spin_lock(&ib_umem_cache_lock);
+	list_for_each_entry_safe(umem, tmp, &ib_umem_cache_lru, cache_lru) {
+		if (ib_umem_cache_npages <= limit)
+			break;
+		ib_umem_cache_unlink(umem);
+		umem->cache_state = IB_UMEM_CACHE_STALE;
+		list_add_tail(&umem->cache_lru, &dispose);
+	}
+	spin_unlock(&ib_umem_cache_lock);
+
+	ib_umem_cache_dispose(&dispose);
+}
+
+static int umem_cache_pages_set(const char *val, const struct kernel_param *kp)
+{
+	int ret;
+
+	ret = param_set_uint(val, kp);
+	if (ret)
+		return ret;
+	/* a lower limit, or disabling the cache, drops what no longer fits */
+	ib_umem_cache_trim(READ_ONCE(umem_cache_pages));
+	return 0;
+}
+
+static const struct kernel_param_ops umem_cache_pages_ops = {
+	.set = umem_cache_pages_set,
+	.get = param_get_uint,
+};
+
+/**
+ * ib_umem_cache_flush_device - drop the cached umems of a device
+ * @device: device being unregistered
+ *
+ * Called once all users of @device are gone, while its DMA device can
+ * still be used to unmap the cached regions.
+ */
+void ib_umem_cache_flush_device(struct ib_device *device)
+{
+	ib_umem_cache_flush(device, NULL);
+	/* Releases already queued by invalidations, not all of ib_wq */
+	wait_var_event(&ib_umem_cache_releasing,
+		       !atomic_read(&ib_umem_cache_releasing));
+}
+#endif /* HAVE_MMU_INTERVAL_NOTIFIER */
+
 /**
  * __ib_umem_get - Pin and DMA map userspace memory.
  *
@@ -230,8 +523,13 @@ struct ib_umem *__ib_umem_get(struct ib_udata *udata,
 #endif
 	unsigned long cur_base;
 	unsigned long dma_attr = 0;
+#ifdef HAVE_MMU_INTERVAL_NOTIFIER
+	unsigned long cache_seq = 0;
+#endif
 	struct mm_struct *mm;
 	unsigned long npages;
+	unsigned long list_len;
+	unsigned int list_order;
 	int ret;
 	struct scatterlist *sg = NULL;
 #ifdef HAVE_GET_USER_PAGES_GUP_FLAGS
@@ -288,6 +586,15 @@ struct ib_umem *__ib_umem_get(struct ib_udata *udata,
 	if (access & IB_ACCESS_ON_DEMAND)
 		return ERR_PTR(-EOPNOTSUPP);
 
+#ifdef HAVE_MMU_INTERVAL_NOTIFIER
+	if (READ_ONCE(umem_cache_pages)) {
+		umem = ib_umem_cache_get(device, current->mm, addr, size,
+					 access);
+		if (umem)
+			return umem;
+	}
+#endif
+
 	umem = kzalloc(sizeof(*umem), GFP_KERNEL);
 	if (!umem)
 		return ERR_PTR(-ENOMEM);
@@ -310,11 +617,20 @@ struct ib_umem *__ib_umem_get(struct ib_udata *udata,
 	/* We assume the memory is from hugetlb until proved otherwise */
 	umem->hugetlb   = 1;
 #endif
-	page_list = (struct page **) __get_free_page(GFP_KERNEL);
+	npages = ib_umem_num_pages(umem);
+	list_order = min_t(unsigned int, IB_UMEM_PAGE_LIST_ORDER,
+			   get_order(npages * sizeof(struct page *)));
+	page_list = (struct page **) __get_free_pages(GFP_KERNEL | __GFP_NOWARN,
+						     list_order);
+	if (!page_list && list_order) {
+		list_order = 0;
+		page_list = (struct page **) __get_free_page(GFP_KERNEL);
+	}
 	if (!page_list) {
 		ret = -ENOMEM;
 		goto umem_kfree;
 	}
+	list_len = (PAGE_SIZE << list_order) / sizeof(struct page *);
 
 #if !defined(HAVE_FOLL_LONGTERM) && !defined(HAVE_GET_USER_PAGES_LONGTERM)
 	/*
@@ -325,7 +641,6 @@ struct ib_umem *__ib_umem_get(struct ib_udata *udata,
 	if (!vma_list)
 		umem->hugetlb = 0;
 #endif
-	npages = ib_umem_num_pages(umem);
 	if (npages == 0 || npages > UINT_MAX) {
 		ret = -EINVAL;
 		goto out;
@@ -333,6 +648,9 @@ struct ib_umem *__ib_umem_get(struct ib_udata *udata,
 
 	lock_limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
 
+#if defined(HAVE_MMU_INTERVAL_NOTIFIER) && defined(HAVE_ATOMIC_PINNED_VM)
+account:
+#endif
 #ifdef HAVE_ATOMIC_PINNED_VM
 	new_pinned = atomic64_add_return(npages, &mm->pinned_vm);
 	if (new_pinned > lock_limit && !capable(CAP_IPC_LOCK)) {
@@ -349,6 +667,11 @@ struct ib_umem *__ib_umem_get(struct ib_udata *udata,
 
 #ifdef HAVE_ATOMIC_PINNED_VM
 		atomic64_sub(npages, &mm->pinned_vm);
+#ifdef HAVE_MMU_INTERVAL_NOTIFIER
+		/* Cached registrations of this mm count against the limit */
+		if (ib_umem_cache_flush(NULL, mm))
+			goto account;
+#endif
 #else
 		up_write(&mm->mmap_sem);
 #ifndef HAVE_PINNED_VM
@@ -381,13 +704,17 @@ struct ib_umem *__ib_umem_get(struct ib_udata *udata,
 	sg = umem->sg_head.sgl;
 #endif
 
+#ifdef HAVE_MMU_INTERVAL_NOTIFIER
+	/* registrations that could never be parked are not tracked */
+	if (npages <= READ_ONCE(umem_cache_pages))
+		cache_seq = ib_umem_cache_begin(umem, access);
+#endif
 	while (npages) {
 		cond_resched();
 #ifdef HAVE_UNPIN_USER_PAGES_DIRTY_LOCK_EXPORTED
 		ret = pin_user_pages_fast(cur_base,
 					  min_t(unsigned long, npages,
-						PAGE_SIZE /
-						sizeof(struct page *)),
+						list_len),
 					  gup_flags | FOLL_LONGTERM, page_list);
 		if (ret < 0)
 			goto umem_release;
@@ -396,18 +723,18 @@ struct ib_umem *__ib_umem_get(struct ib_udata *udata,
 #ifdef HAVE_FOLL_LONGTERM
 		ret = get_user_pages(cur_base,
 				     min_t(unsigned long, npages,
-					   PAGE_SIZE / sizeof (struct page *)),
+					   list_len),
 				     gup_flags | FOLL_LONGTERM,
 				     page_list, NULL);
 #elif defined(HAVE_GET_USER_PAGES_LONGTERM)
 		ret = get_user_pages_longterm(cur_base,
 			min_t(unsigned long, npages,
-			PAGE_SIZE / sizeof (struct page *)),
+			list_len),
 			gup_flags, page_list, NULL);
 #elif defined(HAVE_GET_USER_PAGES_8_PARAMS)
 		ret = get_user_pages(current, current->mm, cur_base,
 				     min_t(unsigned long, npages,
-					   PAGE_SIZE / sizeof (struct page *)),
+					   list_len),
 				     1, !umem->writable, page_list, vma_list);
 #else
 #ifdef HAVE_GET_USER_PAGES_7_PARAMS
@@ -416,7 +743,7 @@ struct ib_umem *__ib_umem_get(struct ib_udata *udata,
 		ret = get_user_pages(cur_base,
 #endif
 				min_t(unsigned long, npages,
-					PAGE_SIZE / sizeof (struct page *)),
+					list_len),
 #ifdef HAVE_GET_USER_PAGES_GUP_FLAGS
 				gup_flags, page_list, vma_list);
 #else
@@ -428,12 +755,12 @@ struct ib_umem *__ib_umem_get(struct ib_udata *udata,
 #ifdef HAVE_GET_USER_PAGES_GUP_FLAGS
 			pr_debug("%s: failed to get user pages, nr_pages=%lu, flags=%u\n", __func__,
 			       min_t(unsigned long, npages,
-				     PAGE_SIZE / sizeof(struct page *)),
+				     list_len),
 			       gup_flags);
 #else
 			pr_debug("%s: failed to get user pages, nr_pages=%lu\n", __func__,
 			       min_t(unsigned long, npages,
-				     PAGE_SIZE / sizeof(struct page *)));
+				     list_len));
 #endif
 #ifndef HAVE_UNPIN_USER_PAGES_DIRTY_LOCK_EXPORTED
 			up_read(&mm->mmap_sem);
@@ -528,11 +855,15 @@ struct ib_umem *__ib_umem_get(struct ib_udata *udata,
 		goto umem_release;
 	}
 
+#ifdef HAVE_MMU_INTERVAL_NOTIFIER
+	ib_umem_cache_track(umem, cache_seq);
+#endif
 	ret = 0;
 	goto out;
 
 umem_release:
 #ifdef HAVE_MMU_INTERVAL_NOTIFIER
+	ib_umem_cache_untrack(umem);
 	__ib_umem_release(device, umem, 0);
 #else
 	__ib_umem_release(context->device, umem, 0);
@@ -573,7 +904,7 @@ out:
 	if (vma_list)
 		free_page((unsigned long) vma_list);
 #endif
-	free_page((unsigned long) page_list);
+	free_pages((unsigned long) page_list, list_order);
 umem_kfree:
 	if (ret) {
 		mmdrop(umem->owning_mm);
@@ -615,21 +946,12 @@ struct ib_umem *ib_umem_get_peer(struct ib_udata *udata, unsigned long addr,
 }
 EXPORT_SYMBOL(ib_umem_get_peer);
 
-/**
- * ib_umem_release - release memory pinned with ib_umem_get
- * @umem: umem struct to release
- */
-void ib_umem_release(struct ib_umem *umem)
+static void ib_umem_do_release(struct ib_umem *umem)
 {
-	if (!umem)
-		return;
-#ifdef CONFIG_INFINIBAND_ON_DEMAND_PAGING
-	if (umem->is_odp)
-		return ib_umem_odp_release(to_ib_umem_odp(umem));
+#ifdef HAVE_MMU_INTERVAL_NOTIFIER
+	if (umem->cache_state != IB_UMEM_CACHE_NONE)
+		mmu_interval_notifier_remove(&umem->cache_notifier);
 #endif
-
-	if (umem->is_peer)
-		return ib_peer_umem_release(umem);
 #ifdef HAVE_MMU_NOTIFIER_OPS_HAS_FREE_NOTIFIER
 	__ib_umem_release(umem->ibdev, umem, 1);
 #else
@@ -650,6 +972,29 @@ void ib_umem_release(struct ib_umem *umem)
 	mmdrop(umem->owning_mm);
 	kfree(umem);
 }
+
+/**
+ * ib_umem_release - release memory pinned with ib_umem_get
+ * @umem: umem struct to release
+ */
+void ib_umem_release(struct ib_umem *umem)
+{
+	if (!umem)
+		return;
+#ifdef CONFIG_INFINIBAND_ON_DEMAND_PAGING
+	if (umem->is_odp)
+		return ib_umem_odp_release(to_ib_umem_odp(umem));
+#endif
+
+	if (umem->is_peer)
+		return ib_peer_umem_release(umem);
+#ifdef HAVE_MMU_INTERVAL_NOTIFIER
+	if (umem->cache_state == IB_UMEM_CACHE_ACTIVE &&
+	    ib_umem_cache_put(umem))
+		return;
+#endif
+	ib_umem_do_release(umem);
+}
 EXPORT_SYMBOL(ib_umem_release);
 
 int ib_umem_page_count(struct ib_umem *umem)
@@ -41,6 +41,7 @@
 #include <linux/hugetlb.h>
 #include <linux/interval_tree.h>
 #include <linux/pagemap.h>
+#include <linux/moduleparam.h>
 
 #include <rdma/ib_verbs.h>
 #include <rdma/ib_umem.h>
@@ -48,6 +49,13 @@
 
 #include "uverbs.h"
 
+static unsigned int odp_prefetch_max_pages = 512;
+module_param(odp_prefetch_max_pages, uint, 0644);
+MODULE_PARM_DESC(odp_prefetch_max_pages,
+		 "Max PAGE_SIZE pages an ODP fault maps ahead of a forward access stream, 0 disables prefetch (default 512)");
+
+#define IB_ODP_PREFETCH_MIN_PAGES	16
+
 #if defined(HAVE_INTERVAL_TREE_TAKES_RB_ROOT)
 #ifdef HAVE_RB_ROOT_CACHED
 #undef HAVE_RB_ROOT_CACHED
@@ -1047,6 +1055,47 @@ out:
 	return ret;
 }
 
+/*
+ * Return how many bytes from @user_virt a fault for @bcnt bytes should map.
+ *
+ * A fault that lands at, or within one stride past, the end of what the
+ * previous fault mapped is taken as a forward stream (sequential or with a
+ * constant stride) and is extended by a window that doubles on each hit, up
+ * to odp_prefetch_max_pages.  Anything else resets the window, so random
+ * access patterns map only what they touch.
+ *
+ * The window is counted in PAGE_SIZE pages rather than umem pages, so a
+ * hugetlb backed umem prefetches no more memory than any other umem.
+ */
+static u64 ib_umem_odp_fault_len(struct ib_umem_odp *umem_odp, u64 user_virt,
+				 u64 bcnt)
+{
+	unsigned int max_pages = READ_ONCE(odp_prefetch_max_pages);
+	u64 last = READ_ONCE(umem_odp->fault_last_va);
+	u64 next = READ_ONCE(umem_odp->fault_next_va);
+	u64 stride = READ_ONCE(umem_odp->fault_stride);
+	u64 end = user_virt + bcnt;
+	unsigned int window = 0;
+
+	if (max_pages && !umem_odp->is_implicit_odp && user_virt > last &&
+	    user_virt <= next + stride) {
+		window = max_t(unsigned int,
+			       READ_ONCE(umem_odp->prefetch_pages) * 2,
+			       IB_ODP_PREFETCH_MIN_PAGES);
+		window = max_t(u64, window, (user_virt - last) >> PAGE_SHIFT);
+		window = min(window, max_pages);
+		end = min_t(u64, end + ((u64)window << PAGE_SHIFT),
+			    ib_umem_end(umem_odp));
+	}
+
+	WRITE_ONCE(umem_odp->fault_stride,
+		   user_virt > last ? user_virt - last : 0);
+	WRITE_ONCE(umem_odp->fault_last_va, user_virt);
+	WRITE_ONCE(umem_odp->fault_next_va, end);
+	WRITE_ONCE(umem_odp->prefetch_pages, window);
+	return end - user_virt;
+}
+
 /**
  * ib_umem_odp_map_dma_pages - Pin and DMA map userspace memory in an ODP MR.
  *
@@ -1063,9 +1112,9 @@ out:
  * @umem_odp: the umem to map and pin
  * @user_virt: the address from which we need to map.
  * @bcnt: the minimal number of bytes to pin and map. The mapping might be
- *        bigger due to alignment, and may also be smaller in case of an error
- *        pinning or mapping a page. The actual pages mapped is returned in
- *        the return value.
+ *        bigger due to alignment or prefetch of a forward access stream, and
+ *        may also be smaller in case of an error pinning or mapping a page.
+ *        The actual pages mapped is returned in the return value.
  * @access_mask: bit mask of the requested access permissions for the given
  *               range.
  * @current_seq: the MMU notifiers sequance value for synchronization with
@@ -1079,7 +1128,7 @@ int ib_umem_odp_map_dma_pages(struct ib_umem_odp *umem_odp, u64 user_virt,
 	struct task_struct *owning_process  = NULL;
 	struct mm_struct *owning_mm = umem_odp->umem.owning_mm;
 	struct page       **local_page_list = NULL;
-	u64 page_mask, off;
+	u64 page_mask, off, req_end;
 	int j, k, ret = 0, start_idx, npages = 0;
 	unsigned int flags = 0, page_shift;
 	phys_addr_t p = 0;
@@ -1091,6 +1140,9 @@ int ib_umem_odp_map_dma_pages(struct ib_umem_odp *umem_odp, u64 user_virt,
 	    user_virt + bcnt > ib_umem_end(umem_odp))
 		return -EFAULT;
 
+	req_end = user_virt + bcnt;
+	bcnt = ib_umem_odp_fault_len(umem_odp, user_virt, bcnt);
+
 	local_page_list = (struct page **)__get_free_page(GFP_KERNEL);
 	if (!local_page_list)
 		return -ENOMEM;
@@ -1245,6 +1297,16 @@ int ib_umem_odp_map_dma_pages(struct ib_umem_odp *umem_odp, u64 user_virt,
 		else
 			ret = k - start_idx;
 	}
+	if (ret > 0) {
+		u64 req_pages = (ALIGN(req_end, BIT(page_shift)) -
+				 ib_umem_start(umem_odp)) >> page_shift;
+
+		atomic64_inc(&umem_odp->stats.faults);
+		atomic64_add(ret, &umem_odp->stats.fault_pages);
+		if ((u64)k > req_pages)
+			atomic64_add(k - req_pages,
+				     &umem_odp->stats.prefetch_pages);
+	}
 
 	mmput(owning_mm);
 out_put_task:
@@ -1258,7 +1320,7 @@ EXPORT_SYMBOL(ib_umem_odp_map_dma_pages);
 void ib_umem_odp_unmap_dma_pages(struct ib_umem_odp *umem_odp, u64 virt,
 				 u64 bound)
 {
-	int idx;
+	int idx, unmapped = 0;
 	u64 addr;
 #ifdef HAVE_MMU_NOTIFIER_OPS_HAS_FREE_NOTIFIER
 	struct ib_device *dev = umem_odp->umem.ibdev;
@@ -1268,6 +1330,7 @@ void ib_umem_odp_unmap_dma_pages(struct ib_umem_odp *umem_odp, u64 virt,
 
 	lockdep_assert_held(&umem_odp->umem_mutex);
 
+	atomic64_inc(&umem_odp->stats.invalidations);
 	virt = max_t(u64, virt, ib_umem_start(umem_odp));
 	bound = min_t(u64, bound, ib_umem_end(umem_odp));
 	/* Note that during the run of this function, the
@@ -1276,6 +1339,9 @@ void ib_umem_odp_unmap_dma_pages(struct ib_umem_odp *umem_odp, u64 virt,
 	 * invalidations, so we must make sure we free each page only
 	 * once. */
 	for (addr = virt; addr < bound; addr += BIT(umem_odp->page_shift)) {
+		/* Nothing left to unmap, skip the rest of the range */
+		if (!umem_odp->npages)
+			break;
 		idx = (addr - ib_umem_start(umem_odp)) >> umem_odp->page_shift;
 		if (umem_odp->page_list[idx]) {
 			struct page *page = umem_odp->page_list[idx];
@@ -1303,8 +1369,10 @@ void ib_umem_odp_unmap_dma_pages(struct ib_umem_odp *umem_odp, u64 virt,
 			umem_odp->page_list[idx] = NULL;
 			umem_odp->dma_list[idx] = 0;
 			umem_odp->npages--;
+			unmapped++;
 		}
 	}
+	atomic64_add(unmapped, &umem_odp->stats.invalidated_pages);
 }
 EXPORT_SYMBOL(ib_umem_odp_unmap_dma_pages);
 
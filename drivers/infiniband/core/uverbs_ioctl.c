@@ -543,13 +543,32 @@ static void bundle_destroy(struct bundle_priv *pbundle, bool commit)
 	}
 }
 
+/*
+ * State kept across the entries of a RDMA_VERBS_BATCH_IOCTL: the method
+ * lookup of the previous entry and one bundle buffer for methods that do not
+ * fit on the stack.
+ */
+struct bundle_batch {
+	void __rcu **slot;
+	unsigned long method_key;
+	unsigned long slots_len;
+	u32 key;
+	struct bundle_priv *pbundle;
+};
+
+#define UVERBS_BATCH_MAX_ENTRIES	256
+
 static int ib_uverbs_cmd_verbs(struct ib_uverbs_file *ufile,
 			       struct ib_uverbs_ioctl_hdr *hdr,
-			       struct ib_uverbs_attr __user *user_attrs)
+			       struct ib_uverbs_attr __user *user_attrs,
+			       struct bundle_batch *batch)
 {
 	const struct uverbs_api_ioctl_method *method_elm;
 	struct uverbs_api *uapi = ufile->device->uapi;
+	u32 key = uapi_key_obj(hdr->object_id) |
+		  uapi_key_ioctl_method(hdr->method_id);
 	struct radix_tree_iter attrs_iter;
+	unsigned long method_key, slots_len;
 	struct bundle_priv *pbundle;
 	struct bundle_priv onstack;
 	void __rcu **slot;
@@ -557,21 +576,49 @@ static int ib_uverbs_cmd_verbs(struct ib_uverbs_file *ufile,
 
 	if (unlikely(hdr->driver_id != uapi->driver_id))
 		return -EINVAL;
+
+	if (batch && batch->slot && batch->key == key) {
+		slot = batch->slot;
+		method_key = batch->method_key;
+		slots_len = batch->slots_len;
+	} else {
 #ifdef HAVE_RADIX_TREE_ITER_LOOKUP
-	slot = radix_tree_iter_lookup(
-		&uapi->radix, &attrs_iter,
-		uapi_key_obj(hdr->object_id) |
-			uapi_key_ioctl_method(hdr->method_id));
+		slot = radix_tree_iter_lookup(&uapi->radix, &attrs_iter, key);
 #else
-	radix_tree_iter_init(&attrs_iter,  uapi_key_obj(hdr->object_id) |
-					uapi_key_ioctl_method(hdr->method_id));
-	slot = radix_tree_next_chunk(&uapi->radix, &attrs_iter, RADIX_TREE_ITER_CONTIG);
+		radix_tree_iter_init(&attrs_iter, key);
+		slot = radix_tree_next_chunk(&uapi->radix, &attrs_iter,
+					     RADIX_TREE_ITER_CONTIG);
 #endif
-	if (unlikely(!slot))
-		return -EPROTONOSUPPORT;
+		if (unlikely(!slot))
+			return -EPROTONOSUPPORT;
+		method_key = attrs_iter.index;
+		slots_len = radix_tree_chunk_size(&attrs_iter);
+		if (batch) {
+			batch->slot = slot;
+			batch->key = key;
+			batch->method_key = method_key;
+			batch->slots_len = slots_len;
+		}
+	}
 	method_elm = rcu_dereference_protected(*slot, true);
 
-	if (!method_elm->use_stack) {
+	if (method_elm->use_stack) {
+		pbundle = &onstack;
+		pbundle->internal_avail = sizeof(pbundle->internal_buffer);
+		pbundle->allocated_mem = NULL;
+	} else if (batch && method_elm->bundle_size <= PAGE_SIZE) {
+		/* reused by the next entry, so keep it off allocated_mem */
+		if (!batch->pbundle) {
+			batch->pbundle = kmalloc(PAGE_SIZE, GFP_KERNEL);
+			if (!batch->pbundle)
+				return -ENOMEM;
+		}
+		pbundle = batch->pbundle;
+		pbundle->internal_avail =
+			method_elm->bundle_size -
+			offsetof(struct bundle_priv, internal_buffer);
+		pbundle->allocated_mem = NULL;
+	} else {
 		pbundle = kmalloc(method_elm->bundle_size, GFP_KERNEL);
 		if (!pbundle)
 			return -ENOMEM;
@@ -580,20 +627,16 @@ static int ib_uverbs_cmd_verbs(struct ib_uverbs_file *ufile,
 			offsetof(struct bundle_priv, internal_buffer);
 		pbundle->alloc_head.next = NULL;
 		pbundle->allocated_mem = &pbundle->alloc_head;
-	} else {
-		pbundle = &onstack;
-		pbundle->internal_avail = sizeof(pbundle->internal_buffer);
-		pbundle->allocated_mem = NULL;
 	}
 
 	/* Space for the pbundle->bundle.attrs flex array */
 	pbundle->method_elm = method_elm;
-	pbundle->method_key = attrs_iter.index;
+	pbundle->method_key = method_key;
 	pbundle->bundle.ufile = ufile;
 	pbundle->bundle.context = NULL; /* only valid if bundle has uobject */
 	pbundle->radix = &uapi->radix;
 	pbundle->radix_slots = slot;
-	pbundle->radix_slots_len = radix_tree_chunk_size(&attrs_iter);
+	pbundle->radix_slots_len = slots_len;
 	pbundle->user_attrs = user_attrs;
 
 	pbundle->internal_used = ALIGN(pbundle->method_elm->key_bitmap_len *
@@ -611,6 +654,88 @@ static int ib_uverbs_cmd_verbs(struct ib_uverbs_file *ufile,
 	return ret;
 }
 
+static int ib_uverbs_get_hdr(struct ib_uverbs_ioctl_hdr __user *user_hdr,
+			     struct ib_uverbs_ioctl_hdr *hdr)
+{
+	if (copy_from_user(hdr, user_hdr, sizeof(*hdr)))
+		return -EFAULT;
+
+	if (hdr->length > PAGE_SIZE ||
+	    hdr->length != struct_size(hdr, attrs, hdr->num_attrs))
+		return -EINVAL;
+
+	if (hdr->reserved1 || hdr->reserved2)
+		return -EPROTONOSUPPORT;
+
+	return 0;
+}
+
+/*
+ * Run up to UVERBS_BATCH_MAX_ENTRIES methods under a single disassociate_srcu
+ * read section.  Every entry is a complete RDMA_VERBS_IOCTL command and takes
+ * its uobject locks exactly as it would on its own, so a failed entry never
+ * undoes the ones before it.
+ */
+static long ib_uverbs_ioctl_batch(struct ib_uverbs_file *file,
+				  struct ib_uverbs_ioctl_batch __user *user_batch)
+{
+	struct ib_uverbs_ioctl_batch_entry __user *entries;
+	struct ib_uverbs_ioctl_hdr __user *user_hdr;
+	struct ib_uverbs_ioctl_batch_entry entry;
+	struct ib_uverbs_ioctl_batch batch;
+	struct bundle_batch state = {};
+	struct ib_uverbs_ioctl_hdr hdr;
+	u32 done = 0;
+	int srcu_key;
+	int err = 0;
+	int ret;
+
+	if (copy_from_user(&batch, user_batch, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.flags & ~IB_UVERBS_BATCH_F_CONTINUE || batch.reserved)
+		return -EPROTONOSUPPORT;
+
+	if (!batch.num_entries || batch.num_entries > UVERBS_BATCH_MAX_ENTRIES)
+		return -EINVAL;
+
+	entries = u64_to_user_ptr(batch.entries);
+
+	srcu_key = srcu_read_lock(&file->device->disassociate_srcu);
+	while (done < batch.num_entries) {
+		if (copy_from_user(&entry, &entries[done], sizeof(entry))) {
+			err = -EFAULT;
+			break;
+		}
+
+		user_hdr = u64_to_user_ptr(entry.hdr);
+		ret = entry.reserved ? -EPROTONOSUPPORT :
+				       ib_uverbs_get_hdr(user_hdr, &hdr);
+		if (!ret)
+			ret = ib_uverbs_cmd_verbs(file, &hdr, user_hdr->attrs,
+						  &state);
+		done++;
+
+		if (put_user(ret, &entries[done - 1].status)) {
+			err = -EFAULT;
+			break;
+		}
+		if (ret && !(batch.flags & IB_UVERBS_BATCH_F_CONTINUE))
+			break;
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	srcu_read_unlock(&file->device->disassociate_srcu, srcu_key);
+	kfree(state.pbundle);
+
+	if (put_user(done, &user_batch->num_done))
+		return -EFAULT;
+	return err;
+}
+
 long ib_uverbs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct ib_uverbs_file *file = filp->private_data;
@@ -620,22 +745,18 @@ long ib_uverbs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	int srcu_key;
 	int err;
 
+	if (cmd == RDMA_VERBS_BATCH_IOCTL)
+		return ib_uverbs_ioctl_batch(file, (void __user *)arg);
+
 	if (unlikely(cmd != RDMA_VERBS_IOCTL))
 		return -ENOIOCTLCMD;
 
-	err = copy_from_user(&hdr, user_hdr, sizeof(hdr));
+	err = ib_uverbs_get_hdr(user_hdr, &hdr);
 	if (err)
-		return -EFAULT;
-
-	if (hdr.length > PAGE_SIZE ||
-	    hdr.length != struct_size(&hdr, attrs, hdr.num_attrs))
-		return -EINVAL;
-
-	if (hdr.reserved1 || hdr.reserved2)
-		return -EPROTONOSUPPORT;
+		return err;
 
 	srcu_key = srcu_read_lock(&file->device->disassociate_srcu);
-	err = ib_uverbs_cmd_verbs(file, &hdr, user_hdr->attrs);
+	err = ib_uverbs_cmd_verbs(file, &hdr, user_hdr->attrs, NULL);
 	srcu_read_unlock(&file->device->disassociate_srcu, srcu_key);
 	return err;
 }
@@ -1946,6 +1946,7 @@ int ib_destroy_qp_user(struct ib_qp *qp, struct ib_udata *udata)
 {
 	const struct ib_gid_attr *alt_path_sgid_attr = qp->alt_path_sgid_attr;
 	const struct ib_gid_attr *av_sgid_attr = qp->av_sgid_attr;
+	struct ib_mr_pool_cpu __percpu *mr_pcpu = qp->mr_pcpu;
 	struct ib_pd *pd;
 	struct ib_cq *scq, *rcq;
 	struct ib_srq *srq;
@@ -1953,7 +1954,7 @@ int ib_destroy_qp_user(struct ib_qp *qp, struct ib_udata *udata)
 	struct ib_qp_security *sec;
 	int ret;
 
-	WARN_ON_ONCE(qp->mrs_used > 0);
+	WARN_ON_ONCE(ib_mr_pool_used(qp) > 0);
 
 	if (atomic_read(&qp->usecnt))
 		return -EBUSY;
@@ -1977,6 +1978,7 @@ int ib_destroy_qp_user(struct ib_qp *qp, struct ib_udata *udata)
 	rdma_restrack_del(&qp->res);
 	ret = qp->device->ops.destroy_qp(qp, udata);
 	if (!ret) {
+		free_percpu(mr_pcpu);
 		if (alt_path_sgid_attr)
 			rdma_put_gid_attr(alt_path_sgid_attr);
 		if (av_sgid_attr)
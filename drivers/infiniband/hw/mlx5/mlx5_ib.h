@@ -700,6 +700,17 @@ struct mlx5_cache_ent {
 
 	/* Statistics */
 	u32                     miss;
+	u32			hit;
+
+	/*
+	 * Adaptive sizing: requests and misses seen in the current interval,
+	 * the learned demand per interval, and the configured limit that
+	 * serves as the floor of the adapted one.
+	 */
+	u32			interval_gets;
+	u32			interval_miss;
+	u32			demand;
+	u32			base_limit;
 
 	struct mlx5_ib_dev     *dev;
 	struct work_struct	work;
@@ -715,6 +726,10 @@ struct mlx5_mr_cache {
 	unsigned long		last_add;
 	int			rel_timeout;
 	int			rel_imm;
+	/* serializes turning adaptive sizing on and off */
+	struct mutex		adapt_mutex;
+	int			adaptive;
+	struct delayed_work	adapt_work;
 };
 
 struct mlx5_ib_gsi_qp;
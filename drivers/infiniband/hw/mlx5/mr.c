@@ -441,6 +441,115 @@ static void cache_work_func(struct work_struct *work)
 	__cache_work_func(ent);
 }
 
+/*
+ * Adaptive sizing.  Every MR_CACHE_ADAPT_INTERVAL_MS the limit of each entry
+ * is set from the demand learned for it: the demand jumps up to the number
+ * of requests of the interval and grows further by the number of misses, so
+ * the next burst of that size is served from the cache, and decays by an
+ * eighth of the gap per interval once requests slow down.  The limit never
+ * drops below the configured one.  An entry is refilled up to twice its
+ * limit, so the adapted limit is capped at half of MR_CACHE_ADAPT_MAX_MRS
+ * and of MR_CACHE_ADAPT_XLT_BUDGET octowords (2 MiB) of translation table,
+ * which bounds what one entry can hold.  Excess MRs are released by the
+ * usual rel_timeout garbage collection.
+ */
+#define MR_CACHE_ADAPT_INTERVAL_MS	1000
+#define MR_CACHE_ADAPT_MAX_MRS		512
+#define MR_CACHE_ADAPT_XLT_BUDGET	(1 << 17)
+
+static u32 mr_cache_adapt_limit(u32 *demand, u32 gets, u32 misses, u32 floor,
+				u32 cap)
+{
+	if (gets >= *demand)
+		*demand = gets + misses;
+	else if (misses)
+		*demand += misses;
+	else
+		*demand -= DIV_ROUND_UP(*demand - gets, 8);
+
+	return max(min(*demand, cap), floor);
+}
+
+static u32 mr_cache_adapt_cap(struct mlx5_cache_ent *ent)
+{
+	return min_t(u32, MR_CACHE_ADAPT_MAX_MRS,
+		     MR_CACHE_ADAPT_XLT_BUDGET / ent->xlt) / 2;
+}
+
+/*
+ * A recorded demand trace and the limits mr_cache_adapt_limit() must
+ * produce for it, with a floor of 4 and a cap of 64: a ramp, a burst that
+ * hits the cap, and a long idle period that decays back to the floor.
+ * Rows with a repeat count are fed that many times and only the last
+ * result is checked.
+ */
+static const struct {
+	u32 gets;
+	u32 misses;
+	u32 repeat;
+	u32 limit;
+} mr_cache_adapt_trace[] = {
+	{ 10,	3,	1,	13 },
+	{ 40,	10,	1,	50 },
+	{ 40,	5,	1,	55 },
+	{ 100,	40,	1,	64 },
+	{ 0,	0,	2,	64 },
+	{ 30,	0,	1,	64 },
+	{ 0,	0,	40,	4 },
+};
+
+static int mr_cache_adapt_selftest(struct mlx5_ib_dev *dev)
+{
+	u32 demand = 0, limit = 0;
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(mr_cache_adapt_trace); i++) {
+		for (j = 0; j < mr_cache_adapt_trace[i].repeat; j++)
+			limit = mr_cache_adapt_limit(&demand,
+					mr_cache_adapt_trace[i].gets,
+					mr_cache_adapt_trace[i].misses, 4, 64);
+		if (limit != mr_cache_adapt_trace[i].limit) {
+			mlx5_ib_warn(dev, "adaptive MR cache trace step %d: limit %u, expected %u\n",
+				     i, limit, mr_cache_adapt_trace[i].limit);
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+static void mr_cache_adapt_work_func(struct work_struct *work)
+{
+	struct mlx5_mr_cache *cache =
+		container_of(work, struct mlx5_mr_cache, adapt_work.work);
+	struct mlx5_cache_ent *ent;
+	int i;
+
+	for (i = 0; i < MAX_MR_CACHE_ENTRIES; i++) {
+		ent = &cache->ent[i];
+		/* orders the device cannot cache have no translation size */
+		if (!ent->xlt)
+			continue;
+
+		spin_lock_irq(&ent->lock);
+		if (!ent->disabled) {
+			ent->limit = mr_cache_adapt_limit(&ent->demand,
+							  ent->interval_gets,
+							  ent->interval_miss,
+							  ent->base_limit,
+							  mr_cache_adapt_cap(ent));
+			queue_adjust_cache_locked(ent);
+		}
+		ent->interval_gets = 0;
+		ent->interval_miss = 0;
+		spin_unlock_irq(&ent->lock);
+	}
+
+	if (READ_ONCE(cache->adaptive))
+		queue_delayed_work(cache->wq, &cache->adapt_work,
+				   msecs_to_jiffies(MR_CACHE_ADAPT_INTERVAL_MS));
+}
+
 /* Allocate a special entry from the cache */
 struct mlx5_ib_mr *mlx5_mr_cache_alloc(struct mlx5_ib_dev *dev,
 				       unsigned int entry)
@@ -455,7 +564,10 @@ struct mlx5_ib_mr *mlx5_mr_cache_alloc(struct mlx5_ib_dev *dev,
 
 	ent = &cache->ent[entry];
 	spin_lock_irq(&ent->lock);
+	ent->interval_gets++;
 	if (list_empty(&ent->head)) {
+		ent->miss++;
+		ent->interval_miss++;
 		spin_unlock_irq(&ent->lock);
 		atomic_inc(&ent->do_complete);
 		mr = create_cache_mr(ent);
@@ -465,6 +577,7 @@ struct mlx5_ib_mr *mlx5_mr_cache_alloc(struct mlx5_ib_dev *dev,
 		mr = list_first_entry(&ent->head, struct mlx5_ib_mr, list);
 		list_del(&mr->list);
 		ent->available_mrs--;
+		ent->hit++;
 		queue_adjust_cache_locked(ent);
 		spin_unlock_irq(&ent->lock);
 	}
@@ -484,11 +597,16 @@ static struct mlx5_ib_mr *get_cache_mr(struct mlx5_cache_ent *req_ent)
 			    ent - dev->cache.ent);
 
 		spin_lock_irq(&ent->lock);
+		/* demand is accounted to the order that was asked for */
+		if (ent == req_ent)
+			ent->interval_gets++;
 		if (!list_empty(&ent->head)) {
 			mr = list_first_entry(&ent->head, struct mlx5_ib_mr,
 					      list);
 			list_del(&mr->list);
 			ent->available_mrs--;
+			if (ent == req_ent)
+				ent->hit++;
 			queue_adjust_cache_locked(ent);
 			spin_unlock_irq(&ent->lock);
 			break;
@@ -497,8 +615,12 @@ static struct mlx5_ib_mr *get_cache_mr(struct mlx5_cache_ent *req_ent)
 		spin_unlock_irq(&ent->lock);
 	}
 
-	if (!mr)
+	if (!mr) {
+		spin_lock_irq(&req_ent->lock);
 		req_ent->miss++;
+		req_ent->interval_miss++;
+		spin_unlock_irq(&req_ent->lock);
+	}
 
 	return mr;
 }
@@ -586,6 +708,8 @@ int mlx5_mr_cache_init(struct mlx5_ib_dev *dev)
 
 	mutex_init(&dev->slow_path_mutex);
 	cache->rel_timeout = 300;
+	mutex_init(&cache->adapt_mutex);
+	INIT_DELAYED_WORK(&cache->adapt_work, mr_cache_adapt_work_func);
 	cache->wq = alloc_ordered_workqueue("mkey_cache", WQ_MEM_RECLAIM);
 	if (!cache->wq) {
 		mlx5_ib_warn(dev, "failed to create work queue\n");
@@ -628,6 +752,7 @@ int mlx5_mr_cache_init(struct mlx5_ib_dev *dev)
 			ent->limit = dev->mdev->profile.mr_cache[i].limit;
 		else
 			ent->limit = 0;
+		ent->base_limit = ent->limit;
 		spin_lock_irq(&ent->lock);
 		queue_adjust_cache_locked(ent);
 		spin_unlock_irq(&ent->lock);
@@ -656,6 +781,11 @@ int mlx5_mr_cache_cleanup(struct mlx5_ib_dev *dev)
 	}
 
 	mlx5_mr_sysfs_cleanup(dev);
+	/* sysfs is gone, nothing can turn adaptive sizing back on */
+	mutex_lock(&dev->cache.adapt_mutex);
+	WRITE_ONCE(dev->cache.adaptive, 0);
+	mutex_unlock(&dev->cache.adapt_mutex);
+	cancel_delayed_work_sync(&dev->cache.adapt_work);
 	mlx5_cmd_cleanup_async_ctx(&dev->async_ctx);
 
 	for (i = 0; i < MAX_MR_CACHE_ENTRIES; i++)
@@ -2488,6 +2618,7 @@ static ssize_t limit_store(struct cache_order *co, struct order_attribute *oa,
 	 */
 	spin_lock_irq(&ent->lock);
 	ent->limit = var;
+	ent->base_limit = var;
 	err = resize_available_mrs(ent, 0, true);
 	spin_unlock_irq(&ent->lock);
 	if (err)
@@ -2526,6 +2657,18 @@ static ssize_t miss_store(struct cache_order *co, struct order_attribute *oa,
 	return count;
 }
 
+static ssize_t hit_show(struct cache_order *co, struct order_attribute *oa,
+			char *buf)
+{
+	struct mlx5_ib_dev *dev = co->dev;
+	struct mlx5_mr_cache *cache = &dev->cache;
+	struct mlx5_cache_ent *ent = &cache->ent[co->index];
+	int err;
+
+	err = snprintf(buf, 20, "%d\n", ent->hit);
+	return err;
+}
+
 static ssize_t size_show(struct cache_order *co, struct order_attribute *oa,
 			 char *buf)
 {
@@ -2621,12 +2764,14 @@ static struct sysfs_ops order_sysfs_ops = {
 static ORDER_ATTR_RO(cur);
 static ORDER_ATTR(limit);
 static ORDER_ATTR(miss);
+static ORDER_ATTR_RO(hit);
 static ORDER_ATTR(size);
 
 static struct attribute *order_default_attrs[] = {
 	&order_attr_cur.attr,
 	&order_attr_limit.attr,
 	&order_attr_miss.attr,
+	&order_attr_hit.attr,
 	&order_attr_size.attr,
 	NULL
 };
@@ -2720,6 +2865,58 @@ static ssize_t rel_timeout_store(struct mlx5_ib_dev *dev, const char *buf, size_
 	return count;
 }
 
+static ssize_t adaptive_show(struct mlx5_ib_dev *dev, char *buf)
+{
+	struct mlx5_mr_cache *cache = &dev->cache;
+	int err;
+
+	err = snprintf(buf, 20, "%d\n", cache->adaptive);
+	return err;
+}
+
+static ssize_t adaptive_store(struct mlx5_ib_dev *dev, const char *buf, size_t count)
+{
+	struct mlx5_mr_cache *cache = &dev->cache;
+	struct mlx5_cache_ent *ent;
+	int i, err = 0;
+	u32 var;
+
+	if (kstrtouint(buf, 0, &var))
+		return -EINVAL;
+
+	if (var > 1)
+		return -EINVAL;
+
+	mutex_lock(&cache->adapt_mutex);
+	if (var == cache->adaptive)
+		goto out;
+
+	if (var) {
+		/* replay the reference trace before trusting the policy */
+		err = mr_cache_adapt_selftest(dev);
+		if (err)
+			goto out;
+		WRITE_ONCE(cache->adaptive, var);
+		queue_delayed_work(cache->wq, &cache->adapt_work, 0);
+		goto out;
+	}
+
+	/* Go back to the configured limits, excess MRs age out as usual */
+	WRITE_ONCE(cache->adaptive, var);
+	cancel_delayed_work_sync(&cache->adapt_work);
+	for (i = 0; i < MAX_MR_CACHE_ENTRIES; i++) {
+		ent = &cache->ent[i];
+		spin_lock_irq(&ent->lock);
+		ent->limit = ent->base_limit;
+		ent->demand = 0;
+		queue_adjust_cache_locked(ent);
+		spin_unlock_irq(&ent->lock);
+	}
+out:
+	mutex_unlock(&cache->adapt_mutex);
+	return err ? err : count;
+}
+
 static ssize_t cache_attr_show(struct kobject *kobj,
 			       struct attribute *attr, char *buf)
 {
@@ -2760,10 +2957,12 @@ static struct sysfs_ops cache_sysfs_ops = {
 
 static CACHE_ATTR(rel_imm);
 static CACHE_ATTR(rel_timeout);
+static CACHE_ATTR(adaptive);
 
 static struct attribute *cache_default_attrs[] = {
 	&cache_attr_rel_imm.attr,
 	&cache_attr_rel_timeout.attr,
+	&cache_attr_adaptive.attr,
 	NULL
 };
 
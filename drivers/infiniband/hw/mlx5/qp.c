@@ -5674,6 +5674,7 @@ static void handle_drain_completion(struct ib_cq *cq,
 #endif
 				break;
 			case IB_POLL_WORKQUEUE:
+			case IB_POLL_HYBRID:
 				cancel_work_sync(&cq->work);
 				break;
 			default:
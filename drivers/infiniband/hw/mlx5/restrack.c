@@ -103,6 +103,33 @@ static int fill_stat_mr_entry(struct sk_buff *msg, struct ib_mr *ibmr)
 					 atomic64_read(&mr->odp_stats.prefetch)))
 		goto err_table;
 
+	/* Implicit MRs map through child umems, report explicit ones only */
+	if (mr->umem && !to_ib_umem_odp(mr->umem)->is_implicit_odp) {
+		struct ib_umem_odp_stats *stats =
+			&to_ib_umem_odp(mr->umem)->stats;
+
+		if (rdma_nl_stat_hwcounter_entry(
+			    msg, "odp_fault_calls",
+			    atomic64_read(&stats->faults)))
+			goto err_table;
+		if (rdma_nl_stat_hwcounter_entry(
+			    msg, "odp_fault_pages",
+			    atomic64_read(&stats->fault_pages)))
+			goto err_table;
+		if (rdma_nl_stat_hwcounter_entry(
+			    msg, "odp_prefetch_pages",
+			    atomic64_read(&stats->prefetch_pages)))
+			goto err_table;
+		if (rdma_nl_stat_hwcounter_entry(
+			    msg, "odp_invalidation_ranges",
+			    atomic64_read(&stats->invalidations)))
+			goto err_table;
+		if (rdma_nl_stat_hwcounter_entry(
+			    msg, "odp_invalidated_pages",
+			    atomic64_read(&stats->invalidated_pages)))
+			goto err_table;
+	}
+
 	nla_nest_end(msg, table_attr);
 	return 0;
 
@@ -637,6 +637,9 @@ static void nvme_free_ns(struct kref *kref)
 	put_disk(ns->disk);
 	nvme_put_ns_head(ns->head);
 	nvme_put_ctrl(ns->ctrl);
+#ifdef CONFIG_NVME_MULTIPATH
+	free_percpu(ns->inflight);
+#endif
 	kfree(ns);
 }
 
@@ -1030,6 +1033,7 @@ static inline blk_status_t nvme_setup_rw(struct nvme_ns *ns,
 
 void nvme_cleanup_cmd(struct request *req)
 {
+	nvme_mpath_end_request(req);
 #if defined(HAVE_T10_PI_PREPARE) || !defined(HAVE_T10_PI_H)
 #ifdef HAVE_REQ_OP
 	if (blk_integrity_rq(req) && req_op(req) == REQ_OP_READ &&
@@ -1151,6 +1155,8 @@ blk_status_t nvme_setup_cmd(struct nvme_ns *ns, struct request *req,
 
 	cmd->common.command_id = req->tag;
 	trace_nvme_setup_cmd(req, cmd);
+	if (ret == BLK_STS_OK)
+		nvme_mpath_start_request(req);
 	return ret;
 }
 EXPORT_SYMBOL_GPL(nvme_setup_cmd);
@@ -4503,6 +4509,12 @@ static void nvme_alloc_ns(struct nvme_ctrl *ctrl, unsigned nsid)
 	if (!ns)
 		return;
 
+#ifdef CONFIG_NVME_MULTIPATH
+	ns->inflight = alloc_percpu(long);
+	if (!ns->inflight)
+		goto out_free_ns;
+#endif
+
 	ns->queue = blk_mq_init_queue(ctrl->tagset);
 	if (IS_ERR(ns->queue))
 		goto out_free_ns;
@@ -4610,6 +4622,9 @@ static void nvme_alloc_ns(struct nvme_ctrl *ctrl, unsigned nsid)
  out_free_queue:
 	blk_cleanup_queue(ns->queue);
  out_free_ns:
+#ifdef CONFIG_NVME_MULTIPATH
+	free_percpu(ns->inflight);
+#endif
 	kfree(ns);
 }
 
@@ -253,6 +253,59 @@ out:
 	return found;
 }
 
+static u64 nvme_path_cost(struct nvme_ns *ns, int iopolicy)
+{
+	long inflight = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		inflight += READ_ONCE(*per_cpu_ptr(ns->inflight, cpu));
+	if (inflight < 0)
+		inflight = 0;
+
+	if (iopolicy == NVME_IOPOLICY_QD)
+		return inflight;
+
+	/*
+	 * Expected time until a new request on this path completes.  A path
+	 * without latency samples yet costs nothing, so it gets probed.
+	 */
+	return (inflight + 1) * atomic64_read(&ns->ewma_ns);
+}
+
+static struct nvme_ns *nvme_least_loaded_path(struct nvme_ns_head *head,
+		int iopolicy)
+{
+	u64 found_cost = U64_MAX, fallback_cost = U64_MAX, cost;
+	struct nvme_ns *found = NULL, *fallback = NULL, *ns;
+
+	list_for_each_entry_rcu(ns, &head->list, siblings) {
+		if (nvme_path_is_disabled(ns))
+			continue;
+
+		switch (ns->ana_state) {
+		case NVME_ANA_OPTIMIZED:
+			cost = nvme_path_cost(ns, iopolicy);
+			if (cost < found_cost) {
+				found_cost = cost;
+				found = ns;
+			}
+			break;
+		case NVME_ANA_NONOPTIMIZED:
+			cost = nvme_path_cost(ns, iopolicy);
+			if (cost < fallback_cost) {
+				fallback_cost = cost;
+				fallback = ns;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return found ? found : fallback;
+}
+
 static inline bool nvme_path_is_optimized(struct nvme_ns *ns)
 {
 	return ns->ctrl->state == NVME_CTRL_LIVE &&
@@ -261,20 +314,71 @@ static inline bool nvme_path_is_optimized(struct nvme_ns *ns)
 
 inline struct nvme_ns *nvme_find_path(struct nvme_ns_head *head)
 {
+	int iopolicy = READ_ONCE(head->subsys->iopolicy);
 	int node = numa_node_id();
 	struct nvme_ns *ns;
 
+	if (iopolicy == NVME_IOPOLICY_QD || iopolicy == NVME_IOPOLICY_ST)
+		return nvme_least_loaded_path(head, iopolicy);
+
 	ns = srcu_dereference(head->current_path[node], &head->srcu);
 	if (unlikely(!ns))
 		return __nvme_find_path(head, node);
 
-	if (READ_ONCE(head->subsys->iopolicy) == NVME_IOPOLICY_RR)
+	if (iopolicy == NVME_IOPOLICY_RR)
 		return nvme_round_robin_path(head, node, ns);
 	if (unlikely(!nvme_path_is_optimized(ns)))
 		return __nvme_find_path(head, node);
 	return ns;
 }
 
+void nvme_mpath_start_request(struct request *rq)
+{
+	struct nvme_ns *ns = rq->q->queuedata;
+	int iopolicy;
+
+	if (!(rq->cmd_flags & REQ_NVME_MPATH) ||
+	    (nvme_req(rq)->flags & NVME_MPATH_CNT_ACTIVE))
+		return;
+
+	iopolicy = READ_ONCE(ns->head->subsys->iopolicy);
+	if (iopolicy != NVME_IOPOLICY_QD && iopolicy != NVME_IOPOLICY_ST)
+		return;
+
+	this_cpu_inc(*ns->inflight);
+	nvme_req(rq)->flags |= NVME_MPATH_CNT_ACTIVE;
+	nvme_req(rq)->start_time =
+		iopolicy == NVME_IOPOLICY_ST ? ktime_get_ns() : 0;
+}
+
+void nvme_mpath_end_request(struct request *rq)
+{
+	struct nvme_ns *ns = rq->q->queuedata;
+	u64 lat, ewma;
+
+	if (!(nvme_req(rq)->flags & NVME_MPATH_CNT_ACTIVE))
+		return;
+	nvme_req(rq)->flags &= ~NVME_MPATH_CNT_ACTIVE;
+	this_cpu_dec(*ns->inflight);
+
+	/* only successful completions say anything about the path latency */
+	if (!nvme_req(rq)->start_time || nvme_req(rq)->status ||
+	    !blk_mq_request_started(rq))
+		return;
+
+	/*
+	 * Completions of one path race on several CPUs; losing one of two
+	 * concurrent samples does not matter for an average.
+	 */
+	lat = ktime_get_ns() - nvme_req(rq)->start_time;
+	ewma = atomic64_read(&ns->ewma_ns);
+	if (ewma)
+		ewma = ewma - (ewma >> 3) + (lat >> 3);
+	else
+		ewma = lat;
+	atomic64_set(&ns->ewma_ns, ewma);
+}
+
 static bool nvme_available_path(struct nvme_ns_head *head)
 {
 	struct nvme_ns *ns;
@@ -665,6 +769,8 @@ void nvme_mpath_stop(struct nvme_ctrl *ctrl)
 static const char *nvme_iopolicy_names[] = {
 	[NVME_IOPOLICY_NUMA]	= "numa",
 	[NVME_IOPOLICY_RR]	= "round-robin",
+	[NVME_IOPOLICY_QD]	= "queue-depth",
+	[NVME_IOPOLICY_ST]	= "service-time",
 };
 
 static ssize_t nvme_subsys_iopolicy_show(struct device *dev,
@@ -191,6 +191,9 @@ struct nvme_request {
 	u8			flags;
 	u16			status;
 	struct nvme_ctrl	*ctrl;
+#ifdef CONFIG_NVME_MULTIPATH
+	u64			start_time;
+#endif
 };
 
 /*
@@ -201,6 +204,7 @@ struct nvme_request {
 enum {
 	NVME_REQ_CANCELLED		= (1 << 0),
 	NVME_REQ_USERCMD		= (1 << 1),
+	NVME_MPATH_CNT_ACTIVE		= (1 << 2),
 };
 
 static inline struct nvme_request *nvme_req(struct request *req)
@@ -389,6 +393,8 @@ struct nvme_ctrl {
 enum nvme_iopolicy {
 	NVME_IOPOLICY_NUMA,
 	NVME_IOPOLICY_RR,
+	NVME_IOPOLICY_QD,
+	NVME_IOPOLICY_ST,
 };
 
 struct nvme_subsystem {
@@ -470,6 +476,14 @@ struct nvme_ns {
 #ifdef CONFIG_NVME_MULTIPATH
 	enum nvme_ana_state ana_state;
 	u32 ana_grpid;
+	/*
+	 * Path load for the queue-depth and service-time iopolicies.  The
+	 * inflight count is incremented on the submitting CPU and decremented
+	 * on the completing CPU, so only the sum over all CPUs is meaningful.
+	 * ewma_ns is the completion latency EWMA of the path in nanoseconds.
+	 */
+	long __percpu *inflight;
+	atomic64_t ewma_ns;
 #endif
 	struct list_head siblings;
 	struct nvm_dev *ndev;
@@ -758,6 +772,8 @@ bool nvme_mpath_clear_current_path(struct nvme_ns *ns);
 void nvme_mpath_clear_ctrl_paths(struct nvme_ctrl *ctrl);
 struct nvme_ns *nvme_find_path(struct nvme_ns_head *head);
 blk_qc_t nvme_ns_head_submit_bio(struct bio *bio);
+void nvme_mpath_start_request(struct request *rq);
+void nvme_mpath_end_request(struct request *rq);
 
 static inline void nvme_mpath_check_last_path(struct nvme_ns *ns)
 {
@@ -828,6 +844,12 @@ static inline void nvme_mpath_clear_ctrl_paths(struct nvme_ctrl *ctrl)
 static inline void nvme_mpath_check_last_path(struct nvme_ns *ns)
 {
 }
+static inline void nvme_mpath_start_request(struct request *rq)
+{
+}
+static inline void nvme_mpath_end_request(struct request *rq)
+{
+}
 static inline void nvme_trace_bio_complete(struct request *req,
         blk_status_t status)
 {
@@ -64,6 +64,8 @@ struct nvme_rdma_qe {
 	struct ib_cqe		cqe;
 	void			*data;
 	u64			dma;
+	struct ib_recv_wr	recv_wr;
+	struct ib_sge		recv_sge;
 };
 
 struct nvme_rdma_sgl {
@@ -111,6 +113,11 @@ struct nvme_rdma_queue {
 	bool			pi_support;
 	int			cq_size;
 	struct mutex		queue_lock;
+
+	/* receives reposted at the end of the current completion batch */
+	struct ib_cq_batch	recv_batch;
+	struct ib_recv_wr	*recv_first;
+	struct ib_recv_wr	*recv_last;
 };
 
 struct nvme_rdma_ctrl {
@@ -166,6 +173,7 @@ MODULE_PARM_DESC(register_always,
 static int nvme_rdma_cm_handler(struct rdma_cm_id *cm_id,
 		struct rdma_cm_event *event);
 static void nvme_rdma_recv_done(struct ib_cq *cq, struct ib_wc *wc);
+static void nvme_rdma_recv_flush(struct ib_cq *cq, struct ib_cq_batch *batch);
 static void nvme_rdma_complete_rq(struct request *rq);
 
 #ifdef HAVE_BLK_MQ_TAG_SET_HAS_CONST_OPS
@@ -691,6 +699,9 @@ static int nvme_rdma_alloc_queue(struct nvme_rdma_ctrl *ctrl,
 	else
 		queue->pi_support = false;
 	init_completion(&queue->cm_done);
+	ib_cq_batch_init(&queue->recv_batch, nvme_rdma_recv_flush);
+	queue->recv_first = NULL;
+	queue->recv_last = NULL;
 
 	if (idx > 0)
 		queue->cmnd_capsule_len = ctrl->ctrl.ioccsz * 16;
@@ -1895,25 +1906,32 @@ static int nvme_rdma_post_send(struct nvme_rdma_queue *queue,
 	return ret;
 }
 
-static int nvme_rdma_post_recv(struct nvme_rdma_queue *queue,
+static struct ib_recv_wr *nvme_rdma_init_recv_wr(struct nvme_rdma_queue *queue,
 		struct nvme_rdma_qe *qe)
 {
-	struct ib_recv_wr wr;
-	struct ib_sge list;
-	int ret;
+	struct ib_recv_wr *wr = &qe->recv_wr;
+	struct ib_sge *list = &qe->recv_sge;
 
-	list.addr   = qe->dma;
-	list.length = sizeof(struct nvme_completion);
-	list.lkey   = queue->device->pd->local_dma_lkey;
+	list->addr   = qe->dma;
+	list->length = sizeof(struct nvme_completion);
+	list->lkey   = queue->device->pd->local_dma_lkey;
 
 	qe->cqe.done = nvme_rdma_recv_done;
 
-	wr.next     = NULL;
-	wr.wr_cqe   = &qe->cqe;
-	wr.sg_list  = &list;
-	wr.num_sge  = 1;
+	wr->next     = NULL;
+	wr->wr_cqe   = &qe->cqe;
+	wr->sg_list  = list;
+	wr->num_sge  = 1;
+
+	return wr;
+}
+
+static int nvme_rdma_post_recv_list(struct nvme_rdma_queue *queue,
+		struct ib_recv_wr *first)
+{
+	int ret;
 
-	ret = ib_post_recv(queue->qp, &wr, NULL);
+	ret = ib_post_recv(queue->qp, first, NULL);
 	if (unlikely(ret)) {
 		dev_err(queue->ctrl->ctrl.device,
 			"%s failed with error code %d\n", __func__, ret);
@@ -1921,6 +1939,46 @@ static int nvme_rdma_post_recv(struct nvme_rdma_queue *queue,
 	return ret;
 }
 
+static int nvme_rdma_post_recv(struct nvme_rdma_queue *queue,
+		struct nvme_rdma_qe *qe)
+{
+	return nvme_rdma_post_recv_list(queue,
+			nvme_rdma_init_recv_wr(queue, qe));
+}
+
+static void nvme_rdma_recv_flush(struct ib_cq *cq, struct ib_cq_batch *batch)
+{
+	struct nvme_rdma_queue *queue =
+		container_of(batch, struct nvme_rdma_queue, recv_batch);
+	struct ib_recv_wr *first = queue->recv_first;
+
+	queue->recv_first = NULL;
+	queue->recv_last = NULL;
+	nvme_rdma_post_recv_list(queue, first);
+}
+
+/*
+ * Repost a receive from its completion.  Where the CQ core allows it the
+ * receives of a completion batch are chained and posted together.
+ */
+static void nvme_rdma_repost_recv(struct ib_cq *cq,
+		struct nvme_rdma_queue *queue, struct nvme_rdma_qe *qe)
+{
+	struct ib_recv_wr *wr;
+
+	if (!ib_cq_batch_add(cq, &queue->recv_batch)) {
+		nvme_rdma_post_recv(queue, qe);
+		return;
+	}
+
+	wr = nvme_rdma_init_recv_wr(queue, qe);
+	if (queue->recv_last)
+		queue->recv_last->next = wr;
+	else
+		queue->recv_first = wr;
+	queue->recv_last = wr;
+}
+
 static struct blk_mq_tags *nvme_rdma_tagset(struct nvme_rdma_queue *queue)
 {
 	u32 queue_idx = nvme_rdma_queue_idx(queue);
@@ -2060,7 +2118,7 @@ static void nvme_rdma_recv_done(struct ib_cq *cq, struct ib_wc *wc)
 		nvme_rdma_process_nvme_rsp(queue, cqe, wc);
 	ib_dma_sync_single_for_device(ibdev, qe->dma, len, DMA_FROM_DEVICE);
 
-	nvme_rdma_post_recv(queue, qe);
+	nvme_rdma_repost_recv(cq, queue, qe);
 }
 
 static int nvme_rdma_conn_established(struct nvme_rdma_queue *queue)
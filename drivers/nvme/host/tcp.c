@@ -17,6 +17,8 @@
 #include <linux/blk-mq.h>
 #include <crypto/hash.h>
 #include <net/busy_poll.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "nvme.h"
 #include "fabrics.h"
@@ -33,6 +35,27 @@ static int so_priority;
 module_param(so_priority, int, 0644);
 MODULE_PARM_DESC(so_priority, "nvme tcp socket optimize priority");
 
+/*
+ * With adaptive_io_cpu set, io_work follows the CPU that submits to the
+ * queue (or, for queues nobody submits to, the CPU the socket receives
+ * on) instead of staying on its static qid based CPU.  A queue only moves
+ * once the same new CPU has been seen io_cpu_hysteresis io_work runs in a
+ * row, so a briefly migrating task does not drag the queue around.
+ * A submitting CPU that has not submitted for NVME_TCP_SUBMIT_IDLE is
+ * forgotten, so the queue falls back to following the RX CPU.
+ */
+static bool adaptive_io_cpu;
+module_param(adaptive_io_cpu, bool, 0644);
+MODULE_PARM_DESC(adaptive_io_cpu,
+		 "move queue io_work to the submitting/receiving CPU (default:false)");
+
+static unsigned int io_cpu_hysteresis = 32;
+module_param(io_cpu_hysteresis, uint, 0644);
+MODULE_PARM_DESC(io_cpu_hysteresis,
+		 "io_work runs on a new CPU before a queue migrates (default:32)");
+
+#define NVME_TCP_SUBMIT_IDLE	HZ
+
 enum nvme_tcp_send_state {
 	NVME_TCP_SEND_CMD_PDU = 0,
 	NVME_TCP_SEND_H2C_PDU,
@@ -79,6 +102,14 @@ struct nvme_tcp_queue {
 	struct work_struct	io_work;
 	int			io_cpu;
 
+	/* adaptive io_cpu steering */
+	int			submit_cpu;
+	unsigned long		submit_time;
+	int			rx_cpu;
+	int			steer_cpu;
+	unsigned int		steer_streak;
+	unsigned long		nr_migrations;
+
 	struct mutex		send_mutex;
 	struct llist_head	req_list;
 	struct list_head	send_list;
@@ -133,11 +164,13 @@ struct nvme_tcp_ctrl {
 #ifdef HAVE_BLK_MQ_HCTX_TYPE
 	u32			io_queues[HCTX_MAX_TYPES];
 #endif
+	struct dentry		*debugfs;
 };
 
 static LIST_HEAD(nvme_tcp_ctrl_list);
 static DEFINE_MUTEX(nvme_tcp_ctrl_mutex);
 static struct workqueue_struct *nvme_tcp_wq;
+static struct dentry *nvme_tcp_debugfs;
 static const struct blk_mq_ops nvme_tcp_mq_ops;
 static const struct blk_mq_ops nvme_tcp_admin_mq_ops;
 static int nvme_tcp_try_send(struct nvme_tcp_queue *queue);
@@ -1114,12 +1147,48 @@ static int nvme_tcp_try_recv(struct nvme_tcp_queue *queue)
 	return consumed;
 }
 
+static void nvme_tcp_steer_io_cpu(struct nvme_tcp_queue *queue)
+{
+	int cpu;
+
+	queue->rx_cpu = READ_ONCE(queue->sock->sk->sk_incoming_cpu);
+
+	cpu = READ_ONCE(queue->submit_cpu);
+	if (cpu >= 0 && time_after(jiffies, READ_ONCE(queue->submit_time) +
+				   NVME_TCP_SUBMIT_IDLE)) {
+		/* the submitter went idle or away */
+		WRITE_ONCE(queue->submit_cpu, -1);
+		cpu = -1;
+	}
+	if (cpu < 0)
+		cpu = queue->rx_cpu;
+	if (cpu < 0 || cpu == queue->io_cpu || !cpu_online(cpu)) {
+		queue->steer_streak = 0;
+		return;
+	}
+
+	if (cpu != queue->steer_cpu) {
+		queue->steer_cpu = cpu;
+		queue->steer_streak = 0;
+	}
+	if (++queue->steer_streak < READ_ONCE(io_cpu_hysteresis))
+		return;
+
+	/* takes effect with the next queue_work_on() */
+	WRITE_ONCE(queue->io_cpu, cpu);
+	queue->steer_streak = 0;
+	queue->nr_migrations++;
+}
+
 static void nvme_tcp_io_work(struct work_struct *w)
 {
 	struct nvme_tcp_queue *queue =
 		container_of(w, struct nvme_tcp_queue, io_work);
 	unsigned long deadline = jiffies + msecs_to_jiffies(1);
 
+	if (READ_ONCE(adaptive_io_cpu))
+		nvme_tcp_steer_io_cpu(queue);
+
 	do {
 		bool pending = false;
 		int result;
@@ -1475,6 +1544,10 @@ static int nvme_tcp_alloc_queue(struct nvme_ctrl *nctrl,
 		n = (qid - 1) % num_online_cpus();
 	queue->io_cpu = cpumask_next_wrap(n - 1, cpu_online_mask, -1, false);
 #endif
+	queue->submit_cpu = -1;
+	queue->rx_cpu = -1;
+	queue->steer_cpu = -1;
+	queue->steer_streak = 0;
 	queue->request = NULL;
 	queue->data_remaining = 0;
 	queue->ddgst_remaining = 0;
@@ -2162,10 +2235,45 @@ static void nvme_tcp_free_ctrl(struct nvme_ctrl *nctrl)
 
 	nvmf_free_options(nctrl->opts);
 free_ctrl:
+	debugfs_remove(ctrl->debugfs);
 	kfree(ctrl->queues);
 	kfree(ctrl);
 }
 
+static int nvme_tcp_io_cpu_show(struct seq_file *m, void *p)
+{
+	struct nvme_tcp_ctrl *ctrl = m->private;
+	int i;
+
+	seq_puts(m, "qid io_cpu submit_cpu rx_cpu migrations\n");
+	for (i = 0; i < ctrl->ctrl.queue_count; i++) {
+		struct nvme_tcp_queue *queue = &ctrl->queues[i];
+
+		if (!test_bit(NVME_TCP_Q_ALLOCATED, &queue->flags))
+			continue;
+		seq_printf(m, "%d %d %d %d %lu\n", i,
+			   READ_ONCE(queue->io_cpu),
+			   READ_ONCE(queue->submit_cpu),
+			   READ_ONCE(queue->rx_cpu),
+			   READ_ONCE(queue->nr_migrations));
+	}
+
+	return 0;
+}
+
+static int nvme_tcp_io_cpu_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nvme_tcp_io_cpu_show, inode->i_private);
+}
+
+static const struct file_operations nvme_tcp_io_cpu_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nvme_tcp_io_cpu_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static void nvme_tcp_set_sg_null(struct nvme_command *c)
 {
 	struct nvme_sgl_desc *sg = &c->common.dptr.sgl;
@@ -2375,6 +2483,11 @@ static blk_status_t nvme_tcp_queue_rq(struct blk_mq_hw_ctx *hctx,
 
 	blk_mq_start_request(rq);
 
+	if (READ_ONCE(adaptive_io_cpu)) {
+		WRITE_ONCE(queue->submit_cpu, raw_smp_processor_id());
+		if (READ_ONCE(queue->submit_time) != jiffies)
+			WRITE_ONCE(queue->submit_time, jiffies);
+	}
 	nvme_tcp_queue_request(req, true, bd->last);
 
 	return BLK_STS_OK;
@@ -2576,6 +2689,9 @@ static struct nvme_ctrl *nvme_tcp_create_ctrl(struct device *dev,
 	if (ret)
 		goto out_kfree_queues;
 
+	ctrl->debugfs = debugfs_create_file(dev_name(ctrl->ctrl.device), 0444,
+			nvme_tcp_debugfs, ctrl, &nvme_tcp_io_cpu_fops);
+
 	if (!nvme_change_ctrl_state(&ctrl->ctrl, NVME_CTRL_CONNECTING)) {
 		WARN_ON_ONCE(1);
 		ret = -EINTR;
@@ -2627,6 +2743,7 @@ static int __init nvme_tcp_init_module(void)
 	if (!nvme_tcp_wq)
 		return -ENOMEM;
 
+	nvme_tcp_debugfs = debugfs_create_dir("nvme_tcp", NULL);
 	nvmf_register_transport(&nvme_tcp_transport);
 	return 0;
 }
@@ -2643,6 +2760,7 @@ static void __exit nvme_tcp_cleanup_module(void)
 	mutex_unlock(&nvme_tcp_ctrl_mutex);
 	flush_workqueue(nvme_delete_wq);
 
+	debugfs_remove_recursive(nvme_tcp_debugfs);
 	destroy_workqueue(nvme_tcp_wq);
 }
 
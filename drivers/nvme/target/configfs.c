@@ -383,6 +383,48 @@ static ssize_t nvmet_param_offload_queues_store(struct config_item *item,
 
 CONFIGFS_ATTR(nvmet_, param_offload_queues);
 
+static ssize_t nvmet_param_poll_cpus_show(struct config_item *item,
+		char *page)
+{
+	struct nvmet_port *port = to_nvmet_port(item);
+
+	return snprintf(page, PAGE_SIZE, "%*pbl\n",
+			cpumask_pr_args(port->poll_cpumask));
+}
+
+static ssize_t nvmet_param_poll_cpus_store(struct config_item *item,
+		const char *page, size_t count)
+{
+	struct nvmet_port *port = to_nvmet_port(item);
+	cpumask_var_t mask;
+	int ret;
+
+	if (nvmet_is_port_enabled(port, __func__))
+		return -EACCES;
+
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	ret = cpulist_parse(page, mask);
+	if (ret || !cpumask_subset(mask, cpu_online_mask)) {
+		pr_err("Invalid value '%s' for poll_cpus\n", page);
+		free_cpumask_var(mask);
+		return -EINVAL;
+	}
+	if (!cpumask_empty(mask) &&
+	    port->disc_addr.trtype != NVMF_TRTYPE_TCP) {
+		pr_err("poll_cpus is only supported on tcp ports\n");
+		free_cpumask_var(mask);
+		return -EINVAL;
+	}
+	cpumask_copy(port->poll_cpumask, mask);
+	free_cpumask_var(mask);
+
+	return count;
+}
+
+CONFIGFS_ATTR(nvmet_, param_poll_cpus);
+
 static ssize_t nvmet_param_offload_srq_size_show(struct config_item *item,
 		char *page)
 {
@@ -693,6 +735,12 @@ static ssize_t nvmet_ns_buffered_io_store(struct config_item *item,
 		return -EINVAL;
 	}
 
+	if (!val && ns->async_io) {
+		pr_err("disable async_io before disabling buffered_io.\n");
+		mutex_unlock(&ns->subsys->lock);
+		return -EINVAL;
+	}
+
 	ns->buffered_io = val;
 	mutex_unlock(&ns->subsys->lock);
 	return count;
@@ -700,6 +748,260 @@ static ssize_t nvmet_ns_buffered_io_store(struct config_item *item,
 
 CONFIGFS_ATTR(nvmet_ns_, buffered_io);
 
+static ssize_t nvmet_ns_async_io_show(struct config_item *item, char *page)
+{
+	return sprintf(page, "%d\n", to_nvmet_ns(item)->async_io);
+}
+
+static ssize_t nvmet_ns_async_io_store(struct config_item *item,
+		const char *page, size_t count)
+{
+	struct nvmet_ns *ns = to_nvmet_ns(item);
+	bool val;
+
+	if (strtobool(page, &val))
+		return -EINVAL;
+
+	mutex_lock(&ns->subsys->lock);
+	if (ns->enabled) {
+		pr_err("disable ns before setting async_io value.\n");
+		mutex_unlock(&ns->subsys->lock);
+		return -EINVAL;
+	}
+
+	/* the engine only serves the buffered I/O slow path */
+	if (val && !ns->buffered_io) {
+		pr_err("enable buffered_io before setting async_io.\n");
+		mutex_unlock(&ns->subsys->lock);
+		return -EINVAL;
+	}
+
+	ns->async_io = val;
+	mutex_unlock(&ns->subsys->lock);
+	return count;
+}
+
+CONFIGFS_ATTR(nvmet_ns_, async_io);
+
+static const struct nvmet_type_name_map nvmet_buffered_io_policy[] = {
+	{ NVMET_BUFFERED_IO_GLOBAL,	"global" },
+	{ NVMET_BUFFERED_IO_CPU,	"cpu" },
+	{ NVMET_BUFFERED_IO_NUMA,	"numa" },
+};
+
+static ssize_t nvmet_ns_buffered_io_policy_show(struct config_item *item,
+		char *page)
+{
+	struct nvmet_ns *ns = to_nvmet_ns(item);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(nvmet_buffered_io_policy); i++) {
+		if (ns->buffered_io_policy == nvmet_buffered_io_policy[i].type)
+			return sprintf(page, "%s\n",
+				       nvmet_buffered_io_policy[i].name);
+	}
+
+	return sprintf(page, "\n");
+}
+
+static ssize_t nvmet_ns_buffered_io_policy_store(struct config_item *item,
+		const char *page, size_t count)
+{
+	struct nvmet_ns *ns = to_nvmet_ns(item);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(nvmet_buffered_io_policy); i++) {
+		if (sysfs_streq(page, nvmet_buffered_io_policy[i].name))
+			goto found;
+	}
+
+	pr_err("Invalid value '%s' for buffered_io_policy\n", page);
+	return -EINVAL;
+
+found:
+	mutex_lock(&ns->subsys->lock);
+	if (ns->enabled) {
+		pr_err("disable ns before setting buffered_io_policy value.\n");
+		mutex_unlock(&ns->subsys->lock);
+		return -EINVAL;
+	}
+
+	ns->buffered_io_policy = nvmet_buffered_io_policy[i].type;
+	mutex_unlock(&ns->subsys->lock);
+	return count;
+}
+
+CONFIGFS_ATTR(nvmet_ns_, buffered_io_policy);
+
+static ssize_t nvmet_ns_buffered_io_delay_show(struct config_item *item,
+		char *page)
+{
+	return nvmet_hist_show(to_nvmet_ns(item)->buffered_io_delay, page);
+}
+
+static ssize_t nvmet_ns_buffered_io_delay_store(struct config_item *item,
+		const char *page, size_t count)
+{
+	struct nvmet_ns *ns = to_nvmet_ns(item);
+	bool val;
+
+	/* writing 0 resets the histogram */
+	if (strtobool(page, &val) || val)
+		return -EINVAL;
+
+	nvmet_hist_reset(ns->buffered_io_delay);
+	return count;
+}
+
+CONFIGFS_ATTR(nvmet_ns_, buffered_io_delay);
+
+static ssize_t nvmet_ns_async_io_delay_show(struct config_item *item,
+		char *page)
+{
+	return nvmet_hist_show(to_nvmet_ns(item)->async_io_delay, page);
+}
+
+static ssize_t nvmet_ns_async_io_delay_store(struct config_item *item,
+		const char *page, size_t count)
+{
+	struct nvmet_ns *ns = to_nvmet_ns(item);
+	bool val;
+
+	/* writing 0 resets the histogram */
+	if (strtobool(page, &val) || val)
+		return -EINVAL;
+
+	nvmet_hist_reset(ns->async_io_delay);
+	return count;
+}
+
+CONFIGFS_ATTR(nvmet_ns_, async_io_delay);
+
+static ssize_t nvmet_ns_lat_store(struct nvmet_ns *ns, int op,
+		const char *page, size_t count)
+{
+	bool val;
+
+	/* writing 0 resets the histogram */
+	if (strtobool(page, &val) || val)
+		return -EINVAL;
+
+	nvmet_hist_reset(&ns->lat->op[op]);
+	return count;
+}
+
+static ssize_t nvmet_ns_latency_read_show(struct config_item *item,
+		char *page)
+{
+	return nvmet_hist_show(&to_nvmet_ns(item)->lat->op[NVMET_LAT_READ],
+			       page);
+}
+
+static ssize_t nvmet_ns_latency_read_store(struct config_item *item,
+		const char *page, size_t count)
+{
+	return nvmet_ns_lat_store(to_nvmet_ns(item), NVMET_LAT_READ,
+				  page, count);
+}
+
+CONFIGFS_ATTR(nvmet_ns_, latency_read);
+
+static ssize_t nvmet_ns_latency_write_show(struct config_item *item,
+		char *page)
+{
+	return nvmet_hist_show(&to_nvmet_ns(item)->lat->op[NVMET_LAT_WRITE],
+			       page);
+}
+
+static ssize_t nvmet_ns_latency_write_store(struct config_item *item,
+		const char *page, size_t count)
+{
+	return nvmet_ns_lat_store(to_nvmet_ns(item), NVMET_LAT_WRITE,
+				  page, count);
+}
+
+CONFIGFS_ATTR(nvmet_ns_, latency_write);
+
+static ssize_t nvmet_ns_latency_flush_show(struct config_item *item,
+		char *page)
+{
+	return nvmet_hist_show(&to_nvmet_ns(item)->lat->op[NVMET_LAT_FLUSH],
+			       page);
+}
+
+static ssize_t nvmet_ns_latency_flush_store(struct config_item *item,
+		const char *page, size_t count)
+{
+	return nvmet_ns_lat_store(to_nvmet_ns(item), NVMET_LAT_FLUSH,
+				  page, count);
+}
+
+CONFIGFS_ATTR(nvmet_ns_, latency_flush);
+
+static ssize_t nvmet_ns_latency_queues_show(struct config_item *item,
+		char *page)
+{
+	return nvmet_ns_queue_lat_show(to_nvmet_ns(item), page);
+}
+
+static ssize_t nvmet_ns_latency_queues_store(struct config_item *item,
+		const char *page, size_t count)
+{
+	bool val;
+
+	/* writing 0 resets all per-queue histograms */
+	if (strtobool(page, &val) || val)
+		return -EINVAL;
+
+	nvmet_ns_queue_lat_reset(to_nvmet_ns(item));
+	return count;
+}
+
+CONFIGFS_ATTR(nvmet_ns_, latency_queues);
+
+static ssize_t nvmet_ns_wb_cache_mb_show(struct config_item *item,
+		char *page)
+{
+	return sprintf(page, "%u\n", to_nvmet_ns(item)->wb_cache_mb);
+}
+
+static ssize_t nvmet_ns_wb_cache_mb_store(struct config_item *item,
+		const char *page, size_t count)
+{
+	struct nvmet_ns *ns = to_nvmet_ns(item);
+	u32 val;
+
+	if (kstrtou32(page, 0, &val))
+		return -EINVAL;
+
+	mutex_lock(&ns->subsys->lock);
+	if (ns->enabled) {
+		pr_err("disable ns before setting wb_cache_mb value.\n");
+		mutex_unlock(&ns->subsys->lock);
+		return -EINVAL;
+	}
+
+	ns->wb_cache_mb = val;
+	mutex_unlock(&ns->subsys->lock);
+	return count;
+}
+
+CONFIGFS_ATTR(nvmet_ns_, wb_cache_mb);
+
+static ssize_t nvmet_ns_wb_cache_stats_show(struct config_item *item,
+		char *page)
+{
+	struct nvmet_ns *ns = to_nvmet_ns(item);
+	ssize_t ret;
+
+	mutex_lock(&ns->subsys->lock);
+	ret = nvmet_wbc_stats_show(ns, page);
+	mutex_unlock(&ns->subsys->lock);
+	return ret;
+}
+
+CONFIGFS_ATTR_RO(nvmet_ns_, wb_cache_stats);
+
 static ssize_t nvmet_ns_offload_cmd_tmo_us_show(struct config_item *item,
 						char *page)
 {
@@ -876,6 +1178,16 @@ static struct configfs_attribute *nvmet_ns_attrs[] = {
 	&nvmet_ns_attr_offload_backend_error_cmds,
 	&nvmet_ns_attr_offload_cmd_tmo_us,
 	&nvmet_ns_attr_buffered_io,
+	&nvmet_ns_attr_async_io,
+	&nvmet_ns_attr_buffered_io_policy,
+	&nvmet_ns_attr_buffered_io_delay,
+	&nvmet_ns_attr_async_io_delay,
+	&nvmet_ns_attr_latency_read,
+	&nvmet_ns_attr_latency_write,
+	&nvmet_ns_attr_latency_flush,
+	&nvmet_ns_attr_latency_queues,
+	&nvmet_ns_attr_wb_cache_mb,
+	&nvmet_ns_attr_wb_cache_stats,
 	&nvmet_ns_attr_revalidate_size,
 #ifdef CONFIG_PCI_P2PDMA
 	&nvmet_ns_attr_p2pmem,
@@ -1885,6 +2197,7 @@ static void nvmet_port_release(struct config_item *item)
 
 	list_del(&port->global_entry);
 
+	free_cpumask_var(port->poll_cpumask);
 	kfree(port->ana_state);
 	kfree(port);
 }
@@ -1900,6 +2213,7 @@ static struct configfs_attribute *nvmet_port_attrs[] = {
 	&nvmet_attr_param_offload_queues,
 	&nvmet_attr_param_offload_srq_size,
 	&nvmet_attr_param_offload_queue_size,
+	&nvmet_attr_param_poll_cpus,
 #ifdef CONFIG_BLK_DEV_INTEGRITY
 #ifdef HAVE_BLKDEV_BIO_INTEGRITY_BYTES
 	&nvmet_attr_param_pi_enable,
@@ -1939,6 +2253,12 @@ static struct config_group *nvmet_ports_make(struct config_group *group,
 		return ERR_PTR(-ENOMEM);
 	}
 
+	if (!zalloc_cpumask_var(&port->poll_cpumask, GFP_KERNEL)) {
+		kfree(port->ana_state);
+		kfree(port);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	for (i = 1; i <= NVMET_MAX_ANAGRPS; i++) {
 		if (i == NVMET_DEFAULT_ANA_GRPID)
 			port->ana_state[1] = NVME_ANA_OPTIMIZED;
@@ -19,6 +19,9 @@
 #include "nvmet.h"
 
 struct workqueue_struct *buffered_io_wq;
+struct workqueue_struct *buffered_io_cpu_wq;
+struct workqueue_struct *buffered_io_numa_wq;
+struct workqueue_struct *file_aio_wq;
 static const struct nvmet_fabrics_ops *nvmet_transports[NVMF_TRTYPE_MAX];
 static DEFINE_IDA(cntlid_ida);
 
@@ -436,6 +439,15 @@ int nvmet_enable_port(struct nvmet_port *port, struct nvmet_subsys *subsys)
 		goto out_module_put;
 	}
 
+	/* only nvmet-tcp knows how to run busy-poll threads */
+	if (!cpumask_empty(port->poll_cpumask) &&
+	    port->disc_addr.trtype != NVMF_TRTYPE_TCP) {
+		pr_err("poll cpus are not supported by transport type %d\n",
+		       port->disc_addr.trtype);
+		ret = -EINVAL;
+		goto out_module_put;
+	}
+
 	if (port->pi_enable && subsys->offloadble) {
 		pr_err("T10-PI is not supported on offloadble subsystem\n");
 		ret = -EINVAL;
@@ -562,6 +574,7 @@ void nvmet_put_namespace(struct nvmet_ns *ns)
 
 static void nvmet_ns_dev_disable(struct nvmet_ns *ns)
 {
+	nvmet_wbc_destroy(ns);
 	nvmet_bdev_ns_disable(ns);
 #ifdef HAVE_FS_HAS_KIOCB
 	nvmet_file_ns_disable(ns);
@@ -696,6 +709,38 @@ static int nvmet_offload_ns_enable(struct nvmet_ns *ns)
 }
 
 
+/*
+ * Per-queue latency histograms are allocated for every enabled namespace of
+ * the subsystem when an I/O queue is set up, and for the queues already set
+ * up when a namespace is enabled, both under subsys->lock.  Failing to
+ * allocate one only leaves that queue out of queue_lat.
+ */
+static void nvmet_ns_alloc_queue_lat(struct nvmet_ns *ns, u16 qid)
+{
+	struct nvmet_hist __percpu *hist;
+
+	if (!qid || qid > NVMET_NR_QUEUES || ns->queue_lat[qid])
+		return;
+
+	hist = alloc_percpu(struct nvmet_hist);
+	if (hist)
+		WRITE_ONCE(ns->queue_lat[qid], hist);
+}
+
+static void nvmet_ns_alloc_queue_lats(struct nvmet_ns *ns)
+{
+	struct nvmet_subsys *subsys = ns->subsys;
+	struct nvmet_ctrl *ctrl;
+	u16 qid;
+
+	lockdep_assert_held(&subsys->lock);
+
+	list_for_each_entry(ctrl, &subsys->ctrls, subsys_entry)
+		for (qid = 1; qid <= subsys->max_qid; qid++)
+			if (READ_ONCE(ctrl->sqs[qid]))
+				nvmet_ns_alloc_queue_lat(ns, qid);
+}
+
 int nvmet_ns_enable(struct nvmet_ns *ns)
 {
 	struct nvmet_subsys *subsys = ns->subsys;
@@ -729,6 +774,10 @@ int nvmet_ns_enable(struct nvmet_ns *ns)
 	if (ret)
 		goto out_dev_disable;
 
+	ret = nvmet_wbc_init(ns);
+	if (ret)
+		goto out_dev_disable;
+
 	list_for_each_entry(ctrl, &subsys->ctrls, subsys_entry)
 		nvmet_p2pmem_ns_add_p2p(ctrl, ns);
 	
@@ -753,6 +802,7 @@ int nvmet_ns_enable(struct nvmet_ns *ns)
 		goto out_restore_subsys_maxnsid;
 
 	subsys->nr_namespaces++;
+	nvmet_ns_alloc_queue_lats(ns);
 
 	if (ns->pdev) {
 		ret = nvmet_offload_ns_enable(ns);
@@ -842,12 +892,20 @@ out_unlock:
 
 void nvmet_ns_free(struct nvmet_ns *ns)
 {
+	int i;
+
 	nvmet_ns_disable(ns);
 
 	down_write(&nvmet_ana_sem);
 	nvmet_ana_group_enabled[ns->anagrpid]--;
 	up_write(&nvmet_ana_sem);
 
+	for (i = 0; i <= NVMET_NR_QUEUES; i++)
+		free_percpu(ns->queue_lat[i]);
+	kfree(ns->queue_lat);
+	free_percpu(ns->lat);
+	free_percpu(ns->async_io_delay);
+	free_percpu(ns->buffered_io_delay);
 	kfree(ns->device_path);
 	kfree(ns);
 }
@@ -860,6 +918,23 @@ struct nvmet_ns *nvmet_ns_alloc(struct nvmet_subsys *subsys, u32 nsid)
 	if (!ns)
 		return NULL;
 
+	ns->buffered_io_delay = alloc_percpu(struct nvmet_hist);
+	if (!ns->buffered_io_delay)
+		goto out_free_ns;
+
+	ns->async_io_delay = alloc_percpu(struct nvmet_hist);
+	if (!ns->async_io_delay)
+		goto out_free_delay;
+
+	ns->lat = alloc_percpu(struct nvmet_ns_lat);
+	if (!ns->lat)
+		goto out_free_async_delay;
+
+	ns->queue_lat = kcalloc(NVMET_NR_QUEUES + 1, sizeof(*ns->queue_lat),
+				GFP_KERNEL);
+	if (!ns->queue_lat)
+		goto out_free_lat;
+
 	init_completion(&ns->disable_done);
 
 	ns->nsid = nsid;
@@ -872,9 +947,165 @@ struct nvmet_ns *nvmet_ns_alloc(struct nvmet_subsys *subsys, u32 nsid)
 
 	uuid_gen(&ns->uuid);
 	ns->buffered_io = false;
+	ns->async_io = false;
+	ns->buffered_io_policy = NVMET_BUFFERED_IO_GLOBAL;
 	ns->offload_cmd_tmo_us = NVMET_DEFAULT_CMD_TIMEOUT_USEC;
 
 	return ns;
+
+out_free_lat:
+	free_percpu(ns->lat);
+out_free_async_delay:
+	free_percpu(ns->async_io_delay);
+out_free_delay:
+	free_percpu(ns->buffered_io_delay);
+out_free_ns:
+	kfree(ns);
+	return NULL;
+}
+
+static u64 nvmet_hist_sum(struct nvmet_hist __percpu *hist, u64 *sum)
+{
+	u64 total = 0;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct nvmet_hist *h = per_cpu_ptr(hist, cpu);
+
+		for (i = 0; i < NVMET_HIST_BUCKETS; i++)
+			sum[i] += READ_ONCE(h->bucket[i]);
+	}
+
+	for (i = 0; i < NVMET_HIST_BUCKETS; i++)
+		total += sum[i];
+	return total;
+}
+
+/* bucket holding the given per-mille rank */
+static int nvmet_hist_quantile(u64 *sum, u64 total, unsigned int permille)
+{
+	u64 rank = div_u64(total * permille + 999, 1000), seen = 0;
+	int i;
+
+	for (i = 0; i < NVMET_HIST_BUCKETS - 1; i++) {
+		seen += sum[i];
+		if (seen >= rank)
+			break;
+	}
+	return i;
+}
+
+/* upper bound in usecs of a bucket, the lower one of the open ended last */
+static int nvmet_hist_print_bound(char *buf, size_t size, int b)
+{
+	if (b == NVMET_HIST_BUCKETS - 1)
+		return scnprintf(buf, size, " >=%lu", 1UL << (b - 1));
+	return scnprintf(buf, size, " %lu", 1UL << b);
+}
+
+ssize_t nvmet_hist_show(struct nvmet_hist __percpu *hist, char *page)
+{
+	u64 sum[NVMET_HIST_BUCKETS] = { };
+	ssize_t len = 0;
+	int i;
+
+	nvmet_hist_sum(hist, sum);
+
+	for (i = 0; i < NVMET_HIST_BUCKETS - 1; i++)
+		len += sprintf(page + len, "<%lu %llu\n", 1UL << i, sum[i]);
+	len += sprintf(page + len, ">=%lu %llu\n", 1UL << (i - 1), sum[i]);
+
+	return len;
+}
+
+void nvmet_hist_reset(struct nvmet_hist __percpu *hist)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(hist, cpu), 0, sizeof(struct nvmet_hist));
+}
+
+ssize_t nvmet_ns_queue_lat_show(struct nvmet_ns *ns, char *page)
+{
+	struct nvmet_hist __percpu *hist;
+	static const unsigned int permille[] = { 500, 990, 999 };
+	ssize_t len;
+	u64 total;
+	int qid, i;
+
+	len = scnprintf(page, PAGE_SIZE, "qid samples p50 p99 p999\n");
+	for (qid = 0; qid <= NVMET_NR_QUEUES; qid++) {
+		u64 sum[NVMET_HIST_BUCKETS] = { };
+
+		hist = READ_ONCE(ns->queue_lat[qid]);
+		if (!hist)
+			continue;
+
+		total = nvmet_hist_sum(hist, sum);
+		if (!total)
+			continue;
+
+		len += scnprintf(page + len, PAGE_SIZE - len, "%d %llu",
+				 qid, total);
+		for (i = 0; i < ARRAY_SIZE(permille); i++)
+			len += nvmet_hist_print_bound(page + len,
+					PAGE_SIZE - len,
+					nvmet_hist_quantile(sum, total,
+							    permille[i]));
+		len += scnprintf(page + len, PAGE_SIZE - len, "\n");
+	}
+
+	return len;
+}
+
+void nvmet_ns_queue_lat_reset(struct nvmet_ns *ns)
+{
+	struct nvmet_hist __percpu *hist;
+	int qid;
+
+	for (qid = 0; qid <= NVMET_NR_QUEUES; qid++) {
+		hist = READ_ONCE(ns->queue_lat[qid]);
+		if (hist)
+			nvmet_hist_reset(hist);
+	}
+}
+
+static void nvmet_ns_account_latency(struct nvmet_req *req)
+{
+	struct nvmet_hist __percpu *hist;
+	struct nvmet_ns *ns = req->ns;
+	u16 qid = req->sq->qid;
+	u64 usecs;
+	int op;
+
+	/* admin opcodes overlap the I/O ones */
+	if (!qid)
+		return;
+
+	switch (req->cmd->common.opcode) {
+	case nvme_cmd_read:
+		op = NVMET_LAT_READ;
+		break;
+	case nvme_cmd_write:
+		op = NVMET_LAT_WRITE;
+		break;
+	case nvme_cmd_flush:
+		op = NVMET_LAT_FLUSH;
+		break;
+	default:
+		return;
+	}
+
+	usecs = div_u64(ktime_get_ns() - req->start_time, NSEC_PER_USEC);
+	nvmet_hist_add(&ns->lat->op[op], usecs);
+
+	if (unlikely(qid > NVMET_NR_QUEUES))
+		return;
+
+	hist = READ_ONCE(ns->queue_lat[qid]);
+	if (likely(hist))
+		nvmet_hist_add(hist, usecs);
 }
 
 static void nvmet_update_sq_head(struct nvmet_req *req)
@@ -932,8 +1163,10 @@ static void __nvmet_req_complete(struct nvmet_req *req, u16 status)
 
 	trace_nvmet_req_complete(req);
 
-	if (req->ns)
+	if (req->ns) {
+		nvmet_ns_account_latency(req);
 		nvmet_put_namespace(req->ns);
+	}
 	req->ops->queue_response(req);
 }
 
@@ -961,6 +1194,16 @@ void nvmet_sq_setup(struct nvmet_ctrl *ctrl, struct nvmet_sq *sq,
 	sq->size = size;
 
 	ctrl->sqs[qid] = sq;
+
+	if (qid) {
+		struct nvmet_ns *ns;
+		unsigned long idx;
+
+		mutex_lock(&ctrl->subsys->lock);
+		xa_for_each(&ctrl->subsys->namespaces, idx, ns)
+			nvmet_ns_alloc_queue_lat(ns, qid);
+		mutex_unlock(&ctrl->subsys->lock);
+	}
 }
 
 static void nvmet_confirm_sq(struct percpu_ref *ref)
@@ -984,6 +1227,7 @@ void nvmet_sq_destroy(struct nvmet_sq *sq)
 	wait_for_completion(&sq->confirm_done);
 	wait_for_completion(&sq->free_done);
 	percpu_ref_exit(&sq->ref);
+	nvmet_sgl_pool_destroy(&sq->sgl_pool);
 
 	if (ctrl) {
 		nvmet_ctrl_put(ctrl);
@@ -1010,6 +1254,7 @@ int nvmet_sq_init(struct nvmet_sq *sq)
 	}
 	init_completion(&sq->free_done);
 	init_completion(&sq->confirm_done);
+	nvmet_sgl_pool_init(&sq->sgl_pool);
 
 	return 0;
 }
@@ -1100,6 +1345,9 @@ bool nvmet_req_init(struct nvmet_req *req, struct nvmet_cq *cq,
 	req->ns = NULL;
 	req->error_loc = NVMET_NO_ERROR_LOC;
 	req->error_slba = 0;
+	req->start_time = ktime_get_ns();
+	req->wbc_fixup = false;
+	req->wbc_fua_ready = false;
 
 	/* no support for fused commands yet */
 	if (unlikely(flags & (NVME_CMD_FUSE_FIRST | NVME_CMD_FUSE_SECOND))) {
@@ -1220,99 +1468,249 @@ static bool nvmet_req_find_p2p_dev(struct nvmet_req *req)
 	return false;
 }
 
-#ifndef HAVE_SGL_FREE
-static void nvmet_free_sgl(struct scatterlist *sgl, unsigned int nents)
+/*
+ * Per-queue page cache for data buffers.  Pages released by a completed
+ * command stay on its submission queue (up to sgl_pool_high_wmark) and
+ * back the next command, so the steady state never reaches the page
+ * allocator.  Under memory pressure the shrinker trims every pool down
+ * to sgl_pool_low_wmark.
+ */
+static unsigned int sgl_pool_high_wmark = 256;
+module_param(sgl_pool_high_wmark, uint, 0644);
+MODULE_PARM_DESC(sgl_pool_high_wmark,
+		 "max pages cached per nvmet queue for data buffers (default:256)");
+
+static unsigned int sgl_pool_low_wmark = 32;
+module_param(sgl_pool_low_wmark, uint, 0644);
+MODULE_PARM_DESC(sgl_pool_low_wmark,
+		 "pages per nvmet queue kept under memory pressure (default:32)");
+
+static LIST_HEAD(nvmet_sgl_pools);
+static DEFINE_SPINLOCK(nvmet_sgl_pools_lock);
+
+static void nvmet_sgl_pool_init(struct nvmet_sgl_pool *pool)
 {
-	struct scatterlist *sg;
-	int count;
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->pages);
+	pool->nr_pages = 0;
+	pool->dead = false;
 
-	if (!sgl || !nents)
-		return;
+	spin_lock(&nvmet_sgl_pools_lock);
+	list_add_tail(&pool->entry, &nvmet_sgl_pools);
+	spin_unlock(&nvmet_sgl_pools_lock);
+}
 
-	for_each_sg(sgl, sg, nents, count)
-		__free_page(sg_page(sg));
-	kfree(sgl);
+static void nvmet_sgl_free_page_list(struct list_head *pages)
+{
+	struct page *page, *tmp;
+
+	list_for_each_entry_safe(page, tmp, pages, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
 }
-#endif
 
-#ifndef HAVE_SGL_ALLOC
-static int nvmet_alloc_sgl(struct scatterlist **sgl, unsigned int *nents,
-               u32 length)
+/* return @nr pages from @pages to @pool, freeing what does not fit */
+static void nvmet_sgl_pool_put_pages(struct nvmet_sgl_pool *pool,
+		struct list_head *pages, unsigned int nr)
 {
-	struct scatterlist *sg;
+	unsigned int high = READ_ONCE(sgl_pool_high_wmark);
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	while (nr && !pool->dead && pool->nr_pages < high) {
+		list_move(pages->next, &pool->pages);
+		pool->nr_pages++;
+		nr--;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	nvmet_sgl_free_page_list(pages);
+}
+
+/* move pages above @keep to @victims, the caller frees them */
+static unsigned long nvmet_sgl_pool_trim(struct nvmet_sgl_pool *pool,
+		unsigned int keep, unsigned long nr_to_scan,
+		struct list_head *victims)
+{
+	unsigned long flags, freed = 0;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	while (pool->nr_pages > keep && freed < nr_to_scan) {
+		list_move(pool->pages.next, victims);
+		pool->nr_pages--;
+		freed++;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	return freed;
+}
+
+static void nvmet_sgl_pool_destroy(struct nvmet_sgl_pool *pool)
+{
+	unsigned long flags;
+	LIST_HEAD(victims);
+
+	spin_lock(&nvmet_sgl_pools_lock);
+	list_del(&pool->entry);
+	spin_unlock(&nvmet_sgl_pools_lock);
+
+	/* late frees from the transport go straight to the page allocator */
+	spin_lock_irqsave(&pool->lock, flags);
+	pool->dead = true;
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	nvmet_sgl_pool_trim(pool, 0, ULONG_MAX, &victims);
+	nvmet_sgl_free_page_list(&victims);
+}
+
+static unsigned long nvmet_sgl_pool_count(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	unsigned int low = READ_ONCE(sgl_pool_low_wmark);
+	struct nvmet_sgl_pool *pool;
+	unsigned long count = 0;
+
+	spin_lock(&nvmet_sgl_pools_lock);
+	list_for_each_entry(pool, &nvmet_sgl_pools, entry) {
+		unsigned int nr = READ_ONCE(pool->nr_pages);
+
+		if (nr > low)
+			count += nr - low;
+	}
+	spin_unlock(&nvmet_sgl_pools_lock);
+
+	return count;
+}
+
+static unsigned long nvmet_sgl_pool_scan(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	unsigned int low = READ_ONCE(sgl_pool_low_wmark);
+	struct nvmet_sgl_pool *pool;
+	unsigned long freed = 0;
+	LIST_HEAD(victims);
+
+	spin_lock(&nvmet_sgl_pools_lock);
+	list_for_each_entry(pool, &nvmet_sgl_pools, entry) {
+		if (freed >= sc->nr_to_scan)
+			break;
+		freed += nvmet_sgl_pool_trim(pool, low,
+					     sc->nr_to_scan - freed, &victims);
+	}
+	spin_unlock(&nvmet_sgl_pools_lock);
+
+	nvmet_sgl_free_page_list(&victims);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker nvmet_sgl_pool_shrinker = {
+	.count_objects	= nvmet_sgl_pool_count,
+	.scan_objects	= nvmet_sgl_pool_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+
+struct scatterlist *nvmet_sgl_alloc(struct nvmet_sq *sq, u32 length,
+		unsigned int *nents)
+{
+	struct nvmet_sgl_pool *pool = &sq->sgl_pool;
+	unsigned int nent, nr_cached = 0, i;
+	struct scatterlist *sgl, *sg;
+	unsigned long flags;
 	struct page *page;
-	unsigned int nent;
-	int i = 0;
+	LIST_HEAD(pages);
 
 	nent = DIV_ROUND_UP(length, PAGE_SIZE);
-	sg = kmalloc_array(nent, sizeof(struct scatterlist), GFP_KERNEL);
-	if (!sg)
-		goto out;
+	sgl = kmalloc_array(nent, sizeof(struct scatterlist), GFP_KERNEL);
+	if (!sgl)
+		return NULL;
+	sg_init_table(sgl, nent);
 
-	sg_init_table(sg, nent);
+	/* take all the cached pages we need under a single lock hold */
+	spin_lock_irqsave(&pool->lock, flags);
+	while (nr_cached < nent && pool->nr_pages) {
+		list_move(pool->pages.next, &pages);
+		pool->nr_pages--;
+		nr_cached++;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
 
-	while (length) {
+	for_each_sg(sgl, sg, nent, i) {
 		u32 page_len = min_t(u32, length, PAGE_SIZE);
 
-	        page = alloc_page(GFP_KERNEL);
-		if (!page)
-	                goto out_free_pages;
+		page = list_first_entry_or_null(&pages, struct page, lru);
+		if (page) {
+			list_del(&page->lru);
+			nr_cached--;
+		} else {
+			page = alloc_page(GFP_KERNEL);
+			if (!page)
+				goto out_free_pages;
+		}
 
-	        sg_set_page(&sg[i], page, page_len, 0);
+		sg_set_page(sg, page, page_len, 0);
 		length -= page_len;
-		i++;
 	}
-	*sgl = sg;
+
 	*nents = nent;
-	return 0;
+	return sgl;
 
 out_free_pages:
+	/* everything taken so far, set up or not, goes back to the pool */
 	while (i > 0) {
 		i--;
-		__free_page(sg_page(&sg[i]));
+		list_add(&sg_page(&sgl[i])->lru, &pages);
+		nr_cached++;
 	}
-	kfree(sg);
-out:
-	return NVME_SC_INTERNAL;
+	nvmet_sgl_pool_put_pages(pool, &pages, nr_cached);
+	kfree(sgl);
+	return NULL;
 }
-#endif
+EXPORT_SYMBOL_GPL(nvmet_sgl_alloc);
+
+void nvmet_sgl_free(struct nvmet_sq *sq, struct scatterlist *sgl)
+{
+	struct scatterlist *sg;
+	unsigned int nr = 0;
+	LIST_HEAD(pages);
+
+	if (!sgl)
+		return;
+
+	for (sg = sgl; sg; sg = sg_next(sg)) {
+		struct page *page = sg_page(sg);
+
+		if (page) {
+			list_add(&page->lru, &pages);
+			nr++;
+		}
+	}
+	nvmet_sgl_pool_put_pages(&sq->sgl_pool, &pages, nr);
+	kfree(sgl);
+}
+EXPORT_SYMBOL_GPL(nvmet_sgl_free);
 
 int nvmet_req_alloc_sgls(struct nvmet_req *req)
 {
 	if (nvmet_req_find_p2p_dev(req) && !nvmet_req_alloc_p2pmem_sgls(req))
 		return 0;
 
-#ifdef HAVE_SGL_ALLOC
-	req->sg = sgl_alloc(nvmet_data_transfer_len(req), GFP_KERNEL,
-			    &req->sg_cnt);
+	req->sg = nvmet_sgl_alloc(req->sq, nvmet_data_transfer_len(req),
+				  &req->sg_cnt);
 	if (unlikely(!req->sg))
 		goto out;
-#else
-	if (nvmet_alloc_sgl(&req->sg, &req->sg_cnt,
-			    nvmet_data_transfer_len(req)))
-		goto out;
-#endif
 
 	if (req->metadata_len) {
-#ifdef HAVE_SGL_ALLOC
-		req->metadata_sg = sgl_alloc(req->metadata_len, GFP_KERNEL,
-					     &req->metadata_sg_cnt);
+		req->metadata_sg = nvmet_sgl_alloc(req->sq, req->metadata_len,
+						   &req->metadata_sg_cnt);
 		if (unlikely(!req->metadata_sg))
 			goto out_free;
-#else
-		if (nvmet_alloc_sgl(&req->metadata_sg, &req->metadata_sg_cnt,
-				    req->metadata_len))
-			goto out_free;
-#endif
 	}
 
 	return 0;
 out_free:
-#ifdef HAVE_SGL_FREE
-	sgl_free(req->sg);
-#else
-	nvmet_free_sgl(req->sg, req->sg_cnt);
-#endif
+	nvmet_sgl_free(req->sq, req->sg);
 out:
 	return -ENOMEM;
 }
@@ -1325,15 +1723,9 @@ void nvmet_req_free_sgls(struct nvmet_req *req)
 		if (req->metadata_sg)
 			pci_p2pmem_free_sgl(req->p2p_dev, req->metadata_sg);
 	} else {
-#ifdef HAVE_SGL_FREE
-		sgl_free(req->sg);
+		nvmet_sgl_free(req->sq, req->sg);
 		if (req->metadata_sg)
-			sgl_free(req->metadata_sg);
-#else
-		nvmet_free_sgl(req->sg, req->sg_cnt);
-		if (req->metadata_sg)
-			nvmet_free_sgl(req->metadata_sg, req->metadata_sg_cnt);
-#endif
+			nvmet_sgl_free(req->sq, req->metadata_sg);
 	}
 
 	req->sg = NULL;
@@ -1847,9 +2239,45 @@ static int __init nvmet_init(void)
 		goto out;
 	}
 
+	buffered_io_cpu_wq = alloc_workqueue("nvmet-buffered-io-cpu-wq",
+			WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+	if (!buffered_io_cpu_wq) {
+		error = -ENOMEM;
+		goto out_free_work_queue;
+	}
+
+	buffered_io_numa_wq = alloc_workqueue("nvmet-buffered-io-numa-wq",
+			WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
+	if (!buffered_io_numa_wq) {
+		error = -ENOMEM;
+		goto out_free_cpu_work_queue;
+	}
+
+	file_aio_wq = alloc_workqueue("nvmet-file-aio-wq",
+			WQ_MEM_RECLAIM | WQ_HIGHPRI | WQ_UNBOUND, 0);
+	if (!file_aio_wq) {
+		error = -ENOMEM;
+		goto out_free_numa_work_queue;
+	}
+
+	nvmet_wbc_wq = alloc_workqueue("nvmet-wbc-wq",
+			WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
+	if (!nvmet_wbc_wq) {
+		error = -ENOMEM;
+		goto out_free_aio_work_queue;
+	}
+
+#ifdef HAVE_REGISTER_SHRINKER_FMT
+	error = register_shrinker(&nvmet_sgl_pool_shrinker, "nvmet-sgl-pool");
+#else
+	error = register_shrinker(&nvmet_sgl_pool_shrinker);
+#endif
+	if (error)
+		goto out_free_wbc_work_queue;
+
 	error = nvmet_init_discovery();
 	if (error)
-		goto out_free_work_queue;
+		goto out_unregister_shrinker;
 
 	error = nvmet_init_configfs();
 	if (error)
@@ -1858,6 +2286,16 @@ static int __init nvmet_init(void)
 
 out_exit_discovery:
 	nvmet_exit_discovery();
+out_unregister_shrinker:
+	unregister_shrinker(&nvmet_sgl_pool_shrinker);
+out_free_wbc_work_queue:
+	destroy_workqueue(nvmet_wbc_wq);
+out_free_aio_work_queue:
+	destroy_workqueue(file_aio_wq);
+out_free_numa_work_queue:
+	destroy_workqueue(buffered_io_numa_wq);
+out_free_cpu_work_queue:
+	destroy_workqueue(buffered_io_cpu_wq);
 out_free_work_queue:
 	destroy_workqueue(buffered_io_wq);
 out:
@@ -1869,6 +2307,11 @@ static void __exit nvmet_exit(void)
 	nvmet_exit_configfs();
 	nvmet_exit_discovery();
 	ida_destroy(&cntlid_ida);
+	unregister_shrinker(&nvmet_sgl_pool_shrinker);
+	destroy_workqueue(nvmet_wbc_wq);
+	destroy_workqueue(file_aio_wq);
+	destroy_workqueue(buffered_io_numa_wq);
+	destroy_workqueue(buffered_io_cpu_wq);
 	destroy_workqueue(buffered_io_wq);
 
 	BUILD_BUG_ON(sizeof(struct nvmf_disc_rsp_page_entry) != 1024);
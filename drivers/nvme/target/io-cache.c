@@ -0,0 +1,791 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * NVMe Over Fabrics Target write-back cache.
+ *
+ * Small writes to a namespace are copied into page sized DRAM entries
+ * indexed by their page offset in the namespace and completed right away.
+ * A per-namespace work item later writes the dirty entries back in index
+ * order, merging neighbouring pages into large sequential writes.  Flush
+ * writes back everything that was dirty when it started before flushing
+ * the backend, FUA writes go straight to the backend once any write back
+ * that may still carry older data for their range has finished.
+ *
+ * Only writes that cover each page they touch either fully or that hit a
+ * page already in the cache are absorbed, so cached pages are always
+ * complete and never need a read-modify-write cycle.  Writes that cannot
+ * be absorbed still update the cached pages they overlap before going to
+ * the backend, which keeps the cache the authoritative copy of every page
+ * it holds.
+ */
+#ifdef pr_fmt
+#undef pr_fmt
+#endif
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/blkdev.h>
+#include <linux/uio.h>
+#include <linux/xarray.h>
+#include "nvmet.h"
+
+/* largest write (in pages) that is absorbed by the cache */
+#define NVMET_WBC_MAX_WRITE_PAGES	32
+/* pages written back per batch and per backend I/O */
+#define NVMET_WBC_BATCH			256
+#define NVMET_WBC_MAX_RUN		64
+
+#define NVMET_WBC_DIRTY			XA_MARK_0
+
+static unsigned int wb_cache_expire_ms = 1000;
+module_param(wb_cache_expire_ms, uint, 0644);
+MODULE_PARM_DESC(wb_cache_expire_ms,
+	"delay in ms before dirty write-back cache pages are written back");
+
+struct nvmet_wbc_entry {
+	unsigned long		index;
+	struct page		*page;
+	bool			dirty;
+	bool			writeback;
+};
+
+struct nvmet_wbc {
+	struct nvmet_ns		*ns;
+	struct xarray		pages;
+	unsigned long		max_pages;
+	/* protected by the xarray lock */
+	unsigned long		nr_pages;
+	unsigned long		nr_dirty;
+	unsigned long		nr_clean;
+	/* reads waiting to overlay cached pages on backend data */
+	unsigned int		nr_fixups;
+	int			wb_error;
+
+	u64			read_hits;
+	u64			read_partial;
+	u64			write_absorbed;
+	u64			write_bypassed;
+	u64			wb_ios;
+	u64			wb_pages;
+
+	struct delayed_work	wb_work;
+	/* serializes writeback passes, protects batch and bvec */
+	struct mutex		wb_lock;
+	struct nvmet_wbc_entry	*batch[NVMET_WBC_BATCH];
+	struct bio_vec		bvec[NVMET_WBC_MAX_RUN];
+};
+
+struct nvmet_wbc_bio_batch {
+	atomic_t		pending;
+	int			error;
+	struct completion	done;
+};
+
+struct workqueue_struct *nvmet_wbc_wq;
+
+static struct nvmet_wbc_entry *nvmet_wbc_alloc_entry(void)
+{
+	struct nvmet_wbc_entry *e;
+
+	e = kzalloc(sizeof(*e), GFP_NOWAIT | __GFP_NOWARN);
+	if (!e)
+		return NULL;
+
+	e->page = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+	if (!e->page) {
+		kfree(e);
+		return NULL;
+	}
+	return e;
+}
+
+static void nvmet_wbc_free_entry(struct nvmet_wbc_entry *e)
+{
+	__free_page(e->page);
+	kfree(e);
+}
+
+static void nvmet_wbc_set_dirty(struct nvmet_wbc *wbc,
+		struct nvmet_wbc_entry *e)
+{
+	if (e->dirty)
+		return;
+	if (!e->writeback)
+		wbc->nr_clean--;
+	e->dirty = true;
+	__xa_set_mark(&wbc->pages, e->index, NVMET_WBC_DIRTY);
+	wbc->nr_dirty++;
+}
+
+static void nvmet_wbc_kick(struct nvmet_wbc *wbc, bool now)
+{
+	if (now)
+		mod_delayed_work(nvmet_wbc_wq, &wbc->wb_work, 0);
+	else
+		queue_delayed_work(nvmet_wbc_wq, &wbc->wb_work,
+				   msecs_to_jiffies(wb_cache_expire_ms));
+}
+
+/*
+ * Part of the I/O range [pos, pos + len) that falls into cache page @index,
+ * returned as the offset into the page, the offset into the range and the
+ * length.
+ */
+static size_t nvmet_wbc_span(unsigned long index, loff_t pos, size_t len,
+		unsigned int *page_off, size_t *skip)
+{
+	loff_t start = max_t(loff_t, pos, (loff_t)index << PAGE_SHIFT);
+	loff_t end = min_t(loff_t, pos + len,
+			   ((loff_t)index + 1) << PAGE_SHIFT);
+
+	*page_off = start & ~PAGE_MASK;
+	*skip = start - pos;
+	return end - start;
+}
+
+/* copy all cached pages overlapping the request into its SGL */
+static void nvmet_wbc_copy_to_sgl(struct nvmet_wbc *wbc,
+		struct nvmet_req *req, loff_t pos, size_t len)
+{
+	XA_STATE(xas, &wbc->pages, pos >> PAGE_SHIFT);
+	struct nvmet_wbc_entry *e;
+	unsigned int off;
+	size_t skip, n;
+
+	xas_for_each(&xas, e, (pos + len - 1) >> PAGE_SHIFT) {
+		n = nvmet_wbc_span(e->index, pos, len, &off, &skip);
+		sg_pcopy_from_buffer(req->sg, req->sg_cnt,
+				     page_address(e->page) + off, n, skip);
+	}
+}
+
+static void nvmet_wbc_copy_from_sgl(struct nvmet_wbc *wbc,
+		struct nvmet_wbc_entry *e, struct nvmet_req *req,
+		loff_t pos, size_t len)
+{
+	unsigned int off;
+	size_t skip, n;
+
+	n = nvmet_wbc_span(e->index, pos, len, &off, &skip);
+	sg_pcopy_to_buffer(req->sg, req->sg_cnt,
+			   page_address(e->page) + off, n, skip);
+	nvmet_wbc_set_dirty(wbc, e);
+}
+
+static bool nvmet_wbc_read(struct nvmet_wbc *wbc, struct nvmet_req *req,
+		loff_t pos, size_t len)
+{
+	unsigned long first = pos >> PAGE_SHIFT;
+	unsigned long last = (pos + len - 1) >> PAGE_SHIFT;
+	XA_STATE(xas, &wbc->pages, first);
+	unsigned long flags, hits = 0;
+	struct nvmet_wbc_entry *e;
+
+	xa_lock_irqsave(&wbc->pages, flags);
+	xas_for_each(&xas, e, last)
+		hits++;
+
+	if (!hits) {
+		xa_unlock_irqrestore(&wbc->pages, flags);
+		return false;
+	}
+
+	if (hits <= last - first) {
+		/*
+		 * Let the backend read the whole range and overlay the cached
+		 * pages on completion.  No clean page is freed until then, so
+		 * the backend data of a page written back meanwhile is never
+		 * returned without the overlay.
+		 */
+		wbc->nr_fixups++;
+		wbc->read_partial++;
+		req->wbc_fixup = true;
+		xa_unlock_irqrestore(&wbc->pages, flags);
+		return false;
+	}
+
+	nvmet_wbc_copy_to_sgl(wbc, req, pos, len);
+	wbc->read_hits++;
+	xa_unlock_irqrestore(&wbc->pages, flags);
+
+	nvmet_req_complete(req, 0);
+	return true;
+}
+
+/*
+ * Number of pages the write would have to add to the cache, or UINT_MAX if
+ * it only partially covers a page that is not cached.
+ */
+static unsigned int nvmet_wbc_missing(struct nvmet_wbc *wbc, loff_t pos,
+		size_t len)
+{
+	unsigned long idx, last = (pos + len - 1) >> PAGE_SHIFT;
+	unsigned int missing = 0, off;
+	size_t skip;
+
+	for (idx = pos >> PAGE_SHIFT; idx <= last; idx++) {
+		if (xa_load(&wbc->pages, idx))
+			continue;
+		if (nvmet_wbc_span(idx, pos, len, &off, &skip) != PAGE_SIZE)
+			return UINT_MAX;
+		missing++;
+	}
+	return missing;
+}
+
+/*
+ * A write back pass may have taken its copy of a cached page before a FUA
+ * write updated it, and could then land on the backend after the FUA data.
+ * Once the cache holds the new data, wait for any pass in progress and only
+ * then send the FUA write, which the backend makes durable (REQ_FUA or
+ * IOCB_DSYNC) before the request completes.
+ */
+static void nvmet_wbc_fua(struct nvmet_req *req)
+{
+	struct nvmet_wbc *wbc = req->ns->wbc;
+
+	mutex_lock(&wbc->wb_lock);
+	mutex_unlock(&wbc->wb_lock);
+
+	req->wbc_fua_ready = true;
+	req->execute(req);
+}
+
+static void nvmet_wbc_fua_bdev_work(struct work_struct *w)
+{
+	nvmet_wbc_fua(container_of(w, struct nvmet_req, b.work));
+}
+
+#ifdef HAVE_FS_HAS_KIOCB
+static void nvmet_wbc_fua_file_work(struct work_struct *w)
+{
+	nvmet_wbc_fua(container_of(w, struct nvmet_req, f.work));
+}
+#endif
+
+static void nvmet_wbc_queue_fua(struct nvmet_req *req)
+{
+	struct work_struct *work = &req->b.work;
+
+#ifdef HAVE_FS_HAS_KIOCB
+	if (req->ns->file) {
+		work = &req->f.work;
+		INIT_WORK(work, nvmet_wbc_fua_file_work);
+	} else
+#endif
+		INIT_WORK(work, nvmet_wbc_fua_bdev_work);
+	queue_work(nvmet_wbc_wq, work);
+}
+
+static bool nvmet_wbc_write(struct nvmet_wbc *wbc, struct nvmet_req *req,
+		loff_t pos, size_t len)
+{
+	struct nvmet_wbc_entry *new[NVMET_WBC_MAX_WRITE_PAGES], *e;
+	unsigned long first = pos >> PAGE_SHIFT;
+	unsigned long last = (pos + len - 1) >> PAGE_SHIFT;
+	unsigned int reserved = 0, nr_new = 0, off;
+	unsigned long idx, flags;
+	bool absorb = false, full;
+	size_t skip;
+
+	if (!(req->cmd->rw.control & cpu_to_le16(NVME_RW_FUA)) &&
+	    last - first < NVMET_WBC_MAX_WRITE_PAGES) {
+		xa_lock_irqsave(&wbc->pages, flags);
+		reserved = nvmet_wbc_missing(wbc, pos, len);
+		if (reserved != UINT_MAX &&
+		    wbc->nr_pages + reserved <= wbc->max_pages) {
+			wbc->nr_pages += reserved;
+			absorb = true;
+		} else {
+			reserved = 0;
+		}
+		xa_unlock_irqrestore(&wbc->pages, flags);
+	}
+
+	while (absorb && nr_new < reserved) {
+		new[nr_new] = nvmet_wbc_alloc_entry();
+		if (!new[nr_new])
+			absorb = false;
+		else
+			nr_new++;
+	}
+
+	xa_lock_irqsave(&wbc->pages, flags);
+	for (idx = first; idx <= last; idx++) {
+		e = xa_load(&wbc->pages, idx);
+		if (!e) {
+			full = nvmet_wbc_span(idx, pos, len, &off, &skip) ==
+				PAGE_SIZE;
+			if (!absorb || !nr_new || !full) {
+				absorb = false;
+				continue;
+			}
+
+			e = new[--nr_new];
+			e->index = idx;
+			if (xa_is_err(__xa_store(&wbc->pages, idx, e,
+						 GFP_ATOMIC))) {
+				new[nr_new++] = e;
+				absorb = false;
+				continue;
+			}
+			reserved--;
+			wbc->nr_clean++;
+		}
+		nvmet_wbc_copy_from_sgl(wbc, e, req, pos, len);
+	}
+	wbc->nr_pages -= reserved;
+
+	if (absorb)
+		wbc->write_absorbed++;
+	else
+		wbc->write_bypassed++;
+	full = wbc->nr_dirty >= wbc->max_pages / 2 ||
+		(!absorb && wbc->nr_pages == wbc->max_pages);
+	xa_unlock_irqrestore(&wbc->pages, flags);
+
+	while (nr_new)
+		nvmet_wbc_free_entry(new[--nr_new]);
+
+	nvmet_wbc_kick(wbc, full);
+	if (req->cmd->rw.control & cpu_to_le16(NVME_RW_FUA)) {
+		nvmet_wbc_queue_fua(req);
+		return true;
+	}
+	if (!absorb)
+		return false;
+
+	nvmet_req_complete(req, 0);
+	return true;
+}
+
+/*
+ * Serve a read or write from the cache.  Returns true if the request was
+ * completed, false if the caller has to pass it on to the backend.
+ */
+bool nvmet_wbc_execute_rw(struct nvmet_req *req)
+{
+	struct nvmet_ns *ns = req->ns;
+	loff_t pos = le64_to_cpu(req->cmd->rw.slba) << ns->blksize_shift;
+	size_t len = req->transfer_len;
+
+	/* let the backend fail out of range I/O */
+	if (!len || pos + len > ns->size || req->wbc_fua_ready)
+		return false;
+
+	if (req->cmd->rw.opcode == nvme_cmd_write)
+		return nvmet_wbc_write(ns->wbc, req, pos, len);
+	return nvmet_wbc_read(ns->wbc, req, pos, len);
+}
+
+/* overlay cached pages on data the backend returned for a partial hit */
+void nvmet_wbc_read_done(struct nvmet_req *req)
+{
+	struct nvmet_wbc *wbc = req->ns->wbc;
+	loff_t pos = le64_to_cpu(req->cmd->rw.slba) << req->ns->blksize_shift;
+	unsigned long flags;
+
+	xa_lock_irqsave(&wbc->pages, flags);
+	nvmet_wbc_copy_to_sgl(wbc, req, pos, req->transfer_len);
+	wbc->nr_fixups--;
+	xa_unlock_irqrestore(&wbc->pages, flags);
+	req->wbc_fixup = false;
+}
+
+/*
+ * Discard and Write Zeroes go straight to the backend, zero the cached
+ * copies of the range so a later write back does not resurrect old data.
+ */
+void nvmet_wbc_zero_range(struct nvmet_ns *ns, loff_t pos, loff_t len)
+{
+	struct nvmet_wbc *wbc = ns->wbc;
+	struct nvmet_wbc_entry *e;
+	unsigned long flags;
+	unsigned int off;
+	size_t skip, n;
+	XA_STATE(xas, wbc ? &wbc->pages : NULL, pos >> PAGE_SHIFT);
+
+	if (!wbc || len <= 0)
+		return;
+
+	xa_lock_irqsave(&wbc->pages, flags);
+	xas_for_each(&xas, e, (pos + len - 1) >> PAGE_SHIFT) {
+		n = nvmet_wbc_span(e->index, pos, len, &off, &skip);
+		memset(page_address(e->page) + off, 0, n);
+		nvmet_wbc_set_dirty(wbc, e);
+	}
+	xa_unlock_irqrestore(&wbc->pages, flags);
+}
+
+/* free clean pages, unless a partial read hit may still need them */
+static void nvmet_wbc_sweep(struct nvmet_wbc *wbc)
+{
+	XA_STATE(xas, &wbc->pages, 0);
+	struct nvmet_wbc_entry *e;
+	unsigned int visited = 0;
+	unsigned long flags;
+
+	xas_lock_irqsave(&xas, flags);
+	xas_for_each(&xas, e, ULONG_MAX) {
+		if (!wbc->nr_clean || wbc->nr_fixups)
+			break;
+
+		if (!e->dirty && !e->writeback) {
+			xas_store(&xas, NULL);
+			wbc->nr_clean--;
+			wbc->nr_pages--;
+			nvmet_wbc_free_entry(e);
+		}
+
+		if (++visited % 64 == 0) {
+			xas_pause(&xas);
+			xas_unlock_irqrestore(&xas, flags);
+			cond_resched();
+			xas_lock_irqsave(&xas, flags);
+		}
+	}
+	xas_unlock_irqrestore(&xas, flags);
+}
+
+/* pick up to NVMET_WBC_BATCH dirty pages at or after *next, in order */
+static unsigned int nvmet_wbc_collect(struct nvmet_wbc *wbc,
+		unsigned long *next)
+{
+	XA_STATE(xas, &wbc->pages, *next);
+	struct nvmet_wbc_entry *e;
+	unsigned int nr = 0;
+	unsigned long flags;
+
+	xas_lock_irqsave(&xas, flags);
+	xas_for_each_marked(&xas, e, ULONG_MAX, NVMET_WBC_DIRTY) {
+		xas_clear_mark(&xas, NVMET_WBC_DIRTY);
+		e->dirty = false;
+		e->writeback = true;
+		wbc->nr_dirty--;
+		wbc->batch[nr++] = e;
+		if (nr == NVMET_WBC_BATCH)
+			break;
+	}
+	xas_unlock_irqrestore(&xas, flags);
+
+	if (nr)
+		*next = wbc->batch[nr - 1]->index + 1;
+	return nr;
+}
+
+#ifdef HAVE_BIO_ENDIO_1_PARAM
+static void nvmet_wbc_bio_done(struct bio *bio)
+#else
+static void nvmet_wbc_bio_done(struct bio *bio, int error)
+#endif
+{
+	struct nvmet_wbc_bio_batch *b = bio->bi_private;
+
+#ifdef HAVE_BLK_STATUS_T
+	if (bio->bi_status)
+#elif defined(HAVE_STRUCT_BIO_BI_ERROR)
+	if (bio->bi_error)
+#else
+	if (error)
+#endif
+		b->error = -EIO;
+	bio_put(bio);
+	if (atomic_dec_and_test(&b->pending))
+		complete(&b->done);
+}
+
+static struct bio *nvmet_wbc_alloc_bio(struct nvmet_wbc *wbc,
+		struct nvmet_wbc_bio_batch *b, unsigned int nr, sector_t sector)
+{
+	struct bio *bio = bio_alloc(GFP_NOIO, nr);
+
+#if defined HAVE_BIO_BI_DISK || defined HAVE_ENUM_BIO_REMAPPED
+	bio_set_dev(bio, wbc->ns->bdev);
+#else
+	bio->bi_bdev = wbc->ns->bdev;
+#endif
+#ifdef HAVE_STRUCT_BIO_BI_ITER
+	bio->bi_iter.bi_sector = sector;
+#else
+	bio->bi_sector = sector;
+#endif
+	bio->bi_private = b;
+	bio->bi_end_io = nvmet_wbc_bio_done;
+#ifdef HAVE_BLK_TYPE_OP_IS_SYNC
+	bio->bi_opf = REQ_OP_WRITE;
+#else
+	bio_set_op_attrs(bio, REQ_OP_WRITE, 0);
+#endif
+	atomic_inc(&b->pending);
+	return bio;
+}
+
+static void nvmet_wbc_submit_bio(struct bio *bio)
+{
+#ifdef HAVE_SUBMIT_BIO_1_PARAM
+	submit_bio(bio);
+#else
+	submit_bio(bio_data_dir(bio), bio);
+#endif
+}
+
+static void nvmet_wbc_write_run_bdev(struct nvmet_wbc *wbc,
+		struct nvmet_wbc_bio_batch *b, struct nvmet_wbc_entry **run,
+		unsigned int nr)
+{
+	sector_t sector = (sector_t)run[0]->index << (PAGE_SHIFT - 9);
+	struct bio *bio;
+	unsigned int i;
+
+	bio = nvmet_wbc_alloc_bio(wbc, b, nr, sector);
+	for (i = 0; i < nr; i++) {
+		if (bio_add_page(bio, run[i]->page, PAGE_SIZE, 0) ==
+				PAGE_SIZE)
+			continue;
+
+		nvmet_wbc_submit_bio(bio);
+		bio = nvmet_wbc_alloc_bio(wbc, b, nr - i,
+				sector + (i << (PAGE_SHIFT - 9)));
+		bio_add_page(bio, run[i]->page, PAGE_SIZE, 0);
+	}
+	nvmet_wbc_submit_bio(bio);
+}
+
+#ifdef HAVE_FS_HAS_KIOCB
+static int nvmet_wbc_write_run_file(struct nvmet_wbc *wbc,
+		struct nvmet_wbc_entry **run, unsigned int nr)
+{
+	struct file *file = wbc->ns->file;
+	size_t len = (size_t)nr << PAGE_SHIFT;
+	struct iov_iter iter;
+	struct kiocb iocb;
+	unsigned int i;
+	ssize_t ret;
+
+	for (i = 0; i < nr; i++) {
+		wbc->bvec[i].bv_page = run[i]->page;
+		wbc->bvec[i].bv_offset = 0;
+		wbc->bvec[i].bv_len = PAGE_SIZE;
+	}
+
+#ifdef HAVE_IOV_ITER_IS_BVEC_SET
+	iov_iter_bvec(&iter, WRITE, wbc->bvec, nr, len);
+#else
+	iov_iter_bvec(&iter, ITER_BVEC | WRITE, wbc->bvec, nr, len);
+#endif
+	init_sync_kiocb(&iocb, file);
+	iocb.ki_pos = (loff_t)run[0]->index << PAGE_SHIFT;
+
+	ret = file->f_op->write_iter(&iocb, &iter);
+	if (ret == len)
+		return 0;
+	return ret < 0 ? ret : -EIO;
+}
+#endif
+
+/* write the collected batch back as runs of consecutive pages */
+static int nvmet_wbc_submit(struct nvmet_wbc *wbc, unsigned int nr)
+{
+	struct nvmet_wbc_entry **batch = wbc->batch;
+	struct nvmet_wbc_bio_batch b;
+	unsigned int i, start = 0, ios = 0;
+	struct blk_plug plug;
+	int ret = 0, err;
+
+	atomic_set(&b.pending, 1);
+	b.error = 0;
+	init_completion(&b.done);
+
+	blk_start_plug(&plug);
+	for (i = 1; i <= nr; i++) {
+		if (i < nr && batch[i]->index == batch[i - 1]->index + 1 &&
+		    i - start < NVMET_WBC_MAX_RUN)
+			continue;
+
+#ifdef HAVE_FS_HAS_KIOCB
+		if (wbc->ns->file) {
+			err = nvmet_wbc_write_run_file(wbc, &batch[start],
+						       i - start);
+			if (err && !ret)
+				ret = err;
+		} else
+#endif
+			nvmet_wbc_write_run_bdev(wbc, &b, &batch[start],
+						 i - start);
+		start = i;
+		ios++;
+	}
+	blk_finish_plug(&plug);
+
+	if (!atomic_dec_and_test(&b.pending))
+		wait_for_completion(&b.done);
+	if (b.error && !ret)
+		ret = b.error;
+
+	wbc->wb_ios += ios;
+	wbc->wb_pages += nr;
+	return ret;
+}
+
+static void nvmet_wbc_finish(struct nvmet_wbc *wbc, unsigned int nr, int err)
+{
+	struct nvmet_wbc_entry *e;
+	unsigned long flags;
+	unsigned int i;
+
+	xa_lock_irqsave(&wbc->pages, flags);
+	for (i = 0; i < nr; i++) {
+		e = wbc->batch[i];
+		e->writeback = false;
+
+		if (err) {
+			/* keep the whole batch around for the next pass */
+			if (!e->dirty) {
+				e->dirty = true;
+				__xa_set_mark(&wbc->pages, e->index,
+					      NVMET_WBC_DIRTY);
+				wbc->nr_dirty++;
+			}
+			continue;
+		}
+
+		/* rewritten while under write back */
+		if (e->dirty)
+			continue;
+
+		if (wbc->nr_fixups) {
+			wbc->nr_clean++;
+			continue;
+		}
+
+		__xa_erase(&wbc->pages, e->index);
+		wbc->nr_pages--;
+		nvmet_wbc_free_entry(e);
+	}
+	xa_unlock_irqrestore(&wbc->pages, flags);
+}
+
+/*
+ * Write back every page that is dirty when the pass starts.  Pages dirtied
+ * behind the cursor are left for the next pass so a flush cannot be starved
+ * by a steady stream of writes.
+ */
+static int nvmet_wbc_writeback(struct nvmet_wbc *wbc)
+{
+	unsigned long next = 0;
+	unsigned int nr;
+	int ret = 0;
+
+	mutex_lock(&wbc->wb_lock);
+	nvmet_wbc_sweep(wbc);
+	while (!ret && (nr = nvmet_wbc_collect(wbc, &next))) {
+		ret = nvmet_wbc_submit(wbc, nr);
+		nvmet_wbc_finish(wbc, nr, ret);
+	}
+	mutex_unlock(&wbc->wb_lock);
+
+	return ret;
+}
+
+static void nvmet_wbc_wb_work(struct work_struct *w)
+{
+	struct nvmet_wbc *wbc = container_of(to_delayed_work(w),
+			struct nvmet_wbc, wb_work);
+	int ret;
+
+	ret = nvmet_wbc_writeback(wbc);
+	if (ret) {
+		pr_err_ratelimited("nsid %u: cache write back failed (%d)\n",
+				   wbc->ns->nsid, ret);
+		WRITE_ONCE(wbc->wb_error, ret);
+		nvmet_wbc_kick(wbc, false);
+	}
+}
+
+/* write back all dirty pages, reporting earlier background failures too */
+int nvmet_wbc_flush(struct nvmet_ns *ns)
+{
+	struct nvmet_wbc *wbc = ns->wbc;
+	int ret;
+
+	ret = nvmet_wbc_writeback(wbc);
+	if (xchg(&wbc->wb_error, 0) && !ret)
+		ret = -EIO;
+	return ret;
+}
+
+ssize_t nvmet_wbc_stats_show(struct nvmet_ns *ns, char *page)
+{
+	struct nvmet_wbc *wbc = ns->wbc;
+	unsigned long flags;
+	ssize_t len;
+
+	if (!wbc)
+		return sprintf(page, "disabled\n");
+
+	xa_lock_irqsave(&wbc->pages, flags);
+	len = sprintf(page,
+		      "max_pages %lu\n"
+		      "cached_pages %lu\n"
+		      "dirty_pages %lu\n"
+		      "read_hits %llu\n"
+		      "read_partial %llu\n"
+		      "write_absorbed %llu\n"
+		      "write_bypassed %llu\n"
+		      "writeback_ios %llu\n"
+		      "writeback_pages %llu\n",
+		      wbc->max_pages, wbc->nr_pages, wbc->nr_dirty,
+		      wbc->read_hits, wbc->read_partial,
+		      wbc->write_absorbed, wbc->write_bypassed,
+		      wbc->wb_ios, wbc->wb_pages);
+	xa_unlock_irqrestore(&wbc->pages, flags);
+
+	return len;
+}
+
+int nvmet_wbc_init(struct nvmet_ns *ns)
+{
+	struct nvmet_wbc *wbc;
+
+	if (!ns->wb_cache_mb)
+		return 0;
+
+	if (ns->metadata_size || ns->use_p2pmem || ns->subsys->offloadble) {
+		pr_err("write-back cache is not supported with metadata, p2pmem or offload\n");
+		return -EINVAL;
+	}
+
+	wbc = kzalloc(sizeof(*wbc), GFP_KERNEL);
+	if (!wbc)
+		return -ENOMEM;
+
+	wbc->ns = ns;
+	xa_init_flags(&wbc->pages, XA_FLAGS_LOCK_IRQ);
+	wbc->max_pages = (unsigned long)ns->wb_cache_mb << (20 - PAGE_SHIFT);
+	mutex_init(&wbc->wb_lock);
+	INIT_DELAYED_WORK(&wbc->wb_work, nvmet_wbc_wb_work);
+	ns->wbc = wbc;
+
+	return 0;
+}
+
+void nvmet_wbc_destroy(struct nvmet_ns *ns)
+{
+	struct nvmet_wbc *wbc = ns->wbc;
+	struct nvmet_wbc_entry *e;
+	unsigned long idx;
+	int ret;
+
+	if (!wbc)
+		return;
+
+	cancel_delayed_work_sync(&wbc->wb_work);
+	ret = nvmet_wbc_writeback(wbc);
+	if (ret)
+		pr_err("nsid %u: lost %lu dirty cache pages (%d)\n",
+		       ns->nsid, wbc->nr_dirty, ret);
+
+	xa_for_each(&wbc->pages, idx, e)
+		nvmet_wbc_free_entry(e);
+	xa_destroy(&wbc->pages);
+
+	ns->wbc = NULL;
+	kfree(wbc);
+}
@@ -175,6 +175,8 @@ static void nvmet_bio_done(struct bio *bio, int error)
 {
 	struct nvmet_req *req = bio->bi_private;
 
+	if (unlikely(req->wbc_fixup))
+		nvmet_wbc_read_done(req);
 #ifdef HAVE_BLK_STATUS_T
 	nvmet_req_complete(req, blk_to_nvme_status(req, bio->bi_status));
 #elif defined(HAVE_STRUCT_BIO_BI_ERROR)
@@ -274,6 +276,9 @@ static void nvmet_bdev_execute_rw(struct nvmet_req *req)
 		return;
 	}
 
+	if (req->ns->wbc && nvmet_wbc_execute_rw(req))
+		return;
+
 	if (req->cmd->rw.opcode == nvme_cmd_write) {
 #ifdef HAVE_BLK_TYPE_OP_IS_SYNC
 #ifdef HAVE_REQ_IDLE
@@ -413,6 +418,13 @@ static void nvmet_bdev_execute_rw(struct nvmet_req *req)
 	blk_finish_plug(&plug);
 }
 
+static void nvmet_bdev_flush_work(struct work_struct *w)
+{
+	struct nvmet_req *req = container_of(w, struct nvmet_req, b.work);
+
+	nvmet_req_complete(req, nvmet_bdev_flush(req));
+}
+
 static void nvmet_bdev_execute_flush(struct nvmet_req *req)
 {
 	struct bio *bio = &req->b.inline_bio;
@@ -420,6 +432,13 @@ static void nvmet_bdev_execute_flush(struct nvmet_req *req)
 	if (!nvmet_check_transfer_len(req, 0))
 		return;
 
+	/* the cache write back has to finish before the device flush */
+	if (req->ns->wbc) {
+		INIT_WORK(&req->b.work, nvmet_bdev_flush_work);
+		queue_work(nvmet_wbc_wq, &req->b.work);
+		return;
+	}
+
 #ifdef HAVE_BIO_INIT_3_PARAMS
 	bio_init(bio, req->inline_bvec, ARRAY_SIZE(req->inline_bvec));
 #else
@@ -449,6 +468,9 @@ static void nvmet_bdev_execute_flush(struct nvmet_req *req)
 
 u16 nvmet_bdev_flush(struct nvmet_req *req)
 {
+	if (req->ns->wbc && nvmet_wbc_flush(req->ns))
+		return NVME_SC_INTERNAL | NVME_SC_DNR;
+
 #ifdef HAVE_BLKDEV_ISSUE_FLUSH_1_PARAM
 	if (blkdev_issue_flush(req->ns->bdev))
 #else
@@ -468,6 +490,10 @@ static u16 nvmet_bdev_discard_range(struct nvmet_req *req,
 	struct nvmet_ns *ns = req->ns;
 	int ret;
 
+	nvmet_wbc_zero_range(ns,
+			le64_to_cpu(range->slba) << ns->blksize_shift,
+			(loff_t)le32_to_cpu(range->nlb) << ns->blksize_shift);
+
 #ifdef HAVE___BLKDEV_ISSUE_DISCARD
 	ret = __blkdev_issue_discard(ns->bdev,
 			le64_to_cpu(range->slba) << (ns->blksize_shift - 9),
@@ -555,6 +581,9 @@ static void nvmet_bdev_execute_write_zeroes(struct nvmet_req *req)
 	nr_sector = (((sector_t)le16_to_cpu(write_zeroes->length) + 1) <<
 		(req->ns->blksize_shift - 9));
 
+	nvmet_wbc_zero_range(req->ns, (loff_t)sector << 9,
+			(loff_t)nr_sector << 9);
+
 #ifdef CONFIG_COMPAT_IS_BLKDEV_ISSUE_ZEROOUT_HAS_FLAGS
 	ret = __blkdev_issue_zeroout(req->ns->bdev, sector, nr_sector,
 			GFP_KERNEL, &bio, 0);
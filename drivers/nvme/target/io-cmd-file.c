@@ -17,6 +17,18 @@
 #define NVMET_MAX_MPOOL_BVEC		16
 #define NVMET_MIN_MPOOL_OBJ		16
 
+static struct workqueue_struct *nvmet_file_buffered_io_wq(struct nvmet_ns *ns)
+{
+	switch (ns->buffered_io_policy) {
+	case NVMET_BUFFERED_IO_CPU:
+		return buffered_io_cpu_wq;
+	case NVMET_BUFFERED_IO_NUMA:
+		return buffered_io_numa_wq;
+	default:
+		return buffered_io_wq;
+	}
+}
+
 int nvmet_file_ns_revalidate(struct nvmet_ns *ns)
 {
 	struct kstat stat;
@@ -36,8 +48,10 @@ int nvmet_file_ns_revalidate(struct nvmet_ns *ns)
 void nvmet_file_ns_disable(struct nvmet_ns *ns)
 {
 	if (ns->file) {
+		if (ns->async_io)
+			flush_workqueue(file_aio_wq);
 		if (ns->buffered_io)
-			flush_workqueue(buffered_io_wq);
+			flush_workqueue(nvmet_file_buffered_io_wq(ns));
 		mempool_destroy(ns->bvec_pool);
 		ns->bvec_pool = NULL;
 		kmem_cache_destroy(ns->bvec_cache);
@@ -149,6 +163,8 @@ static void nvmet_file_io_done(struct kiocb *iocb, long ret, long ret2)
 
 	if (unlikely(ret != req->transfer_len))
 		status = errno_to_nvme_status(req, ret);
+	if (unlikely(req->wbc_fixup))
+		nvmet_wbc_read_done(req);
 	nvmet_req_complete(req, status);
 }
 
@@ -244,13 +260,52 @@ static void nvmet_file_buffered_io_work(struct work_struct *w)
 {
 	struct nvmet_req *req = container_of(w, struct nvmet_req, f.work);
 
+	nvmet_hist_add(req->ns->buffered_io_delay,
+		       div_u64(ktime_get_ns() - req->f.queue_time,
+			       NSEC_PER_USEC));
 	nvmet_file_execute_io(req, 0);
 }
 
 static void nvmet_file_submit_buffered_io(struct nvmet_req *req)
 {
+	struct nvmet_ns *ns = req->ns;
+
 	INIT_WORK(&req->f.work, nvmet_file_buffered_io_work);
-	queue_work(buffered_io_wq, &req->f.work);
+	req->f.queue_time = ktime_get_ns();
+
+	/*
+	 * The CPU policy keeps the work on the CPU the nvmet queue delivered
+	 * the command on, the NUMA policy lets an unbound worker of the same
+	 * node pick it up, the global policy leaves it to the shared queue.
+	 */
+	if (ns->buffered_io_policy == NVMET_BUFFERED_IO_CPU)
+		queue_work_on(raw_smp_processor_id(), buffered_io_cpu_wq,
+			      &req->f.work);
+	else
+		queue_work(nvmet_file_buffered_io_wq(ns), &req->f.work);
+}
+
+/*
+ * Async engine: a request that missed the page cache on its IOCB_NOWAIT
+ * attempt goes straight to a work item of its own on the engine's
+ * high-priority unbound queue.  There it blocks in parallel with the other
+ * misses instead of queueing behind the shared buffered I/O workqueues.
+ */
+static void nvmet_file_async_io_work(struct work_struct *w)
+{
+	struct nvmet_req *req = container_of(w, struct nvmet_req, f.work);
+
+	nvmet_hist_add(req->ns->async_io_delay,
+		       div_u64(ktime_get_ns() - req->f.queue_time,
+			       NSEC_PER_USEC));
+	nvmet_file_execute_io(req, 0);
+}
+
+static void nvmet_file_submit_async_io(struct nvmet_req *req)
+{
+	INIT_WORK(&req->f.work, nvmet_file_async_io_work);
+	req->f.queue_time = ktime_get_ns();
+	queue_work(file_aio_wq, &req->f.work);
 }
 
 static void nvmet_file_execute_rw(struct nvmet_req *req)
@@ -265,6 +320,9 @@ static void nvmet_file_execute_rw(struct nvmet_req *req)
 		return;
 	}
 
+	if (req->ns->wbc && nvmet_wbc_execute_rw(req))
+		return;
+
 	if (nr_bvec > NVMET_MAX_INLINE_BIOVEC)
 		req->f.bvec = kmalloc_array(nr_bvec, sizeof(struct bio_vec),
 				GFP_KERNEL);
@@ -284,13 +342,40 @@ static void nvmet_file_execute_rw(struct nvmet_req *req)
 				nvmet_file_execute_io(req, IOCB_NOWAIT))
 			return;
 #endif
-		nvmet_file_submit_buffered_io(req);
+		if (req->ns->async_io && likely(!req->f.mpool_alloc))
+			nvmet_file_submit_async_io(req);
+		else
+			nvmet_file_submit_buffered_io(req);
 	} else
 		nvmet_file_execute_io(req, 0);
 }
 
+/*
+ * Buffered reads that fit the inline bvec only try the page cache with
+ * IOCB_NOWAIT and hand misses to a workqueue, so they can be executed from
+ * the submitter's context without waiting on the backing device.
+ */
+bool nvmet_file_execute_is_nowait(struct nvmet_req *req)
+{
+#ifdef HAVE_IOCB_NOWAIT
+	return req->execute == nvmet_file_execute_rw &&
+		req->ns->buffered_io &&
+		req->cmd->rw.opcode == nvme_cmd_read &&
+		req->sg_cnt <= NVMET_MAX_INLINE_BIOVEC;
+#else
+	return false;
+#endif
+}
+
 u16 nvmet_file_flush(struct nvmet_req *req)
 {
+	int ret;
+
+	if (req->ns->wbc) {
+		ret = nvmet_wbc_flush(req->ns);
+		if (ret)
+			return errno_to_nvme_status(req, ret);
+	}
 	return errno_to_nvme_status(req, vfs_fsync(req->ns->file, 1));
 }
 
@@ -333,6 +418,7 @@ static void nvmet_file_execute_discard(struct nvmet_req *req)
 			break;
 		}
 
+		nvmet_wbc_zero_range(req->ns, offset, len);
 		ret = vfs_fallocate(req->ns->file, mode, offset, len);
 		if (ret && ret != -EOPNOTSUPP) {
 			req->error_slba = le64_to_cpu(range.slba);
@@ -387,6 +473,7 @@ static void nvmet_file_write_zeroes_work(struct work_struct *w)
 		return;
 	}
 
+	nvmet_wbc_zero_range(req->ns, offset, len);
 	ret = vfs_fallocate(req->ns->file, mode, offset, len);
 	nvmet_req_complete(req, ret < 0 ? errno_to_nvme_status(req, ret) : 0);
 }
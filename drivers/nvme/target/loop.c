@@ -18,6 +18,11 @@
 
 #define NVME_LOOP_MAX_SEGMENTS		256
 
+static bool inline_execute;
+module_param(inline_execute, bool, 0444);
+MODULE_PARM_DESC(inline_execute,
+	"execute small page cache reads of buffered file namespaces in the submitter's context");
+
 struct nvme_loop_iod {
 	struct nvme_request	nvme_req;
 	struct nvme_command	cmd;
@@ -186,6 +191,18 @@ static blk_status_t nvme_loop_queue_rq(struct blk_mq_hw_ctx *hctx,
 #endif
 	}
 
+	/*
+	 * I/O queues are created with BLK_MQ_F_BLOCKING when inline_execute
+	 * is set, so requests the backend can serve without waiting on the
+	 * device are executed right here instead of bouncing through the
+	 * system workqueue.
+	 */
+	if ((hctx->flags & BLK_MQ_F_BLOCKING) &&
+	    nvmet_req_execute_is_nowait(&iod->req)) {
+		iod->req.execute(&iod->req);
+		return BLK_STS_OK;
+	}
+
 	schedule_work(&iod->work);
 	return BLK_STS_OK;
 }
@@ -582,6 +599,8 @@ static int nvme_loop_create_io_queues(struct nvme_loop_ctrl *ctrl)
 	ctrl->tag_set.reserved_tags = 1; /* fabric connect */
 	ctrl->tag_set.numa_node = ctrl->ctrl.numa_node;
 	ctrl->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+	if (inline_execute)
+		ctrl->tag_set.flags |= BLK_MQ_F_BLOCKING;
 	ctrl->tag_set.cmd_size = sizeof(struct nvme_loop_iod) +
 		NVME_INLINE_SG_CNT * sizeof(struct scatterlist);
 	ctrl->tag_set.driver_data = ctrl;
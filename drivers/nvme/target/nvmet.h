@@ -12,6 +12,7 @@
 #include <linux/kref.h>
 #include <linux/percpu-refcount.h>
 #include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/mutex.h>
 #include <linux/uuid.h>
 #include <linux/nvme.h>
@@ -56,6 +57,49 @@
 #define IPO_IATTR_CONNECT_SQE(x)	\
 	(cpu_to_le32(offsetof(struct nvmf_connect_command, x)))
 
+/*
+ * Log2 histogram of microsecond latencies, kept per CPU so the I/O path
+ * never shares a cache line.  Bucket 0 counts samples below 1us, bucket
+ * N samples in [2^(N-1), 2^N) us and the last bucket is open ended.
+ */
+#define NVMET_HIST_BUCKETS	24
+
+struct nvmet_hist {
+	u64			bucket[NVMET_HIST_BUCKETS];
+};
+
+static inline void nvmet_hist_add(struct nvmet_hist __percpu *hist,
+		u64 usecs)
+{
+	unsigned int b = 0;
+
+	if (usecs)
+		b = min_t(unsigned int, ilog2(usecs) + 1,
+			  NVMET_HIST_BUCKETS - 1);
+	this_cpu_inc(hist->bucket[b]);
+}
+
+/*
+ * Per-namespace latency from nvmet_req_init() to __nvmet_req_complete(),
+ * split by command type.
+ */
+enum nvmet_lat_op {
+	NVMET_LAT_READ,
+	NVMET_LAT_WRITE,
+	NVMET_LAT_FLUSH,
+	NVMET_LAT_NR_OPS,
+};
+
+struct nvmet_ns_lat {
+	struct nvmet_hist	op[NVMET_LAT_NR_OPS];
+};
+
+enum nvmet_buffered_io_policy {
+	NVMET_BUFFERED_IO_GLOBAL,	/* shared buffered_io_wq */
+	NVMET_BUFFERED_IO_CPU,		/* submitting CPU */
+	NVMET_BUFFERED_IO_NUMA,		/* any CPU of the submitting node */
+};
+
 struct nvmet_ns {
 	struct percpu_ref	ref;
 	struct block_device	*bdev;
@@ -70,6 +114,15 @@ struct nvmet_ns {
 	u32			anagrpid;
 
 	bool			buffered_io;
+	bool			async_io;
+	enum nvmet_buffered_io_policy buffered_io_policy;
+	struct nvmet_hist __percpu *buffered_io_delay;
+	struct nvmet_hist __percpu *async_io_delay;
+	struct nvmet_ns_lat __percpu *lat;
+	/* indexed by qid, allocated when the ns or an I/O queue is set up */
+	struct nvmet_hist __percpu **queue_lat;
+	u32			wb_cache_mb;
+	struct nvmet_wbc	*wbc;
 	bool			enabled;
 	struct nvmet_subsys	*subsys;
 	const char		*device_path;
@@ -103,6 +156,14 @@ struct nvmet_cq {
 	u16			size;
 };
 
+struct nvmet_sgl_pool {
+	spinlock_t		lock;
+	struct list_head	pages;
+	unsigned int		nr_pages;
+	bool			dead;
+	struct list_head	entry;
+};
+
 struct nvmet_sq {
 	struct nvmet_ctrl	*ctrl;
 	struct percpu_ref	ref;
@@ -112,6 +173,7 @@ struct nvmet_sq {
 	bool			sqhd_disabled;
 	struct completion	free_done;
 	struct completion	confirm_done;
+	struct nvmet_sgl_pool	sgl_pool;
 };
 
 struct nvmet_ana_group {
@@ -134,6 +196,8 @@ static inline struct nvmet_ana_group *to_ana_group(struct config_item *item)
  *				for a discovery log page entry.
  * @group:		ConfigFS group for this element's folder.
  * @priv:		Private data for the transport.
+ * @poll_cpumask:	CPUs running busy-poll threads for this port, if
+ *				the transport supports polling.
  */
 struct nvmet_port {
 	struct list_head		entry;
@@ -157,6 +221,7 @@ struct nvmet_port {
 	u32				offload_queue_size;
 	size_t				offload_srq_size;
 	bool				many_offload_subsys_support;
+	cpumask_var_t			poll_cpumask;
 };
 
 static inline struct nvmet_port *to_nvmet_port(struct config_item *item)
@@ -369,6 +434,7 @@ struct nvmet_req {
 	union {
 		struct {
 			struct bio      inline_bio;
+			struct work_struct	work;
 		} b;
 		struct {
 			bool			mpool_alloc;
@@ -377,6 +443,7 @@ struct nvmet_req {
 #endif
 			struct bio_vec          *bvec;
 			struct work_struct      work;
+			u64			queue_time;
 		} f;
 		struct {
 			struct request		*rq;
@@ -399,9 +466,16 @@ struct nvmet_req {
 	struct device		*p2p_client;
 	u16			error_loc;
 	u64			error_slba;
+	u64			start_time;
+	bool			wbc_fixup;
+	bool			wbc_fua_ready;
 };
 
 extern struct workqueue_struct *buffered_io_wq;
+extern struct workqueue_struct *buffered_io_cpu_wq;
+extern struct workqueue_struct *buffered_io_numa_wq;
+extern struct workqueue_struct *file_aio_wq;
+extern struct workqueue_struct *nvmet_wbc_wq;
 
 static inline void nvmet_set_result(struct nvmet_req *req, u32 result)
 {
@@ -463,6 +537,9 @@ bool nvmet_check_data_len_lte(struct nvmet_req *req, size_t data_len);
 void nvmet_req_complete(struct nvmet_req *req, u16 status);
 int nvmet_req_alloc_sgls(struct nvmet_req *req);
 void nvmet_req_free_sgls(struct nvmet_req *req);
+struct scatterlist *nvmet_sgl_alloc(struct nvmet_sq *sq, u32 length,
+		unsigned int *nents);
+void nvmet_sgl_free(struct nvmet_sq *sq, struct scatterlist *sgl);
 
 void nvmet_execute_set_features(struct nvmet_req *req);
 void nvmet_execute_get_features(struct nvmet_req *req);
@@ -496,6 +573,10 @@ int nvmet_ns_enable(struct nvmet_ns *ns);
 void nvmet_ns_disable(struct nvmet_ns *ns);
 struct nvmet_ns *nvmet_ns_alloc(struct nvmet_subsys *subsys, u32 nsid);
 void nvmet_ns_free(struct nvmet_ns *ns);
+ssize_t nvmet_hist_show(struct nvmet_hist __percpu *hist, char *page);
+void nvmet_hist_reset(struct nvmet_hist __percpu *hist);
+ssize_t nvmet_ns_queue_lat_show(struct nvmet_ns *ns, char *page);
+void nvmet_ns_queue_lat_reset(struct nvmet_ns *ns);
 
 void nvmet_send_ana_event(struct nvmet_subsys *subsys,
 		struct nvmet_port *port);
@@ -585,9 +666,17 @@ int nvmet_file_ns_enable(struct nvmet_ns *ns);
 void nvmet_bdev_ns_disable(struct nvmet_ns *ns);
 #ifdef HAVE_FS_HAS_KIOCB
 void nvmet_file_ns_disable(struct nvmet_ns *ns);
+bool nvmet_file_execute_is_nowait(struct nvmet_req *req);
 #endif
 u16 nvmet_bdev_flush(struct nvmet_req *req);
 u16 nvmet_file_flush(struct nvmet_req *req);
+int nvmet_wbc_init(struct nvmet_ns *ns);
+void nvmet_wbc_destroy(struct nvmet_ns *ns);
+bool nvmet_wbc_execute_rw(struct nvmet_req *req);
+void nvmet_wbc_read_done(struct nvmet_req *req);
+void nvmet_wbc_zero_range(struct nvmet_ns *ns, loff_t pos, loff_t len);
+int nvmet_wbc_flush(struct nvmet_ns *ns);
+ssize_t nvmet_wbc_stats_show(struct nvmet_ns *ns, char *page);
 void nvmet_ns_changed(struct nvmet_subsys *subsys, u32 nsid);
 void nvmet_bdev_ns_revalidate(struct nvmet_ns *ns);
 #ifdef HAVE_FS_HAS_KIOCB
@@ -595,6 +684,15 @@ int nvmet_file_ns_revalidate(struct nvmet_ns *ns);
 #endif
 void nvmet_ns_revalidate(struct nvmet_ns *ns);
 
+static inline bool nvmet_req_execute_is_nowait(struct nvmet_req *req)
+{
+#ifdef HAVE_FS_HAS_KIOCB
+	return req->ns && req->ns->file && nvmet_file_execute_is_nowait(req);
+#else
+	return false;
+#endif
+}
+
 static inline u32 nvmet_rw_data_len(struct nvmet_req *req)
 {
 	return ((u32)le16_to_cpu(req->cmd->rw.length) + 1) <<
@@ -121,6 +121,16 @@ struct nvmet_rdma_queue {
 
 	bool                    offload;
 	struct nvmet_rdma_xrq   *xrq;
+
+	/*
+	 * Receives reposted while a completion batch of the queue is being
+	 * processed are chained and posted at the end of the batch.
+	 */
+	struct ib_cq_batch	recv_batch;
+	spinlock_t		recv_lock;
+	bool			recv_batching;
+	struct ib_recv_wr	*recv_first;
+	struct ib_recv_wr	*recv_last;
 };
 
 struct nvmet_rdma_port {
@@ -155,6 +165,10 @@ static bool nvmet_rdma_use_srq;
 module_param_named(use_srq, nvmet_rdma_use_srq, bool, 0444);
 MODULE_PARM_DESC(use_srq, "Use shared receive queue.");
 
+static unsigned int nvmet_rdma_cq_poll_usecs;
+module_param_named(cq_poll_usecs, nvmet_rdma_cq_poll_usecs, uint, 0444);
+MODULE_PARM_DESC(cq_poll_usecs, "Busy-poll queue CQs for this long without completions before re-arming them, 0 keeps plain workqueue polling (default: 0)");
+
 static int srq_size_set(const char *val, const struct kernel_param *kp);
 static const struct kernel_param_ops srq_size_ops = {
 	.set = srq_size_set,
@@ -581,6 +595,8 @@ static int nvmet_rdma_post_recv(struct nvmet_rdma_device *ndev,
 		cmd->sge[0].addr, cmd->sge[0].length,
 		DMA_FROM_DEVICE);
 
+	/* may still point at the next receive of an earlier batch */
+	cmd->wr.next = NULL;
 	if (cmd->nsrq)
 		ret = ib_post_srq_recv(cmd->nsrq->srq, &cmd->wr, NULL);
 	else
@@ -592,6 +608,63 @@ static int nvmet_rdma_post_recv(struct nvmet_rdma_device *ndev,
 	return ret;
 }
 
+static void nvmet_rdma_recv_flush(struct ib_cq *cq, struct ib_cq_batch *batch)
+{
+	struct nvmet_rdma_queue *queue =
+		container_of(batch, struct nvmet_rdma_queue, recv_batch);
+	struct ib_recv_wr *first;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&queue->recv_lock, flags);
+	first = queue->recv_first;
+	queue->recv_first = NULL;
+	queue->recv_last = NULL;
+	queue->recv_batching = false;
+	spin_unlock_irqrestore(&queue->recv_lock, flags);
+
+	if (!first)
+		return;
+
+	if (queue->nsrq)
+		ret = ib_post_srq_recv(queue->nsrq->srq, first, NULL);
+	else
+		ret = ib_post_recv(queue->qp, first, NULL);
+
+	if (unlikely(ret))
+		pr_err("post_recv cmd failed\n");
+}
+
+/*
+ * Repost the receive of a command.  Responses may be queued from any
+ * context, but while the CQ of the queue is processing a batch the
+ * receive is added to the batch chain instead.
+ */
+static void nvmet_rdma_repost_recv(struct nvmet_rdma_queue *queue,
+		struct nvmet_rdma_cmd *cmd)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->recv_lock, flags);
+	if (!queue->recv_batching) {
+		spin_unlock_irqrestore(&queue->recv_lock, flags);
+		nvmet_rdma_post_recv(queue->dev, cmd);
+		return;
+	}
+
+	ib_dma_sync_single_for_device(queue->dev->device,
+		cmd->sge[0].addr, cmd->sge[0].length,
+		DMA_FROM_DEVICE);
+
+	cmd->wr.next = NULL;
+	if (queue->recv_last)
+		queue->recv_last->next = &cmd->wr;
+	else
+		queue->recv_first = &cmd->wr;
+	queue->recv_last = &cmd->wr;
+	spin_unlock_irqrestore(&queue->recv_lock, flags);
+}
+
 static void nvmet_rdma_process_wr_wait_list(struct nvmet_rdma_queue *queue)
 {
 	spin_lock(&queue->rsp_wr_wait_lock);
@@ -818,7 +891,7 @@ static void nvmet_rdma_queue_response(struct nvmet_req *req)
 		first_wr = &rsp->send_wr;
 	}
 
-	nvmet_rdma_post_recv(rsp->queue->dev, rsp->cmd);
+	nvmet_rdma_repost_recv(rsp->queue, rsp->cmd);
 
 	ib_dma_sync_single_for_device(rsp->queue->dev->device,
 		rsp->send_sge.addr, rsp->send_sge.length,
@@ -1109,6 +1182,15 @@ static void nvmet_rdma_recv_done(struct ib_cq *cq, struct ib_wc *wc)
 		return;
 	}
 
+	/* only this CQ context opens a batch, and its flush closes it */
+	if (!queue->recv_batching && ib_cq_batch_add(cq, &queue->recv_batch)) {
+		unsigned long flags;
+
+		spin_lock_irqsave(&queue->recv_lock, flags);
+		queue->recv_batching = true;
+		spin_unlock_irqrestore(&queue->recv_lock, flags);
+	}
+
 	cmd->queue = queue;
 	rsp = nvmet_rdma_get_rsp(queue);
 	if (unlikely(!rsp)) {
@@ -1350,13 +1432,17 @@ static int nvmet_rdma_create_queue_ib(struct nvmet_rdma_queue *queue)
 	nr_cqe = queue->recv_queue_size + 2 * queue->send_queue_size;
 
 	queue->cq = ib_cq_pool_get(ndev->device, nr_cqe + 1,
-				   queue->comp_vector, IB_POLL_WORKQUEUE);
+				   queue->comp_vector,
+				   nvmet_rdma_cq_poll_usecs ?
+				   IB_POLL_HYBRID : IB_POLL_WORKQUEUE);
 	if (IS_ERR(queue->cq)) {
 		ret = PTR_ERR(queue->cq);
 		pr_err("failed to create CQ cqe= %d ret= %d\n",
 		       nr_cqe + 1, ret);
 		goto out;
 	}
+	if (nvmet_rdma_cq_poll_usecs)
+		ib_cq_set_poll_usecs(queue->cq, nvmet_rdma_cq_poll_usecs);
 
 	memset(&qp_attr, 0, sizeof(qp_attr));
 	qp_attr.qp_context = queue;
@@ -1559,6 +1645,8 @@ nvmet_rdma_alloc_queue(struct nvmet_rdma_device *ndev,
 	INIT_LIST_HEAD(&queue->free_rsps);
 	spin_lock_init(&queue->rsps_lock);
 	INIT_LIST_HEAD(&queue->queue_list);
+	spin_lock_init(&queue->recv_lock);
+	ib_cq_batch_init(&queue->recv_batch, nvmet_rdma_recv_flush);
 
 	queue->idx = ida_simple_get(&nvmet_rdma_queue_ida, 0, 0, GFP_KERNEL);
 	if (queue->idx < 0) {
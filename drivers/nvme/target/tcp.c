@@ -16,6 +16,9 @@
 #include <net/tcp.h>
 #include <linux/inet.h>
 #include <linux/llist.h>
+#include <linux/kthread.h>
+#include <linux/cpuhotplug.h>
+#include <net/busy_poll.h>
 #include <crypto/hash.h>
 
 #include "nvmet.h"
@@ -32,10 +35,30 @@ static int so_priority;
 module_param(so_priority, int, 0644);
 MODULE_PARM_DESC(so_priority, "nvmet tcp socket optimize priority");
 
+/*
+ * Queues of a port with poll cpus configured are served by busy-polling
+ * kthreads.  A polled queue that sees no traffic for this long falls back
+ * to the interrupt driven io_work until it becomes busy again.
+ */
+static unsigned int poll_idle_usecs = 100;
+module_param(poll_idle_usecs, uint, 0644);
+MODULE_PARM_DESC(poll_idle_usecs,
+		 "idle time before a polled queue backs off to interrupt mode (default:100)");
+
 #define NVMET_TCP_RECV_BUDGET		8
 #define NVMET_TCP_SEND_BUDGET		8
 #define NVMET_TCP_IO_WORK_BUDGET	64
 
+/*
+ * Small C2H transfers are sent in batches: the data PDU header, payload
+ * and response capsule of up to NVMET_TCP_SEND_BUDGET commands go out in
+ * a single sendmsg.  Copying a few pages is cheaper than a sendpage call
+ * per PDU; anything larger keeps the zero-copy per PDU path.
+ */
+#define NVMET_TCP_BATCH_MAX_SEGS	4
+#define NVMET_TCP_BATCH_MAX_BVEC	\
+	(NVMET_TCP_SEND_BUDGET * (NVMET_TCP_BATCH_MAX_SEGS + 2))
+
 enum nvmet_tcp_send_state {
 	NVMET_TCP_SEND_DATA_PDU,
 	NVMET_TCP_SEND_DATA,
@@ -93,11 +116,37 @@ enum nvmet_tcp_queue_state {
 	NVMET_TCP_Q_DISCONNECTING,
 };
 
+struct nvmet_tcp_poller {
+	struct task_struct	*thread;
+	int			cpu;
+	bool			stopped;
+	struct mutex		lock;
+	struct list_head	queues;
+	wait_queue_head_t	wait;
+};
+
+/* pollers of a port, kept alive by the port and by each of its queues */
+struct nvmet_tcp_poll_group {
+	struct kref		ref;
+	struct hlist_node	cpuhp_node;
+	int			nr_pollers;
+	int			last_poller;
+	struct nvmet_tcp_poller	pollers[];
+};
+
 struct nvmet_tcp_queue {
 	struct socket		*sock;
 	struct nvmet_tcp_port	*port;
 	struct work_struct	io_work;
 	int			cpu;
+
+	/* busy poll state */
+	struct nvmet_tcp_poll_group *poll_group;
+	struct nvmet_tcp_poller	*poller;
+	struct list_head	poll_entry;
+	bool			polling;
+	u64			poll_last_busy;
+
 	struct nvmet_cq		nvme_cq;
 	struct nvmet_sq		nvme_sq;
 
@@ -109,6 +158,7 @@ struct nvmet_tcp_queue {
 	struct list_head	resp_send_list;
 	int			send_list_len;
 	struct nvmet_tcp_cmd	*snd_cmd;
+	struct bio_vec		snd_bvec[NVMET_TCP_BATCH_MAX_BVEC];
 
 	/* recv state */
 	int			offset;
@@ -148,6 +198,7 @@ struct nvmet_tcp_port {
 	struct nvmet_port	*nport;
 	struct sockaddr_storage addr;
 	int			last_cpu;
+	struct nvmet_tcp_poll_group *poll_group;
 	void (*data_ready)(struct sock *);
 };
 
@@ -156,6 +207,7 @@ static LIST_HEAD(nvmet_tcp_queue_list);
 static DEFINE_MUTEX(nvmet_tcp_queue_mutex);
 
 static struct workqueue_struct *nvmet_tcp_wq;
+static enum cpuhp_state nvmet_tcp_cpuhp_state;
 static const struct nvmet_fabrics_ops nvmet_tcp_ops;
 static void nvmet_tcp_free_cmd(struct nvmet_tcp_cmd *c);
 static void nvmet_tcp_finish_cmd(struct nvmet_tcp_cmd *cmd);
@@ -360,7 +412,7 @@ static int nvmet_tcp_map_data(struct nvmet_tcp_cmd *cmd)
 	}
 	cmd->req.transfer_len += len;
 
-	cmd->req.sg = sgl_alloc(len, GFP_KERNEL, &cmd->req.sg_cnt);
+	cmd->req.sg = nvmet_sgl_alloc(cmd->req.sq, len, &cmd->req.sg_cnt);
 	if (!cmd->req.sg)
 		return NVME_SC_INTERNAL;
 	cmd->cur_sg = cmd->req.sg;
@@ -374,7 +426,7 @@ static int nvmet_tcp_map_data(struct nvmet_tcp_cmd *cmd)
 
 	return 0;
 err:
-	sgl_free(cmd->req.sg);
+	nvmet_sgl_free(cmd->req.sq, cmd->req.sg);
 	return NVME_SC_INTERNAL;
 }
 
@@ -509,7 +561,8 @@ static void nvmet_tcp_queue_response(struct nvmet_req *req)
 	struct nvmet_tcp_queue	*queue = cmd->queue;
 
 	llist_add(&cmd->lentry, &queue->resp_list);
-	queue_work_on(cmd->queue->cpu, nvmet_tcp_wq, &cmd->queue->io_work);
+	if (!READ_ONCE(queue->polling))
+		queue_work_on(queue->cpu, nvmet_tcp_wq, &queue->io_work);
 }
 
 static int nvmet_try_send_data_pdu(struct nvmet_tcp_cmd *cmd)
@@ -579,7 +632,7 @@ static int nvmet_try_send_data(struct nvmet_tcp_cmd *cmd, bool last_in_batch)
 
 	if (queue->nvme_sq.sqhd_disabled) {
 		kfree(cmd->iov);
-		sgl_free(cmd->req.sg);
+		nvmet_sgl_free(cmd->req.sq, cmd->req.sg);
 	}
 
 	return 1;
@@ -610,7 +663,7 @@ static int nvmet_try_send_response(struct nvmet_tcp_cmd *cmd,
 		return -EAGAIN;
 
 	kfree(cmd->iov);
-	sgl_free(cmd->req.sg);
+	nvmet_sgl_free(cmd->req.sq, cmd->req.sg);
 	cmd->queue->snd_cmd = NULL;
 	nvmet_tcp_put_cmd(cmd);
 	return 1;
@@ -721,11 +774,220 @@ done_send:
 	return 1;
 }
 
+static bool nvmet_tcp_can_batch(struct nvmet_tcp_cmd *cmd)
+{
+	switch (cmd->state) {
+	case NVMET_TCP_SEND_DATA_PDU:
+		return !cmd->queue->data_digest &&
+			cmd->req.sg_cnt <= NVMET_TCP_BATCH_MAX_SEGS;
+	case NVMET_TCP_SEND_R2T:
+	case NVMET_TCP_SEND_RESPONSE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static inline void nvmet_tcp_set_bvec(struct bio_vec *bv, void *pdu,
+		unsigned int len)
+{
+	bv->bv_page = virt_to_page(pdu);
+	bv->bv_offset = offset_in_page(pdu);
+	bv->bv_len = len;
+}
+
+/* add the PDUs of @cmd to the batch, returns the number of bytes added */
+static size_t nvmet_tcp_batch_add_cmd(struct nvmet_tcp_cmd *cmd,
+		struct bio_vec *bv, int *nr_bvec)
+{
+	struct nvmet_tcp_queue *queue = cmd->queue;
+	u8 hdgst = nvmet_tcp_hdgst_len(queue);
+	struct scatterlist *sg;
+	size_t len = 0;
+	int i;
+
+	switch (cmd->state) {
+	case NVMET_TCP_SEND_DATA_PDU:
+		len = sizeof(*cmd->data_pdu) + hdgst;
+		nvmet_tcp_set_bvec(&bv[(*nr_bvec)++], cmd->data_pdu, len);
+		for_each_sg(cmd->req.sg, sg, cmd->req.sg_cnt, i) {
+			bv[*nr_bvec].bv_page = sg_page(sg);
+			bv[*nr_bvec].bv_offset = sg->offset;
+			bv[*nr_bvec].bv_len = sg->length;
+			(*nr_bvec)++;
+			len += sg->length;
+		}
+		if (queue->nvme_sq.sqhd_disabled)
+			break;
+		/* the response goes right behind the data */
+		nvmet_setup_response_pdu(cmd);
+		cmd->state = NVMET_TCP_SEND_DATA_PDU;
+		nvmet_tcp_set_bvec(&bv[(*nr_bvec)++], cmd->rsp_pdu,
+				   sizeof(*cmd->rsp_pdu) + hdgst);
+		len += sizeof(*cmd->rsp_pdu) + hdgst;
+		break;
+	case NVMET_TCP_SEND_R2T:
+		len = sizeof(*cmd->r2t_pdu) + hdgst;
+		nvmet_tcp_set_bvec(&bv[(*nr_bvec)++], cmd->r2t_pdu, len);
+		break;
+	case NVMET_TCP_SEND_RESPONSE:
+		len = sizeof(*cmd->rsp_pdu) + hdgst;
+		nvmet_tcp_set_bvec(&bv[(*nr_bvec)++], cmd->rsp_pdu, len);
+		break;
+	default:
+		break;
+	}
+
+	return len;
+}
+
+static void nvmet_tcp_batch_cmd_done(struct nvmet_tcp_cmd *cmd)
+{
+	/* an R2T only solicits data, the command stays alive */
+	if (cmd->state == NVMET_TCP_SEND_R2T)
+		return;
+
+	cmd->wbytes_done = cmd->req.transfer_len;
+	kfree(cmd->iov);
+	nvmet_sgl_free(cmd->req.sq, cmd->req.sg);
+	nvmet_tcp_put_cmd(cmd);
+}
+
+/*
+ * Set up the per PDU send state of a command the batch only partially
+ * sent, so that nvmet_tcp_try_send_one() resumes right where it stopped.
+ */
+static void nvmet_tcp_batch_cmd_partial(struct nvmet_tcp_cmd *cmd,
+		size_t sent)
+{
+	u8 hdgst = nvmet_tcp_hdgst_len(cmd->queue);
+	size_t hdr_len = sizeof(*cmd->data_pdu) + hdgst;
+
+	cmd->queue->snd_cmd = cmd;
+
+	if (cmd->state != NVMET_TCP_SEND_DATA_PDU || sent < hdr_len) {
+		cmd->offset = sent;
+		return;
+	}
+
+	sent -= hdr_len;
+	if (sent < cmd->req.transfer_len) {
+		cmd->state = NVMET_TCP_SEND_DATA;
+		cmd->wbytes_done = sent;
+		cmd->cur_sg = cmd->req.sg;
+		while (sent >= cmd->cur_sg->length) {
+			sent -= cmd->cur_sg->length;
+			cmd->cur_sg = sg_next(cmd->cur_sg);
+		}
+		cmd->offset = sent;
+		return;
+	}
+
+	cmd->wbytes_done = cmd->req.transfer_len;
+	cmd->cur_sg = NULL;
+	cmd->state = NVMET_TCP_SEND_RESPONSE;
+	cmd->offset = sent - cmd->req.transfer_len;
+}
+
+/*
+ * Send up to @budget queued commands with one sendmsg.  Returns the number
+ * of commands fully sent, -EAGAIN if the socket could not take any of them,
+ * or a socket error.  A command that cannot be batched is left in
+ * queue->snd_cmd for the per PDU path.
+ */
+static int nvmet_tcp_try_send_batch(struct nvmet_tcp_queue *queue,
+		int budget, int *sends)
+{
+	struct nvmet_tcp_cmd *cmds[NVMET_TCP_SEND_BUDGET];
+	size_t lens[NVMET_TCP_SEND_BUDGET];
+	struct msghdr msg = { .msg_flags = MSG_DONTWAIT };
+	struct nvmet_tcp_cmd *cmd, *next = NULL;
+	int nr_cmds = 0, nr_bvec = 0, done = 0, i;
+	size_t len = 0, sent;
+	int ret;
+
+	budget = min(budget, NVMET_TCP_SEND_BUDGET);
+	while (nr_cmds < budget) {
+		cmd = nvmet_tcp_fetch_cmd(queue);
+		if (!cmd)
+			break;
+		if (!nvmet_tcp_can_batch(cmd)) {
+			next = cmd;
+			break;
+		}
+		lens[nr_cmds] = nvmet_tcp_batch_add_cmd(cmd, queue->snd_bvec,
+							&nr_bvec);
+		len += lens[nr_cmds];
+		cmds[nr_cmds++] = cmd;
+	}
+	queue->snd_cmd = next;
+
+	if (!nr_cmds)
+		return 0;
+
+	if (next || queue->send_list_len || !llist_empty(&queue->resp_list))
+		msg.msg_flags |= MSG_MORE;
+	else
+		msg.msg_flags |= MSG_EOR;
+
+#ifdef HAVE_IOV_ITER_IS_BVEC_SET
+	iov_iter_bvec(&msg.msg_iter, WRITE, queue->snd_bvec, nr_bvec, len);
+#else
+	iov_iter_bvec(&msg.msg_iter, ITER_BVEC | WRITE, queue->snd_bvec,
+		      nr_bvec, len);
+#endif
+	ret = sock_sendmsg(queue->sock, &msg);
+	sent = ret > 0 ? ret : 0;
+
+	for (i = 0; i < nr_cmds; i++) {
+		if (sent < lens[i])
+			break;
+		sent -= lens[i];
+		nvmet_tcp_batch_cmd_done(cmds[i]);
+		done++;
+	}
+
+	if (i < nr_cmds) {
+		/* short send, everything behind the cut goes back in order */
+		if (next) {
+			list_add(&next->entry, &queue->resp_send_list);
+			queue->send_list_len++;
+		}
+		queue->snd_cmd = NULL;
+		if (sent) {
+			nvmet_tcp_batch_cmd_partial(cmds[i], sent);
+			i++;
+		}
+		while (--nr_cmds >= i) {
+			list_add(&cmds[nr_cmds]->entry,
+				 &queue->resp_send_list);
+			queue->send_list_len++;
+		}
+	}
+
+	*sends += done;
+	if (ret < 0 && ret != -EAGAIN)
+		return ret;
+	return done ? done : -EAGAIN;
+}
+
 static int nvmet_tcp_try_send(struct nvmet_tcp_queue *queue,
 		int budget, int *sends)
 {
 	int i, ret = 0;
 
+	if (!queue->snd_cmd) {
+		ret = nvmet_tcp_try_send_batch(queue, budget, sends);
+		if (ret == -EAGAIN)
+			return 0;
+		if (unlikely(ret < 0)) {
+			nvmet_tcp_socket_error(queue, ret);
+			return ret;
+		}
+		if (ret > 0 && !queue->snd_cmd)
+			return 1;
+	}
+
 	for (i = 0; i < budget; i++) {
 		ret = nvmet_tcp_try_send_one(queue, i == budget - 1);
 		if (unlikely(ret < 0)) {
@@ -1198,34 +1460,214 @@ static void nvmet_tcp_schedule_release_queue(struct nvmet_tcp_queue *queue)
 	spin_unlock(&queue->state_lock);
 }
 
-static void nvmet_tcp_io_work(struct work_struct *w)
+static int nvmet_tcp_do_io(struct nvmet_tcp_queue *queue, int *ops)
 {
-	struct nvmet_tcp_queue *queue =
-		container_of(w, struct nvmet_tcp_queue, io_work);
 	bool pending;
-	int ret, ops = 0;
+	int ret;
 
 	do {
 		pending = false;
 
-		ret = nvmet_tcp_try_recv(queue, NVMET_TCP_RECV_BUDGET, &ops);
+		ret = nvmet_tcp_try_recv(queue, NVMET_TCP_RECV_BUDGET, ops);
 		if (ret > 0)
 			pending = true;
 		else if (ret < 0)
-			return;
+			return ret;
 
-		ret = nvmet_tcp_try_send(queue, NVMET_TCP_SEND_BUDGET, &ops);
+		ret = nvmet_tcp_try_send(queue, NVMET_TCP_SEND_BUDGET, ops);
 		if (ret > 0)
 			pending = true;
 		else if (ret < 0)
-			return;
+			return ret;
+
+	} while (pending && *ops < NVMET_TCP_IO_WORK_BUDGET);
+
+	return pending;
+}
+
+/*
+ * Hand a busy queue over to its poller.  Returns false if the queue is
+ * going away, in which case io_work keeps serving it.
+ */
+static bool nvmet_tcp_poll_queue_start(struct nvmet_tcp_queue *queue)
+{
+	struct nvmet_tcp_poller *poller = queue->poller;
+	bool started = false;
+
+	mutex_lock(&poller->lock);
+	if (!poller->stopped && queue->state != NVMET_TCP_Q_DISCONNECTING) {
+		queue->poll_last_busy = local_clock();
+		WRITE_ONCE(queue->polling, true);
+		list_add_tail(&queue->poll_entry, &poller->queues);
+		started = true;
+	}
+	mutex_unlock(&poller->lock);
+
+	if (started)
+		wake_up(&poller->wait);
+	return started;
+}
 
-	} while (pending && ops < NVMET_TCP_IO_WORK_BUDGET);
+/* called with poller->lock held */
+static void nvmet_tcp_poll_queue_stop(struct nvmet_tcp_queue *queue,
+		bool kick)
+{
+	list_del_init(&queue->poll_entry);
+	WRITE_ONCE(queue->polling, false);
+	/* catch anything that arrived while data_ready was muted */
+	if (kick)
+		queue_work_on(queue->cpu, nvmet_tcp_wq, &queue->io_work);
+}
+
+static void nvmet_tcp_poll_group_free(struct kref *ref)
+{
+	kfree(container_of(ref, struct nvmet_tcp_poll_group, ref));
+}
+
+static void nvmet_tcp_poll_queue_release(struct nvmet_tcp_queue *queue)
+{
+	if (!queue->poller)
+		return;
+
+	mutex_lock(&queue->poller->lock);
+	if (queue->polling)
+		nvmet_tcp_poll_queue_stop(queue, false);
+	mutex_unlock(&queue->poller->lock);
+}
+
+static void nvmet_tcp_poll_queue_put(struct nvmet_tcp_queue *queue)
+{
+	if (queue->poll_group)
+		kref_put(&queue->poll_group->ref, nvmet_tcp_poll_group_free);
+}
+
+/*
+ * Spinning only pays off when the socket can busy poll its NAPI context,
+ * otherwise the poller would just spin on an empty receive queue.
+ */
+static bool nvmet_tcp_queue_can_busy_poll(struct nvmet_tcp_queue *queue)
+{
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	return sk_can_busy_loop(queue->sock->sk);
+#else
+	return false;
+#endif
+}
+
+static void nvmet_tcp_poll_queue(struct nvmet_tcp_queue *queue)
+{
+	u64 now;
+	int ret, ops = 0;
+
+	if (!nvmet_tcp_queue_can_busy_poll(queue)) {
+		nvmet_tcp_poll_queue_stop(queue, true);
+		return;
+	}
+	sk_busy_loop(queue->sock->sk, true);
+
+	ret = nvmet_tcp_do_io(queue, &ops);
+	if (ret < 0) {
+		/* the queue is being torn down, release work takes over */
+		nvmet_tcp_poll_queue_stop(queue, false);
+		return;
+	}
+
+	now = local_clock();
+	if (ops)
+		queue->poll_last_busy = now;
+	else if (now - queue->poll_last_busy >
+		 (u64)READ_ONCE(poll_idle_usecs) * NSEC_PER_USEC)
+		nvmet_tcp_poll_queue_stop(queue, true);
+}
+
+static int nvmet_tcp_poller_thread(void *data)
+{
+	struct nvmet_tcp_poller *poller = data;
+	struct nvmet_tcp_queue *queue, *tmp;
+
+	while (!kthread_should_stop()) {
+		if (list_empty_careful(&poller->queues)) {
+			wait_event_interruptible(poller->wait,
+				!list_empty_careful(&poller->queues) ||
+				kthread_should_stop());
+			continue;
+		}
+
+		mutex_lock(&poller->lock);
+		list_for_each_entry_safe(queue, tmp, &poller->queues,
+					 poll_entry)
+			nvmet_tcp_poll_queue(queue);
+		mutex_unlock(&poller->lock);
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static int nvmet_tcp_poller_start(struct nvmet_tcp_poller *poller)
+{
+	struct task_struct *thread;
+
+	thread = kthread_create_on_node(nvmet_tcp_poller_thread, poller,
+			cpu_to_node(poller->cpu), "nvmet_tcp_poll/%d",
+			poller->cpu);
+	if (IS_ERR(thread)) {
+		pr_err("failed to start poller on cpu %d: %ld\n",
+		       poller->cpu, PTR_ERR(thread));
+		return PTR_ERR(thread);
+	}
+	kthread_bind(thread, poller->cpu);
+	poller->thread = thread;
+
+	mutex_lock(&poller->lock);
+	poller->stopped = false;
+	mutex_unlock(&poller->lock);
+
+	wake_up_process(thread);
+	return 0;
+}
+
+static void nvmet_tcp_poller_stop(struct nvmet_tcp_poller *poller)
+{
+	struct nvmet_tcp_queue *queue, *tmp;
+
+	if (!poller->thread)
+		return;
+
+	kthread_stop(poller->thread);
+	poller->thread = NULL;
+
+	/* give whatever is left back to io_work */
+	mutex_lock(&poller->lock);
+	poller->stopped = true;
+	list_for_each_entry_safe(queue, tmp, &poller->queues, poll_entry)
+		nvmet_tcp_poll_queue_stop(queue, true);
+	mutex_unlock(&poller->lock);
+}
+
+static void nvmet_tcp_io_work(struct work_struct *w)
+{
+	struct nvmet_tcp_queue *queue =
+		container_of(w, struct nvmet_tcp_queue, io_work);
+	int ret, ops = 0;
+
+	/* raced with a switch to poll mode, the poller owns the queue now */
+	if (READ_ONCE(queue->polling))
+		return;
+
+	ret = nvmet_tcp_do_io(queue, &ops);
+	if (ret < 0)
+		return;
+
+	if (ops && queue->poller && nvmet_tcp_queue_can_busy_poll(queue) &&
+	    nvmet_tcp_poll_queue_start(queue))
+		return;
 
 	/*
 	 * We exahusted our budget, requeue our selves
 	 */
-	if (pending)
+	if (ret)
 		queue_work_on(queue->cpu, nvmet_tcp_wq, &queue->io_work);
 }
 
@@ -1336,7 +1778,7 @@ static void nvmet_tcp_finish_cmd(struct nvmet_tcp_cmd *cmd)
 	nvmet_req_uninit(&cmd->req);
 	nvmet_tcp_unmap_pdu_iovec(cmd);
 	kfree(cmd->iov);
-	sgl_free(cmd->req.sg);
+	nvmet_sgl_free(cmd->req.sq, cmd->req.sg);
 }
 
 static void nvmet_tcp_uninit_data_in_cmds(struct nvmet_tcp_queue *queue)
@@ -1365,6 +1807,7 @@ static void nvmet_tcp_release_queue_work(struct work_struct *w)
 	mutex_unlock(&nvmet_tcp_queue_mutex);
 
 	nvmet_tcp_restore_socket_callbacks(queue);
+	nvmet_tcp_poll_queue_release(queue);
 	flush_work(&queue->io_work);
 
 	nvmet_tcp_uninit_data_in_cmds(queue);
@@ -1375,6 +1818,7 @@ static void nvmet_tcp_release_queue_work(struct work_struct *w)
 	if (queue->hdr_digest || queue->data_digest)
 		nvmet_tcp_free_crypto(queue);
 	ida_simple_remove(&nvmet_tcp_queue_ida, queue->idx);
+	nvmet_tcp_poll_queue_put(queue);
 
 	kfree(queue);
 }
@@ -1385,7 +1829,7 @@ static void nvmet_tcp_data_ready(struct sock *sk)
 
 	read_lock_bh(&sk->sk_callback_lock);
 	queue = sk->sk_user_data;
-	if (likely(queue))
+	if (likely(queue) && !READ_ONCE(queue->polling))
 		queue_work_on(queue->cpu, nvmet_tcp_wq, &queue->io_work);
 	read_unlock_bh(&sk->sk_callback_lock);
 }
@@ -1406,7 +1850,9 @@ static void nvmet_tcp_write_space(struct sock *sk)
 
 	if (sk_stream_is_writeable(sk)) {
 		clear_bit(SOCK_NOSPACE, &sk->sk_socket->flags);
-		queue_work_on(queue->cpu, nvmet_tcp_wq, &queue->io_work);
+		if (!READ_ONCE(queue->polling))
+			queue_work_on(queue->cpu, nvmet_tcp_wq,
+				      &queue->io_work);
 	}
 out:
 	read_unlock_bh(&sk->sk_callback_lock);
@@ -1493,6 +1939,11 @@ static int nvmet_tcp_set_queue_sock(struct nvmet_tcp_queue *queue)
 
 	write_lock_bh(&sock->sk->sk_callback_lock);
 	sock->sk->sk_user_data = queue;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	/* let the poller busy poll without net.core.busy_read */
+	if (queue->poller)
+		sock->sk->sk_ll_usec = 1;
+#endif
 	queue->data_ready = sock->sk->sk_data_ready;
 	sock->sk->sk_data_ready = nvmet_tcp_data_ready;
 	queue->state_change = sock->sk->sk_state_change;
@@ -1524,6 +1975,7 @@ static int nvmet_tcp_alloc_queue(struct nvmet_tcp_port *port,
 	INIT_LIST_HEAD(&queue->free_list);
 	init_llist_head(&queue->resp_list);
 	INIT_LIST_HEAD(&queue->resp_send_list);
+	INIT_LIST_HEAD(&queue->poll_entry);
 
 	queue->idx = ida_simple_get(&nvmet_tcp_queue_ida, 0, 0, GFP_KERNEL);
 	if (queue->idx < 0) {
@@ -1539,9 +1991,22 @@ static int nvmet_tcp_alloc_queue(struct nvmet_tcp_port *port,
 	if (ret)
 		goto out_free_connect;
 
-	port->last_cpu = cpumask_next_wrap(port->last_cpu,
-				cpu_online_mask, -1, false);
-	queue->cpu = port->last_cpu;
+	if (port->poll_group) {
+		struct nvmet_tcp_poll_group *pg = port->poll_group;
+
+		kref_get(&pg->ref);
+		queue->poll_group = pg;
+		pg->last_poller = (pg->last_poller + 1) % pg->nr_pollers;
+		queue->poller = &pg->pollers[pg->last_poller];
+		queue->cpu = queue->poller->cpu;
+		/* the poller is parked while its cpu is offline */
+		if (!cpu_active(queue->cpu))
+			queue->cpu = cpumask_any(cpu_active_mask);
+	} else {
+		port->last_cpu = cpumask_next_wrap(port->last_cpu,
+					cpu_online_mask, -1, false);
+		queue->cpu = port->last_cpu;
+	}
 	nvmet_prepare_receive_pdu(queue);
 
 	mutex_lock(&nvmet_tcp_queue_mutex);
@@ -1560,6 +2025,7 @@ out_destroy_sq:
 	list_del_init(&queue->queue_list);
 	mutex_unlock(&nvmet_tcp_queue_mutex);
 	nvmet_sq_destroy(&queue->nvme_sq);
+	nvmet_tcp_poll_queue_put(queue);
 out_free_connect:
 	nvmet_tcp_free_cmd(&queue->connect);
 out_ida_remove:
@@ -1606,6 +2072,114 @@ out:
 	read_unlock_bh(&sk->sk_callback_lock);
 }
 
+/* point the io_work of all queues assigned to @poller at @cpu */
+static void nvmet_tcp_poller_move_queues(struct nvmet_tcp_poller *poller,
+		int cpu)
+{
+	struct nvmet_tcp_queue *queue;
+
+	mutex_lock(&nvmet_tcp_queue_mutex);
+	list_for_each_entry(queue, &nvmet_tcp_queue_list, queue_list)
+		if (queue->poller == poller)
+			WRITE_ONCE(queue->cpu, cpu);
+	mutex_unlock(&nvmet_tcp_queue_mutex);
+}
+
+/*
+ * Pollers follow cpu hotplug: the queues of a cpu going down are moved to
+ * another cpu, its poller hands them back to io_work and exits.  The
+ * poller is restarted and gets its queues back when the cpu comes back
+ * online.
+ */
+static int nvmet_tcp_cpu_online(unsigned int cpu, struct hlist_node *node)
+{
+	struct nvmet_tcp_poll_group *pg =
+		hlist_entry_safe(node, struct nvmet_tcp_poll_group, cpuhp_node);
+	int i, ret;
+
+	for (i = 0; i < pg->nr_pollers; i++) {
+		if (pg->pollers[i].cpu != cpu)
+			continue;
+		ret = nvmet_tcp_poller_start(&pg->pollers[i]);
+		if (ret)
+			return ret;
+		nvmet_tcp_poller_move_queues(&pg->pollers[i], cpu);
+	}
+	return 0;
+}
+
+static int nvmet_tcp_cpu_offline(unsigned int cpu, struct hlist_node *node)
+{
+	struct nvmet_tcp_poll_group *pg =
+		hlist_entry_safe(node, struct nvmet_tcp_poll_group, cpuhp_node);
+	int i;
+
+	for (i = 0; i < pg->nr_pollers; i++) {
+		if (pg->pollers[i].cpu != cpu)
+			continue;
+		/* the cpu stays active when the port is merely removed */
+		if (!cpu_active(cpu))
+			nvmet_tcp_poller_move_queues(&pg->pollers[i],
+					cpumask_any(cpu_active_mask));
+		nvmet_tcp_poller_stop(&pg->pollers[i]);
+	}
+	return 0;
+}
+
+static void nvmet_tcp_stop_pollers(struct nvmet_tcp_port *port)
+{
+	struct nvmet_tcp_poll_group *pg = port->poll_group;
+
+	if (!pg)
+		return;
+
+	/* stops the pollers of all online cpus */
+	cpuhp_state_remove_instance(nvmet_tcp_cpuhp_state, &pg->cpuhp_node);
+	port->poll_group = NULL;
+	kref_put(&pg->ref, nvmet_tcp_poll_group_free);
+}
+
+static int nvmet_tcp_start_pollers(struct nvmet_tcp_port *port)
+{
+	struct cpumask *mask = port->nport->poll_cpumask;
+	struct nvmet_tcp_poll_group *pg;
+	struct nvmet_tcp_poller *poller;
+	int cpu, ret, nr = cpumask_weight(mask);
+
+	if (!nr)
+		return 0;
+
+	if (!IS_ENABLED(CONFIG_NET_RX_BUSY_POLL)) {
+		pr_err("poll cpus need CONFIG_NET_RX_BUSY_POLL\n");
+		return -EOPNOTSUPP;
+	}
+
+	pg = kzalloc(struct_size(pg, pollers, nr), GFP_KERNEL);
+	if (!pg)
+		return -ENOMEM;
+	kref_init(&pg->ref);
+	pg->last_poller = -1;
+
+	for_each_cpu(cpu, mask) {
+		poller = &pg->pollers[pg->nr_pollers++];
+		poller->cpu = cpu;
+		poller->stopped = true;
+		mutex_init(&poller->lock);
+		INIT_LIST_HEAD(&poller->queues);
+		init_waitqueue_head(&poller->wait);
+	}
+
+	/* starts the pollers of all online cpus, rolls back on failure */
+	ret = cpuhp_state_add_instance(nvmet_tcp_cpuhp_state, &pg->cpuhp_node);
+	if (ret) {
+		kfree(pg);
+		return ret;
+	}
+	port->poll_group = pg;
+
+	return 0;
+}
+
 static int nvmet_tcp_add_port(struct nvmet_port *nport)
 {
 	struct nvmet_tcp_port *port;
@@ -1679,10 +2253,14 @@ static int nvmet_tcp_add_port(struct nvmet_port *nport)
 		goto err_sock;
 	}
 
+	ret = nvmet_tcp_start_pollers(port);
+	if (ret)
+		goto err_sock;
+
 	ret = kernel_listen(port->sock, 128);
 	if (ret) {
 		pr_err("failed to listen %d on port sock\n", ret);
-		goto err_sock;
+		goto err_pollers;
 	}
 
 	nport->priv = port;
@@ -1691,6 +2269,8 @@ static int nvmet_tcp_add_port(struct nvmet_port *nport)
 
 	return 0;
 
+err_pollers:
+	nvmet_tcp_stop_pollers(port);
 err_sock:
 	sock_release(port->sock);
 err_port:
@@ -1708,6 +2288,7 @@ static void nvmet_tcp_remove_port(struct nvmet_port *nport)
 	write_unlock_bh(&port->sock->sk->sk_callback_lock);
 	cancel_work_sync(&port->accept_work);
 
+	nvmet_tcp_stop_pollers(port);
 	sock_release(port->sock);
 	kfree(port);
 }
@@ -1775,11 +2356,20 @@ static int __init nvmet_tcp_init(void)
 	if (!nvmet_tcp_wq)
 		return -ENOMEM;
 
+	ret = cpuhp_setup_state_multi(CPUHP_AP_ONLINE_DYN, "nvmet/tcp:online",
+				      nvmet_tcp_cpu_online,
+				      nvmet_tcp_cpu_offline);
+	if (ret < 0)
+		goto err;
+	nvmet_tcp_cpuhp_state = ret;
+
 	ret = nvmet_register_transport(&nvmet_tcp_ops);
 	if (ret)
-		goto err;
+		goto err_cpuhp;
 
 	return 0;
+err_cpuhp:
+	cpuhp_remove_multi_state(nvmet_tcp_cpuhp_state);
 err:
 	destroy_workqueue(nvmet_tcp_wq);
 	return ret;
@@ -1798,6 +2388,7 @@ static void __exit nvmet_tcp_exit(void)
 	mutex_unlock(&nvmet_tcp_queue_mutex);
 	flush_scheduled_work();
 
+	cpuhp_remove_multi_state(nvmet_tcp_cpuhp_state);
 	destroy_workqueue(nvmet_tcp_wq);
 }
 
@@ -11,6 +11,9 @@
 #include <linux/list.h>
 #include <linux/scatterlist.h>
 #include <linux/workqueue.h>
+#ifdef HAVE_MMU_INTERVAL_NOTIFIER
+#include <linux/mmu_notifier.h>
+#endif
 #include <rdma/ib_verbs.h>
 
 struct ib_ucontext;
@@ -37,6 +40,14 @@ struct ib_umem {
 	int             nmap;
 	unsigned int    sg_nents;
 	unsigned int    page_shift;
+#ifdef HAVE_MMU_INTERVAL_NOTIFIER
+	/* Registration cache state, protected by the umem cache lock */
+	struct mmu_interval_notifier cache_notifier;
+	struct hlist_node	cache_node;
+	struct list_head	cache_lru;
+	int			cache_access;
+	u8			cache_state;
+#endif
 };
 
 typedef void (*umem_invalidate_func_t)(struct ib_umem *umem, void *priv);
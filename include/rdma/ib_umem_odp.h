@@ -15,6 +15,17 @@
 #include <linux/interval_tree.h>
 #endif
 
+struct ib_umem_odp_stats {
+	/* ib_umem_odp_map_dma_pages() calls that mapped at least a page */
+	atomic64_t		faults;
+	atomic64_t		fault_pages;
+	/* Pages mapped beyond the requested range by adaptive prefetch */
+	atomic64_t		prefetch_pages;
+	/* ib_umem_odp_unmap_dma_pages() ranges and the pages they unmapped */
+	atomic64_t		invalidations;
+	atomic64_t		invalidated_pages;
+};
+
 struct ib_umem_odp {
 	struct ib_umem umem;
 #ifdef HAVE_MMU_INTERVAL_NOTIFIER
@@ -66,6 +77,17 @@ struct ib_umem_odp {
 	struct completion	notifier_completion;
 #endif
 	unsigned int		page_shift;
+
+	/*
+	 * Fault stream tracking for prefetch, updated locklessly by the
+	 * fault path since it only steers how much is mapped ahead.
+	 */
+	u64			fault_last_va;
+	u64			fault_next_va;
+	u64			fault_stride;
+	unsigned int		prefetch_pages;	/* in PAGE_SIZE pages */
+
+	struct ib_umem_odp_stats stats;
 };
 
 static inline struct ib_umem_odp *to_ib_umem_odp(struct ib_umem *umem)
@@ -1383,6 +1383,20 @@ struct ib_cqe {
 	void (*done)(struct ib_cq *cq, struct ib_wc *wc);
 };
 
+/**
+ * struct ib_cq_batch - work deferred to the end of a batch of completions
+ * @flush: called once after the done handlers of the batch have run
+ * @entry: link on the batch list of the CQ, internal to the RDMA core
+ *
+ * A done handler that wants to amortise work over all completions polled
+ * in one go, e.g. reposting receives with a single doorbell, queues a
+ * batch with ib_cq_batch_add() and does the work from @flush.
+ */
+struct ib_cq_batch {
+	void (*flush)(struct ib_cq *cq, struct ib_cq_batch *batch);
+	struct list_head entry;
+};
+
 struct ib_send_wr {
 	struct ib_send_wr      *next;
 	union {
@@ -1614,6 +1628,15 @@ enum ib_poll_context {
 	IB_POLL_LAST_POOL_TYPE = IB_POLL_UNBOUND_WORKQUEUE,
 
 	IB_POLL_DIRECT,		   /* caller context, no hw completions */
+	IB_POLL_HYBRID,		   /* busy-poll from workqueue, then re-arm */
+};
+
+/* Time an IB_POLL_HYBRID CQ spent busy-polling versus waiting for an IRQ */
+struct ib_cq_poll_stats {
+	u64	spin_ns;
+	u64	sleep_ns;
+	u64	spin_comps;	/* completions found while spinning */
+	u64	arms;		/* times the CQ was re-armed */
 };
 
 struct ib_cq {
@@ -1627,7 +1650,13 @@ struct ib_cq {
 	atomic_t          	usecnt; /* count number of work queues */
 	enum ib_poll_context	poll_ctx;
 	struct ib_wc		*wc;
+	struct list_head	batch_list;
 	struct list_head        pool_entry;
+	/* completions processed, sampled by the shared CQ pool */
+	unsigned long		comp_count;
+	unsigned long		pool_comp_last;
+	unsigned long		pool_stamp;
+	unsigned long		pool_rate;
 	union {
 #if defined(HAVE_IRQ_POLL_H)
 #if IS_ENABLED(CONFIG_IRQ_POLL)
@@ -1641,6 +1670,11 @@ struct ib_cq {
 	struct workqueue_struct *comp_wq;
 	struct dim *dim;
 
+	/* IB_POLL_HYBRID busy-poll window and accounting */
+	unsigned int		poll_usecs;
+	u64			armed_at;
+	struct ib_cq_poll_stats	poll_stats;
+
 	/* updated only by trace points */
 	ktime_t timestamp;
 	u8 interrupt:1;
@@ -1653,6 +1687,28 @@ struct ib_cq {
 	struct rdma_restrack_entry res;
 };
 
+/* Shared CQs of one completion vector and the NUMA node it interrupts on */
+struct ib_cq_pool_vector {
+	struct list_head	cqs;
+	int			node;
+};
+
+/* Least loaded shared CQ last seen for callers on one NUMA node */
+struct ib_cq_pool_hint {
+	struct ib_cq		*cq;
+	unsigned long		load;
+	unsigned long		next_load;
+	unsigned long		stamp;
+};
+
+struct ib_cq_pool {
+	unsigned int		 nr_vectors;
+	struct ib_cq_pool_vector *vectors;
+	struct ib_cq_pool_hint	 *hints;
+	unsigned long		 peak_rate;
+	unsigned long		 peak_stamp;
+};
+
 struct ib_srq {
 	struct ib_device       *device;
 	struct ib_pd	       *pd;
@@ -1810,6 +1866,12 @@ struct ib_qp {
 	int			mrs_used;
 	struct list_head	rdma_mrs;
 	struct list_head	sig_mrs;
+	struct ib_mr_pool_cpu __percpu *mr_pcpu;
+	/* MRs added on demand to rdma_mrs and sig_mrs, see rdma_rw */
+	u32			mrs_grown[2];
+	unsigned long		mr_grow_flags;
+	unsigned long		mr_grow_stamp;
+	struct delayed_work	mr_grow_work;
 	struct ib_srq	       *srq;
 	struct ib_xrcd	       *xrcd; /* XRC TGT QPs only */
 	struct list_head	xrcd_list;
@@ -2857,7 +2919,7 @@ struct ib_device {
 	u32                          index;
 
 	spinlock_t                   cq_pools_lock;
-	struct list_head             cq_pools[IB_POLL_LAST_POOL_TYPE + 1];
+	struct ib_cq_pool            cq_pools[IB_POLL_HYBRID + 1];
 
 	struct rdma_restrack_root *res;
 
@@ -4081,6 +4143,33 @@ static inline void ib_free_cq(struct ib_cq *cq)
 }
 
 int ib_process_cq_direct(struct ib_cq *cq, int budget);
+void ib_cq_set_poll_usecs(struct ib_cq *cq, unsigned int usecs);
+void ib_cq_get_poll_stats(struct ib_cq *cq, struct ib_cq_poll_stats *stats);
+
+static inline void ib_cq_batch_init(struct ib_cq_batch *batch,
+		void (*flush)(struct ib_cq *cq, struct ib_cq_batch *batch))
+{
+	batch->flush = flush;
+	INIT_LIST_HEAD(&batch->entry);
+}
+
+/**
+ * ib_cq_batch_add - defer work to the end of the current completion batch
+ * @cq: CQ whose done handler is running
+ * @batch: batch to flush, queued at most once per batch
+ *
+ * May only be called from a done handler run by the CQ core.  Returns
+ * false if @cq is polled directly by its consumer, possibly from several
+ * contexts at once, in which case the caller has to do the work itself.
+ */
+static inline bool ib_cq_batch_add(struct ib_cq *cq, struct ib_cq_batch *batch)
+{
+	if (cq->poll_ctx == IB_POLL_DIRECT)
+		return false;
+	if (list_empty(&batch->entry))
+		list_add_tail(&batch->entry, &cq->batch_list);
+	return true;
+}
 
 /**
  * ib_create_cq - Creates a CQ on the specified device.
@@ -7,11 +7,22 @@
 
 #include <rdma/ib_verbs.h>
 
+struct ib_mr_pool_stats {
+	u64	misses;		/* per-CPU magazine empty, refilled from the QP */
+	u64	exhausted;	/* no free MR left in the pool */
+	u32	grown;		/* MRs added by ib_mr_pool_grow() */
+};
+
 struct ib_mr *ib_mr_pool_get(struct ib_qp *qp, struct list_head *list);
 void ib_mr_pool_put(struct ib_qp *qp, struct list_head *list, struct ib_mr *mr);
 
 int ib_mr_pool_init(struct ib_qp *qp, struct list_head *list, int nr,
 		enum ib_mr_type type, u32 max_num_sg, u32 max_num_meta_sg);
+int ib_mr_pool_grow(struct ib_qp *qp, struct list_head *list, int nr,
+		u32 max_grown, enum ib_mr_type type, u32 max_num_sg,
+		u32 max_num_meta_sg);
+u32 ib_mr_pool_shrink(struct ib_qp *qp, struct list_head *list);
 void ib_mr_pool_destroy(struct ib_qp *qp, struct list_head *list);
+void ib_mr_pool_get_stats(struct ib_qp *qp, struct ib_mr_pool_stats *stats);
 
 #endif /* _RDMA_MR_POOL_H */
@@ -8,12 +8,14 @@
 
 #include <linux/mutex.h>
 #include <linux/pid_namespace.h>
+#include <linux/workqueue.h>
 
 #include <rdma/restrack.h>
 #include <rdma/rdma_netlink.h>
 
 struct ib_device;
 struct ib_qp;
+struct rdma_counter_history;
 
 struct auto_mode_param {
 	int qp_type;
@@ -30,6 +32,8 @@ struct rdma_port_counter {
 	struct rdma_hw_stats *hstats;
 	unsigned int num_counters;
 	struct mutex lock;
+	/* Snapshots the counters of this port while there are any */
+	struct delayed_work sample_work;
 };
 
 struct rdma_counter {
@@ -41,6 +45,8 @@ struct rdma_counter {
 	struct mutex			lock;
 	struct rdma_hw_stats		*stats;
 	u32				port;
+	/* Ring of periodic snapshots of @stats, protected by @lock */
+	struct rdma_counter_history	*history;
 };
 
 void rdma_counter_init(struct ib_device *dev);
@@ -51,6 +57,8 @@ int rdma_counter_bind_qp_auto(struct ib_qp *qp, u32 port);
 int rdma_counter_unbind_qp(struct ib_qp *qp, bool force);
 
 int rdma_counter_query_stats(struct rdma_counter *counter);
+u64 rdma_counter_history_delta(struct rdma_counter *counter, u64 *delta,
+			       u32 *samples);
 u64 rdma_counter_get_hwstat_value(struct ib_device *dev, u32 port, u32 index);
 int rdma_counter_bind_qpn(struct ib_device *dev, u32 port,
 			  u32 qp_num, u32 counter_id);
@@ -23,7 +23,8 @@
 	ib_poll_ctx(DIRECT)			\
 	ib_poll_ctx(SOFTIRQ)			\
 	ib_poll_ctx(WORKQUEUE)			\
-	ib_poll_ctx_end(UNBOUND_WORKQUEUE)
+	ib_poll_ctx(UNBOUND_WORKQUEUE)		\
+	ib_poll_ctx_end(HYBRID)
 
 #undef ib_poll_ctx
 #undef ib_poll_ctx_end
@@ -533,6 +533,31 @@ enum rdma_nldev_attr {
 
 	RDMA_NLDEV_ATTR_RES_RAW,	/* binary */
 
+	/*
+	 * SA path record cache counters of a port
+	 */
+	RDMA_NLDEV_ATTR_SA_PATH_CACHE,	/* nested table */
+
+	/*
+	 * Increase and per-second rate of the hw counters of a bound
+	 * counter over its sampled history
+	 */
+	RDMA_NLDEV_ATTR_STAT_HISTORY,		/* nested table */
+	RDMA_NLDEV_ATTR_STAT_HISTORY_SAMPLES,	/* u32 */
+	RDMA_NLDEV_ATTR_STAT_HISTORY_WINDOW_MS,	/* u64 */
+	RDMA_NLDEV_ATTR_STAT_HISTORY_DELTAS,	/* nested table */
+	RDMA_NLDEV_ATTR_STAT_HISTORY_RATES,	/* nested table */
+
+	/*
+	 * Busy-poll accounting of an IB_POLL_HYBRID kernel CQ
+	 */
+	RDMA_NLDEV_ATTR_RES_CQ_POLL_STATS,	/* nested table */
+
+	/*
+	 * MR pool counters of a kernel QP
+	 */
+	RDMA_NLDEV_ATTR_RES_QP_MR_POOL,		/* nested table */
+
 	/*
 	 * Always the end
 	 */
@@ -40,6 +40,8 @@
 #define RDMA_IOCTL_MAGIC	0x1b
 #define RDMA_VERBS_IOCTL \
 	_IOWR(RDMA_IOCTL_MAGIC, 1, struct ib_uverbs_ioctl_hdr)
+#define RDMA_VERBS_BATCH_IOCTL \
+	_IOWR(RDMA_IOCTL_MAGIC, 2, struct ib_uverbs_ioctl_batch)
 
 enum {
 	/* User input */
@@ -84,4 +86,28 @@ struct ib_uverbs_ioctl_hdr {
 	struct ib_uverbs_attr  attrs[0];
 };
 
+/*
+ * RDMA_VERBS_BATCH_IOCTL runs a list of RDMA_VERBS_IOCTL commands in order
+ * and reports a status per entry.  Execution stops at the first failing
+ * entry unless IB_UVERBS_BATCH_F_CONTINUE is set; num_done tells how many
+ * entries were executed.
+ */
+enum {
+	IB_UVERBS_BATCH_F_CONTINUE = 1U << 0,
+};
+
+struct ib_uverbs_ioctl_batch_entry {
+	__aligned_u64 hdr;	/* struct ib_uverbs_ioctl_hdr __user * */
+	__s32 status;		/* kernel output */
+	__u32 reserved;
+};
+
+struct ib_uverbs_ioctl_batch {
+	__aligned_u64 entries;	/* struct ib_uverbs_ioctl_batch_entry __user * */
+	__u32 num_entries;
+	__u32 flags;		/* combination of IB_UVERBS_BATCH_F_XXXX */
+	__u32 num_done;		/* kernel output */
+	__u32 reserved;
+};
+
 #endif